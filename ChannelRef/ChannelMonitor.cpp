@@ -0,0 +1,219 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ChannelMonitor.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+ChannelMonitor::ChannelMonitor() : nChannels(0), sampleRate(30000.0f), primed(false),
+	enabled(false), numExcluded(0), version(0)
+{
+}
+
+ChannelMonitor::~ChannelMonitor()
+{
+}
+
+void ChannelMonitor::prepare(int numChannels, float rate)
+{
+	nChannels = std::max(0, numChannels);
+	sampleRate = rate > 0 ? rate : 30000.0f;
+	primed = false;
+
+	meanSquare.assign(nChannels, 0.0f);
+	badTime.assign(nChannels, 0.0f);
+	goodTime.assign(nChannels, 0.0f);
+	excluded.assign(nChannels, 0);
+	blockBad.assign(nChannels, 0);
+	sortedRms.assign(nChannels, 0.0f);
+	changedChannels.assign(nChannels, 0);
+
+	int numWords = (nChannels + 63) / 64;
+	excludedWords.reset(new std::atomic<unsigned long long>[numWords]);
+	for (int w=0; w<numWords; w++)
+		excludedWords[w].store(0);
+
+	publishedRms.reset(new std::atomic<float>[nChannels]);
+	for (int c=0; c<nChannels; c++)
+		publishedRms[c].store(0.0f);
+
+	numExcluded.store(0);
+	version.fetch_add(1);
+}
+
+int ChannelMonitor::getNumChannels()
+{
+	return nChannels;
+}
+
+void ChannelMonitor::setEnabled(bool state)
+{
+	enabled.store(state);
+}
+
+bool ChannelMonitor::isEnabled()
+{
+	return enabled.load();
+}
+
+int ChannelMonitor::process(const float* const* channels, int numSamples)
+{
+	int numChanged = 0;
+
+	if (!enabled.load())
+	{
+		primed = false;
+
+		for (int c=0; c<nChannels; c++)
+		{
+			if (excluded[c])
+			{
+				setExcluded(c, false);
+				changedChannels[numChanged++] = c;
+			}
+		}
+	}
+	else if (numSamples > 0 && nChannels > 0)
+	{
+		float blockTime = numSamples / sampleRate;
+		float alpha = primed ? 1.0f - std::exp(-blockTime / MONITOR_TIME_CONSTANT) : 1.0f;
+
+		/* One pass per channel: power, range and saturation of the block */
+		for (int c=0; c<nChannels; c++)
+		{
+			const float* x = channels[c];
+			float sum = 0.0f;
+			float lo = x[0];
+			float hi = x[0];
+
+			for (int s=0; s<numSamples; s++)
+			{
+				sum += x[s] * x[s];
+				lo = std::min(lo, x[s]);
+				hi = std::max(hi, x[s]);
+			}
+
+			/* NaNs fail the comparison, count as saturated and are kept out
+			   of the running RMS */
+			bool saturated = !(hi < MONITOR_SATURATION_LEVEL && lo > -MONITOR_SATURATION_LEVEL);
+			blockBad[c] = saturated || (numSamples > 1 && hi - lo < MONITOR_FLAT_LEVEL);
+
+			if (!saturated)
+				meanSquare[c] += alpha * (sum / numSamples - meanSquare[c]);
+
+			sortedRms[c] = std::sqrt(meanSquare[c]);
+			publishedRms[c].store(sortedRms[c], std::memory_order_relaxed);
+		}
+
+		primed = true;
+
+		int middle = nChannels / 2;
+		std::nth_element(sortedRms.begin(), sortedRms.begin() + middle, sortedRms.end());
+		float noiseLimit = MONITOR_NOISE_FACTOR * sortedRms[middle];
+
+		for (int c=0; c<nChannels; c++)
+		{
+			bool bad = blockBad[c] || (noiseLimit > 0 && meanSquare[c] > noiseLimit * noiseLimit);
+
+			if (bad)
+			{
+				badTime[c] += blockTime;
+				goodTime[c] = 0.0f;
+			}
+			else
+			{
+				goodTime[c] += blockTime;
+				badTime[c] = 0.0f;
+			}
+
+			if (!excluded[c] && badTime[c] >= MONITOR_ONSET_TIME)
+			{
+				setExcluded(c, true);
+				changedChannels[numChanged++] = c;
+			}
+			else if (excluded[c] && goodTime[c] >= MONITOR_HOLD_TIME)
+			{
+				setExcluded(c, false);
+				changedChannels[numChanged++] = c;
+			}
+		}
+	}
+
+	if (numChanged > 0)
+		version.fetch_add(1);
+
+	return numChanged;
+}
+
+const int* ChannelMonitor::getChangedChannels()
+{
+	return changedChannels.data();
+}
+
+void ChannelMonitor::setExcluded(int channel, bool state)
+{
+	excluded[channel] = state ? 1 : 0;
+	badTime[channel] = 0.0f;
+	goodTime[channel] = 0.0f;
+
+	unsigned long long bit = 1ULL << (channel % 64);
+
+	if (state)
+	{
+		excludedWords[channel / 64].fetch_or(bit);
+		numExcluded.fetch_add(1);
+	}
+	else
+	{
+		excludedWords[channel / 64].fetch_and(~bit);
+		numExcluded.fetch_sub(1);
+	}
+}
+
+bool ChannelMonitor::isExcluded(int channel)
+{
+	if (channel < 0 || channel >= nChannels)
+		return false;
+
+	return (excludedWords[channel / 64].load() >> (channel % 64)) & 1;
+}
+
+float ChannelMonitor::getRms(int channel)
+{
+	if (channel < 0 || channel >= nChannels)
+		return 0.0f;
+
+	return publishedRms[channel].load(std::memory_order_relaxed);
+}
+
+int ChannelMonitor::getNumExcluded()
+{
+	return numExcluded.load();
+}
+
+int ChannelMonitor::getVersion()
+{
+	return version.load();
+}
@@ -0,0 +1,128 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __CHANNELMONITOR_H__
+#define __CHANNELMONITOR_H__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/* Absolute level (in microvolts) at which a channel counts as saturated */
+#define MONITOR_SATURATION_LEVEL 6000.0f
+
+/* Peak-to-peak range (in microvolts) below which a block counts as flat */
+#define MONITOR_FLAT_LEVEL 0.1f
+
+/* Channels whose RMS exceeds the median RMS by this factor are noisy */
+#define MONITOR_NOISE_FACTOR 5.0f
+
+/* Time constant of the running RMS in seconds */
+#define MONITOR_TIME_CONSTANT 1.0f
+
+/* A channel is excluded once it has been bad for MONITOR_ONSET_TIME and
+   included again once it has been good for MONITOR_HOLD_TIME (seconds) */
+#define MONITOR_ONSET_TIME 0.05f
+#define MONITOR_HOLD_TIME 2.0f
+
+
+/**
+
+  Channel monitor
+
+  Detects bad input channels while acquisition is running: channels that
+  saturate, that are flat (disconnected or shorted), or whose running RMS
+  is far above the median of all channels. Each block costs one pass over
+  the input per channel plus a median over the channel RMS values.
+
+  A channel is excluded after it has been bad for a short time and is
+  included again only after it has been good for a longer time, so
+  intermittent channels do not switch back and forth on every block.
+
+  process() runs on the audio thread and returns the channels whose state
+  changed, which the processor masks out of the reference plan (see
+  ReferencePlan::setChannelMasked()). The exclusions are also published
+  through atomics, so the GUI can show them without locking.
+
+  @see ReferencePlan, ChannelRefNode
+
+*/
+
+class ChannelMonitor
+{
+public:
+
+	ChannelMonitor();
+	~ChannelMonitor();
+
+	/** Allocate the state for the given number of channels and include all
+	    of them. Must not be called while process() is running. */
+	void prepare(int numChannels, float sampleRate);
+
+	int getNumChannels();
+
+	/** While disabled, process() includes all channels again and does not
+	    look at the data. */
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	/** Update the statistics from a block of input and return the number of
+	    channels whose exclusion changed (see getChangedChannels()). */
+	int process(const float* const* channels, int numSamples);
+	const int* getChangedChannels();
+
+	/** Current state, safe to read from any thread. */
+	bool isExcluded(int channel);
+	float getRms(int channel);
+	int getNumExcluded();
+
+	/** Incremented whenever the set of excluded channels changes. */
+	int getVersion();
+
+private:
+
+	void setExcluded(int channel, bool excluded);
+
+	int nChannels;
+	float sampleRate;
+	bool primed;
+	std::atomic<bool> enabled;
+
+	std::vector<float> meanSquare;
+	std::vector<float> badTime;
+	std::vector<float> goodTime;
+	std::vector<char> excluded;
+	std::vector<char> blockBad;
+	std::vector<float> sortedRms;
+	std::vector<int> changedChannels;
+
+	/* Published state: one bit per channel, RMS for display */
+	std::unique_ptr<std::atomic<unsigned long long>[]> excludedWords;
+	std::unique_ptr<std::atomic<float>[]> publishedRms;
+	std::atomic<int> numExcluded;
+	std::atomic<int> version;
+
+};
+
+
+#endif  //__CHANNELMONITOR_H__
@@ -25,6 +25,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ChannelRefCanvas.h"
 #include "ChannelRefEditor.h"
 
+#include <algorithm>
+
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -80,6 +82,7 @@ ChannelRefCanvas::ChannelRefCanvas(ChannelRefNode* n) :
 	presetNames.add("Common average reference");
 	presetNames.add("Avg of other tetrodes");
 	presetNames.add("Avg of next tetrode");
+	presetNames.add("Bipolar chain");
 
     presetNamesBox = new ComboBox("Presets");
     presetNamesBox->addItemList(presetNames, 1);
@@ -103,6 +106,133 @@ ChannelRefCanvas::ChannelRefCanvas(ChannelRefNode* n) :
     channelCountBox->addListener(this);
     addAndMakeVisible(channelCountBox);
 
+	normalizationLabel = new Label("NormalizationLabel", "Weights");
+	addAndMakeVisible(normalizationLabel);
+
+    normalizationBox = new ComboBox("Normalization");
+    normalizationBox->addItem("Sum to one", ReferenceMatrix::SUM_TO_ONE + 1);
+    normalizationBox->addItem("Raw weights", ReferenceMatrix::RAW_WEIGHTS + 1);
+    normalizationBox->addItem("Least squares", ReferenceMatrix::LEAST_SQUARES + 1);
+    normalizationBox->setSelectedId(ReferenceMatrix::SUM_TO_ONE + 1, dontSendNotification);
+    normalizationBox->setEditableText(false);
+    normalizationBox->addListener(this);
+    addAndMakeVisible(normalizationBox);
+
+    fitButton = new UtilityButton("Fit", Font("Small Text", 13, Font::plain));
+    fitButton->setRadius(3.0f);
+    fitButton->addListener(this);
+    addAndMakeVisible(fitButton);
+
+	referenceTypeLabel = new Label("ReferenceTypeLabel", "Reference");
+	addAndMakeVisible(referenceTypeLabel);
+
+    referenceTypeBox = new ComboBox("ReferenceType");
+    referenceTypeBox->addItem("Average", ReferenceMatrix::AVERAGE_REFERENCE + 1);
+    referenceTypeBox->addItem("Median", ReferenceMatrix::MEDIAN_REFERENCE + 1);
+    referenceTypeBox->addItem("Trimmed mean", ReferenceMatrix::TRIMMED_MEAN_REFERENCE + 1);
+    referenceTypeBox->setSelectedId(ReferenceMatrix::AVERAGE_REFERENCE + 1, dontSendNotification);
+    referenceTypeBox->setEditableText(false);
+    referenceTypeBox->addListener(this);
+    addAndMakeVisible(referenceTypeBox);
+
+    probeButton = new UtilityButton("Probe", Font("Small Text", 13, Font::plain));
+    probeButton->setRadius(3.0f);
+    probeButton->addListener(this);
+    addAndMakeVisible(probeButton);
+
+    localButton = new UtilityButton("Local", Font("Small Text", 13, Font::plain));
+    localButton->setRadius(3.0f);
+    localButton->addListener(this);
+    addAndMakeVisible(localButton);
+
+	radiusLabel = new Label("RadiusLabel", "Radius");
+	addAndMakeVisible(radiusLabel);
+
+	/* Inner and outer radius (um) of local references */
+	innerRadiusEditor = new Label("InnerRadius", "");
+	innerRadiusEditor->setEditable(true);
+	innerRadiusEditor->setColour(Label::backgroundColourId, Colours::lightgrey);
+	addAndMakeVisible(innerRadiusEditor);
+
+	outerRadiusEditor = new Label("OuterRadius", "");
+	outerRadiusEditor->setEditable(true);
+	outerRadiusEditor->setColour(Label::backgroundColourId, Colours::lightgrey);
+	addAndMakeVisible(outerRadiusEditor);
+
+    autoExcludeButton = new UtilityButton("Exclude bad", Font("Small Text", 13, Font::plain));
+    autoExcludeButton->setRadius(4.0f);
+    autoExcludeButton->setClickingTogglesState(true);
+    autoExcludeButton->addListener(this);
+    addAndMakeVisible(autoExcludeButton);
+
+    suggestButton = new UtilityButton("Suggest", Font("Small Text", 13, Font::plain));
+    suggestButton->setRadius(4.0f);
+    suggestButton->addListener(this);
+    addAndMakeVisible(suggestButton);
+
+    spatialModeBox = new ComboBox("SpatialMode");
+    for (int m=0; m<SpatialFilter::NUM_MODES; m++)
+        spatialModeBox->addItem(SpatialFilter::getModeName((SpatialFilter::Mode) m), m + 1);
+    spatialModeBox->setSelectedId(SpatialFilter::OFF + 1, dontSendNotification);
+    spatialModeBox->setEditableText(false);
+    spatialModeBox->addListener(this);
+    addAndMakeVisible(spatialModeBox);
+
+    spatialComponentsBox = new ComboBox("SpatialComponents");
+    for (int k=1; k<=16; k++)
+        spatialComponentsBox->addItem(String(k) + (k == 1 ? " component" : " components"), k);
+    spatialComponentsBox->setSelectedId(SPATIAL_COMPONENTS, dontSendNotification);
+    spatialComponentsBox->setEditableText(false);
+    spatialComponentsBox->addListener(this);
+    addAndMakeVisible(spatialComponentsBox);
+
+    /* Filled in update() */
+    montageBox = new ComboBox("Montage");
+    montageBox->setEditableText(false);
+    montageBox->addListener(this);
+    addAndMakeVisible(montageBox);
+
+    addMontageButton = new UtilityButton("Add", Font("Small Text", 13, Font::plain));
+    addMontageButton->setRadius(3.0f);
+    addMontageButton->addListener(this);
+    addAndMakeVisible(addMontageButton);
+
+    removeMontageButton = new UtilityButton("Remove", Font("Small Text", 13, Font::plain));
+    removeMontageButton->setRadius(3.0f);
+    removeMontageButton->addListener(this);
+    addAndMakeVisible(removeMontageButton);
+
+    fitGainsButton = new UtilityButton("Fit gains", Font("Small Text", 13, Font::plain));
+    fitGainsButton->setRadius(3.0f);
+    fitGainsButton->addListener(this);
+    addAndMakeVisible(fitGainsButton);
+
+    resetGainsButton = new UtilityButton("Reset gains", Font("Small Text", 13, Font::plain));
+    resetGainsButton->setRadius(3.0f);
+    resetGainsButton->addListener(this);
+    addAndMakeVisible(resetGainsButton);
+
+    filterModeBox = new ComboBox("FilterMode");
+    for (int m=0; m<ReferenceFilter::NUM_MODES; m++)
+        filterModeBox->addItem(ReferenceFilter::getModeName((ReferenceFilter::Mode) m), m + 1);
+    filterModeBox->setSelectedId(ReferenceFilter::OFF + 1, dontSendNotification);
+    filterModeBox->setEditableText(false);
+    filterModeBox->addListener(this);
+    addAndMakeVisible(filterModeBox);
+
+	/* Low and high cutoff (Hz) of the filter, applied when edited */
+	lowCutEditor = new Label("LowCut", "");
+	lowCutEditor->setEditable(true);
+	lowCutEditor->setColour(Label::backgroundColourId, Colours::lightgrey);
+	lowCutEditor->addListener(this);
+	addAndMakeVisible(lowCutEditor);
+
+	highCutEditor = new Label("HighCut", "");
+	highCutEditor->setEditable(true);
+	highCutEditor->setColour(Label::backgroundColourId, Colours::lightgrey);
+	highCutEditor->addListener(this);
+	addAndMakeVisible(highCutEditor);
+
     update();
 }
 
@@ -112,12 +242,16 @@ ChannelRefCanvas::~ChannelRefCanvas()
 
 void ChannelRefCanvas::beginAnimation()
 {
-//    startCallbacks();
+    processor->getTelemetry()->setEnabled(true);
+    processor->getCovarianceEngine()->start();
+    startCallbacks();
 }
 
 void ChannelRefCanvas::endAnimation()
 {
-//    stopCallbacks();
+    stopCallbacks();
+    processor->getCovarianceEngine()->stop();
+    processor->getTelemetry()->setEnabled(false);
 }
 
 
@@ -128,7 +262,8 @@ void ChannelRefCanvas::paint(Graphics& g)
 
 void ChannelRefCanvas::refresh()
 {
-    repaint();
+	display->updateExclusions();
+	display->updateTelemetry();
 }
 
 void ChannelRefCanvas::refreshState()
@@ -151,12 +286,60 @@ void ChannelRefCanvas::resized()
 	channelCountBox->setBounds(460, getHeight()-30, 250, 20);
 	presetNamesLabel->setBounds(380, getHeight()-60, 100, 20);
 	presetNamesBox->setBounds(460, getHeight()-60, 250, 20);
+
+	referenceTypeLabel->setBounds(730, getHeight()-60, 70, 20);
+	referenceTypeBox->setBounds(800, getHeight()-60, 130, 20);
+	normalizationLabel->setBounds(730, getHeight()-30, 70, 20);
+	normalizationBox->setBounds(800, getHeight()-30, 130, 20);
+	fitButton->setBounds(940, getHeight()-30, 50, 20);
+
+	probeButton->setBounds(1010, getHeight()-60, 60, 20);
+	localButton->setBounds(1075, getHeight()-60, 60, 20);
+	radiusLabel->setBounds(1005, getHeight()-30, 55, 20);
+	innerRadiusEditor->setBounds(1060, getHeight()-30, 35, 20);
+	outerRadiusEditor->setBounds(1100, getHeight()-30, 35, 20);
+
+	autoExcludeButton->setBounds(1155, getHeight()-60, 100, 20);
+	suggestButton->setBounds(1155, getHeight()-30, 100, 20);
+
+	spatialModeBox->setBounds(1270, getHeight()-60, 120, 20);
+	spatialComponentsBox->setBounds(1270, getHeight()-30, 120, 20);
+
+	montageBox->setBounds(1405, getHeight()-60, 130, 20);
+	addMontageButton->setBounds(1405, getHeight()-30, 62, 20);
+	removeMontageButton->setBounds(1473, getHeight()-30, 62, 20);
+
+	fitGainsButton->setBounds(1550, getHeight()-60, 90, 20);
+	resetGainsButton->setBounds(1550, getHeight()-30, 90, 20);
+
+	filterModeBox->setBounds(1655, getHeight()-60, 110, 20);
+	lowCutEditor->setBounds(1655, getHeight()-30, 52, 20);
+	highCutEditor->setBounds(1713, getHeight()-30, 52, 20);
 }
 
 void ChannelRefCanvas::update()
 {
 	display->update();
 	gainSlider->setValue(processor->getGlobalGain());
+	normalizationBox->setSelectedId(processor->getReferenceMatrix()->getNormalization() + 1, dontSendNotification);
+	referenceTypeBox->setSelectedId(processor->getReferenceMatrix()->getReferenceType() + 1, dontSendNotification);
+	innerRadiusEditor->setText(String(processor->getLocalInnerRadius()), dontSendNotification);
+	outerRadiusEditor->setText(String(processor->getLocalOuterRadius()), dontSendNotification);
+	autoExcludeButton->setToggleState(processor->getAutoExclude(), dontSendNotification);
+	spatialModeBox->setSelectedId(processor->getSpatialMode() + 1, dontSendNotification);
+	spatialComponentsBox->setSelectedId(processor->getSpatialComponents(), dontSendNotification);
+	filterModeBox->setSelectedId(processor->getFilterMode() + 1, dontSendNotification);
+	lowCutEditor->setText(String(processor->getFilterLowCut()), dontSendNotification);
+	highCutEditor->setText(String(processor->getFilterHighCut()), dontSendNotification);
+
+	/* Id 1 is the matrix, montage m has id m + 2 */
+	montageBox->clear(dontSendNotification);
+	montageBox->addItem("Matrix", 1);
+	for (int m=0; m<processor->getNumMontages(); m++)
+		montageBox->addItem(processor->getMontageName(m), m + 2);
+	montageBox->setSelectedId(processor->getActiveMontage() + 2, dontSendNotification);
+	removeMontageButton->setEnabled(processor->getActiveMontage() >= 0);
+	resetGainsButton->setEnabled(processor->getReferenceMatrix()->hasChannelGains());
 }
 
 void ChannelRefCanvas::mouseDown(const MouseEvent& event)
@@ -187,6 +370,71 @@ void ChannelRefCanvas::buttonClicked(Button* b)
 		ChannelRefEditor* editor = dynamic_cast<ChannelRefEditor*>(processor->getEditor());
 		editor->saveParametersDialog();
 	}
+	else if (button == fitButton)
+	{
+		processor->fitLeastSquares();
+	}
+	else if (button == probeButton)
+	{
+		FileChooser fc("Choose a probe geometry file...",
+					   File::getCurrentWorkingDirectory(),
+					   "*",
+					   true);
+
+		if (fc.browseForFileToOpen())
+		{
+			processor->loadProbeGeometry(fc.getResult().getFullPathName());
+		}
+	}
+	else if (button == localButton)
+	{
+		processor->setLocalRadius(innerRadiusEditor->getText().getFloatValue(),
+								  outerRadiusEditor->getText().getFloatValue());
+
+		if (processor->applyLocalReference())
+		{
+			presetNamesBox->setSelectedId(1, dontSendNotification);
+		}
+		update();
+	}
+	else if (button == autoExcludeButton)
+	{
+		processor->setAutoExclude(button->getToggleState());
+	}
+	else if (button == addMontageButton)
+	{
+		/* The matrix as set up in single mode (or a bipolar preset) */
+		if (processor->addMontageFromMatrix("Montage " + String(processor->getNumMontages() + 1)))
+		{
+			processor->commitReferenceMatrix();
+			processor->setActiveMontage(processor->getNumMontages() - 1);
+		}
+		update();
+	}
+	else if (button == removeMontageButton)
+	{
+		processor->removeMontage(processor->getActiveMontage());
+		processor->commitReferenceMatrix();
+		update();
+	}
+	else if (button == fitGainsButton)
+	{
+		/* The canvas is updated through the editor once the fit is done */
+		processor->fitChannelGains();
+	}
+	else if (button == resetGainsButton)
+	{
+		processor->resetChannelGains();
+		update();
+	}
+	else if (button == suggestButton)
+	{
+		if (processor->applySuggestedReferences())
+		{
+			presetNamesBox->setSelectedId(1, dontSendNotification);
+		}
+		update();
+	}
 }
 
 void ChannelRefCanvas::comboBoxChanged(ComboBox* cb)
@@ -198,6 +446,35 @@ void ChannelRefCanvas::comboBoxChanged(ComboBox* cb)
 		int numChannels = s.getIntValue();
 		display->applyPreset(presetName, numChannels);
 	}
+	else if (cb == normalizationBox)
+	{
+		ReferenceMatrix* refMat = processor->getReferenceMatrix();
+		refMat->setNormalization((ReferenceMatrix::Normalization) (normalizationBox->getSelectedId() - 1));
+		processor->commitReferenceMatrix();
+	}
+	else if (cb == referenceTypeBox)
+	{
+		ReferenceMatrix* refMat = processor->getReferenceMatrix();
+		refMat->setReferenceType((ReferenceMatrix::ReferenceType) (referenceTypeBox->getSelectedId() - 1));
+		processor->commitReferenceMatrix();
+	}
+	else if (cb == spatialModeBox)
+	{
+		processor->setSpatialMode((SpatialFilter::Mode) (spatialModeBox->getSelectedId() - 1));
+	}
+	else if (cb == spatialComponentsBox)
+	{
+		processor->setSpatialComponents(spatialComponentsBox->getSelectedId());
+	}
+	else if (cb == filterModeBox)
+	{
+		processor->setFilterMode((ReferenceFilter::Mode) (filterModeBox->getSelectedId() - 1));
+	}
+	else if (cb == montageBox)
+	{
+		processor->setActiveMontage(montageBox->getSelectedId() - 2);
+		removeMontageButton->setEnabled(processor->getActiveMontage() >= 0);
+	}
 }
 
 void ChannelRefCanvas::sliderValueChanged(Slider* slider)
@@ -208,13 +485,40 @@ void ChannelRefCanvas::sliderValueChanged(Slider* slider)
 	}
 }
 
+void ChannelRefCanvas::labelTextChanged(Label* label)
+{
+	if (label == lowCutEditor || label == highCutEditor)
+	{
+		float lowCut = lowCutEditor->getText().getFloatValue();
+		float highCut = highCutEditor->getText().getFloatValue();
+		float nyquist = 0.5f * processor->getSampleRate();
+
+		/* Rejected cutoffs leave the filter as it is, and the labels go back
+		   to the cutoffs in use */
+		if ((nyquist > 0 && highCut >= nyquist) || !processor->setFilterCutoffs(lowCut, highCut))
+		{
+			String message = "Filter cutoffs must be above 0 Hz, with the low cut below the high cut";
+			if (nyquist > 0)
+				message += " and both below " + String(nyquist) + " Hz";
+			CoreServices::sendStatusMessage(message + ".");
+		}
+
+		lowCutEditor->setText(String(processor->getFilterLowCut()), dontSendNotification);
+		highCutEditor->setText(String(processor->getFilterHighCut()), dontSendNotification);
+	}
+}
+
 
 
 // ----------------------------------------------------------------
 
 ChannelRefDisplay::ChannelRefDisplay(ChannelRefNode* n, ChannelRefCanvas* c, Viewport* v, bool selectMode) :
-    processor(n), canvas(c), viewport(v), nChannelsBefore(-1), singleSelectMode(selectMode)
+    nChannelsBefore(-1), singleSelectMode(selectMode), selectedRow(-1), selectedColumn(-1), zoomLevel(0),
+	cellWidth(TABLE_CELL_WIDTH << TABLE_SUBPIXEL_SHIFT), cellHeight(TABLE_CELL_HEIGHT << TABLE_SUBPIXEL_SHIFT),
+	processor(n), canvas(c), viewport(v), exclusionVersion(-1), rmsScale(0)
 {
+	setOpaque(true);
+	setWantsKeyboardFocus(true);
 	addKeyListener(this);
 	drawTable();
 }
@@ -223,121 +527,134 @@ ChannelRefDisplay::~ChannelRefDisplay()
 {
 }
 
+/* Cell j covers [j*cellWidth, (j+1)*cellWidth) in subpixels and starts at the
+   first pixel at or after that, so getColumnAt() returns the cell a pixel is in */
+int ChannelRefDisplay::getColumnX(int colIndex)
+{
+	int unit = 1 << TABLE_SUBPIXEL_SHIFT;
+	return TABLE_GRID_X + (colIndex * cellWidth + unit - 1) / unit;
+}
+
+int ChannelRefDisplay::getRowY(int rowIndex)
+{
+	int unit = 1 << TABLE_SUBPIXEL_SHIFT;
+	return TABLE_HEADER_HEIGHT + (rowIndex * cellHeight + unit - 1) / unit;
+}
+
+int ChannelRefDisplay::getColumnAt(int x)
+{
+	x -= TABLE_GRID_X;
+	return x < 0 ? -1 : (x << TABLE_SUBPIXEL_SHIFT) / cellWidth;
+}
+
+int ChannelRefDisplay::getRowAt(int y)
+{
+	y -= TABLE_HEADER_HEIGHT;
+	return y < 0 ? -1 : (y << TABLE_SUBPIXEL_SHIFT) / cellHeight;
+}
+
 void ChannelRefDisplay::drawTable()
 {
 	int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
 
 	if (nChannels != nChannelsBefore)
 	{
-		/* Move these values somewhere else? */
-		int xOffset = 50;
-		int yOffset = 1;
-		int cellWidth = 19;
-		int cellHeight = 15;
-		int vSpace = 1;
-		int headerHeight = 20;
-		int carWidth = 35;
-
-		int totalWidth = xOffset + carWidth + nChannels * cellWidth;
-		int totalHeigth = yOffset + headerHeight + nChannels * (cellHeight + vSpace);
+		selectedRow = -1;
+		selectedColumn = -1;
+		nChannelsBefore = nChannels;
+	}
 
-		headerLabels.clear();
-		rowLabels.clear();
-		electrodeButtons.clear();
-		carButtons.clear();
+	/* Also follows the zoom level */
+	setSize(getColumnX(nChannels) + 1, getRowY(nChannels) + 1);
+	repaint();
+}
 
-		/* Create header */
-		Font font(14, Font::plain);
 
-		Label* header1 = new Label("headerCol1", "Target");
-		header1->setJustificationType(Justification::horizontallyCentred);
-		header1->setBounds(0, yOffset, xOffset, headerHeight);
-		header1->setFont(font);
-		addAndMakeVisible(header1);
+void ChannelRefDisplay::update()
+{
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
 
-		headerLabels.add(header1);
+	if (!refMat->takeChanges(changes) || refMat->getNumberOfChannels() != nChannelsBefore)
+	{
+		drawTable();
+		return;
+	}
 
-		Label* header2 = new Label("headerCol2", "CAR");
-		header2->setJustificationType(Justification::horizontallyCentred);
-		header2->setBounds(xOffset, yOffset, carWidth, headerHeight);
-		header2->setFont(font);
-		addAndMakeVisible(header2);
+	for (int i=0; i<(int) changes.size(); i++)
+	{
+		repaintCells(changes[i].row, changes[i].firstCol, changes[i].lastCol);
+	}
+}
 
-		headerLabels.add(header2);
+void ChannelRefDisplay::updateTelemetry()
+{
+	if (!processor->getTelemetry()->readLatest(inputRms, outputRms))
+		return;
 
-		Label* header3 = new Label("headerCol3", "Reference(s)");
-		header3->setJustificationType(Justification::horizontallyCentred);
-		header3->setBounds(xOffset + carWidth, yOffset, totalWidth - xOffset - carWidth, headerHeight);
-		header3->setFont(font);
-		addAndMakeVisible(header3);
+	rmsScale = 0;
+	for (int c=0; c<(int) inputRms.size(); c++)
+	{
+		rmsScale = MAX(rmsScale, MAX(inputRms[c], outputRms[c]));
+	}
 
-		headerLabels.add(header3);
+	/* Only the visible part of the column is actually painted */
+	repaint(TABLE_LABEL_WIDTH, TABLE_HEADER_HEIGHT, TABLE_RMS_WIDTH, getHeight() - TABLE_HEADER_HEIGHT);
+}
 
-		/* Add button matrix */
-		for (int i=0; i<nChannels; i++)
-		{
-			/* Row label */
-			Label* label = new Label(String::formatted("row_label_%d", i), String::formatted("%d", i+1));
-			label->setJustificationType(Justification::horizontallyCentred);
-			label->setBounds(0, yOffset + headerHeight + i*(cellHeight + vSpace), xOffset, cellHeight);
-			label->setFont(font);
-			addAndMakeVisible(label);
-
-			rowLabels.add(label);
-
-			/* Button to select all channels as reference (aka common average reference) */
-			CarButton* cb = new CarButton("all", i);
-			cb->setToggleState(false, dontSendNotification);
-			cb->setBounds(xOffset + 5, yOffset + headerHeight + i*(cellHeight + vSpace), carWidth - 10, cellHeight);
-			cb->addListener(this);
-			cb->setRadioGroupId(0);
-			addAndMakeVisible(cb);
-
-			carButtons.add(cb);
-
-			for (int j=0; j<nChannels; j++)
-			{
-				bool state = processor->getReferenceMatrix()->getValue(i, j) > 0;
+void ChannelRefDisplay::updateExclusions()
+{
+	ChannelMonitor* monitor = processor->getChannelMonitor();
+	int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
 
-				ElectrodeTableButton* button = new ElectrodeTableButton(j+1, i, j);
-				button->setToggleState(state, dontSendNotification);
-				button->setRadioGroupId(0);
-				button->setBounds(xOffset + carWidth + j*cellWidth, yOffset + headerHeight + i*(cellHeight + vSpace), cellWidth, cellHeight);
-				button->addListener(this);
-				addAndMakeVisible(button);
+	if (monitor->getVersion() == exclusionVersion && (int) excluded.size() == nChannels)
+		return;
 
-				electrodeButtons.add(button);
-			}
-		}
+	exclusionVersion = monitor->getVersion();
+	excluded.resize(nChannels, 0);
 
-		setSize(totalWidth, totalHeigth);
-		setBounds(0, 0, totalWidth, totalHeigth);
-	}
-	else
+	for (int c=0; c<nChannels; c++)
 	{
-		/* Only update toggle states of buttons */
-		for (int i=0; i<nChannels; i++)
-		{
-			for (int j=0; j<nChannels; j++)
-			{
-				bool state = processor->getReferenceMatrix()->getValue(i, j) > 0;
+		char state = monitor->isExcluded(c) ? 1 : 0;
+		if (state == excluded[c])
+			continue;
 
-				ElectrodeTableButton* button = electrodeButtons[i*nChannels + j];
-				button->setToggleState(state, dontSendNotification);
-			}
-		}
+		excluded[c] = state;
+
+		/* Row label and column marker in the header */
+		int y = getRowY(c);
+		int x = getColumnX(c);
+		repaint(0, y, TABLE_LABEL_WIDTH, MAX(12, getRowY(c+1) - y));
+		repaint(x, 0, MAX(1, getColumnX(c+1) - x), TABLE_HEADER_HEIGHT);
 	}
 }
 
-
-void ChannelRefDisplay::update()
+/* In heatmap mode a cell is drawn as part of its bin, so the whole bin is
+   repainted; rows and columns are at least one pixel so the area is never empty */
+void ChannelRefDisplay::repaintCells(int rowIndex, int firstCol, int lastCol)
 {
-	drawTable();
+	int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
+	int colsPerBin = getColumnsPerBin();
+	int rowsPerBin = getRowsPerBin();
+
+	int firstRow = rowIndex - rowIndex % rowsPerBin;
+	int lastRow = MIN(nChannels - 1, firstRow + rowsPerBin - 1);
+	firstCol -= firstCol % colsPerBin;
+	lastCol = MIN(nChannels - 1, lastCol - lastCol % colsPerBin + colsPerBin - 1);
+
+	int y = getRowY(firstRow);
+	int h = MAX(1, getRowY(lastRow + 1) - y);
+	int x = getColumnX(firstCol);
+	int w = MAX(1, getColumnX(lastCol + 1) - x);
+
+	/* CAR switch and cells of the row (including the outline) */
+	repaint(TABLE_CAR_X, y, TABLE_CAR_WIDTH, h);
+	repaint(x, y, w + 1, h);
 }
 
 void ChannelRefDisplay::reset()
 {
 	processor->getReferenceMatrix()->clear();
+	processor->commitReferenceMatrix();
 	update();
 }
 
@@ -346,209 +663,414 @@ void ChannelRefDisplay::setEnableSingleSelectionMode(bool b)
 	singleSelectMode = b;
 }
 
+void ChannelRefDisplay::setZoomLevel(int level, int anchorX, int anchorY)
+{
+	level = MIN(MAX(level, TABLE_MIN_ZOOM_LEVEL), TABLE_MAX_ZOOM_LEVEL);
+	if (level == zoomLevel)
+		return;
+
+	/* Keep the cell under the anchor (usually the mouse) in place */
+	int gridX = TABLE_GRID_X;
+	int gridY = TABLE_HEADER_HEIGHT;
+	double scale = level > zoomLevel ? (double)(1 << (level - zoomLevel)) : 1.0 / (1 << (zoomLevel - level));
+	int offsetX = anchorX - viewport->getViewPositionX();
+	int offsetY = anchorY - viewport->getViewPositionY();
+
+	zoomLevel = level;
+	if (level >= 0)
+	{
+		cellWidth = (TABLE_CELL_WIDTH << TABLE_SUBPIXEL_SHIFT) << level;
+		cellHeight = (TABLE_CELL_HEIGHT << TABLE_SUBPIXEL_SHIFT) << level;
+	}
+	else
+	{
+		cellWidth = (TABLE_CELL_WIDTH << TABLE_SUBPIXEL_SHIFT) >> -level;
+		cellHeight = (TABLE_CELL_HEIGHT << TABLE_SUBPIXEL_SHIFT) >> -level;
+	}
+
+	drawTable();
+
+	int newX = anchorX > gridX ? gridX + (int)((anchorX - gridX) * scale) : anchorX;
+	int newY = anchorY > gridY ? gridY + (int)((anchorY - gridY) * scale) : anchorY;
+	viewport->setViewPosition(MAX(0, newX - offsetX), MAX(0, newY - offsetY));
+}
+
 void ChannelRefDisplay::paint(Graphics& g)
 {
 	g.fillAll(Colours::grey);
+
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
+	int nChannels = refMat->getNumberOfChannels();
+	Rectangle<int> clip = g.getClipBounds();
+
+	/* Header */
+	if (clip.getY() < TABLE_HEADER_HEIGHT)
+	{
+		g.setColour(Colours::black);
+		g.setFont(Font(14, Font::plain));
+		g.drawText("Target", 0, 1, TABLE_LABEL_WIDTH, TABLE_HEADER_HEIGHT - 1, Justification::centred, false);
+		g.drawText("RMS", TABLE_LABEL_WIDTH, 1, TABLE_RMS_WIDTH, TABLE_HEADER_HEIGHT - 1, Justification::centred, false);
+		g.drawText("CAR", TABLE_CAR_X, 1, TABLE_CAR_WIDTH, TABLE_HEADER_HEIGHT - 1, Justification::centred, false);
+		g.drawText("Reference(s)", TABLE_GRID_X + 5, 1, 150, TABLE_HEADER_HEIGHT - 1, Justification::centredLeft, false);
+
+		/* Columns of excluded channels */
+		int first = MAX(0, getColumnAt(clip.getX()));
+		int last = MIN((int) excluded.size() - 1, getColumnAt(clip.getRight() - 1));
+
+		g.setColour(Colours::red);
+		for (int j = first; j <= last; j++)
+		{
+			if (excluded[j])
+				g.fillRect(getColumnX(j), TABLE_HEADER_HEIGHT - 4, MAX(1, getColumnX(j+1) - getColumnX(j) - 1), 3);
+		}
+	}
+
+	if (nChannels == 0)
+		return;
+
+	int firstRow = MAX(0, getRowAt(clip.getY()));
+	int lastRow = MIN(nChannels - 1, getRowAt(clip.getBottom() - 1));
+	int firstCol = MAX(0, getColumnAt(clip.getX()));
+	int lastCol = MIN(nChannels - 1, getColumnAt(clip.getRight() - 1));
+
+	if (lastRow < firstRow)
+		return;
+
+	/* Row labels, thinned out so they do not overlap */
+	if (clip.getX() < TABLE_LABEL_WIDTH)
+	{
+		int step = 1;
+		while (getRowY(step) - getRowY(0) < 12)
+			step *= 2;
+
+		g.setFont(Font(14, Font::plain));
+		for (int i = firstRow - firstRow % step; i <= lastRow; i += step)
+		{
+			g.setColour(i < (int) excluded.size() && excluded[i] ? Colours::red : Colours::black);
+			g.drawText(String(i+1), 0, getRowY(i), TABLE_LABEL_WIDTH, MAX(12, getRowY(i+1) - getRowY(i) - 1),
+					   Justification::horizontallyCentred, false);
+		}
+	}
+
+	/* RMS before and after referencing */
+	if (clip.getX() < TABLE_CAR_X && clip.getRight() > TABLE_LABEL_WIDTH && rmsScale > 0)
+	{
+		int maxWidth = TABLE_RMS_WIDTH - 6;
+		int last = MIN(lastRow, (int) inputRms.size() - 1);
+
+		for (int i = firstRow; i <= last; i++)
+		{
+			int y = getRowY(i);
+			int h = getRowY(i+1) - y;
+			if (h == 0)
+				continue;
+
+			int inputWidth = (int) (maxWidth * inputRms[i] / rmsScale + 0.5f);
+			int outputWidth = (int) (maxWidth * outputRms[i] / rmsScale + 0.5f);
+			int barHeight = h > 2 ? h - 1 : h;
+
+			g.setColour(Colours::darkgrey);
+			g.fillRect(TABLE_LABEL_WIDTH + 3, y, inputWidth, barHeight);
+			g.setColour(outputRms[i] > inputRms[i] ? Colours::red : Colours::lightgreen);
+			g.fillRect(TABLE_LABEL_WIDTH + 3, y + barHeight / 4, outputWidth, MAX(1, barHeight / 2));
+		}
+	}
+
+	/* CAR column: one switch per row, all channels selected */
+	if (clip.getX() < TABLE_GRID_X && clip.getRight() > TABLE_CAR_X)
+	{
+		for (int i = firstRow; i <= lastRow; i++)
+		{
+			int y = getRowY(i);
+			int h = getRowY(i+1) - y;
+			if (h == 0)
+				continue;
+
+			g.setColour(refMat->allChannelReferencesActive(i) ? Colours::orange : Colours::darkgrey);
+			g.fillRect(TABLE_CAR_X + 5, y, TABLE_CAR_WIDTH - 10, h > 2 ? h - 1 : h);
+		}
+	}
+
+	if (lastCol < firstCol)
+		return;
+
+	if (isHeatmap())
+		paintHeatmap(g, clip.getIntersection(Rectangle<int>(getColumnX(0), getRowY(0),
+															getColumnX(nChannels) - getColumnX(0),
+															getRowY(nChannels) - getRowY(0))));
+	else
+		paintCells(g, firstRow, lastRow, firstCol, lastCol);
 }
 
-void ChannelRefDisplay::resized()
+bool ChannelRefDisplay::isHeatmap()
 {
+	return (cellWidth >> TABLE_SUBPIXEL_SHIFT) < TABLE_MIN_CELL_PIXELS;
 }
 
-void ChannelRefDisplay::mouseDown(const MouseEvent& event)
+/* Bins are at least one pixel wide and high, so every bin is visible */
+int ChannelRefDisplay::getColumnsPerBin()
 {
-
+	int unit = 1 << TABLE_SUBPIXEL_SHIFT;
+	return isHeatmap() ? (unit + cellWidth - 1) / cellWidth : 1;
 }
 
-void ChannelRefDisplay::buttonEvent(Button* button)
+int ChannelRefDisplay::getRowsPerBin()
 {
+	int unit = 1 << TABLE_SUBPIXEL_SHIFT;
+	return isHeatmap() ? (unit + cellHeight - 1) / cellHeight : 1;
 }
 
-void ChannelRefDisplay::buttonClicked(Button* b)
+void ChannelRefDisplay::paintCells(Graphics& g, int firstRow, int lastRow, int firstCol, int lastCol)
 {
-	
-	selectedRow = -1;
-	selectedColumn = -1;
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
+	bool showNumbers = cellWidth >= (TABLE_CELL_WIDTH << TABLE_SUBPIXEL_SHIFT);
 
-	if (b->getButtonText().startsWith("all"))
-	{
-		CarButton* button = dynamic_cast<CarButton*>(b);
-		int channelIndex = button->getChannelNum();
+	g.setFont(Font(10, Font::plain));
 
-		float* chan = processor->getReferenceMatrix()->getChannel(channelIndex);
+	for (int i = firstRow; i <= lastRow; i++)
+	{
+		int y = getRowY(i);
+		int h = getRowY(i+1) - y - 1;
 
-		float value;
-		button->getToggleState() ? value = 1 : value = 0;
-			
-		for (int i=0; i<processor->getReferenceMatrix()->getNumberOfChannels(); i++)
+		for (int j = firstCol; j <= lastCol; j++)
 		{
-			chan[i] = value;
-		}
+			int x = getColumnX(j);
+			int w = getColumnX(j+1) - x;
 
-		update();
-	}
-	else
-	{
-		ElectrodeTableButton* button = dynamic_cast<ElectrodeTableButton*>(b);
+			g.setColour(refMat->getValue(i, j) != 0 ? Colours::orange : Colours::darkgrey);
+			g.fillRect(x, y, w, h);
 
-		int rowIndex = button->getRowIndex();
-		int colIndex = button->getColIndex();
-		bool state = button->getToggleState();
+			g.setColour(Colours::black);
+			g.drawRect(x, y, w, h, 1);
 
-		if (singleSelectMode)
-		{
-			int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
-			for (int i=0; i<nChannels; i++)
-			{
-				processor->getReferenceMatrix()->setValue(rowIndex, i, 0);
-			}
-			processor->getReferenceMatrix()->setValue(rowIndex, colIndex, 1.);
+			if (showNumbers)
+				g.drawText(String(j+1), x, y, w, h, Justification::centred, false);
+		}
+	}
 
-			selectedRow = rowIndex;
-			selectedColumn = colIndex;
+	if (selectedRow >= firstRow && selectedRow <= lastRow && selectedColumn >= firstCol && selectedColumn <= lastCol)
+	{
+		int x = getColumnX(selectedColumn);
+		int y = getRowY(selectedRow);
 
-			update();
-		}
-		else
-		{
-			processor->getReferenceMatrix()->setValue(rowIndex, colIndex, (float)state);
-		}
+		g.setColour(Colours::white);
+		g.drawRect(x, y, getColumnX(selectedColumn+1) - x, getRowY(selectedRow+1) - y - 1, 1);
 	}
 }
 
-void ChannelRefDisplay::applyPreset(String name, int numChannels)
+/* Each heatmap bin aggregates a block of cells that is aligned to absolute
+   cell indices, and each pixel shows the bin of the cell it lies in. The
+   picture of a pixel therefore does not depend on the area being painted,
+   which allows repainting single bins and scrolling. */
+void ChannelRefDisplay::paintHeatmap(Graphics& g, const Rectangle<int>& area)
 {
+	if (area.isEmpty())
+		return;
+
 	ReferenceMatrix* refMat = processor->getReferenceMatrix();
 	int nChannels = refMat->getNumberOfChannels();
 
-	if (name.equalsIgnoreCase("Other tetrode electrodes"))
-	{
-		nChannels = MIN(nChannels, numChannels);
-		refMat->clear();
+	int colsPerBin = getColumnsPerBin();
+	int rowsPerBin = getRowsPerBin();
 
-		int nTetrodes = nChannels / 4;
-		for (int i=0; i<nTetrodes; i++)
-		{
-			for (int j=0; j<4; j++)
-			{
-				int channelIndex = i*4 + j;
-				for (int k=0; k<4; k++)
-				{
-					if (j != k)
-					{
-						refMat->setValue(channelIndex, i*4 + k, 1);
-					}
-				}
-			}
-		}
+	int firstRow = getRowAt(area.getY());
+	int lastRow = MIN(nChannels - 1, getRowAt(area.getBottom() - 1));
+	int firstCol = getColumnAt(area.getX());
+	int lastCol = MIN(nChannels - 1, getColumnAt(area.getRight() - 1));
 
-		drawTable();
-	}
-	else if (name.equalsIgnoreCase("All tetrode electrodes"))
+	firstRow -= firstRow % rowsPerBin;
+	firstCol -= firstCol % colsPerBin;
+	lastRow = MIN(nChannels - 1, lastRow - lastRow % rowsPerBin + rowsPerBin - 1);
+	lastCol = MIN(nChannels - 1, lastCol - lastCol % colsPerBin + colsPerBin - 1);
+
+	int numBinRows = (lastRow - firstRow) / rowsPerBin + 1;
+	int numBinCols = (lastCol - firstCol) / colsPerBin + 1;
+
+	counts.assign(numBinRows * numBinCols, 0);
+
+	for (int i = firstRow; i <= lastRow; i++)
 	{
-		nChannels = MIN(nChannels, numChannels);
-		refMat->clear();
+		refMat->getReferences(i, refs);
 
-		int nTetrodes = nChannels / 4;
-		for (int i=0; i<nTetrodes; i++)
+		int* binRow = &counts[((i - firstRow) / rowsPerBin) * numBinCols];
+		for (std::vector<int>::iterator it = std::lower_bound(refs.begin(), refs.end(), firstCol);
+			 it != refs.end() && *it <= lastCol; ++it)
 		{
-			for (int j=0; j<4; j++)
-			{
-				int channelIndex = i*4 + j;
-				for (int k=0; k<4; k++)
-				{
-					refMat->setValue(channelIndex, i*4 + k, 1);
-				}
-			}
+			binRow[(*it - firstCol) / colsPerBin]++;
 		}
+	}
 
-		drawTable();
+	/* Bin of each pixel column */
+	int width = area.getWidth();
+	int height = area.getHeight();
+
+	pixelBins.resize(width);
+	for (int x = 0; x < width; x++)
+	{
+		pixelBins[x] = MIN(getColumnAt(area.getX() + x), lastCol);
+		pixelBins[x] = (pixelBins[x] - firstCol) / colsPerBin;
 	}
-	else if (name.equalsIgnoreCase("Common average reference"))
+
+	Image heatmap(Image::RGB, width, height, false);
 	{
-		nChannels = MIN(nChannels, numChannels);
-		refMat->clear();
-		for (int i=0; i<nChannels; i++)
+		Image::BitmapData pixels(heatmap, Image::BitmapData::writeOnly);
+
+		for (int y = 0; y < height; y++)
 		{
-			for (int j=0; j<nChannels; j++)
+			int r = (MIN(getRowAt(area.getY() + y), lastRow) - firstRow) / rowsPerBin;
+			int binHeight = MIN(rowsPerBin, nChannels - firstRow - r * rowsPerBin);
+
+			for (int x = 0; x < width; x++)
 			{
-				refMat->setValue(i, j, 1);
+				int c = pixelBins[x];
+				int binWidth = MIN(colsPerBin, nChannels - firstCol - c * colsPerBin);
+				float fraction = (float)counts[r * numBinCols + c] / (binWidth * binHeight);
+
+				pixels.setPixelColour(x, y, Colours::darkgrey.interpolatedWith(Colours::orange, fraction));
 			}
 		}
+	}
 
-		drawTable();
+	g.drawImageAt(heatmap, area.getX(), area.getY());
+}
+
+void ChannelRefDisplay::resized()
+{
+}
+
+void ChannelRefDisplay::mouseDown(const MouseEvent& event)
+{
+	int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
+	int rowIndex = getRowAt(event.y);
+
+	if (rowIndex < 0 || rowIndex >= nChannels)
+		return;
+
+	if (event.x >= TABLE_CAR_X && event.x < TABLE_GRID_X)
+	{
+		toggleAllReferences(rowIndex);
 	}
-	else if (name.equalsIgnoreCase("Avg of other tetrodes"))
+	else
 	{
-		nChannels = MIN(nChannels, numChannels);
-		refMat->clear();
+		int colIndex = getColumnAt(event.x);
 
-		/* Activate all channels and deselect channels at the same tetrode */
-		int nTetrodes = nChannels / 4;
-		refMat->setAll(1, nChannels);
-		for (int i=0; i<nTetrodes; i++)
-		{
-			for (int j=0; j<4; j++)
-			{
-				int channelIndex = i*4 + j;
-				for (int k=0; k<4; k++)
-				{
-					refMat->setValue(channelIndex, i*4 + k, 0);
-				}
-			}
-		}
+		if (colIndex < 0 || colIndex >= nChannels)
+			return;
 
-		drawTable();
+		if (singleSelectMode)
+			selectReference(rowIndex, colIndex);
+		else
+			toggleReference(rowIndex, colIndex);
+	}
+}
+
+void ChannelRefDisplay::mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel)
+{
+	if (event.mods.isCommandDown() && wheel.deltaY != 0)
+	{
+		setZoomLevel(zoomLevel + (wheel.deltaY > 0 ? 1 : -1), event.x, event.y);
 	}
-	else if (name.equalsIgnoreCase("Avg of next tetrode"))
+	else
 	{
-		nChannels = MIN(nChannels, numChannels);
-		refMat->clear();
+		/* Let the viewport scroll */
+		Component::mouseWheelMove(event, wheel);
+	}
+}
 
-		int nTetrodes = nChannels / 4;
+void ChannelRefDisplay::toggleReference(int rowIndex, int colIndex)
+{
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
 
-		for (int i=0; i<nTetrodes; i++)
-		{
-			for (int j=0; j<4; j++)
-			{
-				for (int k=0; k<4; k++)
-				{
-					if (i < nTetrodes - 1)
-					{
-						refMat->setValue(i*4+j, (i+1)*4+k, 1);
-					}
-					else
-					{
-						refMat->setValue(i*4+j, (i-1)*4+k, 1);
-					}
-				}
-			}
-		}
+	if (selectedRow > -1)
+		repaintCells(selectedRow, selectedColumn, selectedColumn);
+
+	selectedRow = -1;
+	selectedColumn = -1;
+
+	refMat->setValue(rowIndex, colIndex, refMat->getValue(rowIndex, colIndex) != 0 ? 0.0f : 1.0f);
+	processor->commitReferenceMatrixLater();
+
+	update();
+}
+
+void ChannelRefDisplay::toggleAllReferences(int rowIndex)
+{
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
+	float value = refMat->allChannelReferencesActive(rowIndex) ? 0.0f : 1.0f;
+
+	if (selectedRow > -1)
+		repaintCells(selectedRow, selectedColumn, selectedColumn);
+
+	selectedRow = -1;
+	selectedColumn = -1;
+
+	refMat->setRow(rowIndex, value);
+	processor->commitReferenceMatrixLater();
 
+	update();
+}
+
+void ChannelRefDisplay::selectReference(int rowIndex, int colIndex)
+{
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
+
+	/* The outline of the previous selection is removed with the row */
+	if (selectedRow > -1 && selectedRow != rowIndex)
+		repaintCells(selectedRow, selectedColumn, selectedColumn);
+
+	refMat->setRow(rowIndex, 0);
+	refMat->setValue(rowIndex, colIndex, 1.);
+	processor->commitReferenceMatrixLater();
+
+	selectedRow = rowIndex;
+	selectedColumn = colIndex;
+
+	update();
+}
+
+void ChannelRefDisplay::applyPreset(String name, int numChannels)
+{
+	ReferenceMatrix* refMat = processor->getReferenceMatrix();
+
+	if (refMat->applyPreset(name.toStdString(), numChannels))
+	{
 		drawTable();
 	}
+
+	processor->commitReferenceMatrix();
 }
 
-/*
-	using keyboard in single channel mode not implemented yet!
-*/
 bool ChannelRefDisplay::keyPressed(const KeyPress &key, Component *originatingComponent)
 {
-//	std::cout << "ChannelRefDisplay::keyPressed key code = " << key.getKeyCode() << " | description = " << key.getTextDescription() << " | singleSelectMode = " << singleSelectMode << std::endl;
-	if (singleSelectMode)
+	int character = key.getTextCharacter();
+
+	if (character == '+' || character == '=')
+	{
+		setZoomLevel(zoomLevel + 1, viewport->getViewPositionX(), viewport->getViewPositionY());
+		return true;
+	}
+	else if (character == '-')
 	{
-		if (selectedRow > -1 && selectedColumn > -1)
+		setZoomLevel(zoomLevel - 1, viewport->getViewPositionX(), viewport->getViewPositionY());
+		return true;
+	}
+
+	/* In single channel mode, the arrow keys move the selected reference */
+	if (singleSelectMode && selectedRow > -1 && selectedColumn > -1)
+	{
+		int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
+
+		if (key.getKeyCode() == KeyPress::leftKey && selectedColumn > 0)
 		{
-			int nChannels = processor->getReferenceMatrix()->getNumberOfChannels();
-			if (key.getTextDescription().compare("cursor left") == 0 && selectedColumn > 0)
-			{
-//				std::cout << ":::Move left:::" << std::endl;
-			}
-			else if (key.getTextDescription().compare("cursor right") == 0 && selectedColumn < nChannels - 1)
-			{
-//				std::cout << ":::Move right:::" << std::endl;
-			}
+			selectReference(selectedRow, selectedColumn - 1);
+			return true;
+		}
+		else if (key.getKeyCode() == KeyPress::rightKey && selectedColumn < nChannels - 1)
+		{
+			selectReference(selectedRow, selectedColumn + 1);
+			return true;
 		}
 	}
-}
 
+	return false;
+}
@@ -30,12 +30,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "ChannelRefNode.h"
 
-class ElectrodeTableButton;
 class ChannelRefDisplay;
 
 class ChannelRefCanvas : public Visualizer,
 public Button::Listener,
 public ComboBox::Listener,
+public Label::Listener,
 public Slider::Listener
 
 {
@@ -69,6 +69,7 @@ public:
 
 	void comboBoxChanged(ComboBox* cb);
 	void sliderValueChanged(Slider* slider);
+	void labelTextChanged(Label* label);
 
 private:
 
@@ -88,8 +89,28 @@ private:
 	ScopedPointer<UtilityButton> saveButton;
 	ScopedPointer<UtilityButton> loadButton;
 	ScopedPointer<Slider> gainSlider;
-
-	OwnedArray<ElectrodeTableButton> electrodeButtons;
+	ScopedPointer<ComboBox> normalizationBox;
+	ScopedPointer<Label> normalizationLabel;
+	ScopedPointer<UtilityButton> fitButton;
+	ScopedPointer<ComboBox> referenceTypeBox;
+	ScopedPointer<Label> referenceTypeLabel;
+	ScopedPointer<UtilityButton> probeButton;
+	ScopedPointer<UtilityButton> localButton;
+	ScopedPointer<Label> radiusLabel;
+	ScopedPointer<Label> innerRadiusEditor;
+	ScopedPointer<Label> outerRadiusEditor;
+	ScopedPointer<UtilityButton> autoExcludeButton;
+	ScopedPointer<UtilityButton> suggestButton;
+	ScopedPointer<ComboBox> spatialModeBox;
+	ScopedPointer<ComboBox> spatialComponentsBox;
+	ScopedPointer<ComboBox> montageBox;
+	ScopedPointer<UtilityButton> addMontageButton;
+	ScopedPointer<UtilityButton> removeMontageButton;
+	ScopedPointer<UtilityButton> fitGainsButton;
+	ScopedPointer<UtilityButton> resetGainsButton;
+	ScopedPointer<ComboBox> filterModeBox;
+	ScopedPointer<Label> lowCutEditor;
+	ScopedPointer<Label> highCutEditor;
 
 	int scrollBarThickness;
 	int scrollDistance;
@@ -99,44 +120,58 @@ private:
 };
 
 
-class ElectrodeTableButton : public ElectrodeButton
-{
-public:
+/* Layout of the reference table at zoom level 0 (in pixels) */
+#define TABLE_LABEL_WIDTH 50
+#define TABLE_RMS_WIDTH 60
+#define TABLE_CAR_WIDTH 35
+#define TABLE_CAR_X (TABLE_LABEL_WIDTH + TABLE_RMS_WIDTH)
+#define TABLE_GRID_X (TABLE_CAR_X + TABLE_CAR_WIDTH)
+#define TABLE_HEADER_HEIGHT 21
+#define TABLE_CELL_WIDTH 19
+#define TABLE_CELL_HEIGHT 16
 
-	ElectrodeTableButton(int index, int rowIndex_, int colIndex_) : ElectrodeButton(index), rowIndex(rowIndex_), colIndex(colIndex_)
-	{
-	}
+/* Cell sizes are kept in 1/256 pixels so that hit-testing is exact */
+#define TABLE_SUBPIXEL_SHIFT 8
 
-	int getRowIndex()
-	{
-		return rowIndex;
-	}
+/* Zoom levels are powers of two; negative levels zoom out */
+#define TABLE_MIN_ZOOM_LEVEL -5
+#define TABLE_MAX_ZOOM_LEVEL 1
 
-	int getColIndex()
-	{
-		return colIndex;
-	}
+/* Cells narrower than this are drawn as a heatmap instead of buttons */
+#define TABLE_MIN_CELL_PIXELS 5
 
-private:
 
-	int rowIndex;
-	int colIndex;
+/**
 
-};
+  Reference table
 
+  Shows the reference matrix as a grid with one row per target channel and
+  one column per reference channel, plus a CAR column that selects all
+  channels of a row at once. While acquisition is running, the RMS column
+  shows the RMS of each channel before (grey) and after (green, or red if
+  it increased) referencing.
 
-class CarButton : public ElectrodeButton
-{
-public:
+  The grid is a single component that is painted directly from the
+  matrix. Only the part that is visible in the viewport is drawn and clicks
+  are mapped to cells arithmetically, so the cost of painting depends on the
+  viewport size and not on the number of channels. When zoomed out so far
+  that cells are only a few pixels wide, groups of cells are drawn as
+  heatmap pixels whose brightness is the fraction of selected cells.
 
-	CarButton(String label_, int channelIndex_) : ElectrodeButton(channelIndex_)
-	{
-		setButtonText(label_);
-	}
-};
+  update() only repaints the cells that the reference matrix reports as
+  changed, so editing a single cell does not touch the rest of the table.
+
+  Channels that are currently excluded by the channel monitor are marked
+  in red (row label and column header). updateExclusions() is polled while
+  acquisition is running and repaints only the channels that changed.
 
+  Ctrl + mouse wheel (or the + and - keys) changes the zoom level.
 
-class ChannelRefDisplay : public Component, public Button::Listener, public KeyListener
+  @see ChannelRefCanvas, ReferenceMatrix
+
+*/
+
+class ChannelRefDisplay : public Component, public KeyListener
 {
 public:
 
@@ -147,11 +182,11 @@ public:
 
     void resized();
 	void update();
+	void updateExclusions();
+	void updateTelemetry();
 
     void mouseDown(const MouseEvent& event);
-
-	void buttonEvent(Button* button);
-	void buttonClicked(Button* button);
+	void mouseWheelMove(const MouseEvent& event, const MouseWheelDetails& wheel);
 
 	bool keyPressed(const KeyPress &key, Component *originatingComponent);
 
@@ -161,22 +196,53 @@ public:
 
 	void applyPreset(String name, int numChannels);
 
+	void setZoomLevel(int level, int anchorX, int anchorY);
+
 private:
 
+	int getColumnX(int colIndex);
+	int getRowY(int rowIndex);
+	int getColumnAt(int x);
+	int getRowAt(int y);
+
+	bool isHeatmap();
+	int getColumnsPerBin();
+	int getRowsPerBin();
+
+	void paintCells(Graphics& g, int firstRow, int lastRow, int firstCol, int lastCol);
+	void paintHeatmap(Graphics& g, const Rectangle<int>& area);
+	void repaintCells(int rowIndex, int firstCol, int lastCol);
+
+	void toggleReference(int rowIndex, int colIndex);
+	void toggleAllReferences(int rowIndex);
+	void selectReference(int rowIndex, int colIndex);
+
     int nChannelsBefore;
 	bool singleSelectMode;
 	int selectedRow;
 	int selectedColumn;
 
+	int zoomLevel;
+	int cellWidth;
+	int cellHeight;
+
 	ChannelRefNode* processor;
 	ChannelRefCanvas* canvas;
     Viewport* viewport;
-	ScopedPointer<Label> staticLabel;
 
-	OwnedArray<ElectrodeTableButton> electrodeButtons;
-	OwnedArray<CarButton> carButtons;
-	OwnedArray<Label> rowLabels;
-	OwnedArray<Label> headerLabels;
+	std::vector<int> refs;
+	std::vector<int> counts;
+	std::vector<int> pixelBins;
+	std::vector<ReferenceMatrix::Change> changes;
+
+	/* Exclusions as last painted, and the monitor version they are from */
+	std::vector<char> excluded;
+	int exclusionVersion;
+
+	/* Last telemetry frame and the RMS that fills the column */
+	std::vector<float> inputRms;
+	std::vector<float> outputRms;
+	float rmsScale;
 
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ChannelRefDisplay);
 
@@ -31,6 +31,28 @@ ChannelRefEditor::ChannelRefEditor(GenericProcessor* parentNode, bool useDefault
 {	
     tabText = "Channel Ref";
     desiredWidth = 180;
+
+    threadsLabel = new Label("ThreadsLabel", "Threads");
+    threadsLabel->setBounds(10, 30, 60, 20);
+    threadsLabel->setFont(Font("Small Text", 12, Font::plain));
+    addAndMakeVisible(threadsLabel);
+
+    threadsBox = new ComboBox("Threads");
+    for (int i=1; i<=SystemStats::getNumCpus(); i++)
+    {
+        threadsBox->addItem(String(i), i);
+    }
+    threadsBox->setSelectedId(1, dontSendNotification);
+    threadsBox->setBounds(70, 30, 90, 20);
+    threadsBox->addListener(this);
+    addAndMakeVisible(threadsBox);
+
+    referencesLabel = new Label("ReferencesLabel", "");
+    referencesLabel->setBounds(10, 55, 150, 20);
+    referencesLabel->setFont(Font("Small Text", 12, Font::plain));
+    addAndMakeVisible(referencesLabel);
+
+    updateReferenceCount();
 }
 
 ChannelRefEditor::~ChannelRefEditor()
@@ -54,6 +76,26 @@ void ChannelRefEditor::updateSettings()
 	}
 }
 
+void ChannelRefEditor::updateReferenceCount()
+{
+	ChannelRefNode* p = dynamic_cast<ChannelRefNode*>(getProcessor());
+	referencesLabel->setText("Distinct refs: " + String(p->getNumDistinctReferences()), dontSendNotification);
+}
+
+void ChannelRefEditor::comboBoxChanged(ComboBox* cb)
+{
+	if (cb == threadsBox)
+	{
+		ChannelRefNode* p = dynamic_cast<ChannelRefNode*>(getProcessor());
+		p->setNumThreads(threadsBox->getSelectedId());
+
+		if (acquisitionIsActive)
+		{
+			CoreServices::sendStatusMessage("Number of threads will be applied when acquisition restarts.");
+		}
+	}
+}
+
 void ChannelRefEditor::saveCustomParameters(XmlElement* xml)
 {
 	ChannelRefNode* p = dynamic_cast<ChannelRefNode*>(getProcessor());
@@ -65,54 +107,156 @@ void ChannelRefEditor::saveCustomParameters(XmlElement* xml)
 	/* global gain */
     XmlElement* paramXml = xml->createNewChildElement("PARAMETERS");
     paramXml->setAttribute("GlobalGain", p->getGlobalGain());
+    paramXml->setAttribute("NumThreads", p->getNumThreads());
+    paramXml->setAttribute("ParallelMinChannels", p->getParallelMinChannels());
+    paramXml->setAttribute("Normalization", (int) refMat->getNormalization());
+    paramXml->setAttribute("ReferenceType", (int) refMat->getReferenceType());
+    paramXml->setAttribute("TrimFraction", refMat->getTrimFraction());
+    if (refMat->hasChannelGains())
+        paramXml->setAttribute("ChannelGains", String(refMat->getChannelGainText()));
+    paramXml->setAttribute("ProbeGeometry", p->getProbeGeometryPath());
+    paramXml->setAttribute("LocalInnerRadius", p->getLocalInnerRadius());
+    paramXml->setAttribute("LocalOuterRadius", p->getLocalOuterRadius());
+    paramXml->setAttribute("AutoExclude", p->getAutoExclude());
+    paramXml->setAttribute("SpatialMode", (int) p->getSpatialMode());
+    paramXml->setAttribute("SpatialComponents", p->getSpatialComponents());
+    paramXml->setAttribute("FilterMode", (int) p->getFilterMode());
+    paramXml->setAttribute("FilterLowCut", p->getFilterLowCut());
+    paramXml->setAttribute("FilterHighCut", p->getFilterHighCut());
+    paramXml->setAttribute("FilterOrder", p->getFilterOrder());
 
-	/* references for each channel */
+	/* references: preset name, sidecar file, or channel ranges */
 	XmlElement* channelsXml = xml->createNewChildElement("REFERENCES");
 
-    for (int i=0; i<nChannels; i++)
-    {
-		float* ref = refMat->getChannel(i);
- 
-        XmlElement* channelXml = channelsXml->createNewChildElement("CHANNEL");
-        channelXml->setAttribute("Index", i+1);
-		for (int j=0; j<nChannels; j++)
+	if (!refMat->getAppliedPreset().empty())
+	{
+		channelsXml->setAttribute("Preset", String(refMat->getAppliedPreset()));
+		channelsXml->setAttribute("PresetChannels", refMat->getAppliedPresetChannels());
+	}
+	else if (sidecarFile != File::nonexistent && !refMat->isBinary()
+			 && refMat->writeBinary(sidecarFile.getFullPathName().toStdString()))
+	{
+		channelsXml->setAttribute("Sidecar", sidecarFile.getFileName());
+	}
+	else
+	{
+		for (int i=0; i<nChannels; i++)
 		{
-			if (ref[j] > 0)
+			if (refMat->getNumReferences(i) > 0)
 			{
-				XmlElement* refXml = channelXml->createNewChildElement("REFERENCE");
-				refXml->setAttribute("Index", j+1);
-				refXml->setAttribute("Value", ref[j]);
+				XmlElement* channelXml = channelsXml->createNewChildElement("CHANNEL");
+				channelXml->setAttribute("Index", i+1);
+				channelXml->setAttribute("Ranges", String(refMat->getRowRanges(i)));
 			}
 		}
-    }
+	}
+
+	/* montages: derivations of each, and the one in use */
+	XmlElement* montagesXml = xml->createNewChildElement("MONTAGES");
+	montagesXml->setAttribute("Active", p->getActiveMontage());
+
+	for (int m=0; m<p->getNumMontages(); m++)
+	{
+		XmlElement* montageXml = montagesXml->createNewChildElement("MONTAGE");
+		montageXml->setAttribute("Name", p->getMontageName(m));
+		montageXml->setAttribute("Derivations", String(ReferenceMontage::toText(p->getMontageDerivations(m))));
+	}
+}
+
+/* Hand a parsed element and its children to the settings reader */
+static void readElement(ReferenceSettingsReader& reader, XmlElement* xml)
+{
+	ReferenceSettingsReader::Attributes attributes;
+	for (int i=0; i<xml->getNumAttributes(); i++)
+	{
+		attributes[xml->getAttributeName(i).toStdString()] = xml->getAttributeValue(i).toStdString();
+	}
+
+	std::string tag = xml->getTagName().toStdString();
+	reader.startElement(tag, attributes);
+
+	forEachXmlChildElement(*xml, childXml)
+	{
+		readElement(reader, childXml);
+	}
+
+	reader.endElement(tag);
 }
 
 void ChannelRefEditor::loadCustomParameters(XmlElement* xml)
 {
 	ChannelRefNode* p = dynamic_cast<ChannelRefNode*>(getProcessor());
-	ReferenceMatrix* refMat = p->getReferenceMatrix();
+	ReferenceSettingsReader reader(p->getReferenceMatrix(),
+								   File::getCurrentWorkingDirectory().getFullPathName().toStdString());
 
-	forEachXmlChildElementWithTagName(*xml,	paramXml, "PARAMETERS")
+	forEachXmlChildElement(*xml, childXml)
 	{
-    	float globGain = (float)paramXml->getDoubleAttribute("GlobalGain");
-		p->setGlobalGain(globGain);
+		if (childXml->hasTagName("PARAMETERS") || childXml->hasTagName("REFERENCES")
+			|| childXml->hasTagName("MONTAGES"))
+		{
+			readElement(reader, childXml);
+		}
 	}
 
-	forEachXmlChildElementWithTagName(*xml,	channelsXml, "REFERENCES")
+	applySettings(reader);
+}
+
+void ChannelRefEditor::applySettings(ReferenceSettingsReader& reader)
+{
+	ChannelRefNode* p = dynamic_cast<ChannelRefNode*>(getProcessor());
+	const ReferenceSettingsReader::Attributes& params = reader.getParameters();
+
+	if (!params.empty())
 	{
-		forEachXmlChildElementWithTagName(*channelsXml,	channelXml, "CHANNEL")
-		{
-			int channelIndex = channelXml->getIntAttribute("Index");
+		p->setGlobalGain((float) reader.getParameter("GlobalGain", 0));
 
-			forEachXmlChildElementWithTagName(*channelXml,	refXml, "REFERENCE")
-			{
-				int refIndex = refXml->getIntAttribute("Index");
-				float gain = (float)refXml->getDoubleAttribute("Value");
-				refMat->setValue(channelIndex - 1, refIndex - 1, gain);
-			}
-		}
+		p->setNumThreads((int) reader.getParameter("NumThreads", 1));
+		p->setParallelMinChannels((int) reader.getParameter("ParallelMinChannels", PARALLEL_MIN_CHANNELS));
+		threadsBox->setSelectedId(p->getNumThreads(), dontSendNotification);
+
+		reader.applyMatrixParameters();
+
+		/* The geometry is only needed to recompute local references; the
+		   references themselves are stored with the matrix */
+		ReferenceSettingsReader::Attributes::const_iterator geometry = params.find("ProbeGeometry");
+		if (geometry != params.end() && !geometry->second.empty())
+			p->loadProbeGeometry(String(geometry->second));
+
+		p->setLocalRadius((float) reader.getParameter("LocalInnerRadius", 0),
+						  (float) reader.getParameter("LocalOuterRadius", DEFAULT_LOCAL_RADIUS));
+
+		p->setAutoExclude(reader.getParameter("AutoExclude", 0) != 0);
+
+		int spatialMode = (int) reader.getParameter("SpatialMode", SpatialFilter::OFF);
+		if (spatialMode < 0 || spatialMode >= SpatialFilter::NUM_MODES)
+			spatialMode = SpatialFilter::OFF;
+		p->setSpatialMode((SpatialFilter::Mode) spatialMode);
+		p->setSpatialComponents((int) reader.getParameter("SpatialComponents", SPATIAL_COMPONENTS));
+
+		int filterMode = (int) reader.getParameter("FilterMode", ReferenceFilter::OFF);
+		if (filterMode < 0 || filterMode >= ReferenceFilter::NUM_MODES)
+			filterMode = ReferenceFilter::OFF;
+		p->setFilterMode((ReferenceFilter::Mode) filterMode);
+		p->setFilterCutoffs((float) reader.getParameter("FilterLowCut", DEFAULT_FILTER_LOW_CUT),
+							(float) reader.getParameter("FilterHighCut", DEFAULT_FILTER_HIGH_CUT));
+		p->setFilterOrder((int) reader.getParameter("FilterOrder", REFERENCE_FILTER_ORDER));
 	}
 
+	/* Files without montages clear them */
+	p->clearMontages();
+	for (int m=0; m<reader.getNumMontages(); m++)
+	{
+		p->addMontage(String(reader.getMontageName(m)), reader.getMontageDerivations(m));
+	}
+	p->setActiveMontage(reader.getActiveMontage());
+
+	if (!reader.getError().empty())
+	{
+		CoreServices::sendStatusMessage("Channel references: " + String(reader.getError()));
+	}
+
+	p->commitReferenceMatrix();
+
 	updateSettings();
 }
 
@@ -130,7 +274,9 @@ void ChannelRefEditor::saveParametersDialog()
             File fileToSave = fc.getResult();
 
 			XmlElement* xml = new XmlElement("SETTINGS");
+			sidecarFile = fileToSave.withFileExtension("refmat");
 			saveCustomParameters(xml);
+			sidecarFile = File::nonexistent;
 			if(!xml->writeToFile(fileToSave, String::empty))
 			{
 				CoreServices::sendStatusMessage("Couldn't save channel reference data to file.");
@@ -160,10 +306,18 @@ void ChannelRefEditor::loadParametersDialog()
         {
             File fileToOpen = fc.getResult();
 
-			XmlElement* xml = XmlDocument::parse(fileToOpen);
-			loadCustomParameters(xml);
-			CoreServices::sendStatusMessage("Loaded channel reference data from file." + fileToOpen.getFullPathName());
-			delete xml;
+			/* Stream the file instead of parsing it into a document first */
+			ChannelRefNode* p = dynamic_cast<ChannelRefNode*>(getProcessor());
+			ReferenceSettingsReader reader(p->getReferenceMatrix(),
+										   fileToOpen.getParentDirectory().getFullPathName().toStdString());
+
+			bool loaded = reader.read(fileToOpen.getFullPathName().toStdString());
+			applySettings(reader);
+
+			if (loaded)
+			{
+				CoreServices::sendStatusMessage("Loaded channel reference data from file " + fileToOpen.getFullPathName());
+			}
         }
     } else
 	{
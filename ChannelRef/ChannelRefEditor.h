@@ -30,18 +30,25 @@
 
 
 #include "ChannelRefCanvas.h"
+#include "ReferenceSettings.h"
 
 
 /**
 
   User interface for the Channel Refence processor.
 
+  References are saved as the name of the preset they were set up with if
+  they were not edited afterwards, otherwise as a list of channel ranges
+  per channel. Matrices with weights other than 1 that are saved to a file
+  go to a binary sidecar file next to it instead (*.refmat).
+
   @see ChannelRefNode
 
 */
 
 class ChannelRefEditor : public VisualizerEditor,
-    public DragAndDropContainer
+    public DragAndDropContainer,
+    public ComboBox::Listener
 
 {
 public:
@@ -61,10 +68,25 @@ public:
     String writePrbFile(File filename);
     String loadPrbFile(File filename);
 
+    void comboBoxChanged(ComboBox* cb);
+
+    /** Show the number of distinct references of the current matrix. */
+    void updateReferenceCount();
+
 private:
 
+	/** Apply the parameters and references found by a reader. */
+	void applySettings(ReferenceSettingsReader& reader);
+
 	ChannelRefCanvas* chanRefCanvas;
 
+	/* Set while saving to a file that may get a sidecar */
+	File sidecarFile;
+
+	Label* threadsLabel;
+	ComboBox* threadsBox;
+	Label* referencesLabel;
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ChannelRefEditor);
 
 };
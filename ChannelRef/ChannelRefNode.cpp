@@ -26,19 +26,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "ChannelRefEditor.h"
 
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
-
-
 ChannelRefNode::ChannelRefNode()
-    : GenericProcessor("Channel Ref"), channelBuffer(1, BUFFER_SIZE), 
-avgBuffer(1, BUFFER_SIZE), globalGain(1.0f)
+    : GenericProcessor("Channel Ref"), globalGain(1.0f), numDistinctReferences(0), commitTimer(this),
+	numThreads(1), parallelMinChannels(PARALLEL_MIN_CHANNELS), fitState(FIT_IDLE), numFitSamples(0),
+	fitLength(FIT_BUFFER_SIZE), fitChannels(false),
+	localInnerRadius(0), localOuterRadius(DEFAULT_LOCAL_RADIUS), exclusionVersion(0), exclusionTimer(this),
+	acquiring(false), activeMontage(-1),
+	montagesChanged(false), committedPlan(nullptr)
 {
 	int nChannels = getNumInputs();
 	refMat = new ReferenceMatrix(nChannels);
+
+	activePlan = new ReferencePlan();
+	commitReferenceMatrix();
 }
 
 ChannelRefNode::~ChannelRefNode()
 {
+	commitTimer.stopTimer();
+	exclusionTimer.stopTimer();
+
+	delete activePlan;
+	delete pendingPlan.exchange(nullptr);
+	delete retiredPlan.exchange(nullptr);
 	delete refMat;
 }
 
@@ -63,6 +73,16 @@ void ChannelRefNode::updateSettings()
 		refMat->setNumberOfChannels(nChannels);
 	}
 
+	fitBuffer.setSize(nChannels, jmax(FIT_BUFFER_SIZE, GAIN_FIT_BUFFER_SIZE));
+
+	channelMonitor.prepare(nChannels, getSampleRate());
+	telemetry.prepare(nChannels, getSampleRate());
+	covarianceEngine.prepare(nChannels, getSampleRate());
+	spatialFilter.prepare(nChannels);
+	referenceFilter.prepare(nChannels, getSampleRate());
+
+	commitReferenceMatrix();
+
 	if (editor != nullptr)
 	{
 		editor->updateSettings();
@@ -70,6 +90,38 @@ void ChannelRefNode::updateSettings()
 }
 
 
+bool ChannelRefNode::enable()
+{
+	/* Workers only exist (and spin) while acquisition is running */
+	threadPool.setNumThreads(numThreads - 1);
+
+	acquiring = true;
+	if (spatialFilter.getMode() != SpatialFilter::OFF)
+		startSpatialFilter();
+
+	exclusionTimer.startTimer(EXCLUSION_POLL_MS);
+
+	return true;
+}
+
+bool ChannelRefNode::disable()
+{
+	threadPool.setNumThreads(0);
+	exclusionTimer.stopTimer();
+
+	if (spatialFilter.getMode() != SpatialFilter::OFF)
+		stopSpatialFilter();
+	acquiring = false;
+
+	/* A capture that has not started yet would never complete */
+	if (fitState.compareAndSetBool(FIT_IDLE, FIT_REQUESTED))
+	{
+		stopTimer();
+	}
+
+	return true;
+}
+
 void ChannelRefNode::setParameter(int parameterIndex, float newValue)
 {
 
@@ -78,51 +130,189 @@ void ChannelRefNode::setParameter(int parameterIndex, float newValue)
 void ChannelRefNode::process(AudioSampleBuffer& buffer,
                              MidiBuffer& midiMessages)
 {
-	float* ref;
-	float refGain;
-	int numRefs;
-	int numChan = refMat->getNumberOfChannels();
+	acquirePendingPlan();
+
+	ReferencePlan* plan = activePlan;
 
-	channelBuffer = buffer;
+	if (plan->getNumChannels() > buffer.getNumChannels())
+	{
+		return;
+	}
 
-	for (int i=0; i<numChan; i++)
+	/* Bad channels are masked out of the references of the other channels;
+	   this only touches the rows that reference them */
+	if (channelMonitor.getNumChannels() == plan->getNumChannels())
 	{
-		avgBuffer.clear();
+		int numChanged = channelMonitor.process(buffer.getArrayOfReadPointers(), buffer.getNumSamples());
+		const int* changed = channelMonitor.getChangedChannels();
 
-		ref = refMat->getChannel(i);
-		numRefs = 0;
-		for (int j=0; j<numChan; j++)
+		for (int k=0; k<numChanged; k++)
 		{
-			if (ref[j] > 0)
-			{
-				numRefs++;
-			}
+			plan->setChannelMasked(changed[k], channelMonitor.isExcluded(changed[k]));
 		}
+	}
 
-		for (int j=0; j<numChan; j++)
+	/* Raw input for a requested least-squares fit */
+	if (fitState.get() == FIT_REQUESTED)
+	{
+		int n = jmin(buffer.getNumSamples(), fitLength - numFitSamples);
+		int nChannels = jmin(fitBuffer.getNumChannels(), buffer.getNumChannels());
+
+		for (int i=0; i<nChannels; i++)
 		{
-			if (ref[j] > 0)
-			{
-				refGain = 1.0f / float(numRefs);
-				avgBuffer.addFrom(0, 0, channelBuffer, j, 0,
-								  channelBuffer.getNumSamples(), refGain);
-			}
+			fitBuffer.copyFrom(i, numFitSamples, buffer, i, 0, n);
+		}
+		numFitSamples += n;
+
+		if (numFitSamples == fitLength)
+		{
+			fitState.set(FIT_CAPTURED);
 		}
-		
+	}
+
+	/* Each row and sum is a single pass of the vectorized kernel; the gains
+	   already contain the normalization and the global gain. All scratch
+	   memory belongs to the plan, so nothing is allocated here. */
+	bool parallel = threadPool.getNumThreads() > 0 && plan->getNumChannels() >= parallelMinChannels;
+	bool measure = telemetry.getNumChannels() == plan->getNumChannels();
+	int montage = plan->getActiveMontage();
+
+	if (measure)
+		telemetry.measureInput(buffer.getArrayOfReadPointers(), buffer.getNumSamples());
+
+	/* Only copies a few samples now and then; the worker does the rest */
+	if (covarianceEngine.getNumChannels() == plan->getNumChannels())
+		covarianceEngine.push(buffer.getArrayOfReadPointers(), buffer.getNumSamples());
+
+	/* Until a projection of the selected mode has been fitted, the plan
+	   (or montage) references the channels instead */
+	if (spatialFilter.getMode() != SpatialFilter::OFF && spatialFilter.getNumChannels() == plan->getNumChannels()
+		&& spatialFilter.process(buffer.getArrayOfWritePointers(),
+								 buffer.getNumSamples(),
+								 ReferenceKernels::getType(),
+								 parallel ? &threadPool : nullptr))
+	{
+		/* The projection is not tiled, so the filter runs as a second pass */
+		if (referenceFilter.getNumChannels() == plan->getNumChannels())
+			referenceFilter.process(buffer.getArrayOfWritePointers(),
+									buffer.getNumSamples(),
+									ReferenceKernels::getType(),
+									parallel ? &threadPool : nullptr);
+	}
+	else if (montage >= 0)
+	{
+		plan->processMontage(montage,
+							 buffer.getArrayOfWritePointers(),
+							 buffer.getNumSamples(),
+							 ReferenceKernels::getType(),
+							 parallel ? &threadPool : nullptr,
+							 &referenceFilter);
+	}
+	else
+	{
+		plan->process(buffer.getArrayOfWritePointers(),
+					  buffer.getNumSamples(),
+					  ReferenceKernels::getType(),
+					  parallel ? &threadPool : nullptr,
+					  &referenceFilter);
+	}
+
+	if (measure)
+		telemetry.measureOutput(buffer.getArrayOfReadPointers(), buffer.getNumSamples());
+}
 
-		if (numRefs > 0)
+void ChannelRefNode::acquirePendingPlan()
+{
+	/* The previous plan can only be handed back once the message thread
+	   has collected the one before it; otherwise try again next block */
+	if (retiredPlan.get() == nullptr)
+	{
+		ReferencePlan* plan = pendingPlan.exchange(nullptr);
+		if (plan != nullptr)
 		{
-			buffer.addFrom(i, 			// destChannel
-						0, 				// destStartSample
-						avgBuffer, 	// source
-						0,  			// sourceChannel
-						0, 				// sourceStartSample
-						buffer.getNumSamples(), // numSamples
-						-1.0f * globalGain);  // global gain to apply 
+			retiredPlan.set(activePlan);
+			activePlan = plan;
+
+			/* A new plan starts without masks */
+			if (channelMonitor.getNumExcluded() > 0 && channelMonitor.getNumChannels() == plan->getNumChannels())
+			{
+				for (int c=0; c<plan->getNumChannels(); c++)
+				{
+					if (channelMonitor.isExcluded(c))
+						plan->setChannelMasked(c, true);
+				}
+			}
 		}
 	}
 }
 
+void ChannelRefNode::commitReferenceMatrix()
+{
+	/* Any edit still waiting for the timer is part of this commit */
+	commitTimer.stopTimer();
+
+	/* Medians and trimmed means cannot be masked, so the plan leaves the
+	   channels that are excluded now out of them */
+	exclusionVersion = channelMonitor.getVersion();
+	std::vector<char> excluded;
+	if (channelMonitor.getNumChannels() == refMat->getNumberOfChannels())
+	{
+		for (int c=0; c<refMat->getNumberOfChannels(); c++)
+			excluded.push_back(channelMonitor.isExcluded(c) ? 1 : 0);
+	}
+
+	ReferencePlan* plan = new ReferencePlan();
+	plan->compile(refMat, globalGain, true, &excluded);
+
+	/* Montages that do not fit the channel count are compiled empty */
+	for (int m=0; m<(int) montageDerivations.size(); m++)
+	{
+		plan->addMontage(montageDerivations[m], globalGain);
+	}
+	plan->setActiveMontage(activeMontage);
+	montagesChanged = false;
+
+	numDistinctReferences = plan->getNumDistinctReferences();
+
+	delete retiredPlan.exchange(nullptr);
+
+	/* A plan that was never picked up can be deleted right away */
+	delete pendingPlan.exchange(plan);
+	committedPlan = plan;
+
+	ChannelRefEditor* ed = (ChannelRefEditor*) getEditor();
+	if (ed != nullptr)
+	{
+		ed->updateReferenceCount();
+	}
+}
+
+void ChannelRefNode::commitReferenceMatrixLater()
+{
+	/* Restarting the timer pushes the commit back */
+	commitTimer.startTimer(COMMIT_DELAY_MS);
+}
+
+void ChannelRefNode::CommitTimer::timerCallback()
+{
+	node->commitReferenceMatrix();
+}
+
+void ChannelRefNode::ExclusionTimer::timerCallback()
+{
+	/* Averages are masked by the audio thread and need no recompile */
+	if (node->channelMonitor.getVersion() != node->exclusionVersion
+		&& node->refMat->getReferenceType() != ReferenceMatrix::AVERAGE_REFERENCE)
+	{
+		node->commitReferenceMatrix();
+	}
+}
+
+int ChannelRefNode::getNumDistinctReferences()
+{
+	return numDistinctReferences;
+}
+
 ReferenceMatrix* ChannelRefNode::getReferenceMatrix()
 {
 	return refMat;
@@ -131,6 +321,7 @@ ReferenceMatrix* ChannelRefNode::getReferenceMatrix()
 void ChannelRefNode::setGlobalGain(float value)
 {
 	globalGain = value;
+	commitReferenceMatrixLater();
 }
 
 float ChannelRefNode::getGlobalGain()
@@ -138,152 +329,402 @@ float ChannelRefNode::getGlobalGain()
 	return globalGain;
 }
 
-
-ReferenceMatrix::ReferenceMatrix(int nChan)
+void ChannelRefNode::setNumThreads(int n)
 {
-	nChannels = nChan;
-	nChannelsBefore = -1;
-	values = nullptr;
-	update();
+	numThreads = jmax(1, n);
 }
 
-ReferenceMatrix::~ReferenceMatrix()
+int ChannelRefNode::getNumThreads()
 {
-	if (values != nullptr)
-		delete[] values;
+	return numThreads;
 }
 
-void ReferenceMatrix::setNumberOfChannels(int n)
+void ChannelRefNode::setParallelMinChannels(int n)
 {
-	nChannels = n;
-	update();
+	parallelMinChannels = n;
 }
 
-int ReferenceMatrix::getNumberOfChannels()
+int ChannelRefNode::getParallelMinChannels()
 {
-	return nChannels;
+	return parallelMinChannels;
 }
 
-void ReferenceMatrix::update()
+void ChannelRefNode::fitLeastSquares()
 {
-	if (nChannels != nChannelsBefore)
+	if (!CoreServices::getAcquisitionStatus())
 	{
-		if (values != nullptr)
-			delete[] values;
-
-		values = new float[nChannels * nChannels];
-		for (int i=0; i<nChannels * nChannels; i++)
-			values[i] = 0;
+		CoreServices::sendStatusMessage("Start acquisition to fit least-squares reference gains.");
+		return;
+	}
 
-		nChannelsBefore = nChannels;
+	if (fitState.get() == FIT_IDLE)
+	{
+		numFitSamples = 0;
+		fitLength = FIT_BUFFER_SIZE;
+		fitChannels = false;
+		fitState.set(FIT_REQUESTED);
+		startTimer(50);
 	}
 }
 
-void ReferenceMatrix::setValue(int rowIndex, int colIndex, float value)
+void ChannelRefNode::fitChannelGains()
 {
-	if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+	if (!CoreServices::getAcquisitionStatus())
 	{
-		values[rowIndex * nChannels + colIndex] = value;
+		CoreServices::sendStatusMessage("Start acquisition to fit channel reference gains.");
+		return;
 	}
-	else
+
+	if (globalGain == 0.0f)
 	{
-		std::cout << "RefMatrix::setValue INDEX OUT OF BOUNDS! (rowIndex=" << rowIndex << ", colIndex=" << colIndex << ")" << std::endl;
+		CoreServices::sendStatusMessage("Set a gain other than 0 to fit channel reference gains.");
+		return;
 	}
-}
 
-float ReferenceMatrix::getValue(int rowIndex, int colIndex)
-{
-	float value = -1;
-	if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+	if (fitState.get() == FIT_IDLE)
 	{
-		value = values[rowIndex * nChannels + colIndex];
+		numFitSamples = 0;
+		fitLength = GAIN_FIT_BUFFER_SIZE;
+		fitChannels = true;
+		fitState.set(FIT_REQUESTED);
+		startTimer(50);
 	}
-
-	return value;
 }
 
-float* ReferenceMatrix::getChannel(int index)
+void ChannelRefNode::resetChannelGains()
 {
-	if (index >= 0 && index < nChannels)
-		return &values[index * nChannels];
-	else
-		return nullptr;
+	refMat->resetChannelGains();
+	commitReferenceMatrix();
 }
 
-bool ReferenceMatrix::allChannelReferencesActive(int index)
+void ChannelRefNode::timerCallback()
 {
-	float* chan = getChannel(index);
-
-	int nActive = 0;
+	if (fitState.get() == FIT_CAPTURED)
+	{
+		/* Both fits take several passes over the captured data, so they
+		   run in the background; the timer keeps polling for the result */
+		bool started = fitChannels
+			? gainFit.start(refMat, fitBuffer.getArrayOfReadPointers(), fitBuffer.getNumChannels(), fitLength)
+			: leastSquaresFit.start(refMat, fitBuffer.getArrayOfReadPointers(), fitBuffer.getNumChannels(), fitLength);
 
-	if (chan != nullptr)
+		if (started)
+		{
+			fitState.set(FIT_RUNNING);
+		}
+		else
+		{
+			stopTimer();
+			fitState.set(FIT_IDLE);
+			CoreServices::sendStatusMessage("Channels changed while capturing; fit again.");
+		}
+	}
+	else if (fitState.get() == FIT_RUNNING && fitChannels && gainFit.isDone())
 	{
-		for (int i=0; i<nChannels; i++)
+		stopTimer();
+
+		std::vector<float> gains;
+		gainFit.finish(gains);
+
+		/* The fit is of the total gain of each row */
+		if (globalGain != 0.0f && (int) gains.size() == refMat->getNumberOfChannels())
 		{
-			if (chan[i] > 0)
+			for (int i=0; i<(int) gains.size(); i++)
 			{
-				nActive++;
+				gains[i] /= globalGain;
 			}
+
+			refMat->setChannelGains(gains);
+			commitReferenceMatrix();
+
+			if (editor != nullptr)
+			{
+				editor->updateSettings();
+			}
+
+			CoreServices::sendStatusMessage("Fitted channel reference gains.");
 		}
+
+		fitState.set(FIT_IDLE);
 	}
+	else if (fitState.get() == FIT_RUNNING && !fitChannels && leastSquaresFit.isDone())
+	{
+		stopTimer();
 
-	return nActive == nChannels;
-}
+		ReferenceMatrix::FittedGains gains;
+		leastSquaresFit.finish(gains);
 
-void ReferenceMatrix::setAll(float value)
-{
-	if (values != nullptr)
-	{
-		for (int i=0; i<nChannels; i++)
+		/* The gains belong to the references the matrix had at the start */
+		if (leastSquaresFit.getModificationCount() == refMat->getModificationCount())
 		{
-			for (int j=0; j<nChannels; j++)
+			refMat->setFittedGains(gains);
+			refMat->setNormalization(ReferenceMatrix::LEAST_SQUARES);
+			commitReferenceMatrix();
+
+			if (editor != nullptr)
 			{
-				values[i*nChannels + j] = value;
+				editor->updateSettings();
 			}
+
+			CoreServices::sendStatusMessage("Fitted least-squares reference gains.");
 		}
+		else
+		{
+			CoreServices::sendStatusMessage("References changed while fitting; fit again.");
+		}
+
+		fitState.set(FIT_IDLE);
 	}
 }
 
-void ReferenceMatrix::setAll(float value, int maxChan)
+bool ChannelRefNode::loadProbeGeometry(const String& path)
 {
-	if (values != nullptr)
+	if (!probeGeometry.load(path.toStdString()))
 	{
-		maxChan = MIN(nChannels, maxChan);
-		for (int i=0; i<maxChan; i++)
-		{
-			for (int j=0; j<maxChan; j++)
-			{
-				values[i*nChannels + j] = value;
-			}
-		}
+		CoreServices::sendStatusMessage(String(probeGeometry.getError()));
+		return false;
 	}
+
+	probeGeometryPath = path;
+	CoreServices::sendStatusMessage("Loaded probe geometry with " + String(probeGeometry.getNumSites()) + " sites.");
+
+	return true;
+}
+
+String ChannelRefNode::getProbeGeometryPath()
+{
+	return probeGeometryPath;
 }
 
-void ReferenceMatrix::clear()
+ProbeGeometry* ChannelRefNode::getProbeGeometry()
 {
-	if (values != nullptr)
+	return &probeGeometry;
+}
+
+void ChannelRefNode::setLocalRadius(float innerRadius, float outerRadius)
+{
+	localInnerRadius = jmax(0.0f, innerRadius);
+	localOuterRadius = jmax(localInnerRadius, outerRadius);
+}
+
+bool ChannelRefNode::applyLocalReference()
+{
+	if (probeGeometry.getNumSites() == 0)
 	{
-		for (int i=0; i<nChannels; i++)
-		{
-			for (int j=0; j<nChannels; j++)
-			{
-				values[i*nChannels + j] = 0;
-			}
-		}
+		CoreServices::sendStatusMessage("Load a probe geometry to use local references.");
+		return false;
 	}
+
+	probeGeometry.applyLocalReference(refMat, localInnerRadius, localOuterRadius);
+	commitReferenceMatrix();
+
+	return true;
+}
+
+float ChannelRefNode::getLocalInnerRadius()
+{
+	return localInnerRadius;
+}
+
+float ChannelRefNode::getLocalOuterRadius()
+{
+	return localOuterRadius;
+}
+
+void ChannelRefNode::setAutoExclude(bool enabled)
+{
+	channelMonitor.setEnabled(enabled);
+}
+
+bool ChannelRefNode::getAutoExclude()
+{
+	return channelMonitor.isEnabled();
+}
+
+ChannelMonitor* ChannelRefNode::getChannelMonitor()
+{
+	return &channelMonitor;
+}
+
+ReferenceTelemetry* ChannelRefNode::getTelemetry()
+{
+	return &telemetry;
+}
+
+CovarianceEngine* ChannelRefNode::getCovarianceEngine()
+{
+	return &covarianceEngine;
 }
 
-void ReferenceMatrix::print()
+bool ChannelRefNode::applySuggestedReferences()
 {
-	for (int i=0; i<nChannels; i++)
+	std::vector<float> correlation;
+
+	if (!covarianceEngine.getCorrelation(correlation))
 	{
-		float* chan = getChannel(i);
-		for (int j=0; j<nChannels; j++)
-		{
-			std::cout << chan[j] << " ";
-		}
-		std::cout << std::endl;
+		CoreServices::sendStatusMessage("Not enough data yet to suggest references.");
+		return false;
+	}
+
+	std::vector<std::vector<int> > groups;
+	CovarianceEngine::suggestGroups(correlation, covarianceEngine.getNumChannels(),
+									COVARIANCE_GROUP_CORRELATION, groups);
+
+	int numGroups = CovarianceEngine::applyGroups(refMat, groups);
+	if (numGroups == 0)
+	{
+		CoreServices::sendStatusMessage("No correlated channel groups found.");
+		return false;
+	}
+
+	commitReferenceMatrix();
+	CoreServices::sendStatusMessage("Referenced channels within " + String(numGroups) + " correlated groups.");
+
+	return true;
+}
+
+void ChannelRefNode::setSpatialMode(SpatialFilter::Mode mode)
+{
+	bool wasOn = spatialFilter.getMode() != SpatialFilter::OFF;
+	spatialFilter.setMode(mode);
+	bool isOn = spatialFilter.getMode() != SpatialFilter::OFF;
+
+	if (acquiring && isOn && !wasOn)
+		startSpatialFilter();
+	else if (acquiring && wasOn && !isOn)
+		stopSpatialFilter();
+}
+
+SpatialFilter::Mode ChannelRefNode::getSpatialMode()
+{
+	return spatialFilter.getMode();
+}
+
+void ChannelRefNode::setSpatialComponents(int n)
+{
+	spatialFilter.setNumComponents(n);
+}
+
+int ChannelRefNode::getSpatialComponents()
+{
+	return spatialFilter.getNumComponents();
+}
+
+void ChannelRefNode::setFilterMode(ReferenceFilter::Mode mode)
+{
+	referenceFilter.setMode(mode);
+}
+
+ReferenceFilter::Mode ChannelRefNode::getFilterMode()
+{
+	return referenceFilter.getMode();
+}
+
+bool ChannelRefNode::setFilterCutoffs(float lowCut, float highCut)
+{
+	return referenceFilter.setCutoffs(lowCut, highCut);
+}
+
+float ChannelRefNode::getFilterLowCut()
+{
+	return referenceFilter.getLowCut();
+}
+
+float ChannelRefNode::getFilterHighCut()
+{
+	return referenceFilter.getHighCut();
+}
+
+void ChannelRefNode::setFilterOrder(int order)
+{
+	referenceFilter.setOrder(order);
+}
+
+int ChannelRefNode::getFilterOrder()
+{
+	return referenceFilter.getOrder();
+}
+
+void ChannelRefNode::startSpatialFilter()
+{
+	covarianceEngine.start();
+	spatialFilter.start(&covarianceEngine);
+}
+
+void ChannelRefNode::stopSpatialFilter()
+{
+	spatialFilter.stop();
+	covarianceEngine.stop();
+}
+
+void ChannelRefNode::addMontage(const String& name, const std::vector<ReferenceMontage::Derivation>& derivations)
+{
+	montageNames.add(name);
+	montageDerivations.push_back(derivations);
+	montagesChanged = true;
+}
+
+bool ChannelRefNode::addMontageFromMatrix(const String& name)
+{
+	std::vector<ReferenceMontage::Derivation> derivations;
+
+	if (!ReferenceMontage::fromMatrix(refMat, derivations))
+	{
+		CoreServices::sendStatusMessage("Only references to single channels can be added as a montage.");
+		return false;
 	}
-	std::cout << std::endl;
+
+	addMontage(name, derivations);
+
+	return true;
+}
+
+void ChannelRefNode::removeMontage(int index)
+{
+	if (index < 0 || index >= getNumMontages())
+		return;
+
+	if (index <= activeMontage)
+		activeMontage = -1;
+
+	montageNames.remove(index);
+	montageDerivations.erase(montageDerivations.begin() + index);
+	montagesChanged = true;
+}
+
+void ChannelRefNode::clearMontages()
+{
+	activeMontage = -1;
+	montageNames.clear();
+	montageDerivations.clear();
+	montagesChanged = true;
 }
 
+int ChannelRefNode::getNumMontages()
+{
+	return (int) montageDerivations.size();
+}
+
+String ChannelRefNode::getMontageName(int index)
+{
+	return montageNames[index];
+}
+
+const std::vector<ReferenceMontage::Derivation>& ChannelRefNode::getMontageDerivations(int index)
+{
+	return montageDerivations[index];
+}
+
+void ChannelRefNode::setActiveMontage(int index)
+{
+	activeMontage = index >= 0 && index < getNumMontages() ? index : -1;
+
+	/* The committed plan is only switched if it has the same montages;
+	   otherwise the next commit brings the selection along */
+	if (!montagesChanged && committedPlan != nullptr)
+		committedPlan->setActiveMontage(activeMontage);
+}
+
+int ChannelRefNode::getActiveMontage()
+{
+	return activeMontage;
+}
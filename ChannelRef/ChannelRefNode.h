@@ -27,9 +27,37 @@
 
 #include <ProcessorHeaders.h>
 
-#define BUFFER_SIZE 1024
+#include "ChannelMonitor.h"
+#include "CovarianceEngine.h"
+#include "ProbeGeometry.h"
+#include "ReferenceFilter.h"
+#include "ReferenceGainFit.h"
+#include "ReferenceLeastSquaresFit.h"
+#include "ReferenceMatrix.h"
+#include "ReferenceMontage.h"
+#include "ReferencePlan.h"
+#include "ReferenceTelemetry.h"
+#include "SpatialFilter.h"
 
-class ReferenceMatrix;
+/* Below this number of channels, processing stays on the audio thread */
+#define PARALLEL_MIN_CHANNELS 128
+
+/* Number of input samples used to fit least-squares reference gains */
+#define FIT_BUFFER_SIZE 1024
+
+/* Number of input samples used to fit the reference gain of each channel */
+#define GAIN_FIT_BUFFER_SIZE 8192
+
+/* Outer radius of local references in micrometers, until one is set */
+#define DEFAULT_LOCAL_RADIUS 100
+
+/* Milliseconds without further edits before commitReferenceMatrixLater()
+   compiles the plan */
+#define COMMIT_DELAY_MS 200
+
+/* Milliseconds between checks for changed exclusions, which medians and
+   trimmed means only pick up by recompiling */
+#define EXCLUSION_POLL_MS 100
 
 
 /**
@@ -43,7 +71,8 @@ class ReferenceMatrix;
 
 */
 
-class ChannelRefNode : public GenericProcessor
+class ChannelRefNode : public GenericProcessor,
+	public Timer
 
 {
 public:
@@ -63,67 +92,231 @@ public:
 
     void updateSettings();
 
-	ReferenceMatrix* getReferenceMatrix();
-
-	void setGlobalGain(float value);
-	float getGlobalGain();
-
-private:
-
-	ReferenceMatrix* refMat;
-	AudioSampleBuffer channelBuffer;
-	AudioSampleBuffer avgBuffer;
-	float globalGain;
-
-    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ChannelRefNode);
-
-};
-
+    bool enable();
+    bool disable();
 
-/**
-
-  Reference matrix
-
-  Each row indicates the selected reference channels for each channel.
-
-  1: selected
-  0: not selected
-
-  TODO allow values between 0 and 1 to set the gain of each reference channel
-
-  @see ChannelRefNode
-
-*/
+	/** The matrix edited by the GUI (message thread only). Changes are
+	    applied to the audio thread by commitReferenceMatrix(). */
+	ReferenceMatrix* getReferenceMatrix();
 
-class ReferenceMatrix
-{
-public:
+	/** Compile the reference matrix and publish the plan to the audio
+	    thread, which picks it up at the start of the next block. */
+	void commitReferenceMatrix();
 
-    ReferenceMatrix(int nChan);
-    ~ReferenceMatrix();
+	/** Commit the matrix once no further edit has come in for
+	    COMMIT_DELAY_MS, so that a run of clicks in the table compiles the
+	    plan once rather than once per click. */
+	void commitReferenceMatrixLater();
 
-	void setNumberOfChannels(int n);
-	int getNumberOfChannels();
+	/** Number of different reference signals in the last committed matrix. */
+	int getNumDistinctReferences();
 
-	void update();
+	/** The gain is compiled into the plan; a new value is committed with
+	    commitReferenceMatrixLater(), so dragging the gain slider compiles
+	    the plan once it stops. */
+	void setGlobalGain(float value);
+	float getGlobalGain();
 
-	void setValue(int rowIndex, int colIndex, float value);
-	float getValue(int rowIndex, int colIndex);
+	/** Total number of threads (including the audio thread) used to
+	    reference large channel counts; applied when acquisition starts. */
+	void setNumThreads(int n);
+	int getNumThreads();
+
+	void setParallelMinChannels(int n);
+	int getParallelMinChannels();
+
+	/** Capture the next FIT_BUFFER_SIZE input samples (during acquisition),
+	    fit least-squares gains to them in the background (see
+	    ReferenceLeastSquaresFit) and switch the matrix to LEAST_SQUARES
+	    normalization once the fit is done. */
+	void fitLeastSquares();
+
+	/** Capture the next GAIN_FIT_BUFFER_SIZE input samples (during
+	    acquisition) and fit the reference gain of each channel to them in
+	    the background (see ReferenceGainFit). The gains are relative to the
+	    global gain and are committed once the fit is done. */
+	void fitChannelGains();
+
+	/** Set the reference gains of all channels back to 1 and commit. */
+	void resetChannelGains();
+
+	void timerCallback();
+
+	/** Load the site positions of the probe from a geometry file (see
+	    ProbeGeometry). */
+	bool loadProbeGeometry(const String& path);
+	String getProbeGeometryPath();
+	ProbeGeometry* getProbeGeometry();
+
+	/** Distances in micrometers between which channels on the probe are
+	    local references of each other. */
+	void setLocalRadius(float innerRadius, float outerRadius);
+	float getLocalInnerRadius();
+	float getLocalOuterRadius();
+
+	/** Reference each channel to the average of the channels within the
+	    local radius and commit the matrix. */
+	bool applyLocalReference();
+
+	/** Exclude channels that the channel monitor finds to be bad
+	    (saturated, flat or noisy) from all references while acquiring.
+	    Averages drop them with the next block; medians and trimmed means
+	    once the message thread has recompiled the plan. */
+	void setAutoExclude(bool enabled);
+	bool getAutoExclude();
+	ChannelMonitor* getChannelMonitor();
+
+	/** RMS of each channel before and after referencing (and filtering),
+	    measured while enabled (by the canvas while it is visible). */
+	ReferenceTelemetry* getTelemetry();
+
+	/** Channel covariance, estimated while the engine runs (started by the
+	    canvas while it is visible). */
+	CovarianceEngine* getCovarianceEngine();
+
+	/** Reference each channel to the other channels of its group, where
+	    groups are clusters of correlated channels in the current covariance
+	    estimate, and commit the matrix. */
+	bool applySuggestedReferences();
+
+	/** Reference by removing principal components or by whitening instead
+	    of the matrix (see SpatialFilter), once a projection of the mode has
+	    been fitted; until then the matrix is used. While acquiring, the
+	    projection is refitted in the background from the covariance
+	    estimate. */
+	void setSpatialMode(SpatialFilter::Mode mode);
+	SpatialFilter::Mode getSpatialMode();
+	void setSpatialComponents(int n);
+	int getSpatialComponents();
+
+	/** High-pass or band-pass filter applied within the referencing stage
+	    (see ReferenceFilter), after the spatial filter if that is on.
+	    Changes take effect with the next block. */
+	void setFilterMode(ReferenceFilter::Mode mode);
+	ReferenceFilter::Mode getFilterMode();
+	bool setFilterCutoffs(float lowCut, float highCut);
+	float getFilterLowCut();
+	float getFilterHighCut();
+	void setFilterOrder(int order);
+	int getFilterOrder();
+
+	/** Montages of single-reference derivations (see ReferenceMontage).
+	    Like the matrix, changes to the list are applied by
+	    commitReferenceMatrix(), which compiles all montages into the plan,
+	    so switching between them (or back to the matrix) takes effect with
+	    the next block without compiling anything. */
+	void addMontage(const String& name, const std::vector<ReferenceMontage::Derivation>& derivations);
+
+	/** Add the current matrix as a montage; false if a row of it has more
+	    than one reference. */
+	bool addMontageFromMatrix(const String& name);
+
+	/** Removing the montage in use, or one before it, switches back to the
+	    matrix. */
+	void removeMontage(int index);
+	void clearMontages();
+
+	int getNumMontages();
+	String getMontageName(int index);
+	const std::vector<ReferenceMontage::Derivation>& getMontageDerivations(int index);
+
+	/** Montage used instead of the matrix, -1 for the matrix. Takes effect
+	    with the next block, or with the next commit if the montages have
+	    changed since the last one, so that the index always refers to the
+	    montages of the plan it is applied to. */
+	void setActiveMontage(int index);
+	int getActiveMontage();
 
-	float* getChannel(int index);
-	bool allChannelReferencesActive(int index);
+private:
 
-	void setAll(float value);
-	void setAll(float value, int maxChan);
-	void clear();
+	/* Calls commitReferenceMatrix() when it expires; the node's own timer
+	   polls the fits */
+	class CommitTimer : public Timer
+	{
+	public:
+		CommitTimer(ChannelRefNode* n) : node(n) {}
+		void timerCallback();
+	private:
+		ChannelRefNode* node;
+	};
+
+	/* Recompiles median and trimmed-mean plans when the channel monitor
+	   has changed its exclusions; runs while acquiring */
+	class ExclusionTimer : public Timer
+	{
+	public:
+		ExclusionTimer(ChannelRefNode* n) : node(n) {}
+		void timerCallback();
+	private:
+		ChannelRefNode* node;
+	};
+
+	void acquirePendingPlan();
+	void startSpatialFilter();
+	void stopSpatialFilter();
 
-	void print();
+	ReferenceMatrix* refMat;
 
-private:
+	/* Plan handover without locks: the message thread publishes into
+	   pendingPlan, the audio thread swaps it into activePlan at block start
+	   and hands the previous plan back through retiredPlan, which is
+	   deleted on the message thread */
+	ReferencePlan* activePlan;
+	Atomic<ReferencePlan*> pendingPlan;
+	Atomic<ReferencePlan*> retiredPlan;
+	float globalGain;
+	int numDistinctReferences;
+	CommitTimer commitTimer;
+
+	ReferenceThreadPool threadPool;
+	int numThreads;
+	int parallelMinChannels;
+
+	/* Input captured by the audio thread for fitLeastSquares() or
+	   fitChannelGains(), fitted by leastSquaresFit or gainFit while
+	   RUNNING */
+	enum { FIT_IDLE = 0, FIT_REQUESTED, FIT_CAPTURED, FIT_RUNNING };
+	Atomic<int> fitState;
+	AudioSampleBuffer fitBuffer;
+	int numFitSamples;
+	int fitLength;
+	bool fitChannels;
+	ReferenceGainFit gainFit;
+	ReferenceLeastSquaresFit leastSquaresFit;
+
+	ProbeGeometry probeGeometry;
+	String probeGeometryPath;
+	float localInnerRadius;
+	float localOuterRadius;
+
+	/* Runs on the audio thread; its exclusions are applied to activePlan.
+	   Medians and trimmed means leave out the channels that were excluded
+	   at version exclusionVersion, when the plan was compiled */
+	ChannelMonitor channelMonitor;
+	int exclusionVersion;
+	ExclusionTimer exclusionTimer;
+	ReferenceTelemetry telemetry;
+	CovarianceEngine covarianceEngine;
+
+	/* Runs instead of the plan unless OFF or not fitted yet; refitted only
+	   while acquiring */
+	SpatialFilter spatialFilter;
+	bool acquiring;
+
+	/* Passed to the plan, which filters each tile it has referenced */
+	ReferenceFilter referenceFilter;
+
+	/* Montage definitions and selection (message thread). The selection is
+	   handed to the audio thread through the last committed plan, which is
+	   only deleted by the next commit, and only while the definitions are
+	   those the plan was compiled with */
+	StringArray montageNames;
+	std::vector<std::vector<ReferenceMontage::Derivation> > montageDerivations;
+	int activeMontage;
+	bool montagesChanged;
+	ReferencePlan* committedPlan;
 
-	int nChannels;
-	int nChannelsBefore;
-	float* values;
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ChannelRefNode);
 
 };
 
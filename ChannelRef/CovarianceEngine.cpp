@@ -0,0 +1,461 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "CovarianceEngine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "ReferenceKernels.h"
+#include "ReferenceMatrix.h"
+
+
+CovarianceEngine::CovarianceEngine() : nChannels(0), stride(0), decimation(COVARIANCE_DECIMATION),
+	sampleRate(30000.0f), writeCount(0), readCount(0), accepting(false), numDropped(0),
+	chunkFill(0), sampleCredit(0), windowStart(0), shouldExit(false), numChunks(0),
+	totalCount(0), numSamples(0), numUsers(0)
+{
+}
+
+CovarianceEngine::~CovarianceEngine()
+{
+	stopWorker();
+}
+
+void CovarianceEngine::prepare(int numChannels, float rate)
+{
+	stopWorker();
+
+	nChannels = std::max(0, numChannels);
+	sampleRate = rate > 0 ? rate : 30000.0f;
+
+	/* Padded to whole kernel blocks; padding channels stay zero */
+	stride = std::max(1, (nChannels + RANK_UPDATE_COLUMNS - 1) / RANK_UPDATE_COLUMNS) * RANK_UPDATE_COLUMNS;
+
+	ring.assign((size_t) COVARIANCE_RING_SIZE * nChannels * COVARIANCE_CHUNK_SIZE, 0.0f);
+	writeCount.store(0);
+	readCount.store(0);
+	numDropped.store(0);
+	chunkFill = 0;
+	sampleCredit = 0;
+	windowStart = 0;
+
+	samples.assign((size_t) COVARIANCE_CHUNK_SIZE * stride, 0.0f);
+	products.assign((size_t) stride * stride, 0.0f);
+	centre.assign(nChannels, 0.0f);
+	centredSums.assign(nChannels, 0.0);
+	numChunks = 0;
+
+	std::lock_guard<std::mutex> lock(totalsLock);
+	totalProducts.assign((size_t) stride * stride, 0.0);
+	totalSums.assign(nChannels, 0.0);
+	totalCount = 0;
+	numSamples = 0;
+
+	if (numUsers > 0)
+		startWorker();
+}
+
+int CovarianceEngine::getNumChannels()
+{
+	return nChannels;
+}
+
+void CovarianceEngine::setDecimation(int n)
+{
+	decimation = std::max(1, n);
+}
+
+int CovarianceEngine::getDecimation()
+{
+	return decimation;
+}
+
+void CovarianceEngine::start()
+{
+	if (numUsers++ == 0)
+		startWorker();
+}
+
+void CovarianceEngine::stop()
+{
+	if (numUsers > 0 && --numUsers == 0)
+		stopWorker();
+}
+
+void CovarianceEngine::startWorker()
+{
+	if (worker.joinable() || nChannels == 0)
+		return;
+
+	shouldExit.store(false);
+	worker = std::thread(&CovarianceEngine::run, this);
+	accepting.store(true, std::memory_order_release);
+}
+
+void CovarianceEngine::stopWorker()
+{
+	accepting.store(false);
+
+	if (worker.joinable())
+	{
+		shouldExit.store(true);
+		worker.join();
+	}
+}
+
+bool CovarianceEngine::isRunning()
+{
+	return worker.joinable();
+}
+
+void CovarianceEngine::push(const float* const* channels, int numSamples)
+{
+	if (!accepting.load(std::memory_order_acquire) || nChannels == 0 || numSamples <= 0)
+		return;
+
+	/* A contiguous run of the samples that are due; the run moves through
+	   the block from one copy to the next */
+	sampleCredit += numSamples;
+
+	if (sampleCredit < COVARIANCE_RUN_LENGTH * decimation)
+		return;
+
+	int take = std::min(numSamples, sampleCredit / decimation);
+	sampleCredit -= take * decimation;
+
+	windowStart = (windowStart + 61) % (numSamples - take + 1);
+
+	for (int offset = 0; offset < take; )
+	{
+		unsigned int w = writeCount.load(std::memory_order_relaxed);
+
+		if (chunkFill == 0 && w - readCount.load(std::memory_order_acquire) >= COVARIANCE_RING_SIZE)
+		{
+			numDropped.fetch_add(take - offset, std::memory_order_relaxed);
+			return;
+		}
+
+		float* chunk = &ring[(size_t) (w % COVARIANCE_RING_SIZE) * nChannels * COVARIANCE_CHUNK_SIZE];
+		int count = std::min(take - offset, COVARIANCE_CHUNK_SIZE - chunkFill);
+
+		for (int c=0; c<nChannels; c++)
+		{
+			std::memcpy(chunk + c * COVARIANCE_CHUNK_SIZE + chunkFill,
+						channels[c] + windowStart + offset, count * sizeof(float));
+		}
+
+		chunkFill += count;
+		offset += count;
+
+		if (chunkFill == COVARIANCE_CHUNK_SIZE)
+		{
+			writeCount.store(w + 1, std::memory_order_release);
+			chunkFill = 0;
+		}
+	}
+}
+
+/* The worker polls, so that the audio thread never has to wake it */
+void CovarianceEngine::run()
+{
+	while (!shouldExit.load())
+	{
+		unsigned int r = readCount.load(std::memory_order_relaxed);
+
+		if (r == writeCount.load(std::memory_order_acquire))
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			continue;
+		}
+
+		processChunk(&ring[(size_t) (r % COVARIANCE_RING_SIZE) * nChannels * COVARIANCE_CHUNK_SIZE]);
+		readCount.store(r + 1, std::memory_order_release);
+	}
+}
+
+void CovarianceEngine::processChunk(const float* chunk)
+{
+	/* The first chunk sets the centre, so the products stay small */
+	bool first = numChunks == 0 && totalCount == 0;
+
+	for (int c=0; c<nChannels; c++)
+	{
+		const float* x = chunk + c * COVARIANCE_CHUNK_SIZE;
+
+		if (first)
+		{
+			double mean = 0;
+			for (int t=0; t<COVARIANCE_CHUNK_SIZE; t++)
+				mean += std::fabs(x[t]) < 1e30f ? x[t] : 0.0f;
+			centre[c] = (float) (mean / COVARIANCE_CHUNK_SIZE);
+		}
+
+		/* Transpose to sample-major order; non-finite samples count as the centre */
+		float m = centre[c];
+		float sum = 0.0f;
+
+		for (int t=0; t<COVARIANCE_CHUNK_SIZE; t++)
+		{
+			float v = x[t] - m;
+			v = std::fabs(v) < 1e30f ? v : 0.0f;
+			samples[t * stride + c] = v;
+			sum += v;
+		}
+
+		centredSums[c] += sum;
+	}
+
+	/* Upper triangle in blocks of RANK_UPDATE_COLUMNS columns, with the
+	   samples split into k-blocks so that the panels stay in L1 */
+	RankUpdateKernel kernel = ReferenceKernels::getRankUpdate();
+
+	for (int k=0; k<COVARIANCE_CHUNK_SIZE; k+=COVARIANCE_K_BLOCK)
+	{
+		int numK = std::min(COVARIANCE_K_BLOCK, COVARIANCE_CHUNK_SIZE - k);
+		const float* x = samples.data() + (size_t) k * stride;
+
+		for (int column=0; column<stride; column+=RANK_UPDATE_COLUMNS)
+		{
+			for (int row=0; row<column + RANK_UPDATE_COLUMNS; row+=RANK_UPDATE_ROWS)
+			{
+				kernel(products.data(), x, stride, row, column, numK);
+			}
+		}
+	}
+
+	if (++numChunks == COVARIANCE_FLUSH_CHUNKS)
+		flush();
+}
+
+void CovarianceEngine::flush()
+{
+	double n = (double) numChunks * COVARIANCE_CHUNK_SIZE;
+	double decay = std::exp(-n * decimation / (COVARIANCE_MEMORY * sampleRate));
+
+	{
+		std::lock_guard<std::mutex> lock(totalsLock);
+
+		/* Raw moments from the centred ones: sum (u_i + c_i)(u_j + c_j) */
+		for (int i=0; i<nChannels; i++)
+		{
+			for (int j=i; j<nChannels; j++)
+			{
+				double raw = products[(size_t) i * stride + j] + centre[j] * centredSums[i]
+					+ centre[i] * centredSums[j] + n * centre[i] * centre[j];
+				double& total = totalProducts[(size_t) i * stride + j];
+				total = decay * total + raw;
+			}
+
+			totalSums[i] = decay * totalSums[i] + centredSums[i] + n * centre[i];
+		}
+
+		totalCount = decay * totalCount + n;
+		numSamples += (long long) n;
+
+		/* Centre the next chunks on the running mean */
+		for (int i=0; i<nChannels; i++)
+			centre[i] = (float) (totalSums[i] / totalCount);
+	}
+
+	std::fill(products.begin(), products.end(), 0.0f);
+	std::fill(centredSums.begin(), centredSums.end(), 0.0);
+	numChunks = 0;
+}
+
+long long CovarianceEngine::getNumSamples()
+{
+	std::lock_guard<std::mutex> lock(totalsLock);
+	return numSamples;
+}
+
+long long CovarianceEngine::getNumDropped()
+{
+	return numDropped.load();
+}
+
+bool CovarianceEngine::getCovariance(std::vector<double>& covariance)
+{
+	std::lock_guard<std::mutex> lock(totalsLock);
+
+	if (numSamples < COVARIANCE_MIN_SAMPLES || nChannels == 0)
+		return false;
+
+	std::vector<double> mean(nChannels);
+
+	for (int i=0; i<nChannels; i++)
+		mean[i] = totalSums[i] / totalCount;
+
+	covariance.assign((size_t) nChannels * nChannels, 0.0);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		for (int j=i; j<nChannels; j++)
+		{
+			double c = totalProducts[(size_t) i * stride + j] / totalCount - mean[i] * mean[j];
+
+			covariance[(size_t) i * nChannels + j] = c;
+			covariance[(size_t) j * nChannels + i] = c;
+		}
+	}
+
+	return true;
+}
+
+bool CovarianceEngine::getCorrelation(std::vector<float>& correlation)
+{
+	std::vector<double> covariance;
+
+	if (!getCovariance(covariance))
+		return false;
+
+	std::vector<double> deviation(nChannels);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		double variance = covariance[(size_t) i * nChannels + i];
+		deviation[i] = variance > 0 ? std::sqrt(variance) : 0.0;
+	}
+
+	correlation.assign((size_t) nChannels * nChannels, 0.0f);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		for (int j=0; j<nChannels; j++)
+		{
+			double d = deviation[i] * deviation[j];
+			double r = d > 0 ? covariance[(size_t) i * nChannels + j] / d : 0.0;
+
+			correlation[(size_t) i * nChannels + j] = (float) std::max(-1.0, std::min(1.0, r));
+		}
+	}
+
+	return true;
+}
+
+void CovarianceEngine::suggestGroups(const std::vector<float>& correlation, int n,
+									 float minCorrelation, std::vector<std::vector<int> >& groups)
+{
+	/* Average linkage: the similarity of two groups is the mean correlation
+	   between their channels, updated on each merge (Lance-Williams) */
+	std::vector<double> similarity(correlation.begin(), correlation.begin() + (size_t) n * n);
+	std::vector<int> size(n, 1);
+	std::vector<int> active(n);
+
+	groups.assign(n, std::vector<int>());
+	for (int i=0; i<n; i++)
+	{
+		groups[i].push_back(i);
+		active[i] = i;
+	}
+
+	while (active.size() > 1)
+	{
+		double best = -2;
+		int bestA = -1;
+		int bestB = -1;
+
+		for (int a=0; a<(int) active.size(); a++)
+		{
+			const double* row = &similarity[(size_t) active[a] * n];
+			for (int b=a+1; b<(int) active.size(); b++)
+			{
+				if (row[active[b]] > best)
+				{
+					best = row[active[b]];
+					bestA = a;
+					bestB = b;
+				}
+			}
+		}
+
+		if (best < minCorrelation)
+			break;
+
+		int x = active[bestA];
+		int y = active[bestB];
+
+		for (int k=0; k<(int) active.size(); k++)
+		{
+			int z = active[k];
+			if (z == x || z == y)
+				continue;
+
+			double s = (size[x] * similarity[(size_t) x * n + z] + size[y] * similarity[(size_t) y * n + z])
+				/ (size[x] + size[y]);
+			similarity[(size_t) x * n + z] = s;
+			similarity[(size_t) z * n + x] = s;
+		}
+
+		size[x] += size[y];
+		groups[x].insert(groups[x].end(), groups[y].begin(), groups[y].end());
+		groups[y].clear();
+		active.erase(active.begin() + bestB);
+	}
+
+	/* Groups in channel order */
+	std::vector<std::vector<int> > result;
+	for (int i=0; i<n; i++)
+	{
+		if (!groups[i].empty())
+		{
+			std::sort(groups[i].begin(), groups[i].end());
+			result.push_back(groups[i]);
+		}
+	}
+
+	std::sort(result.begin(), result.end());
+	groups.swap(result);
+}
+
+int CovarianceEngine::applyGroups(ReferenceMatrix* refMat, const std::vector<std::vector<int> >& groups)
+{
+	int nChannels = refMat->getNumberOfChannels();
+	int numUsed = 0;
+
+	refMat->clear();
+
+	for (int g=0; g<(int) groups.size(); g++)
+	{
+		if (groups[g].size() < 2)
+			continue;
+
+		for (int a=0; a<(int) groups[g].size(); a++)
+		{
+			for (int b=0; b<(int) groups[g].size(); b++)
+			{
+				int i = groups[g][a];
+				int j = groups[g][b];
+
+				if (i != j && i < nChannels && j < nChannels)
+					refMat->setValue(i, j, 1.0f);
+			}
+		}
+
+		numUsed++;
+	}
+
+	return numUsed;
+}
@@ -0,0 +1,191 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __COVARIANCEENGINE_H__
+#define __COVARIANCEENGINE_H__
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ReferenceMatrix;
+
+/* Samples per channel in each chunk handed to the worker thread */
+#define COVARIANCE_CHUNK_SIZE 256
+
+/* Chunks the ring holds; the audio thread drops samples when it is full */
+#define COVARIANCE_RING_SIZE 8
+
+/* Chunks accumulated in single precision before they are added to the
+   double precision totals */
+#define COVARIANCE_FLUSH_CHUNKS 4
+
+/* Samples per k-block of the rank-k update (panels stay in L1) */
+#define COVARIANCE_K_BLOCK 128
+
+/* One of this many input samples is used by default */
+#define COVARIANCE_DECIMATION 64
+
+/* Samples copied at once (at most one run per block), so the per-channel
+   cost of a copy is spread over many samples */
+#define COVARIANCE_RUN_LENGTH 32
+
+/* Time constant (seconds) over which older data is forgotten */
+#define COVARIANCE_MEMORY 60.0f
+
+/* Samples needed before groups are suggested */
+#define COVARIANCE_MIN_SAMPLES 4096
+
+/* Groups are merged while their average correlation is at least this */
+#define COVARIANCE_GROUP_CORRELATION 0.5f
+
+
+/**
+
+  Covariance engine
+
+  Estimates the covariance and correlation between all input channels
+  while acquisition is running and suggests reference groups from it.
+
+  The audio thread only copies samples (push()): whenever
+  COVARIANCE_RUN_LENGTH samples are due (one in decimation input
+  samples), a contiguous run of them (so the spectrum is not aliased) is
+  copied from the block into a chunk of a lock-free single-producer
+  single-consumer ring. With the default decimation and 1024-sample
+  blocks, 32 samples of every other block are copied, a few percent of the
+  time spent referencing 384 channels. A worker thread transposes each chunk to
+  sample-major order and adds it to the covariance with the cache-blocked
+  rank-k update kernel (see ReferenceKernels), for the upper triangle
+  only. Samples are centred on the running mean before they are
+  accumulated in single precision, and the totals are kept in double
+  precision with exponential forgetting, so the estimate follows slow
+  changes of the recording.
+
+  At 384 channels the worker needs a small fraction of one core even at
+  full rate (decimation 1); if it falls behind, chunks are dropped
+  instead of blocking the audio thread (see getNumDropped()).
+
+  suggestGroups() clusters the channels by correlation (average linkage)
+  and applyGroups() references each channel to the average of the other
+  channels of its group.
+
+  @see ReferenceKernels, ReferenceMatrix, ChannelRefNode
+
+*/
+
+class CovarianceEngine
+{
+public:
+
+	CovarianceEngine();
+	~CovarianceEngine();
+
+	/** Stop the worker, allocate the ring and clear the estimate. */
+	void prepare(int numChannels, float sampleRate);
+
+	int getNumChannels();
+
+	/** Use one of every n input samples (takes effect on prepare()). */
+	void setDecimation(int n);
+	int getDecimation();
+
+	/** Start or stop the worker thread; push() only copies while started.
+	    Calls are counted, so the engine runs until every start() has been
+	    matched by a stop(). */
+	void start();
+	void stop();
+	bool isRunning();
+
+	/** Audio thread: copy part of a block for the worker. Never blocks. */
+	void push(const float* const* channels, int numSamples);
+
+	/** Samples (per channel) accumulated so far and dropped because the
+	    worker fell behind. */
+	long long getNumSamples();
+	long long getNumDropped();
+
+	/** Covariance matrix (numChannels x numChannels, row-major) of the
+	    current estimate. Returns false if there is not enough data yet. */
+	bool getCovariance(std::vector<double>& covariance);
+
+	/** Correlation matrix (numChannels x numChannels, row-major) of the
+	    current estimate. Returns false if there is not enough data yet. */
+	bool getCorrelation(std::vector<float>& correlation);
+
+	/** Channel groups from average-linkage clustering of a correlation
+	    matrix; channels that correlate with no group stay alone. */
+	static void suggestGroups(const std::vector<float>& correlation, int numChannels,
+							  float minCorrelation, std::vector<std::vector<int> >& groups);
+
+	/** Reference each channel of a group (with at least two channels) to
+	    the other channels of the group. Returns the number of groups used. */
+	static int applyGroups(ReferenceMatrix* refMat, const std::vector<std::vector<int> >& groups);
+
+private:
+
+	void startWorker();
+	void stopWorker();
+	void run();
+	void processChunk(const float* chunk);
+	void flush();
+
+	int nChannels;
+	int stride;
+	int decimation;
+	float sampleRate;
+
+	/* Ring of chunks (channel-major, COVARIANCE_CHUNK_SIZE per channel) */
+	std::vector<float> ring;
+	std::atomic<unsigned int> writeCount;
+	std::atomic<unsigned int> readCount;
+	std::atomic<bool> accepting;
+	std::atomic<long long> numDropped;
+
+	/* Audio thread state */
+	int chunkFill;
+	int sampleCredit;
+	int windowStart;
+
+	/* Worker state */
+	std::thread worker;
+	std::atomic<bool> shouldExit;
+	std::vector<float> samples;
+	std::vector<float> products;
+	std::vector<float> centre;
+	std::vector<double> centredSums;
+	int numChunks;
+
+	/* Totals (raw moments, upper triangle with stride) */
+	std::mutex totalsLock;
+	std::vector<double> totalProducts;
+	std::vector<double> totalSums;
+	double totalCount;
+	long long numSamples;
+
+	int numUsers;
+
+};
+
+
+#endif  //__COVARIANCEENGINE_H__
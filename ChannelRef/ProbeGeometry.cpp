@@ -0,0 +1,281 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+
+#include "ProbeGeometry.h"
+#include "ReferenceMatrix.h"
+
+
+ProbeGeometry::ProbeGeometry() : numSites(0)
+{
+}
+
+ProbeGeometry::~ProbeGeometry()
+{
+}
+
+bool ProbeGeometry::load(const std::string& path)
+{
+	std::ifstream file(path.c_str());
+	std::string line;
+
+	error.clear();
+
+	if (!file.is_open())
+	{
+		error = "Couldn't open " + path;
+		return false;
+	}
+
+	/* Read into a new geometry, so that a bad file leaves this one as it is */
+	ProbeGeometry parsed;
+
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++)
+	{
+		std::replace(line.begin(), line.end(), ',', ' ');
+
+		const char* text = line.c_str();
+		char* end;
+
+		while (*text == ' ' || *text == '\t')
+			text++;
+
+		/* Comments, headers and empty lines */
+		if (*text == '#' || !std::isdigit((unsigned char) *text))
+			continue;
+
+		double values[4];
+		int numValues = 0;
+
+		for (; numValues < 4; numValues++)
+		{
+			values[numValues] = std::strtod(text, &end);
+			if (end == text)
+				break;
+			text = end;
+		}
+
+		/* Checked as doubles, before anything is converted */
+		bool valid = numValues >= 3 && values[0] >= 1 && values[0] < MAX_PROBE_CHANNELS + 1
+			&& std::isfinite((float) values[1]) && std::isfinite((float) values[2])
+			&& (numValues < 4 || std::fabs(values[3]) <= MAX_PROBE_CHANNELS);
+
+		if (!valid)
+		{
+			error = "Invalid site in line " + std::to_string(lineNumber) + " of " + path;
+			return false;
+		}
+
+		parsed.setPosition((int) values[0] - 1, (float) values[1], (float) values[2],
+						   numValues > 3 ? (int) values[3] : 0);
+	}
+
+	if (parsed.numSites == 0)
+	{
+		error = "No sites in " + path;
+		return false;
+	}
+
+	xs.swap(parsed.xs);
+	ys.swap(parsed.ys);
+	shanks.swap(parsed.shanks);
+	placed.swap(parsed.placed);
+	numSites = parsed.numSites;
+
+	return true;
+}
+
+const std::string& ProbeGeometry::getError()
+{
+	return error;
+}
+
+void ProbeGeometry::clear()
+{
+	xs.clear();
+	ys.clear();
+	shanks.clear();
+	placed.clear();
+	numSites = 0;
+}
+
+void ProbeGeometry::setPosition(int channel, float x, float y, int shank)
+{
+	if (channel < 0 || channel >= MAX_PROBE_CHANNELS || !std::isfinite(x) || !std::isfinite(y))
+		return;
+
+	if (channel >= (int) xs.size())
+	{
+		xs.resize(channel + 1, 0);
+		ys.resize(channel + 1, 0);
+		shanks.resize(channel + 1, 0);
+		placed.resize(channel + 1, false);
+	}
+
+	if (!placed[channel])
+		numSites++;
+
+	xs[channel] = x;
+	ys[channel] = y;
+	shanks[channel] = shank;
+	placed[channel] = true;
+}
+
+bool ProbeGeometry::hasPosition(int channel)
+{
+	return channel >= 0 && channel < (int) placed.size() && placed[channel];
+}
+
+int ProbeGeometry::getNumSites()
+{
+	return numSites;
+}
+
+void ProbeGeometry::getNeighbourhoods(float innerRadius, float outerRadius,
+									  std::vector<std::vector<int> >& neighbourhoods)
+{
+	int n = (int) xs.size();
+
+	neighbourhoods.assign(n, std::vector<int>());
+
+	if (numSites == 0 || outerRadius < 0 || innerRadius > outerRadius)
+		return;
+
+	/* Bounding box of the sites */
+	float minX = 0, minY = 0, maxX = 0, maxY = 0;
+	bool first = true;
+
+	for (int i=0; i<n; i++)
+	{
+		if (!placed[i])
+			continue;
+
+		minX = first ? xs[i] : std::min(minX, xs[i]);
+		maxX = first ? xs[i] : std::max(maxX, xs[i]);
+		minY = first ? ys[i] : std::min(minY, ys[i]);
+		maxY = first ? ys[i] : std::max(maxY, ys[i]);
+		first = false;
+	}
+
+	/* Cells no smaller than the outer radius, and not so small that the grid
+	   has many more cells than sites */
+	double cellSize = std::max((double) outerRadius, 1e-3);
+	int gridWidth, gridHeight;
+
+	while (true)
+	{
+		gridWidth = (int) ((maxX - minX) / cellSize) + 1;
+		gridHeight = (int) ((maxY - minY) / cellSize) + 1;
+
+		if ((double) gridWidth * gridHeight <= (double) MAX_GRID_CELLS_PER_SITE * numSites + 16)
+			break;
+
+		cellSize *= 2;
+	}
+
+	/* Sites per cell in compressed form (counting sort by cell) */
+	std::vector<int> siteCell(n, -1);
+	std::vector<int> cellStart(gridWidth * gridHeight + 1, 0);
+	std::vector<int> cellSites(numSites);
+
+	for (int i=0; i<n; i++)
+	{
+		if (placed[i])
+		{
+			int cx = (int) ((xs[i] - minX) / cellSize);
+			int cy = (int) ((ys[i] - minY) / cellSize);
+			siteCell[i] = cy * gridWidth + cx;
+			cellStart[siteCell[i] + 1]++;
+		}
+	}
+
+	for (int c=0; c<gridWidth * gridHeight; c++)
+		cellStart[c + 1] += cellStart[c];
+
+	std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+	for (int i=0; i<n; i++)
+	{
+		if (placed[i])
+			cellSites[fill[siteCell[i]]++] = i;
+	}
+
+	float inner2 = innerRadius * innerRadius;
+	float outer2 = outerRadius * outerRadius;
+
+	for (int i=0; i<n; i++)
+	{
+		if (!placed[i])
+			continue;
+
+		std::vector<int>& neighbours = neighbourhoods[i];
+		int cx = siteCell[i] % gridWidth;
+		int cy = siteCell[i] / gridWidth;
+
+		for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, gridHeight - 1); y++)
+		{
+			for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, gridWidth - 1); x++)
+			{
+				int cell = y * gridWidth + x;
+				for (int k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+				{
+					int j = cellSites[k];
+					float dx = xs[j] - xs[i];
+					float dy = ys[j] - ys[i];
+					float d2 = dx*dx + dy*dy;
+
+					if (j != i && shanks[j] == shanks[i] && d2 >= inner2 && d2 <= outer2)
+						neighbours.push_back(j);
+				}
+			}
+		}
+
+		std::sort(neighbours.begin(), neighbours.end());
+	}
+}
+
+int ProbeGeometry::applyLocalReference(ReferenceMatrix* refMat, float innerRadius, float outerRadius)
+{
+	std::vector<std::vector<int> > neighbourhoods;
+	int nChannels = refMat->getNumberOfChannels();
+	int numReferences = 0;
+
+	getNeighbourhoods(innerRadius, outerRadius, neighbourhoods);
+
+	refMat->clear();
+
+	for (int i=0; i<std::min(nChannels, (int) neighbourhoods.size()); i++)
+	{
+		for (int k=0; k<(int) neighbourhoods[i].size() && neighbourhoods[i][k] < nChannels; k++)
+		{
+			refMat->setValue(i, neighbourhoods[i][k], 1);
+			numReferences++;
+		}
+	}
+
+	return numReferences;
+}
@@ -0,0 +1,111 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __PROBEGEOMETRY_H__
+#define __PROBEGEOMETRY_H__
+
+#include <string>
+#include <vector>
+
+class ReferenceMatrix;
+
+/* Upper bound on grid cells per site of the neighbourhood index */
+#define MAX_GRID_CELLS_PER_SITE 4
+
+/* Highest channel number a site can have */
+#define MAX_PROBE_CHANNELS 8192
+
+
+/**
+
+  Probe geometry
+
+  Positions of the recording sites of a probe, used to reference each
+  channel to its spatial neighbourhood (local average reference) instead
+  of to the whole array.
+
+  A geometry file has one line per site:
+
+    channel x y [shank]
+
+  with 1-based channel numbers up to MAX_PROBE_CHANNELS and finite
+  positions in micrometers, separated by spaces, tabs or commas. Lines
+  starting with # and lines that do not start with a number (column
+  headers) are skipped. Channels that are not listed have no position.
+
+  Neighbourhoods are found with a uniform grid whose cells are at least as
+  large as the outer radius, so each query visits the 3x3 cells around a
+  site and building all neighbourhoods costs O(N + N*k) for k neighbours
+  per site.
+
+  @see ReferenceMatrix, ChannelRefNode
+
+*/
+
+class ProbeGeometry
+{
+public:
+
+	ProbeGeometry();
+	~ProbeGeometry();
+
+	/** Replace the positions by the ones in a geometry file. Returns false
+	    (see getError()), and keeps the positions as they were, if the file
+	    cannot be read, has an invalid site or has no sites. */
+	bool load(const std::string& path);
+	const std::string& getError();
+
+	void clear();
+
+	/** Channels out of [0, MAX_PROBE_CHANNELS) and positions that are not
+	    finite are ignored. */
+	void setPosition(int channel, float x, float y, int shank = 0);
+	bool hasPosition(int channel);
+
+	/** Number of channels with a position. */
+	int getNumSites();
+
+	/** Channels on the same shank at a distance d from the given channel with
+	    innerRadius <= d <= outerRadius, in ascending order and without the
+	    channel itself. Channels without a position have no neighbours. */
+	void getNeighbourhoods(float innerRadius, float outerRadius,
+						   std::vector<std::vector<int> >& neighbourhoods);
+
+	/** Reference each channel of the matrix to its neighbourhood. Returns the
+	    number of selected references. */
+	int applyLocalReference(ReferenceMatrix* refMat, float innerRadius, float outerRadius);
+
+private:
+
+	std::vector<float> xs;
+	std::vector<float> ys;
+	std::vector<int> shanks;
+	std::vector<bool> placed;
+	int numSites;
+
+	std::string error;
+
+};
+
+
+#endif  //__PROBEGEOMETRY_H__
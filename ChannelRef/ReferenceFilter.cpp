@@ -0,0 +1,236 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "ReferenceFilter.h"
+
+#include <algorithm>
+#include <cmath>
+
+/* Coefficients of a section: b0, b1, b2, a1, a2 (a0 = 1) */
+enum { B0 = 0, B1, B2, A1, A2 };
+
+static const double pi = 3.14159265358979323846;
+
+ReferenceFilter::ReferenceFilter() : nChannels(0), sampleRate(0), mode(OFF), order(REFERENCE_FILTER_ORDER),
+	lowCut(DEFAULT_FILTER_LOW_CUT), highCut(DEFAULT_FILTER_HIGH_CUT), numChanges(0),
+	designed(-1), designedMode(OFF), designedOrder(0), numSections(0)
+{
+}
+
+ReferenceFilter::~ReferenceFilter()
+{
+}
+
+const char* ReferenceFilter::getModeName(Mode mode)
+{
+	switch (mode)
+	{
+	case HIGH_PASS:
+		return "High-pass";
+	case BAND_PASS:
+		return "Band-pass";
+	default:
+		return "No filter";
+	}
+}
+
+void ReferenceFilter::prepare(int numChannels, float rate)
+{
+	nChannels = numChannels;
+	sampleRate = rate;
+	state.assign((size_t) nChannels * MAX_FILTER_SECTIONS * 2, 0.0);
+
+	/* Design again for the new sample rate */
+	designed = -1;
+}
+
+int ReferenceFilter::getNumChannels()
+{
+	return nChannels;
+}
+
+void ReferenceFilter::setMode(Mode newMode)
+{
+	mode = newMode;
+	numChanges++;
+}
+
+ReferenceFilter::Mode ReferenceFilter::getMode()
+{
+	return (Mode) mode.load();
+}
+
+bool ReferenceFilter::setCutoffs(float low, float high)
+{
+	if (!(low > 0.0f && high > low && std::isfinite(high)))
+		return false;
+
+	lowCut = low;
+	highCut = high;
+	numChanges++;
+
+	return true;
+}
+
+float ReferenceFilter::getLowCut()
+{
+	return lowCut.load();
+}
+
+float ReferenceFilter::getHighCut()
+{
+	return highCut.load();
+}
+
+void ReferenceFilter::setOrder(int n)
+{
+	order = std::min(std::max(2, n + (n & 1)), MAX_FILTER_ORDER);
+	numChanges++;
+}
+
+int ReferenceFilter::getOrder()
+{
+	return order.load();
+}
+
+bool ReferenceFilter::isActive()
+{
+	return mode.load() != OFF && nChannels > 0 && sampleRate > 0;
+}
+
+void ReferenceFilter::reset()
+{
+	std::fill(state.begin(), state.end(), 0.0);
+}
+
+/* One biquad section of a Butterworth edge (RBJ cookbook form) */
+static void designSection(double* section, bool highPass, double cutoff, double sampleRate, double q)
+{
+	double w = 2.0 * pi * cutoff / sampleRate;
+	double cosw = std::cos(w);
+	double alpha = std::sin(w) / (2.0 * q);
+	double a0 = 1.0 + alpha;
+
+	double b = highPass ? (1.0 + cosw) / 2.0 : (1.0 - cosw) / 2.0;
+	section[B0] = b / a0;
+	section[B1] = (highPass ? -2.0 * b : 2.0 * b) / a0;
+	section[B2] = b / a0;
+	section[A1] = -2.0 * cosw / a0;
+	section[A2] = (1.0 - alpha) / a0;
+}
+
+void ReferenceFilter::design()
+{
+	designed = numChanges.load();
+
+	int m = mode.load();
+	int n = order.load();
+	double nyquist = 0.5 * sampleRate;
+	double low = lowCut.load();
+	double high = highCut.load();
+
+	int previousSections = numSections;
+	bool changed = m != designedMode || n != designedOrder;
+
+	designedMode = m;
+	designedOrder = n;
+	numSections = 0;
+
+	/* Pairs of poles of an order n Butterworth filter */
+	for (int edge=0; edge<2; edge++)
+	{
+		bool highPass = edge == 0;
+		double cutoff = highPass ? low : high;
+
+		if (m == OFF || (!highPass && m != BAND_PASS) || cutoff <= 0.0 || cutoff >= nyquist)
+			continue;
+
+		for (int k=0; k<n/2; k++)
+		{
+			double q = 1.0 / (2.0 * std::cos(pi * (2 * k + 1) / (2.0 * n)));
+			designSection(sections + 5 * numSections++, highPass, cutoff, sampleRate, q);
+		}
+	}
+
+	/* The state belongs to sections of another filter (an edge may also
+	   have dropped out because its cutoff is out of range) */
+	if (changed || numSections != previousSections)
+		reset();
+}
+
+struct FilterTask
+{
+	float* const* channels;
+	double* state;
+	const double* sections;
+	int numSections;
+	int numChannels;
+	int numSamples;
+	BiquadKernel kernel;
+};
+
+void ReferenceFilter::filterChannels(void* context, int taskIndex, int numTasks)
+{
+	FilterTask* task = (FilterTask*) context;
+
+	/* Whole vectors of channels per task */
+	int numVectors = (task->numChannels + BIQUAD_LANES - 1) / BIQUAD_LANES;
+	int first = std::min(task->numChannels, BIQUAD_LANES * (numVectors * taskIndex / numTasks));
+	int last = std::min(task->numChannels, BIQUAD_LANES * (numVectors * (taskIndex + 1) / numTasks));
+
+	task->kernel(task->channels + first, task->state + (size_t) first * MAX_FILTER_SECTIONS * 2,
+				 MAX_FILTER_SECTIONS * 2, task->sections, task->numSections, last - first, task->numSamples);
+}
+
+void ReferenceFilter::process(float* const* channels, int numSamples,
+							  ReferenceKernels::Type type, ReferenceThreadPool* threadPool)
+{
+	if (nChannels == 0 || sampleRate <= 0)
+		return;
+
+	/* Also while OFF, so that the state is cleared when it is switched on */
+	if (designed != numChanges.load())
+		design();
+
+	if (numSections == 0)
+		return;
+
+	FilterTask task;
+	task.channels = channels;
+	task.state = state.data();
+	task.sections = sections;
+	task.numSections = numSections;
+	task.numChannels = nChannels;
+	task.numSamples = numSamples;
+	task.kernel = ReferenceKernels::getBiquad(type);
+
+	int numTasks = 1;
+	if (threadPool != nullptr && threadPool->getNumThreads() > 0)
+		numTasks = std::min(threadPool->getNumThreads() + 1, nChannels / BIQUAD_LANES);
+
+	if (numTasks > 1)
+		threadPool->run(&ReferenceFilter::filterChannels, &task, numTasks);
+	else
+		filterChannels(&task, 0, 1);
+}
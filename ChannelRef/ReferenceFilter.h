@@ -0,0 +1,162 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __REFERENCEFILTER_H__
+#define __REFERENCEFILTER_H__
+
+#include <atomic>
+#include <vector>
+
+#include "ReferenceKernels.h"
+#include "ReferenceThreadPool.h"
+
+/* Butterworth order of each edge of the filter until one is set */
+#define REFERENCE_FILTER_ORDER 2
+
+/* Highest order of each edge; a band-pass has sections for both edges */
+#define MAX_FILTER_ORDER MAX_BIQUAD_SECTIONS
+#define MAX_FILTER_SECTIONS MAX_BIQUAD_SECTIONS
+
+/* Cutoffs in Hz until they are set */
+#define DEFAULT_FILTER_LOW_CUT 300.0f
+#define DEFAULT_FILTER_HIGH_CUT 6000.0f
+
+/* Samples of all channels that are referenced and then filtered before
+   the next tile (see ReferencePlan::process()); 384 channels of a tile
+   take 192 kB, which stays in the L2 cache */
+#define FILTER_TILE_SIZE 128
+
+
+/**
+
+  Reference filter
+
+  High-pass or band-pass filter that is applied within the referencing
+  stage, so that the referenced samples are filtered while they are still
+  in cache rather than by a separate filter that streams the whole buffer
+  through memory again.
+
+  Each edge is a Butterworth filter of the given (even) order, built as a
+  cascade of biquad sections (one per pair of poles, designed by the
+  bilinear transform); a band-pass is the high-pass sections followed by
+  the low-pass ones. Sections are in transposed direct form II with
+  coefficients and state in double precision, so that low cutoffs stay
+  accurate.
+
+  Every channel has its own state, which carries over from one call to
+  the next, so a block can be filtered in tiles of any size with the same
+  result. The sections are run by the biquad kernel (see
+  ReferenceKernels), which filters several channels at once in the lanes
+  of its vectors; the channels are split across the thread pool.
+
+  Settings can be changed from any thread. They are picked up by the next
+  call of process(), which designs the sections without allocating; a
+  change of the mode, the order or the number of sections (a cutoff out
+  of range drops its edge) also clears the state.
+
+  @see ReferencePlan, ChannelRefNode
+
+*/
+
+class ReferenceFilter
+{
+public:
+
+	enum Mode
+	{
+		OFF = 0,
+		HIGH_PASS,
+		BAND_PASS,
+		NUM_MODES
+	};
+
+	ReferenceFilter();
+	~ReferenceFilter();
+
+	static const char* getModeName(Mode mode);
+
+	/** Set the number of channels and the sample rate and clear the state.
+	    Must not be called while process() is running. */
+	void prepare(int numChannels, float sampleRate);
+
+	int getNumChannels();
+
+	void setMode(Mode mode);
+	Mode getMode();
+
+	/** Cutoffs in Hz; the high cut only applies to BAND_PASS. Returns
+	    false, and keeps the previous cutoffs, unless 0 < lowCut < highCut
+	    and both are finite. An edge that is not below the Nyquist frequency
+	    is left out of the filter. */
+	bool setCutoffs(float lowCut, float highCut);
+	float getLowCut();
+	float getHighCut();
+
+	/** Butterworth order of each edge, rounded up to an even number in
+	    [2, MAX_FILTER_ORDER]. */
+	void setOrder(int order);
+	int getOrder();
+
+	/** True if the mode is not OFF and the filter is prepared. */
+	bool isActive();
+
+	/** Clear the state of all channels. Must not be called while process()
+	    is running. */
+	void reset();
+
+	/** Filter the channels in place, continuing from the state left by the
+	    previous call. If a thread pool with workers is given, the channels
+	    are split across it. */
+	void process(float* const* channels, int numSamples,
+				 ReferenceKernels::Type type, ReferenceThreadPool* threadPool);
+
+private:
+
+	void design();
+
+	static void filterChannels(void* context, int taskIndex, int numTasks);
+
+	int nChannels;
+	float sampleRate;
+
+	std::atomic<int> mode;
+	std::atomic<int> order;
+	std::atomic<float> lowCut;
+	std::atomic<float> highCut;
+	std::atomic<int> numChanges;
+
+	/* Sections designed for the settings of numChanges == designed */
+	int designed;
+	int designedMode;
+	int designedOrder;
+	int numSections;
+	double sections[MAX_FILTER_SECTIONS * 5];
+
+	/* Two values per section and channel */
+	std::vector<double> state;
+
+};
+
+
+#endif  //__REFERENCEFILTER_H__
@@ -0,0 +1,140 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "ReferenceGainFit.h"
+
+#include <cstring>
+
+#include "ReferenceMatrix.h"
+
+ReferenceGainFit::ReferenceGainFit() : nChannels(0), nSamples(0), done(false)
+{
+}
+
+ReferenceGainFit::~ReferenceGainFit()
+{
+	if (worker.joinable())
+		worker.join();
+}
+
+bool ReferenceGainFit::start(ReferenceMatrix* refMat, const float* const* samples,
+							 int numChannels, int numSamples)
+{
+	if (worker.joinable() || numChannels != refMat->getNumberOfChannels() || numSamples <= 0)
+		return false;
+
+	plan.compile(refMat, 1.0f, false);
+
+	nChannels = numChannels;
+	nSamples = numSamples;
+	data.resize((size_t) nChannels * nSamples);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		std::memcpy(&data[(size_t) i * nSamples], samples[i], nSamples * sizeof(float));
+	}
+
+	done = false;
+	worker = std::thread(&ReferenceGainFit::run, this);
+
+	return true;
+}
+
+bool ReferenceGainFit::isRunning()
+{
+	return worker.joinable();
+}
+
+bool ReferenceGainFit::isDone()
+{
+	return done.load();
+}
+
+bool ReferenceGainFit::finish(std::vector<float>& gains)
+{
+	if (!worker.joinable())
+		return false;
+
+	worker.join();
+	gains.swap(result);
+
+	/* The copy of the data is only needed by the fit */
+	std::vector<float>().swap(data);
+
+	return true;
+}
+
+void ReferenceGainFit::run()
+{
+	std::vector<const float*> samples(nChannels);
+	for (int i=0; i<nChannels; i++)
+	{
+		samples[i] = &data[(size_t) i * nSamples];
+	}
+
+	fit(plan, samples.data(), nSamples, result);
+	done = true;
+}
+
+void ReferenceGainFit::fit(ReferencePlan& plan, const float* const* samples, int numSamples,
+						   std::vector<float>& gains)
+{
+	int numChannels = plan.getNumChannels();
+
+	/* Referenced copy of the data: y = x - r */
+	std::vector<float> referenced((size_t) numChannels * numSamples);
+	std::vector<float*> channels(numChannels);
+
+	for (int i=0; i<numChannels; i++)
+	{
+		channels[i] = &referenced[(size_t) i * numSamples];
+		std::memcpy(channels[i], samples[i], numSamples * sizeof(float));
+	}
+
+	plan.process(channels.data(), numSamples, ReferenceKernels::getBestType(), nullptr);
+
+	gains.assign(numChannels, 1.0f);
+
+	for (int i=0; i<numChannels; i++)
+	{
+		const float* x = samples[i];
+		const float* y = channels[i];
+		double xr = 0.0;
+		double rr = 0.0;
+		double xx = 0.0;
+
+		for (int t=0; t<numSamples; t++)
+		{
+			double r = (double) x[t] - (double) y[t];
+			xr += x[t] * r;
+			rr += r * r;
+			xx += (double) x[t] * x[t];
+		}
+
+		if (rr > GAIN_FIT_MIN_POWER * xx && rr > 0.0)
+		{
+			gains[i] = (float) (xr / rr);
+		}
+	}
+}
@@ -0,0 +1,109 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#ifndef __REFERENCEGAINFIT_H__
+#define __REFERENCEGAINFIT_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ReferencePlan.h"
+
+class ReferenceMatrix;
+
+/* Relative power below which the reference of a channel is taken to be
+   zero, so that its gain stays 1 */
+#define GAIN_FIT_MIN_POWER 1e-12
+
+
+/**
+
+  Reference gain fit
+
+  Fits the reference gain of each channel (see
+  ReferenceMatrix::getChannelGain()) by least squares: for a channel x with
+  reference signal r, the gain g that minimizes the power of x - g * r is
+
+    g = sum(x * r) / sum(r * r)
+
+  The reference signals are those of the matrix with all gains 1, computed
+  by running a plan of the matrix over a copy of the data, so the fit works
+  for average, median and trimmed-mean references alike. Unlike
+  ReferenceLeastSquaresFit, which fits the weight of every reference of a
+  row, this fits a single gain per row, so it is cheap and leaves the
+  structure of the plan as it is.
+
+  start() compiles the matrix and copies the data on the calling thread
+  and fits on a thread of its own, so neither the matrix nor the data have
+  to stay unchanged while the fit runs.
+
+  @see ReferenceMatrix, ChannelRefNode
+
+*/
+
+class ReferenceGainFit
+{
+public:
+
+	ReferenceGainFit();
+	~ReferenceGainFit();
+
+	/** Start fitting the gains of the matrix to the given samples
+	    (numChannels x numSamples). Returns false if a fit is still running
+	    or the channels do not match the matrix. */
+	bool start(ReferenceMatrix* refMat, const float* const* samples, int numChannels, int numSamples);
+
+	/** True from start() until finish(). */
+	bool isRunning();
+
+	/** True once the gains of the running fit are ready. */
+	bool isDone();
+
+	/** Wait for the running fit and take its gains, one per channel.
+	    Returns false if no fit was started. */
+	bool finish(std::vector<float>& gains);
+
+	/** The fit itself, on the calling thread. The plan must be compiled
+	    without global and channel gains. */
+	static void fit(ReferencePlan& plan, const float* const* samples, int numSamples,
+					std::vector<float>& gains);
+
+private:
+
+	void run();
+
+	ReferencePlan plan;
+	std::vector<float> data;
+	int nChannels;
+	int nSamples;
+
+	std::vector<float> result;
+	std::thread worker;
+	std::atomic<bool> done;
+
+};
+
+
+#endif  //__REFERENCEGAINFIT_H__
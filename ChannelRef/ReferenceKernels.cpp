@@ -0,0 +1,1583 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REFERENCE_KERNELS_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define REFERENCE_KERNELS_X86
+#define TARGET(isa)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+
+/* Samples per tile (dest tile stays in L1 while all sources are added) */
+#define KERNEL_TILE_SIZE 2048
+
+/* Sources accumulated per pass over a dest tile */
+#define KERNEL_CHUNK_SIZE 8
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+
+static void accumulateScalar(float* dest, float destGain,
+							 float* const* sources, const int* sourceIndex,
+							 const float* gains, int numSources, int numSamples)
+{
+	for (int t=0; t<numSamples; t+=KERNEL_TILE_SIZE)
+	{
+		int tileEnd = MIN(numSamples, t + KERNEL_TILE_SIZE);
+		int k = 0;
+
+		do
+		{
+			int chunkEnd = MIN(numSources, k + KERNEL_CHUNK_SIZE);
+
+			for (int n=t; n<tileEnd; n++)
+			{
+				float acc;
+				if (k > 0)
+					acc = dest[n];
+				else if (destGain != 0.0f)
+					acc = destGain * dest[n];
+				else
+					acc = 0.0f;
+
+				for (int j=k; j<chunkEnd; j++)
+				{
+					acc += gains[j] * sources[sourceIndex[j]][n];
+				}
+
+				dest[n] = acc;
+			}
+
+			k = chunkEnd;
+		}
+		while (k < numSources);
+	}
+}
+
+
+/* Same operand order as minps/maxps, so that all kernel types give the
+   same result (also for NaNs) */
+static void compareExchangeScalar(float* tile, const int* pairs, int numPairs)
+{
+	for (int p=0; p<numPairs; p++)
+	{
+		float* a = tile + pairs[2*p] * NETWORK_TILE_WIDTH;
+		float* b = tile + pairs[2*p + 1] * NETWORK_TILE_WIDTH;
+
+		for (int n=0; n<NETWORK_TILE_WIDTH; n++)
+		{
+			float x = a[n];
+			float y = b[n];
+			a[n] = x < y ? x : y;
+			b[n] = x > y ? x : y;
+		}
+	}
+}
+
+
+static void rankUpdateScalar(float* c, const float* x, int stride,
+							 int row, int column, int numSamples)
+{
+	float acc[RANK_UPDATE_ROWS][RANK_UPDATE_COLUMNS];
+
+	for (int i=0; i<RANK_UPDATE_ROWS; i++)
+	{
+		for (int j=0; j<RANK_UPDATE_COLUMNS; j++)
+			acc[i][j] = c[(row + i) * stride + column + j];
+	}
+
+	for (int t=0; t<numSamples; t++)
+	{
+		const float* xt = x + t * stride;
+
+		for (int i=0; i<RANK_UPDATE_ROWS; i++)
+		{
+			for (int j=0; j<RANK_UPDATE_COLUMNS; j++)
+				acc[i][j] += xt[row + i] * xt[column + j];
+		}
+	}
+
+	for (int i=0; i<RANK_UPDATE_ROWS; i++)
+	{
+		for (int j=0; j<RANK_UPDATE_COLUMNS; j++)
+			c[(row + i) * stride + column + j] = acc[i][j];
+	}
+}
+
+
+/* Samples per vector of a dest row in the matrix multiply */
+#define MATRIX_MULTIPLY_WIDTH 16
+
+/* Multiplies one vector of MATRIX_MULTIPLY_WIDTH samples per dest row,
+   starting at d[i] + m, with the sources at sample n; only the first count
+   samples of the sources are read, the others count as zero */
+typedef void (*MultiplyVector)(float* const* d, int m, const float* weights, int weightStride,
+							   float* const* sources, int numSources, int n, int count);
+
+static inline const float* sourceVector(float* const* sources, int j, int n, int count, float* x)
+{
+	if (count == MATRIX_MULTIPLY_WIDTH)
+		return sources[j] + n;
+
+	for (int k=0; k<MATRIX_MULTIPLY_WIDTH; k++)
+		x[k] = k < count ? sources[j][n + k] : 0.0f;
+
+	return x;
+}
+
+/* The last partial vector goes through a zero-padded copy of dest, so
+   every sample sees the same sequence of operations */
+static void multiplyTail(MultiplyVector vector, float* const* dest, const float* weights, int weightStride,
+						 float* const* sources, int numSources, int n, int count)
+{
+	float tile[MATRIX_MULTIPLY_ROWS][MATRIX_MULTIPLY_WIDTH];
+	float* d[MATRIX_MULTIPLY_ROWS];
+
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+	{
+		for (int k=0; k<MATRIX_MULTIPLY_WIDTH; k++)
+			tile[i][k] = k < count ? dest[i][n + k] : 0.0f;
+		d[i] = tile[i];
+	}
+
+	vector(d, 0, weights, weightStride, sources, numSources, n, count);
+
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+	{
+		for (int k=0; k<count; k++)
+			dest[i][n + k] = tile[i][k];
+	}
+}
+
+static inline void multiplyVectorScalar(float* const* d, int m, const float* weights, int weightStride,
+										float* const* sources, int numSources, int n, int count)
+{
+	float acc[MATRIX_MULTIPLY_ROWS][MATRIX_MULTIPLY_WIDTH];
+	float x[MATRIX_MULTIPLY_WIDTH];
+
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+	{
+		for (int k=0; k<MATRIX_MULTIPLY_WIDTH; k++)
+			acc[i][k] = d[i][m + k];
+	}
+
+	for (int j=0; j<numSources; j++)
+	{
+		const float* s = sourceVector(sources, j, n, count, x);
+
+		for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+		{
+			float w = weights[i * weightStride + j];
+			for (int k=0; k<MATRIX_MULTIPLY_WIDTH; k++)
+				acc[i][k] += w * s[k];
+		}
+	}
+
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+	{
+		for (int k=0; k<MATRIX_MULTIPLY_WIDTH; k++)
+			d[i][m + k] = acc[i][k];
+	}
+}
+
+static void matrixMultiplyScalar(float* const* dest, const float* weights, int weightStride,
+								 float* const* sources, int numSources, int first, int numSamples)
+{
+	int n = first;
+	for (; n+MATRIX_MULTIPLY_WIDTH<=first+numSamples; n+=MATRIX_MULTIPLY_WIDTH)
+		multiplyVectorScalar(dest, n, weights, weightStride, sources, numSources, n, MATRIX_MULTIPLY_WIDTH);
+
+	if (n < first + numSamples)
+		multiplyTail(&multiplyVectorScalar, dest, weights, weightStride, sources, numSources, n, first + numSamples - n);
+}
+
+
+/* Samples per vector of the group kernels */
+#define GROUP_KERNEL_WIDTH 16
+
+/* Loops over the channels of a group and over the vectors of a pass have
+   fixed bounds; tetrodes and the vectors of a pass are unrolled completely,
+   larger groups by 8 */
+#if defined(__GNUC__)
+#define UNROLL_GROUP _Pragma("GCC unroll 8")
+#else
+#define UNROLL_GROUP
+#endif
+
+/* One pass over a group for GROUP_KERNEL_VECTORS (or fewer) vectors of
+   samples, starting at sample n */
+typedef void (*GroupVectors)(float* const* channels, const float* selfGains, const float* gains, int n);
+
+/* The last partial vector goes through a zero-padded copy of the group, as
+   in multiplyTail() */
+template <int G>
+static void groupTail(GroupVectors vectors, float* const* channels, const float* selfGains, const float* gains,
+					  int n, int count)
+{
+	float tile[G][GROUP_KERNEL_WIDTH];
+	float* c[G];
+
+	for (int k=0; k<G; k++)
+	{
+		for (int i=0; i<GROUP_KERNEL_WIDTH; i++)
+			tile[k][i] = i < count ? channels[k][n + i] : 0.0f;
+		c[k] = tile[k];
+	}
+
+	vectors(c, selfGains, gains, 0);
+
+	for (int k=0; k<G; k++)
+	{
+		for (int i=0; i<count; i++)
+			channels[k][n + i] = tile[k][i];
+	}
+}
+
+template <int G, int V>
+static inline void groupVectorsScalar(float* const* channels, const float* selfGains, const float* gains, int n)
+{
+	float sum[V * GROUP_KERNEL_WIDTH];
+
+	UNROLL_GROUP
+	for (int i=0; i<V*GROUP_KERNEL_WIDTH; i++)
+		sum[i] = 0.0f;
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		const float* x = channels[k] + n;
+		UNROLL_GROUP
+		for (int i=0; i<V*GROUP_KERNEL_WIDTH; i++)
+			sum[i] += x[i];
+	}
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		float* x = channels[k] + n;
+		UNROLL_GROUP
+		for (int i=0; i<V*GROUP_KERNEL_WIDTH; i++)
+		{
+			float acc = selfGains[k] * x[i];
+			acc += gains[k] * sum[i];
+			x[i] = acc;
+		}
+	}
+}
+
+template <int G>
+static void groupScalar(float* const* channels, const float* selfGains, const float* gains,
+						int first, int numSamples)
+{
+	int end = first + numSamples;
+	int n = first;
+
+	for (; n+GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH)
+		groupVectorsScalar<G, GROUP_KERNEL_VECTORS>(channels, selfGains, gains, n);
+
+	for (; n+GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_WIDTH)
+		groupVectorsScalar<G, 1>(channels, selfGains, gains, n);
+
+	if (n < end)
+		groupTail<G>(&groupVectorsScalar<G, 1>, channels, selfGains, gains, n, end - n);
+}
+
+
+/* As accumulateScalar() with one source: the target times a gain of 1
+   (which is exact), plus the scaled source */
+static void derivationScalar(float* const* channels, const int* targets, const int* sources,
+							 const float* gains, int numDerivations, int first, int numSamples)
+{
+	for (int d=0; d<numDerivations; d++)
+	{
+		float* y = channels[targets[d]] + first;
+		const float* x = channels[sources[d]] + first;
+		float g = gains[d];
+
+		for (int n=0; n<numSamples; n++)
+		{
+			y[n] += g * x[n];
+		}
+	}
+}
+
+
+/* One sample of up to BIQUAD_LANES channels through all sections */
+template <int LANES>
+static void biquadSampleScalar(float* const* x, int n, double (*s1)[BIQUAD_LANES], double (*s2)[BIQUAD_LANES],
+							   const double* sections, int numSections)
+{
+	double v[BIQUAD_LANES];
+	for (int l=0; l<LANES; l++)
+		v[l] = x[l][n];
+
+	for (int s=0; s<numSections; s++)
+	{
+		const double* c = sections + 5 * s;
+		for (int l=0; l<LANES; l++)
+		{
+			double y = c[0] * v[l] + s1[s][l];
+			s1[s][l] = c[1] * v[l] - c[3] * y + s2[s][l];
+			s2[s][l] = c[2] * v[l] - c[4] * y;
+			v[l] = y;
+		}
+	}
+
+	for (int l=0; l<LANES; l++)
+		x[l][n] = (float) v[l];
+}
+
+template <int LANES>
+static void biquadLanesScalar(float* const* x, double* state, int stateStride,
+							  const double* sections, int numSections, int numSamples)
+{
+	double s1[MAX_BIQUAD_SECTIONS][BIQUAD_LANES];
+	double s2[MAX_BIQUAD_SECTIONS][BIQUAD_LANES];
+
+	for (int s=0; s<numSections; s++)
+	{
+		for (int l=0; l<LANES; l++)
+		{
+			s1[s][l] = state[l * stateStride + 2 * s];
+			s2[s][l] = state[l * stateStride + 2 * s + 1];
+		}
+	}
+
+	for (int n=0; n<numSamples; n++)
+		biquadSampleScalar<LANES>(x, n, s1, s2, sections, numSections);
+
+	for (int s=0; s<numSections; s++)
+	{
+		for (int l=0; l<LANES; l++)
+		{
+			state[l * stateStride + 2 * s] = s1[s][l];
+			state[l * stateStride + 2 * s + 1] = s2[s][l];
+		}
+	}
+}
+
+/* Lanes are independent, so the remaining channels are single lanes */
+static void biquadScalar(float* const* channels, double* state, int stateStride,
+						 const double* sections, int numSections, int numChannels, int numSamples)
+{
+	int c = 0;
+
+	for (; c+BIQUAD_LANES<=numChannels; c+=BIQUAD_LANES)
+		biquadLanesScalar<BIQUAD_LANES>(channels + c, state + c * stateStride, stateStride,
+										sections, numSections, numSamples);
+
+	for (; c<numChannels; c++)
+		biquadLanesScalar<1>(channels + c, state + c * stateStride, stateStride,
+							 sections, numSections, numSamples);
+}
+
+
+#ifdef REFERENCE_KERNELS_X86
+
+TARGET("sse2")
+static void compareExchangeSSE(float* tile, const int* pairs, int numPairs)
+{
+	for (int p=0; p<numPairs; p++)
+	{
+		float* a = tile + pairs[2*p] * NETWORK_TILE_WIDTH;
+		float* b = tile + pairs[2*p + 1] * NETWORK_TILE_WIDTH;
+
+		for (int n=0; n<NETWORK_TILE_WIDTH; n+=4)
+		{
+			__m128 x = _mm_loadu_ps(a + n);
+			__m128 y = _mm_loadu_ps(b + n);
+			_mm_storeu_ps(a + n, _mm_min_ps(x, y));
+			_mm_storeu_ps(b + n, _mm_max_ps(x, y));
+		}
+	}
+}
+
+TARGET("avx2")
+static void compareExchangeAVX2(float* tile, const int* pairs, int numPairs)
+{
+	for (int p=0; p<numPairs; p++)
+	{
+		float* a = tile + pairs[2*p] * NETWORK_TILE_WIDTH;
+		float* b = tile + pairs[2*p + 1] * NETWORK_TILE_WIDTH;
+
+		__m256 x0 = _mm256_loadu_ps(a);
+		__m256 x1 = _mm256_loadu_ps(a + 8);
+		__m256 y0 = _mm256_loadu_ps(b);
+		__m256 y1 = _mm256_loadu_ps(b + 8);
+		_mm256_storeu_ps(a, _mm256_min_ps(x0, y0));
+		_mm256_storeu_ps(a + 8, _mm256_min_ps(x1, y1));
+		_mm256_storeu_ps(b, _mm256_max_ps(x0, y0));
+		_mm256_storeu_ps(b + 8, _mm256_max_ps(x1, y1));
+	}
+}
+
+TARGET("avx512f")
+static void compareExchangeAVX512(float* tile, const int* pairs, int numPairs)
+{
+	for (int p=0; p<numPairs; p++)
+	{
+		float* a = tile + pairs[2*p] * NETWORK_TILE_WIDTH;
+		float* b = tile + pairs[2*p + 1] * NETWORK_TILE_WIDTH;
+
+		__m512 x = _mm512_loadu_ps(a);
+		__m512 y = _mm512_loadu_ps(b);
+		_mm512_storeu_ps(a, _mm512_min_ps(x, y));
+		_mm512_storeu_ps(b, _mm512_max_ps(x, y));
+	}
+}
+
+TARGET("sse2")
+static inline __m128 initialSSE(const float* dest, float destGain, int k)
+{
+	if (k > 0)
+		return _mm_loadu_ps(dest);
+	else if (destGain != 0.0f)
+		return _mm_mul_ps(_mm_set1_ps(destGain), _mm_loadu_ps(dest));
+	else
+		return _mm_setzero_ps();
+}
+
+TARGET("sse2")
+static void accumulateSSE(float* dest, float destGain,
+						  float* const* sources, const int* sourceIndex,
+						  const float* gains, int numSources, int numSamples)
+{
+	for (int t=0; t<numSamples; t+=KERNEL_TILE_SIZE)
+	{
+		int tileEnd = MIN(numSamples, t + KERNEL_TILE_SIZE);
+		int k = 0;
+
+		do
+		{
+			int chunkEnd = MIN(numSources, k + KERNEL_CHUNK_SIZE);
+			int n = t;
+
+			for (; n+4<=tileEnd; n+=4)
+			{
+				__m128 acc = initialSSE(dest + n, destGain, k);
+				for (int j=k; j<chunkEnd; j++)
+				{
+					__m128 x = _mm_loadu_ps(sources[sourceIndex[j]] + n);
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(gains[j]), x));
+				}
+				_mm_storeu_ps(dest + n, acc);
+			}
+
+			if (n < tileEnd)
+			{
+				/* Tail as a zero-padded vector, so that every sample goes
+				   through the same instructions */
+				int r = tileEnd - n;
+				float d[4] = { 0, 0, 0, 0 };
+				float x[4] = { 0, 0, 0, 0 };
+				for (int i=0; i<r; i++)
+					d[i] = dest[n + i];
+
+				__m128 acc = initialSSE(d, destGain, k);
+				for (int j=k; j<chunkEnd; j++)
+				{
+					for (int i=0; i<r; i++)
+						x[i] = sources[sourceIndex[j]][n + i];
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(gains[j]), _mm_loadu_ps(x)));
+				}
+				_mm_storeu_ps(d, acc);
+
+				for (int i=0; i<r; i++)
+					dest[n + i] = d[i];
+			}
+
+			k = chunkEnd;
+		}
+		while (k < numSources);
+	}
+}
+
+TARGET("avx2,fma")
+static inline void accumulateVectorAVX2(float* dest, float destGain,
+										float* const* sources, const int* sourceIndex,
+										const float* gains, int k, int chunkEnd, int n,
+										bool masked, __m256i mask)
+{
+	__m256 acc;
+	if (k > 0)
+		acc = masked ? _mm256_maskload_ps(dest + n, mask) : _mm256_loadu_ps(dest + n);
+	else if (destGain != 0.0f)
+		acc = _mm256_mul_ps(_mm256_set1_ps(destGain),
+							masked ? _mm256_maskload_ps(dest + n, mask) : _mm256_loadu_ps(dest + n));
+	else
+		acc = _mm256_setzero_ps();
+
+	for (int j=k; j<chunkEnd; j++)
+	{
+		const float* x = sources[sourceIndex[j]] + n;
+		acc = _mm256_fmadd_ps(_mm256_set1_ps(gains[j]),
+							  masked ? _mm256_maskload_ps(x, mask) : _mm256_loadu_ps(x), acc);
+	}
+
+	if (masked)
+		_mm256_maskstore_ps(dest + n, mask, acc);
+	else
+		_mm256_storeu_ps(dest + n, acc);
+}
+
+TARGET("avx2,fma")
+static void accumulateAVX2(float* dest, float destGain,
+						   float* const* sources, const int* sourceIndex,
+						   const float* gains, int numSources, int numSamples)
+{
+	for (int t=0; t<numSamples; t+=KERNEL_TILE_SIZE)
+	{
+		int tileEnd = MIN(numSamples, t + KERNEL_TILE_SIZE);
+		int k = 0;
+
+		do
+		{
+			int chunkEnd = MIN(numSources, k + KERNEL_CHUNK_SIZE);
+			int n = t;
+
+			for (; n+8<=tileEnd; n+=8)
+			{
+				accumulateVectorAVX2(dest, destGain, sources, sourceIndex, gains,
+									 k, chunkEnd, n, false, _mm256_setzero_si256());
+			}
+
+			if (n < tileEnd)
+			{
+				__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(tileEnd - n),
+												  _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+				accumulateVectorAVX2(dest, destGain, sources, sourceIndex, gains,
+									 k, chunkEnd, n, true, mask);
+			}
+
+			k = chunkEnd;
+		}
+		while (k < numSources);
+	}
+}
+
+TARGET("avx512f")
+static inline void accumulateVectorAVX512(float* dest, float destGain,
+										  float* const* sources, const int* sourceIndex,
+										  const float* gains, int k, int chunkEnd, int n,
+										  __mmask16 mask)
+{
+	__m512 acc;
+	if (k > 0)
+		acc = _mm512_maskz_loadu_ps(mask, dest + n);
+	else if (destGain != 0.0f)
+		acc = _mm512_mul_ps(_mm512_set1_ps(destGain), _mm512_maskz_loadu_ps(mask, dest + n));
+	else
+		acc = _mm512_setzero_ps();
+
+	for (int j=k; j<chunkEnd; j++)
+	{
+		__m512 x = _mm512_maskz_loadu_ps(mask, sources[sourceIndex[j]] + n);
+		acc = _mm512_fmadd_ps(_mm512_set1_ps(gains[j]), x, acc);
+	}
+
+	_mm512_mask_storeu_ps(dest + n, mask, acc);
+}
+
+TARGET("avx512f")
+static void accumulateAVX512(float* dest, float destGain,
+							 float* const* sources, const int* sourceIndex,
+							 const float* gains, int numSources, int numSamples)
+{
+	for (int t=0; t<numSamples; t+=KERNEL_TILE_SIZE)
+	{
+		int tileEnd = MIN(numSamples, t + KERNEL_TILE_SIZE);
+		int k = 0;
+
+		do
+		{
+			int chunkEnd = MIN(numSources, k + KERNEL_CHUNK_SIZE);
+			int n = t;
+
+			/* All-ones masks compile to plain loads/stores */
+			for (; n+16<=tileEnd; n+=16)
+			{
+				accumulateVectorAVX512(dest, destGain, sources, sourceIndex, gains,
+									   k, chunkEnd, n, (__mmask16) 0xffff);
+			}
+
+			if (n < tileEnd)
+			{
+				accumulateVectorAVX512(dest, destGain, sources, sourceIndex, gains,
+									   k, chunkEnd, n, (__mmask16) ((1u << (tileEnd - n)) - 1));
+			}
+
+			k = chunkEnd;
+		}
+		while (k < numSources);
+	}
+}
+
+
+/* Two passes of 8 columns, so that the accumulators and operands fit in
+   the 16 SSE registers */
+TARGET("sse2")
+static void rankUpdateSSE(float* c, const float* x, int stride,
+						  int row, int column, int numSamples)
+{
+	for (int half=0; half<RANK_UPDATE_COLUMNS; half+=8)
+	{
+		float* c0 = c + row * stride + column + half;
+		const float* xj = x + column + half;
+		const float* xi = x + row;
+
+		__m128 acc[RANK_UPDATE_ROWS][2];
+		for (int i=0; i<RANK_UPDATE_ROWS; i++)
+		{
+			acc[i][0] = _mm_loadu_ps(c0 + i * stride);
+			acc[i][1] = _mm_loadu_ps(c0 + i * stride + 4);
+		}
+
+		for (int t=0; t<numSamples; t++)
+		{
+			__m128 b0 = _mm_loadu_ps(xj + t * stride);
+			__m128 b1 = _mm_loadu_ps(xj + t * stride + 4);
+
+			for (int i=0; i<RANK_UPDATE_ROWS; i++)
+			{
+				__m128 a = _mm_set1_ps(xi[t * stride + i]);
+				acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(a, b0));
+				acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(a, b1));
+			}
+		}
+
+		for (int i=0; i<RANK_UPDATE_ROWS; i++)
+		{
+			_mm_storeu_ps(c0 + i * stride, acc[i][0]);
+			_mm_storeu_ps(c0 + i * stride + 4, acc[i][1]);
+		}
+	}
+}
+
+TARGET("avx2,fma")
+static void rankUpdateAVX2(float* c, const float* x, int stride,
+						   int row, int column, int numSamples)
+{
+	float* c0 = c + row * stride + column;
+	const float* xj = x + column;
+	const float* xi = x + row;
+
+	__m256 acc[RANK_UPDATE_ROWS][2];
+	for (int i=0; i<RANK_UPDATE_ROWS; i++)
+	{
+		acc[i][0] = _mm256_loadu_ps(c0 + i * stride);
+		acc[i][1] = _mm256_loadu_ps(c0 + i * stride + 8);
+	}
+
+	for (int t=0; t<numSamples; t++)
+	{
+		__m256 b0 = _mm256_loadu_ps(xj + t * stride);
+		__m256 b1 = _mm256_loadu_ps(xj + t * stride + 8);
+
+		for (int i=0; i<RANK_UPDATE_ROWS; i++)
+		{
+			__m256 a = _mm256_broadcast_ss(xi + t * stride + i);
+			acc[i][0] = _mm256_fmadd_ps(a, b0, acc[i][0]);
+			acc[i][1] = _mm256_fmadd_ps(a, b1, acc[i][1]);
+		}
+	}
+
+	for (int i=0; i<RANK_UPDATE_ROWS; i++)
+	{
+		_mm256_storeu_ps(c0 + i * stride, acc[i][0]);
+		_mm256_storeu_ps(c0 + i * stride + 8, acc[i][1]);
+	}
+}
+
+TARGET("avx512f")
+static void rankUpdateAVX512(float* c, const float* x, int stride,
+							 int row, int column, int numSamples)
+{
+	float* c0 = c + row * stride + column;
+	const float* xj = x + column;
+	const float* xi = x + row;
+
+	__m512 acc[RANK_UPDATE_ROWS];
+	for (int i=0; i<RANK_UPDATE_ROWS; i++)
+		acc[i] = _mm512_loadu_ps(c0 + i * stride);
+
+	for (int t=0; t<numSamples; t++)
+	{
+		__m512 b = _mm512_loadu_ps(xj + t * stride);
+
+		for (int i=0; i<RANK_UPDATE_ROWS; i++)
+			acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(xi[t * stride + i]), b, acc[i]);
+	}
+
+	for (int i=0; i<RANK_UPDATE_ROWS; i++)
+		_mm512_storeu_ps(c0 + i * stride, acc[i]);
+}
+
+
+/* Two passes of 8 samples, so that the accumulators and operands fit in
+   the 16 SSE registers */
+TARGET("sse2")
+static inline void multiplyVectorSSE(float* const* d, int m, const float* weights, int weightStride,
+									 float* const* sources, int numSources, int n, int count)
+{
+	float x[MATRIX_MULTIPLY_WIDTH];
+
+	for (int half=0; half<MATRIX_MULTIPLY_WIDTH; half+=8)
+	{
+		__m128 acc[MATRIX_MULTIPLY_ROWS][2];
+		for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+		{
+			acc[i][0] = _mm_loadu_ps(d[i] + m + half);
+			acc[i][1] = _mm_loadu_ps(d[i] + m + half + 4);
+		}
+
+		for (int j=0; j<numSources; j++)
+		{
+			const float* s = sourceVector(sources, j, n, count, x) + half;
+			__m128 b0 = _mm_loadu_ps(s);
+			__m128 b1 = _mm_loadu_ps(s + 4);
+
+			for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+			{
+				__m128 w = _mm_set1_ps(weights[i * weightStride + j]);
+				acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(w, b0));
+				acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(w, b1));
+			}
+		}
+
+		for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+		{
+			_mm_storeu_ps(d[i] + m + half, acc[i][0]);
+			_mm_storeu_ps(d[i] + m + half + 4, acc[i][1]);
+		}
+	}
+}
+
+TARGET("avx2,fma")
+static inline void multiplyVectorAVX2(float* const* d, int m, const float* weights, int weightStride,
+									  float* const* sources, int numSources, int n, int count)
+{
+	float x[MATRIX_MULTIPLY_WIDTH];
+
+	__m256 acc[MATRIX_MULTIPLY_ROWS][2];
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+	{
+		acc[i][0] = _mm256_loadu_ps(d[i] + m);
+		acc[i][1] = _mm256_loadu_ps(d[i] + m + 8);
+	}
+
+	for (int j=0; j<numSources; j++)
+	{
+		const float* s = sourceVector(sources, j, n, count, x);
+		__m256 b0 = _mm256_loadu_ps(s);
+		__m256 b1 = _mm256_loadu_ps(s + 8);
+
+		for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+		{
+			__m256 w = _mm256_broadcast_ss(weights + i * weightStride + j);
+			acc[i][0] = _mm256_fmadd_ps(w, b0, acc[i][0]);
+			acc[i][1] = _mm256_fmadd_ps(w, b1, acc[i][1]);
+		}
+	}
+
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+	{
+		_mm256_storeu_ps(d[i] + m, acc[i][0]);
+		_mm256_storeu_ps(d[i] + m + 8, acc[i][1]);
+	}
+}
+
+TARGET("avx512f")
+static inline void multiplyVectorAVX512(float* const* d, int m, const float* weights, int weightStride,
+										float* const* sources, int numSources, int n, int count)
+{
+	float x[MATRIX_MULTIPLY_WIDTH];
+
+	__m512 acc[MATRIX_MULTIPLY_ROWS];
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+		acc[i] = _mm512_loadu_ps(d[i] + m);
+
+	for (int j=0; j<numSources; j++)
+	{
+		__m512 b = _mm512_loadu_ps(sourceVector(sources, j, n, count, x));
+
+		for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+			acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(weights[i * weightStride + j]), b, acc[i]);
+	}
+
+	for (int i=0; i<MATRIX_MULTIPLY_ROWS; i++)
+		_mm512_storeu_ps(d[i] + m, acc[i]);
+}
+
+TARGET("sse2")
+static void matrixMultiplySSE(float* const* dest, const float* weights, int weightStride,
+							  float* const* sources, int numSources, int first, int numSamples)
+{
+	int n = first;
+	for (; n+MATRIX_MULTIPLY_WIDTH<=first+numSamples; n+=MATRIX_MULTIPLY_WIDTH)
+		multiplyVectorSSE(dest, n, weights, weightStride, sources, numSources, n, MATRIX_MULTIPLY_WIDTH);
+
+	if (n < first + numSamples)
+		multiplyTail(&multiplyVectorSSE, dest, weights, weightStride, sources, numSources, n, first + numSamples - n);
+}
+
+TARGET("avx2,fma")
+static void matrixMultiplyAVX2(float* const* dest, const float* weights, int weightStride,
+							   float* const* sources, int numSources, int first, int numSamples)
+{
+	int n = first;
+	for (; n+MATRIX_MULTIPLY_WIDTH<=first+numSamples; n+=MATRIX_MULTIPLY_WIDTH)
+		multiplyVectorAVX2(dest, n, weights, weightStride, sources, numSources, n, MATRIX_MULTIPLY_WIDTH);
+
+	if (n < first + numSamples)
+		multiplyTail(&multiplyVectorAVX2, dest, weights, weightStride, sources, numSources, n, first + numSamples - n);
+}
+
+TARGET("avx512f")
+static void matrixMultiplyAVX512(float* const* dest, const float* weights, int weightStride,
+								 float* const* sources, int numSources, int first, int numSamples)
+{
+	int n = first;
+	for (; n+MATRIX_MULTIPLY_WIDTH<=first+numSamples; n+=MATRIX_MULTIPLY_WIDTH)
+		multiplyVectorAVX512(dest, n, weights, weightStride, sources, numSources, n, MATRIX_MULTIPLY_WIDTH);
+
+	if (n < first + numSamples)
+		multiplyTail(&multiplyVectorAVX512, dest, weights, weightStride, sources, numSources, n, first + numSamples - n);
+}
+
+
+/* The sum is built by adding the samples (the accumulate kernels multiply
+   them by a gain of 1, which is exact), the rows as in initialX() and
+   accumulateVectorX() */
+template <int G, int V>
+TARGET("sse2")
+static inline void groupVectorsSSE(float* const* channels, const float* selfGains, const float* gains, int n)
+{
+	__m128 sum[4 * V];
+
+	UNROLL_GROUP
+	for (int i=0; i<4*V; i++)
+		sum[i] = _mm_setzero_ps();
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		const float* x = channels[k] + n;
+		UNROLL_GROUP
+		for (int i=0; i<4*V; i++)
+			sum[i] = _mm_add_ps(sum[i], _mm_loadu_ps(x + 4 * i));
+	}
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		__m128 a = _mm_set1_ps(selfGains[k]);
+		__m128 b = _mm_set1_ps(gains[k]);
+		float* x = channels[k] + n;
+
+		UNROLL_GROUP
+		for (int i=0; i<4*V; i++)
+			_mm_storeu_ps(x + 4 * i, _mm_add_ps(_mm_mul_ps(a, _mm_loadu_ps(x + 4 * i)), _mm_mul_ps(b, sum[i])));
+	}
+}
+
+template <int G, int V>
+TARGET("avx2,fma")
+static inline void groupVectorsAVX2(float* const* channels, const float* selfGains, const float* gains, int n)
+{
+	__m256 sum[2 * V];
+
+	UNROLL_GROUP
+	for (int i=0; i<2*V; i++)
+		sum[i] = _mm256_setzero_ps();
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		const float* x = channels[k] + n;
+		UNROLL_GROUP
+		for (int i=0; i<2*V; i++)
+			sum[i] = _mm256_add_ps(sum[i], _mm256_loadu_ps(x + 8 * i));
+	}
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		__m256 a = _mm256_set1_ps(selfGains[k]);
+		__m256 b = _mm256_set1_ps(gains[k]);
+		float* x = channels[k] + n;
+
+		UNROLL_GROUP
+		for (int i=0; i<2*V; i++)
+			_mm256_storeu_ps(x + 8 * i, _mm256_fmadd_ps(b, sum[i], _mm256_mul_ps(a, _mm256_loadu_ps(x + 8 * i))));
+	}
+}
+
+template <int G, int V>
+TARGET("avx512f")
+static inline void groupVectorsAVX512(float* const* channels, const float* selfGains, const float* gains, int n)
+{
+	__m512 sum[V];
+
+	UNROLL_GROUP
+	for (int i=0; i<V; i++)
+		sum[i] = _mm512_setzero_ps();
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		const float* x = channels[k] + n;
+		UNROLL_GROUP
+		for (int i=0; i<V; i++)
+			sum[i] = _mm512_add_ps(sum[i], _mm512_loadu_ps(x + 16 * i));
+	}
+
+	UNROLL_GROUP
+	for (int k=0; k<G; k++)
+	{
+		__m512 a = _mm512_set1_ps(selfGains[k]);
+		__m512 b = _mm512_set1_ps(gains[k]);
+		float* x = channels[k] + n;
+
+		UNROLL_GROUP
+		for (int i=0; i<V; i++)
+			_mm512_storeu_ps(x + 16 * i, _mm512_fmadd_ps(b, sum[i], _mm512_mul_ps(a, _mm512_loadu_ps(x + 16 * i))));
+	}
+}
+
+template <int G>
+TARGET("sse2")
+static void groupSSE(float* const* channels, const float* selfGains, const float* gains,
+					 int first, int numSamples)
+{
+	int end = first + numSamples;
+	int n = first;
+
+	for (; n+GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH)
+		groupVectorsSSE<G, GROUP_KERNEL_VECTORS>(channels, selfGains, gains, n);
+
+	for (; n+GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_WIDTH)
+		groupVectorsSSE<G, 1>(channels, selfGains, gains, n);
+
+	if (n < end)
+		groupTail<G>(&groupVectorsSSE<G, 1>, channels, selfGains, gains, n, end - n);
+}
+
+template <int G>
+TARGET("avx2,fma")
+static void groupAVX2(float* const* channels, const float* selfGains, const float* gains,
+					  int first, int numSamples)
+{
+	int end = first + numSamples;
+	int n = first;
+
+	for (; n+GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH)
+		groupVectorsAVX2<G, GROUP_KERNEL_VECTORS>(channels, selfGains, gains, n);
+
+	for (; n+GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_WIDTH)
+		groupVectorsAVX2<G, 1>(channels, selfGains, gains, n);
+
+	if (n < end)
+		groupTail<G>(&groupVectorsAVX2<G, 1>, channels, selfGains, gains, n, end - n);
+}
+
+template <int G>
+TARGET("avx512f")
+static void groupAVX512(float* const* channels, const float* selfGains, const float* gains,
+						int first, int numSamples)
+{
+	int end = first + numSamples;
+	int n = first;
+
+	for (; n+GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_VECTORS*GROUP_KERNEL_WIDTH)
+		groupVectorsAVX512<G, GROUP_KERNEL_VECTORS>(channels, selfGains, gains, n);
+
+	for (; n+GROUP_KERNEL_WIDTH<=end; n+=GROUP_KERNEL_WIDTH)
+		groupVectorsAVX512<G, 1>(channels, selfGains, gains, n);
+
+	if (n < end)
+		groupTail<G>(&groupVectorsAVX512<G, 1>, channels, selfGains, gains, n, end - n);
+}
+
+
+/* Sources may be the target itself (a channel referenced to itself), so
+   each vector is loaded from both before it is stored */
+TARGET("sse2")
+static void derivationSSE(float* const* channels, const int* targets, const int* sources,
+						  const float* gains, int numDerivations, int first, int numSamples)
+{
+	for (int d=0; d<numDerivations; d++)
+	{
+		float* y = channels[targets[d]] + first;
+		const float* x = channels[sources[d]] + first;
+		__m128 b = _mm_set1_ps(gains[d]);
+		int n = 0;
+
+		for (; n+4<=numSamples; n+=4)
+			_mm_storeu_ps(y + n, _mm_add_ps(_mm_loadu_ps(y + n), _mm_mul_ps(b, _mm_loadu_ps(x + n))));
+
+		/* The same instructions on single lanes */
+		for (; n<numSamples; n++)
+			_mm_store_ss(y + n, _mm_add_ss(_mm_load_ss(y + n), _mm_mul_ss(b, _mm_load_ss(x + n))));
+	}
+}
+
+TARGET("avx2,fma")
+static void derivationAVX2(float* const* channels, const int* targets, const int* sources,
+						   const float* gains, int numDerivations, int first, int numSamples)
+{
+	for (int d=0; d<numDerivations; d++)
+	{
+		float* y = channels[targets[d]] + first;
+		const float* x = channels[sources[d]] + first;
+		__m256 b = _mm256_set1_ps(gains[d]);
+		int n = 0;
+
+		for (; n+8<=numSamples; n+=8)
+			_mm256_storeu_ps(y + n, _mm256_fmadd_ps(b, _mm256_loadu_ps(x + n), _mm256_loadu_ps(y + n)));
+
+		if (n < numSamples)
+		{
+			__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(numSamples - n),
+											  _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+			_mm256_maskstore_ps(y + n, mask, _mm256_fmadd_ps(b, _mm256_maskload_ps(x + n, mask),
+															 _mm256_maskload_ps(y + n, mask)));
+		}
+	}
+}
+
+TARGET("avx512f")
+static void derivationAVX512(float* const* channels, const int* targets, const int* sources,
+							 const float* gains, int numDerivations, int first, int numSamples)
+{
+	for (int d=0; d<numDerivations; d++)
+	{
+		float* y = channels[targets[d]] + first;
+		const float* x = channels[sources[d]] + first;
+		__m512 b = _mm512_set1_ps(gains[d]);
+		int n = 0;
+
+		for (; n+16<=numSamples; n+=16)
+			_mm512_storeu_ps(y + n, _mm512_fmadd_ps(b, _mm512_loadu_ps(x + n), _mm512_loadu_ps(y + n)));
+
+		if (n < numSamples)
+		{
+			__mmask16 mask = (__mmask16) ((1u << (numSamples - n)) - 1);
+			_mm512_mask_storeu_ps(y + n, mask, _mm512_fmadd_ps(b, _mm512_maskz_loadu_ps(mask, x + n),
+															  _mm512_maskz_loadu_ps(mask, y + n)));
+		}
+	}
+}
+
+
+/* Four channels as the low and high pairs of two vectors, with the same
+   operations as biquadScalar() */
+TARGET("sse2")
+static inline void biquadSectionsSSE(__m128d& lo, __m128d& hi, __m128d (*s1)[2], __m128d (*s2)[2],
+									 const double* sections, int numSections)
+{
+	for (int s=0; s<numSections; s++)
+	{
+		const double* c = sections + 5 * s;
+		__m128d b0 = _mm_set1_pd(c[0]);
+		__m128d b1 = _mm_set1_pd(c[1]);
+		__m128d b2 = _mm_set1_pd(c[2]);
+		__m128d a1 = _mm_set1_pd(c[3]);
+		__m128d a2 = _mm_set1_pd(c[4]);
+
+		__m128d y = _mm_add_pd(_mm_mul_pd(b0, lo), s1[s][0]);
+		s1[s][0] = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, lo), _mm_mul_pd(a1, y)), s2[s][0]);
+		s2[s][0] = _mm_sub_pd(_mm_mul_pd(b2, lo), _mm_mul_pd(a2, y));
+		lo = y;
+
+		y = _mm_add_pd(_mm_mul_pd(b0, hi), s1[s][1]);
+		s1[s][1] = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, hi), _mm_mul_pd(a1, y)), s2[s][1]);
+		s2[s][1] = _mm_sub_pd(_mm_mul_pd(b2, hi), _mm_mul_pd(a2, y));
+		hi = y;
+	}
+}
+
+TARGET("sse2")
+static void biquadSSE(float* const* channels, double* state, int stateStride,
+					  const double* sections, int numSections, int numChannels, int numSamples)
+{
+	int c = 0;
+
+	for (; c+4<=numChannels; c+=4)
+	{
+		float* x0 = channels[c];
+		float* x1 = channels[c + 1];
+		float* x2 = channels[c + 2];
+		float* x3 = channels[c + 3];
+		double* st = state + c * stateStride;
+
+		__m128d s1[MAX_BIQUAD_SECTIONS][2];
+		__m128d s2[MAX_BIQUAD_SECTIONS][2];
+		for (int s=0; s<numSections; s++)
+		{
+			s1[s][0] = _mm_setr_pd(st[2 * s], st[stateStride + 2 * s]);
+			s1[s][1] = _mm_setr_pd(st[2 * stateStride + 2 * s], st[3 * stateStride + 2 * s]);
+			s2[s][0] = _mm_setr_pd(st[2 * s + 1], st[stateStride + 2 * s + 1]);
+			s2[s][1] = _mm_setr_pd(st[2 * stateStride + 2 * s + 1], st[3 * stateStride + 2 * s + 1]);
+		}
+
+		/* Four samples of the four channels are transposed at a time */
+		int n = 0;
+		for (; n+4<=numSamples; n+=4)
+		{
+			__m128 r0 = _mm_loadu_ps(x0 + n);
+			__m128 r1 = _mm_loadu_ps(x1 + n);
+			__m128 r2 = _mm_loadu_ps(x2 + n);
+			__m128 r3 = _mm_loadu_ps(x3 + n);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+			__m128 rows[4] = {r0, r1, r2, r3};
+			for (int k=0; k<4; k++)
+			{
+				__m128d lo = _mm_cvtps_pd(rows[k]);
+				__m128d hi = _mm_cvtps_pd(_mm_movehl_ps(rows[k], rows[k]));
+				biquadSectionsSSE(lo, hi, s1, s2, sections, numSections);
+				rows[k] = _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+			}
+
+			_MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+			_mm_storeu_ps(x0 + n, rows[0]);
+			_mm_storeu_ps(x1 + n, rows[1]);
+			_mm_storeu_ps(x2 + n, rows[2]);
+			_mm_storeu_ps(x3 + n, rows[3]);
+		}
+
+		for (; n<numSamples; n++)
+		{
+			__m128d lo = _mm_setr_pd(x0[n], x1[n]);
+			__m128d hi = _mm_setr_pd(x2[n], x3[n]);
+			biquadSectionsSSE(lo, hi, s1, s2, sections, numSections);
+
+			double y[4];
+			_mm_storeu_pd(y, lo);
+			_mm_storeu_pd(y + 2, hi);
+			x0[n] = (float) y[0];
+			x1[n] = (float) y[1];
+			x2[n] = (float) y[2];
+			x3[n] = (float) y[3];
+		}
+
+		for (int s=0; s<numSections; s++)
+		{
+			double v[8];
+			_mm_storeu_pd(v, s1[s][0]);
+			_mm_storeu_pd(v + 2, s1[s][1]);
+			_mm_storeu_pd(v + 4, s2[s][0]);
+			_mm_storeu_pd(v + 6, s2[s][1]);
+			for (int l=0; l<4; l++)
+			{
+				st[l * stateStride + 2 * s] = v[l];
+				st[l * stateStride + 2 * s + 1] = v[4 + l];
+			}
+		}
+	}
+
+	biquadScalar(channels + c, state + c * stateStride, stateStride,
+				 sections, numSections, numChannels - c, numSamples);
+}
+
+TARGET("avx2,fma")
+static inline __m256d biquadSectionsAVX2(__m256d v, __m256d* s1, __m256d* s2,
+										 const double* sections, int numSections)
+{
+	for (int s=0; s<numSections; s++)
+	{
+		const double* c = sections + 5 * s;
+		__m256d y = _mm256_fmadd_pd(_mm256_broadcast_sd(c), v, s1[s]);
+		s1[s] = _mm256_fnmadd_pd(_mm256_broadcast_sd(c + 3), y,
+								 _mm256_fmadd_pd(_mm256_broadcast_sd(c + 1), v, s2[s]));
+		s2[s] = _mm256_fnmadd_pd(_mm256_broadcast_sd(c + 4), y,
+								 _mm256_mul_pd(_mm256_broadcast_sd(c + 2), v));
+		v = y;
+	}
+	return v;
+}
+
+/* Remaining channels go through the same vectors with unused lanes, so
+   that every channel is filtered by the same operations */
+TARGET("avx2,fma")
+static void biquadAVX2(float* const* channels, double* state, int stateStride,
+					   const double* sections, int numSections, int numChannels, int numSamples)
+{
+	for (int c=0; c<numChannels; c+=4)
+	{
+		int lanes = MIN(4, numChannels - c);
+		double* st = state + c * stateStride;
+
+		__m256d s1[MAX_BIQUAD_SECTIONS];
+		__m256d s2[MAX_BIQUAD_SECTIONS];
+		for (int s=0; s<numSections; s++)
+		{
+			double v1[4] = {0, 0, 0, 0};
+			double v2[4] = {0, 0, 0, 0};
+			for (int l=0; l<lanes; l++)
+			{
+				v1[l] = st[l * stateStride + 2 * s];
+				v2[l] = st[l * stateStride + 2 * s + 1];
+			}
+			s1[s] = _mm256_loadu_pd(v1);
+			s2[s] = _mm256_loadu_pd(v2);
+		}
+
+		int n = 0;
+
+		if (lanes == 4)
+		{
+			float* x0 = channels[c];
+			float* x1 = channels[c + 1];
+			float* x2 = channels[c + 2];
+			float* x3 = channels[c + 3];
+
+			/* Four samples of the four channels are transposed at a time */
+			for (; n+4<=numSamples; n+=4)
+			{
+				__m128 r0 = _mm_loadu_ps(x0 + n);
+				__m128 r1 = _mm_loadu_ps(x1 + n);
+				__m128 r2 = _mm_loadu_ps(x2 + n);
+				__m128 r3 = _mm_loadu_ps(x3 + n);
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+				r0 = _mm256_cvtpd_ps(biquadSectionsAVX2(_mm256_cvtps_pd(r0), s1, s2, sections, numSections));
+				r1 = _mm256_cvtpd_ps(biquadSectionsAVX2(_mm256_cvtps_pd(r1), s1, s2, sections, numSections));
+				r2 = _mm256_cvtpd_ps(biquadSectionsAVX2(_mm256_cvtps_pd(r2), s1, s2, sections, numSections));
+				r3 = _mm256_cvtpd_ps(biquadSectionsAVX2(_mm256_cvtps_pd(r3), s1, s2, sections, numSections));
+
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				_mm_storeu_ps(x0 + n, r0);
+				_mm_storeu_ps(x1 + n, r1);
+				_mm_storeu_ps(x2 + n, r2);
+				_mm_storeu_ps(x3 + n, r3);
+			}
+		}
+
+		for (; n<numSamples; n++)
+		{
+			float x[4] = {0, 0, 0, 0};
+			for (int l=0; l<lanes; l++)
+				x[l] = channels[c + l][n];
+
+			__m128 y = _mm256_cvtpd_ps(biquadSectionsAVX2(_mm256_cvtps_pd(_mm_loadu_ps(x)),
+														  s1, s2, sections, numSections));
+			_mm_storeu_ps(x, y);
+
+			for (int l=0; l<lanes; l++)
+				channels[c + l][n] = x[l];
+		}
+
+		for (int s=0; s<numSections; s++)
+		{
+			double v1[4];
+			double v2[4];
+			_mm256_storeu_pd(v1, s1[s]);
+			_mm256_storeu_pd(v2, s2[s]);
+			for (int l=0; l<lanes; l++)
+			{
+				st[l * stateStride + 2 * s] = v1[l];
+				st[l * stateStride + 2 * s + 1] = v2[l];
+			}
+		}
+	}
+}
+
+
+#if defined(_MSC_VER)
+static bool cpuHasFeatures(bool avx512)
+{
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave)
+		return false;
+
+	unsigned long long xcr0 = _xgetbv(0);
+
+	__cpuidex(info, 7, 0);
+	if (avx512)
+		return (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+	else
+		return fma && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+}
+#endif
+
+#endif  // REFERENCE_KERNELS_X86
+
+
+bool ReferenceKernels::isSupported(Type type)
+{
+	switch (type)
+	{
+	case SCALAR:
+		return true;
+#if defined(REFERENCE_KERNELS_X86) && defined(_MSC_VER)
+	case SSE:
+		return true;
+	case AVX2:
+		return cpuHasFeatures(false);
+	case AVX512:
+		return cpuHasFeatures(true);
+#elif defined(REFERENCE_KERNELS_X86)
+	case SSE:
+		return __builtin_cpu_supports("sse2") != 0;
+	case AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case AVX512:
+		return __builtin_cpu_supports("avx512f") != 0;
+#endif
+	default:
+		return false;
+	}
+}
+
+ReferenceKernels::Type ReferenceKernels::getBestType()
+{
+	for (int type=NUM_TYPES-1; type>SCALAR; type--)
+	{
+		if (isSupported((Type) type))
+		{
+			return (Type) type;
+		}
+	}
+
+	return SCALAR;
+}
+
+ReferenceKernels::Type ReferenceKernels::getType()
+{
+	/* Resolved once, by whichever thread asks first */
+	static const Type type = getBestType();
+	return type;
+}
+
+const char* ReferenceKernels::getName(Type type)
+{
+	switch (type)
+	{
+	case SCALAR:
+		return "scalar";
+	case SSE:
+		return "sse";
+	case AVX2:
+		return "avx2";
+	case AVX512:
+		return "avx512";
+	default:
+		return "unknown";
+	}
+}
+
+AccumulateKernel ReferenceKernels::getAccumulate()
+{
+	return getAccumulate(getType());
+}
+
+AccumulateKernel ReferenceKernels::getAccumulate(Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case SSE:
+		return &accumulateSSE;
+	case AVX2:
+		return &accumulateAVX2;
+	case AVX512:
+		return &accumulateAVX512;
+#endif
+	default:
+		return &accumulateScalar;
+	}
+}
+
+CompareExchangeKernel ReferenceKernels::getCompareExchange()
+{
+	return getCompareExchange(getType());
+}
+
+CompareExchangeKernel ReferenceKernels::getCompareExchange(Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case SSE:
+		return &compareExchangeSSE;
+	case AVX2:
+		return &compareExchangeAVX2;
+	case AVX512:
+		return &compareExchangeAVX512;
+#endif
+	default:
+		return &compareExchangeScalar;
+	}
+}
+
+RankUpdateKernel ReferenceKernels::getRankUpdate()
+{
+	return getRankUpdate(getType());
+}
+
+RankUpdateKernel ReferenceKernels::getRankUpdate(Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case SSE:
+		return &rankUpdateSSE;
+	case AVX2:
+		return &rankUpdateAVX2;
+	case AVX512:
+		return &rankUpdateAVX512;
+#endif
+	default:
+		return &rankUpdateScalar;
+	}
+}
+
+MatrixMultiplyKernel ReferenceKernels::getMatrixMultiply()
+{
+	return getMatrixMultiply(getType());
+}
+
+MatrixMultiplyKernel ReferenceKernels::getMatrixMultiply(Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case SSE:
+		return &matrixMultiplySSE;
+	case AVX2:
+		return &matrixMultiplyAVX2;
+	case AVX512:
+		return &matrixMultiplyAVX512;
+#endif
+	default:
+		return &matrixMultiplyScalar;
+	}
+}
+
+DerivationKernel ReferenceKernels::getDerivation()
+{
+	return getDerivation(getType());
+}
+
+DerivationKernel ReferenceKernels::getDerivation(Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case SSE:
+		return &derivationSSE;
+	case AVX2:
+		return &derivationAVX2;
+	case AVX512:
+		return &derivationAVX512;
+#endif
+	default:
+		return &derivationScalar;
+	}
+}
+
+BiquadKernel ReferenceKernels::getBiquad()
+{
+	return getBiquad(getType());
+}
+
+BiquadKernel ReferenceKernels::getBiquad(Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case SSE:
+		return &biquadSSE;
+	case AVX2:
+	case AVX512:
+		return &biquadAVX2;
+#endif
+	default:
+		return &biquadScalar;
+	}
+}
+
+
+template <int G>
+static GroupKernel getGroupKernelOfSize(ReferenceKernels::Type type)
+{
+	switch (type)
+	{
+#ifdef REFERENCE_KERNELS_X86
+	case ReferenceKernels::SSE:
+		return &groupSSE<G>;
+	case ReferenceKernels::AVX2:
+		return &groupAVX2<G>;
+	case ReferenceKernels::AVX512:
+		return &groupAVX512<G>;
+#endif
+	default:
+		return &groupScalar<G>;
+	}
+}
+
+GroupKernel ReferenceKernels::getGroupKernel(int groupSize)
+{
+	return getGroupKernel(getType(), groupSize);
+}
+
+GroupKernel ReferenceKernels::getGroupKernel(Type type, int groupSize)
+{
+	switch (groupSize)
+	{
+	case 4:
+		return getGroupKernelOfSize<4>(type);
+	case 16:
+		return getGroupKernelOfSize<16>(type);
+	case 32:
+		return getGroupKernelOfSize<32>(type);
+	case 64:
+		return getGroupKernelOfSize<64>(type);
+	case 128:
+		return getGroupKernelOfSize<128>(type);
+	case 384:
+		return getGroupKernelOfSize<384>(type);
+	default:
+		return nullptr;
+	}
+}
+
+bool ReferenceKernels::hasGroupKernel(int groupSize)
+{
+	return getGroupKernel(SCALAR, groupSize) != nullptr;
+}
@@ -0,0 +1,261 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEKERNELS_H__
+#define __REFERENCEKERNELS_H__
+
+
+/**
+
+  Weighted-accumulate kernel
+
+    dest[n] = destGain * dest[n] + sum_k gains[k] * sources[sourceIndex[k]][n]
+
+  for k = 0..numSources-1. If destGain is 0, dest is overwritten without
+  being read. All sources are accumulated in a single pass over dest (the
+  sources are processed in small chunks while a tile of dest stays in L1).
+
+*/
+
+typedef void (*AccumulateKernel)(float* dest, float destGain,
+								 float* const* sources, const int* sourceIndex,
+								 const float* gains, int numSources, int numSamples);
+
+
+/* Samples per slot of a compare-exchange tile */
+#define NETWORK_TILE_WIDTH 16
+
+/**
+
+  Compare-exchange kernel
+
+  Applies a comparator network to a transposed (sample-major) tile: slot s
+  holds NETWORK_TILE_WIDTH consecutive samples of one channel at
+  tile + s * NETWORK_TILE_WIDTH, and each comparator (pairs[2p], pairs[2p+1])
+  leaves the minimum in the first and the maximum in the second slot, for
+  all samples of the tile at once.
+
+*/
+
+typedef void (*CompareExchangeKernel)(float* tile, const int* pairs, int numPairs);
+
+
+/* Block of C that the rank-k update kernel keeps in registers */
+#define RANK_UPDATE_ROWS 4
+#define RANK_UPDATE_COLUMNS 16
+
+/**
+
+  Rank-k update kernel
+
+    c[i * stride + j] += sum_t x[t * stride + i] * x[t * stride + j]
+
+  for the RANK_UPDATE_ROWS x RANK_UPDATE_COLUMNS block of c that starts at
+  (row, column), and t = 0..numSamples-1. x is sample-major (one row of
+  stride values per sample), so each sample is an outer product that is
+  added with broadcasts and fused multiply-adds, without reductions.
+
+*/
+
+typedef void (*RankUpdateKernel)(float* c, const float* x, int stride,
+								 int row, int column, int numSamples);
+
+
+/* Rows of dest that the matrix multiply kernel keeps in registers */
+#define MATRIX_MULTIPLY_ROWS 4
+
+/**
+
+  Matrix multiply kernel
+
+    dest[i][first + n] += sum_j weights[i * weightStride + j] * sources[j][first + n]
+
+  for i = 0..MATRIX_MULTIPLY_ROWS-1, j = 0..numSources-1 and
+  n = 0..numSamples-1. Sources and dest are channel buffers (one array of
+  samples per channel), so a vector of 16 samples of each dest row stays in
+  registers while the sources are streamed past it with broadcast weights.
+
+*/
+
+typedef void (*MatrixMultiplyKernel)(float* const* dest, const float* weights, int weightStride,
+									 float* const* sources, int numSources,
+									 int first, int numSamples);
+
+
+/* Vectors of 16 samples per pass of the group kernels; long enough runs
+   of each channel for the prefetchers, short enough that the sum stays in
+   registers (with AVX-512) */
+#define GROUP_KERNEL_VECTORS 8
+
+/**
+
+  Group kernel
+
+    sum[n] = sum_k channels[k][n]
+    channels[k][n] = selfGains[k] * channels[k][n] + gains[k] * sum[n]
+
+  for k = 0..G-1 and n = first..first+numSamples-1, where the group size G
+  is a template parameter. This is one group of a block-structured plan
+  (a tetrode, or all channels for a common average reference) in a single
+  pass: the loops over the group have fixed bounds and are unrolled, and
+  the channels are addressed directly instead of through an index table.
+  The sum of GROUP_KERNEL_VECTORS vectors of samples is built and applied
+  before moving on, so the second read of each channel hits the cache.
+
+  The operations are the same, in the same order, as those of the sum and
+  the rows in the weighted-accumulate kernel of the same type, so both
+  give the same result for every sample.
+
+*/
+
+typedef void (*GroupKernel)(float* const* channels, const float* selfGains, const float* gains,
+							int first, int numSamples);
+
+
+/**
+
+  Derivation kernel
+
+    channels[targets[d]][n] += gains[d] * channels[sources[d]][n]
+
+  for d = 0..numDerivations-1, in this order, and n = first..
+  first+numSamples-1. Each derivation is a single fused pass over its
+  target (one subtraction of a scaled reference channel for bipolar and
+  other single-reference montages). A derivation reads its source after
+  all earlier derivations, so sources that are modified by later
+  derivations are read unmodified. The result is the same as that of the
+  weighted-accumulate kernel of the same type for one source and a
+  destGain of 1.
+
+*/
+
+typedef void (*DerivationKernel)(float* const* channels, const int* targets, const int* sources,
+								 const float* gains, int numDerivations, int first, int numSamples);
+
+
+/* Channels that the biquad kernel filters together, one per lane */
+#define BIQUAD_LANES 4
+
+/* Sections of a cascade, whose state the biquad kernel keeps in registers */
+#define MAX_BIQUAD_SECTIONS 8
+
+/**
+
+  Biquad kernel
+
+    y = b0 * x + s1
+    s1 = b1 * x - a1 * y + s2
+    s2 = b2 * x - a2 * y
+
+  a cascade of numSections biquad sections (transposed direct form II) over
+  channels[c][0..numSamples-1] for c = 0..numChannels-1, in place. Section
+  s has the coefficients b0, b1, b2, a1, a2 at sections[5 * s], and its
+  state s1, s2 of channel c is at state[c * stateStride + 2 * s]. The
+  arithmetic is in double precision.
+
+  A recursion cannot be vectorized over samples, so BIQUAD_LANES channels
+  are transposed into the lanes of the vectors and filtered together. Each
+  sample passes through all sections before the next one, which lets the
+  sections of consecutive samples overlap.
+
+*/
+
+typedef void (*BiquadKernel)(float* const* channels, double* state, int stateStride,
+							 const double* sections, int numSections, int numChannels, int numSamples);
+
+
+/**
+
+  Reference kernels
+
+  Hand-vectorized implementations of the weighted-accumulate, the
+  compare-exchange, the rank-k update, the matrix multiply, the
+  derivation and the biquad kernels, and of the group kernels for the
+  group sizes of common probes. The widest instruction set supported by the CPU is
+  selected at runtime, so the same plugin binary can be used on all
+  machines.
+
+  Within one kernel type, the result for a sample does not depend on the
+  block size or on the position of the sample in the block (tails are
+  processed as masked/padded vectors).
+
+  @see ReferencePlan
+
+*/
+
+class ReferenceKernels
+{
+public:
+
+	enum Type
+	{
+		SCALAR = 0,
+		SSE,
+		AVX2,
+		AVX512,
+		NUM_TYPES
+	};
+
+	/** Widest kernel supported by this CPU. */
+	static Type getBestType();
+
+	/** Kernel used by getAccumulate() and the other getters without a
+	    type: getBestType(), detected on the first call. */
+	static Type getType();
+
+	static bool isSupported(Type type);
+	static const char* getName(Type type);
+
+	static AccumulateKernel getAccumulate();
+	static AccumulateKernel getAccumulate(Type type);
+
+	static CompareExchangeKernel getCompareExchange();
+	static CompareExchangeKernel getCompareExchange(Type type);
+
+	static RankUpdateKernel getRankUpdate();
+	static RankUpdateKernel getRankUpdate(Type type);
+
+	static MatrixMultiplyKernel getMatrixMultiply();
+	static MatrixMultiplyKernel getMatrixMultiply(Type type);
+
+	static DerivationKernel getDerivation();
+	static DerivationKernel getDerivation(Type type);
+
+	/** AVX-512 uses the AVX2 kernel; the state of eight lanes would not
+	    fit into the registers. */
+	static BiquadKernel getBiquad();
+	static BiquadKernel getBiquad(Type type);
+
+	/** Group kernel for groups of the given size, or nullptr if that size
+	    is not specialized (see hasGroupKernel()). */
+	static GroupKernel getGroupKernel(int groupSize);
+	static GroupKernel getGroupKernel(Type type, int groupSize);
+
+	/** True for the specialized group sizes: 4 (tetrodes) and 16, 32, 64,
+	    128 and 384 channels. */
+	static bool hasGroupKernel(int groupSize);
+
+};
+
+
+#endif  //__REFERENCEKERNELS_H__
@@ -0,0 +1,245 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+#include "ReferenceLeastSquaresFit.h"
+
+#include <cmath>
+#include <cstring>
+
+ReferenceLeastSquaresFit::ReferenceLeastSquaresFit() : nChannels(0), nSamples(0), modificationCount(0), done(false)
+{
+}
+
+ReferenceLeastSquaresFit::~ReferenceLeastSquaresFit()
+{
+	if (worker.joinable())
+		worker.join();
+}
+
+bool ReferenceLeastSquaresFit::start(ReferenceMatrix* refMat, const float* const* samples,
+									 int numChannels, int numSamples)
+{
+	if (worker.joinable() || numChannels != refMat->getNumberOfChannels() || numSamples <= 0)
+		return false;
+
+	rows.resize(numChannels);
+	for (int i=0; i<numChannels; i++)
+	{
+		Row& row = rows[i];
+		refMat->getReferences(i, row.refs);
+		row.weights.resize(row.refs.size());
+		for (int k=0; k<(int) row.refs.size(); k++)
+		{
+			row.weights[k] = refMat->getValue(i, row.refs[k]);
+		}
+		row.selfReferenced = refMat->getValue(i, i) > 0;
+	}
+
+	modificationCount = refMat->getModificationCount();
+
+	nChannels = numChannels;
+	nSamples = numSamples;
+	data.resize((size_t) nChannels * nSamples);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		std::memcpy(&data[(size_t) i * nSamples], samples[i], nSamples * sizeof(float));
+	}
+
+	done = false;
+	worker = std::thread(&ReferenceLeastSquaresFit::run, this);
+
+	return true;
+}
+
+bool ReferenceLeastSquaresFit::isRunning()
+{
+	return worker.joinable();
+}
+
+bool ReferenceLeastSquaresFit::isDone()
+{
+	return done.load();
+}
+
+int ReferenceLeastSquaresFit::getModificationCount()
+{
+	return modificationCount;
+}
+
+bool ReferenceLeastSquaresFit::finish(ReferenceMatrix::FittedGains& gains)
+{
+	if (!worker.joinable())
+		return false;
+
+	worker.join();
+	gains.swap(result);
+
+	/* The copies are only needed by the fit */
+	std::vector<float>().swap(data);
+	std::vector<Row>().swap(rows);
+
+	return true;
+}
+
+void ReferenceLeastSquaresFit::run()
+{
+	std::vector<const float*> samples(nChannels);
+	for (int i=0; i<nChannels; i++)
+	{
+		samples[i] = &data[(size_t) i * nSamples];
+	}
+
+	fit(rows, samples.data(), nSamples, result);
+	done = true;
+}
+
+/* Solve the symmetric positive definite system A x = b in place (b becomes
+   x) using the Cholesky decomposition; false if A is singular */
+static bool solveCholesky(std::vector<double>& A, std::vector<double>& b, int n)
+{
+	for (int j=0; j<n; j++)
+	{
+		double d = A[j*n + j];
+		for (int k=0; k<j; k++)
+			d -= A[j*n + k] * A[j*n + k];
+
+		if (d <= 0)
+			return false;
+
+		A[j*n + j] = std::sqrt(d);
+
+		for (int i=j+1; i<n; i++)
+		{
+			double v = A[i*n + j];
+			for (int k=0; k<j; k++)
+				v -= A[i*n + k] * A[j*n + k];
+			A[i*n + j] = v / A[j*n + j];
+		}
+	}
+
+	for (int i=0; i<n; i++)
+	{
+		for (int k=0; k<i; k++)
+			b[i] -= A[i*n + k] * b[k];
+		b[i] /= A[i*n + i];
+	}
+
+	for (int i=n-1; i>=0; i--)
+	{
+		for (int k=i+1; k<n; k++)
+			b[i] -= A[k*n + i] * b[k];
+		b[i] /= A[i*n + i];
+	}
+
+	return true;
+}
+
+static double dot(const float* a, const float* b, int n)
+{
+	double sum = 0;
+	for (int t=0; t<n; t++)
+		sum += (double) a[t] * b[t];
+	return sum;
+}
+
+void ReferenceLeastSquaresFit::fit(const std::vector<Row>& rows, const float* const* samples, int numSamples,
+								   ReferenceMatrix::FittedGains& gains)
+{
+	int numChannels = (int) rows.size();
+	std::vector<float> average(numSamples);
+
+	gains.assign(numChannels, std::vector<float>());
+
+	for (int i=0; i<numChannels; i++)
+	{
+		const std::vector<int>& refs = rows[i].refs;
+		const std::vector<float>& weights = rows[i].weights;
+		std::vector<float>& fit = gains[i];
+
+		int m = (int) refs.size();
+		if (m == 0)
+		{
+			continue;
+		}
+
+		double weightSum = 0;
+		for (int k=0; k<m; k++)
+		{
+			weightSum += weights[k];
+		}
+
+		/* One gain per reference: normal equations of min |x_i - sum a_j x_j|^2,
+		   with a small ridge term against nearly collinear references */
+		if (m <= LS_MAX_REFERENCES && !rows[i].selfReferenced)
+		{
+			std::vector<double> A(m * m), b(m);
+			double trace = 0;
+
+			for (int k=0; k<m; k++)
+			{
+				b[k] = dot(samples[refs[k]], samples[i], numSamples);
+				for (int l=0; l<=k; l++)
+				{
+					A[k*m + l] = A[l*m + k] = dot(samples[refs[k]], samples[refs[l]], numSamples);
+				}
+				trace += A[k*m + k];
+			}
+
+			for (int k=0; k<m; k++)
+			{
+				A[k*m + k] += 1e-9 * trace / m;
+			}
+
+			if (trace > 0 && solveCholesky(A, b, m))
+			{
+				fit.resize(m);
+				for (int k=0; k<m; k++)
+				{
+					fit[k] = (float) b[k];
+				}
+				continue;
+			}
+		}
+
+		/* Otherwise scale the weighted average by the best-fitting factor */
+		std::fill(average.begin(), average.end(), 0.0f);
+		for (int k=0; k<m; k++)
+		{
+			float w = (float) (weights[k] / weightSum);
+			const float* x = samples[refs[k]];
+			for (int t=0; t<numSamples; t++)
+				average[t] += w * x[t];
+		}
+
+		double power = dot(average.data(), average.data(), numSamples);
+		double scale = power > 0 ? dot(samples[i], average.data(), numSamples) / power : 1.0;
+
+		fit.resize(m);
+		for (int k=0; k<m; k++)
+		{
+			fit[k] = (float) (scale * weights[k] / weightSum);
+		}
+	}
+}
@@ -0,0 +1,114 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCELEASTSQUARESFIT_H__
+#define __REFERENCELEASTSQUARESFIT_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ReferenceMatrix.h"
+
+/* Rows with up to this many references get one fitted gain per reference,
+   larger rows a single fitted scale of their weighted average */
+#define LS_MAX_REFERENCES 16
+
+
+/**
+
+  Reference least-squares fit
+
+  Fits the gains of the references of each row of a matrix (see
+  ReferenceMatrix::LEAST_SQUARES), i.e. the gains that minimize the power
+  of each referenced channel. A row of at most LS_MAX_REFERENCES
+  references that does not contain its own channel gets one gain per
+  reference from the normal equations; other rows keep their weights, with
+  a single fitted scale of their weighted average.
+
+  start() copies the references and weights of every row and the data on
+  the calling thread and fits on a thread of its own, so neither the
+  matrix nor the data have to stay unchanged while the fit runs. The
+  gains are only valid for the matrix as it was at start(); the matrix
+  modification count at that point is kept to check that.
+
+  @see ReferenceMatrix, ReferenceGainFit, ChannelRefNode
+
+*/
+
+class ReferenceLeastSquaresFit
+{
+public:
+
+	ReferenceLeastSquaresFit();
+	~ReferenceLeastSquaresFit();
+
+	/** Start fitting the gains of the matrix to the given samples
+	    (numChannels x numSamples). Returns false if a fit is still running
+	    or the channels do not match the matrix. */
+	bool start(ReferenceMatrix* refMat, const float* const* samples, int numChannels, int numSamples);
+
+	/** True from start() until finish(). */
+	bool isRunning();
+
+	/** True once the gains of the running fit are ready. */
+	bool isDone();
+
+	/** Modification count of the matrix when the running fit was started. */
+	int getModificationCount();
+
+	/** Wait for the running fit and take its gains (see
+	    ReferenceMatrix::setFittedGains()). Returns false if no fit was
+	    started. */
+	bool finish(ReferenceMatrix::FittedGains& gains);
+
+	/** References and weights of one row of the matrix. */
+	struct Row
+	{
+		std::vector<int> refs;
+		std::vector<float> weights;
+		bool selfReferenced;
+	};
+
+	/** The fit itself, on the calling thread. */
+	static void fit(const std::vector<Row>& rows, const float* const* samples, int numSamples,
+					ReferenceMatrix::FittedGains& gains);
+
+private:
+
+	void run();
+
+	std::vector<Row> rows;
+	std::vector<float> data;
+	int nChannels;
+	int nSamples;
+	int modificationCount;
+
+	ReferenceMatrix::FittedGains result;
+	std::thread worker;
+	std::atomic<bool> done;
+
+};
+
+
+#endif  //__REFERENCELEASTSQUARESFIT_H__
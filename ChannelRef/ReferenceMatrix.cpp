@@ -0,0 +1,971 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "ReferenceMatrix.h"
+
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+
+static const char* const presetNames[] =
+{
+	"Other tetrode electrodes",
+	"All tetrode electrodes",
+	"Common average reference",
+	"Avg of other tetrodes",
+	"Avg of next tetrode",
+	"Bipolar chain"
+};
+
+#define NUM_PRESETS (int) (sizeof(presetNames) / sizeof(presetNames[0]))
+
+
+/* Entries that can be stored in the bitset alone */
+static inline bool isBinaryValue(float value)
+{
+	return value == 0.0f || value == 1.0f;
+}
+
+static inline int popcount64(uint64_t word)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (int) __popcnt64(word);
+#elif defined(_MSC_VER)
+	return (int) (__popcnt((unsigned int) word) + __popcnt((unsigned int) (word >> 32)));
+#else
+	return __builtin_popcountll(word);
+#endif
+}
+
+static inline int countTrailingZeros64(uint64_t word)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return (int) index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long) word))
+		return (int) index;
+	_BitScanForward(&index, (unsigned long) (word >> 32));
+	return (int) index + 32;
+#else
+	return __builtin_ctzll(word);
+#endif
+}
+
+
+ReferenceMatrix::ReferenceMatrix(int nChan)
+{
+	nChannels = nChan;
+	nChannelsBefore = -1;
+	wordsPerRow = 0;
+	bits = nullptr;
+	values = nullptr;
+	numWeighted = 0;
+	modificationCount = 0;
+	changeLog.reserve(MAX_LOGGED_CHANGES);
+	allChanged = true;
+	appliedPresetChannels = 0;
+	normalization = SUM_TO_ONE;
+	referenceType = AVERAGE_REFERENCE;
+	trimFraction = DEFAULT_TRIM_FRACTION;
+	update();
+}
+
+ReferenceMatrix::~ReferenceMatrix()
+{
+	delete[] bits;
+	delete[] values;
+}
+
+void ReferenceMatrix::setNumberOfChannels(int n)
+{
+	nChannels = n;
+	update();
+}
+
+int ReferenceMatrix::getNumberOfChannels()
+{
+	return nChannels;
+}
+
+void ReferenceMatrix::update()
+{
+	if (nChannels != nChannelsBefore)
+	{
+		delete[] bits;
+		delete[] values;
+
+		wordsPerRow = (nChannels + 63) / 64;
+		bits = new uint64_t[nChannels * wordsPerRow];
+		for (int w=0; w<nChannels * wordsPerRow; w++)
+			bits[w] = 0;
+
+		values = nullptr;
+		numWeighted = 0;
+		fittedGains.clear();
+
+		channelGains.resize(nChannels, 1.0f);
+
+		nChannelsBefore = nChannels;
+		modificationCount++;
+		logAllChanged();
+	}
+}
+
+bool ReferenceMatrix::isBinary()
+{
+	return values == nullptr;
+}
+
+void ReferenceMatrix::allocateValues()
+{
+	if (values == nullptr)
+	{
+		values = new float[nChannels * nChannels];
+		for (int i=0; i<nChannels; i++)
+		{
+			for (int j=0; j<nChannels; j++)
+			{
+				values[i*nChannels + j] = (bits[i*wordsPerRow + j/64] >> (j % 64)) & 1 ? 1.0f : 0.0f;
+			}
+		}
+	}
+}
+
+void ReferenceMatrix::releaseValues()
+{
+	delete[] values;
+	values = nullptr;
+}
+
+void ReferenceMatrix::setBits(int rowIndex, int first, int last, bool state)
+{
+	uint64_t* row = &bits[rowIndex * wordsPerRow];
+
+	for (int w=first/64; w*64<last; w++)
+	{
+		int lo = std::max(first - w*64, 0);
+		int hi = std::min(last - w*64, 64);
+		uint64_t mask = (hi - lo == 64) ? ~(uint64_t) 0 : ((((uint64_t) 1 << (hi - lo)) - 1) << lo);
+
+		if (state)
+			row[w] |= mask;
+		else
+			row[w] &= ~mask;
+	}
+}
+
+void ReferenceMatrix::setValue(int rowIndex, int colIndex, float value)
+{
+	if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+	{
+		float before = getValue(rowIndex, colIndex);
+
+		/* Weights other than 0/1 need the dense matrix, as long as any remain */
+		if (!isBinaryValue(value))
+			allocateValues();
+
+		if (values != nullptr)
+			values[rowIndex * nChannels + colIndex] = value;
+
+		numWeighted += (isBinaryValue(value) ? 0 : 1) - (isBinaryValue(before) ? 0 : 1);
+		if (numWeighted == 0)
+			releaseValues();
+
+		setBits(rowIndex, colIndex, colIndex + 1, value > 0);
+		modificationCount++;
+		logChange(rowIndex, colIndex, colIndex);
+
+		if (rowIndex < (int) fittedGains.size())
+			fittedGains[rowIndex].clear();
+	}
+	else
+	{
+		std::cout << "RefMatrix::setValue INDEX OUT OF BOUNDS! (rowIndex=" << rowIndex << ", colIndex=" << colIndex << ")" << std::endl;
+	}
+}
+
+void ReferenceMatrix::setRow(int rowIndex, float value)
+{
+	if (rowIndex >= 0 && rowIndex < nChannels)
+	{
+		if (values != nullptr || !isBinaryValue(value))
+		{
+			allocateValues();
+			for (int j=0; j<nChannels; j++)
+			{
+				float& v = values[rowIndex*nChannels + j];
+				numWeighted += (isBinaryValue(value) ? 0 : 1) - (isBinaryValue(v) ? 0 : 1);
+				v = value;
+			}
+
+			if (numWeighted == 0)
+				releaseValues();
+		}
+
+		setBits(rowIndex, 0, nChannels, value > 0);
+		modificationCount++;
+		logChange(rowIndex, 0, nChannels - 1);
+
+		if (rowIndex < (int) fittedGains.size())
+			fittedGains[rowIndex].clear();
+	}
+}
+
+float ReferenceMatrix::getValue(int rowIndex, int colIndex)
+{
+	float value = -1;
+	if (rowIndex >= 0 && rowIndex < nChannels && colIndex >= 0 && colIndex < nChannels)
+	{
+		if (values != nullptr)
+			value = values[rowIndex * nChannels + colIndex];
+		else
+			value = (bits[rowIndex * wordsPerRow + colIndex/64] >> (colIndex % 64)) & 1 ? 1.0f : 0.0f;
+	}
+
+	return value;
+}
+
+int ReferenceMatrix::getNumReferences(int rowIndex)
+{
+	int count = 0;
+
+	if (rowIndex >= 0 && rowIndex < nChannels)
+	{
+		const uint64_t* row = &bits[rowIndex * wordsPerRow];
+		for (int w=0; w<wordsPerRow; w++)
+		{
+			count += popcount64(row[w]);
+		}
+	}
+
+	return count;
+}
+
+void ReferenceMatrix::getReferences(int rowIndex, std::vector<int>& refs)
+{
+	refs.clear();
+
+	if (rowIndex >= 0 && rowIndex < nChannels)
+	{
+		const uint64_t* row = &bits[rowIndex * wordsPerRow];
+		for (int w=0; w<wordsPerRow; w++)
+		{
+			for (uint64_t word = row[w]; word != 0; word &= word - 1)
+			{
+				refs.push_back(w*64 + countTrailingZeros64(word));
+			}
+		}
+	}
+}
+
+bool ReferenceMatrix::allChannelReferencesActive(int index)
+{
+	return nChannels > 0 && getNumReferences(index) == nChannels;
+}
+
+void ReferenceMatrix::setAll(float value)
+{
+	if (bits != nullptr)
+	{
+		if (isBinaryValue(value))
+		{
+			releaseValues();
+			numWeighted = 0;
+		}
+		else
+		{
+			allocateValues();
+			for (int i=0; i<nChannels * nChannels; i++)
+			{
+				values[i] = value;
+			}
+			numWeighted = nChannels * nChannels;
+		}
+
+		for (int i=0; i<nChannels; i++)
+		{
+			setBits(i, 0, nChannels, value > 0);
+		}
+
+		modificationCount++;
+		logAllChanged();
+		clearFit();
+	}
+}
+
+void ReferenceMatrix::setAll(float value, int maxChan)
+{
+	if (bits != nullptr)
+	{
+		maxChan = MIN(nChannels, maxChan);
+
+		if (values != nullptr || !isBinaryValue(value))
+		{
+			allocateValues();
+			for (int i=0; i<maxChan; i++)
+			{
+				for (int j=0; j<maxChan; j++)
+				{
+					float& v = values[i*nChannels + j];
+					numWeighted += (isBinaryValue(value) ? 0 : 1) - (isBinaryValue(v) ? 0 : 1);
+					v = value;
+				}
+			}
+
+			if (numWeighted == 0)
+				releaseValues();
+		}
+
+		for (int i=0; i<maxChan; i++)
+		{
+			setBits(i, 0, maxChan, value > 0);
+		}
+
+		modificationCount++;
+		logAllChanged();
+		clearFit();
+	}
+}
+
+void ReferenceMatrix::clear()
+{
+	setAll(0);
+}
+
+void ReferenceMatrix::print()
+{
+	for (int i=0; i<nChannels; i++)
+	{
+		for (int j=0; j<nChannels; j++)
+		{
+			std::cout << getValue(i, j) << " ";
+		}
+		std::cout << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+static bool equalsIgnoreCase(const std::string& a, const char* b)
+{
+	size_t n = 0;
+	for (; b[n] != 0; n++)
+	{
+		if (n >= a.size() || std::tolower(a[n]) != std::tolower(b[n]))
+			return false;
+	}
+	return n == a.size();
+}
+
+int ReferenceMatrix::getNumPresets()
+{
+	return NUM_PRESETS;
+}
+
+const char* ReferenceMatrix::getPresetName(int index)
+{
+	if (index >= 0 && index < NUM_PRESETS)
+		return presetNames[index];
+	else
+		return "";
+}
+
+bool ReferenceMatrix::applyPreset(const std::string& name, int numChannels)
+{
+	int n = MIN(nChannels, numChannels);
+	int nTetrodes = n / 4;
+
+	if (equalsIgnoreCase(name, "Other tetrode electrodes"))
+	{
+		clear();
+
+		for (int i=0; i<nTetrodes; i++)
+		{
+			for (int j=0; j<4; j++)
+			{
+				int channelIndex = i*4 + j;
+				for (int k=0; k<4; k++)
+				{
+					if (j != k)
+					{
+						setValue(channelIndex, i*4 + k, 1);
+					}
+				}
+			}
+		}
+	}
+	else if (equalsIgnoreCase(name, "All tetrode electrodes"))
+	{
+		clear();
+
+		for (int i=0; i<nTetrodes; i++)
+		{
+			for (int j=0; j<4; j++)
+			{
+				int channelIndex = i*4 + j;
+				for (int k=0; k<4; k++)
+				{
+					setValue(channelIndex, i*4 + k, 1);
+				}
+			}
+		}
+	}
+	else if (equalsIgnoreCase(name, "Common average reference"))
+	{
+		clear();
+		setAll(1, n);
+	}
+	else if (equalsIgnoreCase(name, "Avg of other tetrodes"))
+	{
+		clear();
+
+		/* Activate all channels and deselect channels at the same tetrode */
+		setAll(1, n);
+		for (int i=0; i<nTetrodes; i++)
+		{
+			for (int j=0; j<4; j++)
+			{
+				int channelIndex = i*4 + j;
+				for (int k=0; k<4; k++)
+				{
+					setValue(channelIndex, i*4 + k, 0);
+				}
+			}
+		}
+	}
+	else if (equalsIgnoreCase(name, "Avg of next tetrode"))
+	{
+		clear();
+
+		for (int i=0; i<nTetrodes; i++)
+		{
+			for (int j=0; j<4; j++)
+			{
+				for (int k=0; k<4; k++)
+				{
+					if (i < nTetrodes - 1)
+					{
+						setValue(i*4+j, (i+1)*4+k, 1);
+					}
+					else
+					{
+						setValue(i*4+j, (i-1)*4+k, 1);
+					}
+				}
+			}
+		}
+	}
+	else if (equalsIgnoreCase(name, "Bipolar chain"))
+	{
+		clear();
+
+		/* Each channel referenced to the next one; the last stays as is */
+		for (int i=0; i+1<n; i++)
+		{
+			setValue(i, i + 1, 1);
+		}
+	}
+	else
+	{
+		return false;
+	}
+
+	appliedPreset = name;
+	appliedPresetChannels = numChannels;
+
+	return true;
+}
+
+const std::string& ReferenceMatrix::getAppliedPreset()
+{
+	return appliedPreset;
+}
+
+int ReferenceMatrix::getAppliedPresetChannels()
+{
+	return appliedPresetChannels;
+}
+
+std::string ReferenceMatrix::getRowRanges(int rowIndex)
+{
+	std::ostringstream text;
+	std::vector<int> refs;
+
+	getReferences(rowIndex, refs);
+	text << std::setprecision(9);
+
+	for (int k=0; k<(int) refs.size(); )
+	{
+		/* Run of consecutive channels with the same weight */
+		float weight = getValue(rowIndex, refs[k]);
+		int last = k;
+		while (last + 1 < (int) refs.size() && refs[last + 1] == refs[last] + 1
+			   && getValue(rowIndex, refs[last + 1]) == weight)
+		{
+			last++;
+		}
+
+		if (k > 0)
+			text << ',';
+
+		text << refs[k] + 1;
+		if (last > k)
+			text << '-' << refs[last] + 1;
+		if (weight != 1.0f)
+			text << '*' << weight;
+
+		k = last + 1;
+	}
+
+	return text.str();
+}
+
+bool ReferenceMatrix::setRowRanges(int rowIndex, const std::string& ranges)
+{
+	if (rowIndex < 0 || rowIndex >= nChannels)
+		return false;
+
+	setRow(rowIndex, 0);
+
+	bool valid = true;
+	const char* text = ranges.c_str();
+
+	while (*text != 0)
+	{
+		char* end;
+		long first = std::strtol(text, &end, 10);
+		long last = first;
+		float weight = 1.0f;
+
+		if (end == text)
+			return false;
+		text = end;
+
+		if (*text == '-')
+		{
+			last = std::strtol(text + 1, &end, 10);
+			if (end == text + 1)
+				return false;
+			text = end;
+		}
+
+		if (*text == '*')
+		{
+			weight = (float) std::strtod(text + 1, &end);
+			if (end == text + 1)
+				return false;
+			text = end;
+		}
+
+		if (*text == ',')
+			text++;
+		else if (*text != 0)
+			return false;
+
+		if (first < 1 || last > nChannels || first > last)
+		{
+			valid = false;
+			first = std::max(first, 1L);
+			last = std::min(last, (long) nChannels);
+		}
+
+		if (first > last)
+			continue;
+
+		if (weight == 1.0f && values == nullptr)
+		{
+			setBits(rowIndex, (int) first - 1, (int) last, true);
+			modificationCount++;
+			logChange(rowIndex, (int) first - 1, (int) last - 1);
+		}
+		else
+		{
+			for (long j=first; j<=last; j++)
+			{
+				setValue(rowIndex, (int) j - 1, weight);
+			}
+		}
+	}
+
+	return valid;
+}
+
+bool ReferenceMatrix::writeBinary(const std::string& path)
+{
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+	int32_t header[2] = { nChannels, values != nullptr ? 1 : 0 };
+
+	file.write(REFERENCE_BINARY_MAGIC, 8);
+	file.write((const char*) header, sizeof(header));
+	file.write((const char*) bits, sizeof(uint64_t) * nChannels * wordsPerRow);
+	if (values != nullptr)
+		file.write((const char*) values, sizeof(float) * nChannels * nChannels);
+
+	return file.good();
+}
+
+bool ReferenceMatrix::readBinary(const std::string& path)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+
+	char magic[8];
+	int32_t header[2];
+
+	file.read(magic, 8);
+	file.read((char*) header, sizeof(header));
+	if (!file.good() || std::memcmp(magic, REFERENCE_BINARY_MAGIC, 8) != 0)
+		return false;
+
+	/* Check the header against the size of the file before allocating */
+	int n = header[0];
+	bool weighted = header[1] == 1;
+	if (n <= 0 || n > REFERENCE_BINARY_MAX_CHANNELS || (header[1] != 0 && !weighted))
+		return false;
+
+	int words = (n + 63) / 64;
+	uint64_t expectedSize = 8 + sizeof(header) + sizeof(uint64_t) * (uint64_t) n * words
+		+ (weighted ? sizeof(float) * (uint64_t) n * n : 0);
+
+	std::streampos dataStart = file.tellg();
+	file.seekg(0, std::ios::end);
+	std::streamoff fileSize = file.tellg();
+	file.seekg(dataStart);
+	if (fileSize < 0 || (uint64_t) fileSize != expectedSize)
+		return false;
+
+	std::vector<uint64_t> fileBits((size_t) n * words);
+	std::vector<float> fileValues(weighted ? (size_t) n * n : 0);
+
+	file.read((char*) fileBits.data(), sizeof(uint64_t) * fileBits.size());
+	file.read((char*) fileValues.data(), sizeof(float) * fileValues.size());
+	if (!file.good())
+		return false;
+
+	if (n == nChannels)
+	{
+		std::copy(fileBits.begin(), fileBits.end(), bits);
+
+		/* Bits past the last channel would read as references */
+		if (nChannels % 64 != 0)
+		{
+			uint64_t mask = ((uint64_t) 1 << (nChannels % 64)) - 1;
+			for (int i=0; i<nChannels; i++)
+				bits[i * wordsPerRow + wordsPerRow - 1] &= mask;
+		}
+
+		releaseValues();
+		numWeighted = 0;
+		if (!fileValues.empty())
+		{
+			for (int i=0; i<n*n; i++)
+				numWeighted += isBinaryValue(fileValues[i]) ? 0 : 1;
+
+			if (numWeighted > 0)
+			{
+				values = new float[nChannels * nChannels];
+				std::copy(fileValues.begin(), fileValues.end(), values);
+			}
+		}
+
+		modificationCount++;
+		logAllChanged();
+		clearFit();
+	}
+	else
+	{
+		clear();
+
+		int common = MIN(n, nChannels);
+		for (int i=0; i<common; i++)
+		{
+			for (int j=0; j<common; j++)
+			{
+				if ((fileBits[i*words + j/64] >> (j % 64)) & 1)
+					setValue(i, j, fileValues.empty() ? 1.0f : fileValues[i*n + j]);
+			}
+		}
+	}
+
+	return true;
+}
+
+int ReferenceMatrix::getModificationCount()
+{
+	return modificationCount;
+}
+
+void ReferenceMatrix::logChange(int rowIndex, int firstCol, int lastCol)
+{
+	appliedPreset.clear();
+
+	if (allChanged)
+		return;
+
+	if (!changeLog.empty())
+	{
+		Change& last = changeLog.back();
+		if (last.row == rowIndex && firstCol <= last.lastCol + 1 && lastCol >= last.firstCol - 1)
+		{
+			last.firstCol = std::min(last.firstCol, firstCol);
+			last.lastCol = std::max(last.lastCol, lastCol);
+			return;
+		}
+	}
+
+	if (changeLog.size() < MAX_LOGGED_CHANGES)
+	{
+		Change change = { rowIndex, firstCol, lastCol };
+		changeLog.push_back(change);
+	}
+	else
+	{
+		logAllChanged();
+	}
+}
+
+void ReferenceMatrix::logAllChanged()
+{
+	appliedPreset.clear();
+	changeLog.clear();
+	allChanged = true;
+}
+
+bool ReferenceMatrix::takeChanges(std::vector<Change>& changes)
+{
+	bool complete = !allChanged;
+
+	changes.assign(changeLog.begin(), changeLog.end());
+	changeLog.clear();
+	allChanged = false;
+
+	return complete;
+}
+
+void ReferenceMatrix::setNormalization(Normalization mode)
+{
+	if (mode >= 0 && mode < NUM_NORMALIZATIONS)
+	{
+		normalization = mode;
+		modificationCount++;
+	}
+}
+
+ReferenceMatrix::Normalization ReferenceMatrix::getNormalization()
+{
+	return normalization;
+}
+
+void ReferenceMatrix::setReferenceType(ReferenceType type)
+{
+	if (type >= 0 && type < NUM_REFERENCE_TYPES)
+	{
+		referenceType = type;
+		modificationCount++;
+	}
+}
+
+ReferenceMatrix::ReferenceType ReferenceMatrix::getReferenceType()
+{
+	return referenceType;
+}
+
+void ReferenceMatrix::setTrimFraction(float fraction)
+{
+	if (fraction >= 0 && fraction < 0.5f)
+	{
+		trimFraction = fraction;
+		modificationCount++;
+	}
+}
+
+float ReferenceMatrix::getTrimFraction()
+{
+	return trimFraction;
+}
+
+void ReferenceMatrix::getRowGains(int rowIndex, const std::vector<int>& refs, float* gains)
+{
+	int numRefs = (int) refs.size();
+
+	if (normalization == LEAST_SQUARES && rowIndex < (int) fittedGains.size()
+		&& (int) fittedGains[rowIndex].size() == numRefs && numRefs > 0)
+	{
+		std::copy(fittedGains[rowIndex].begin(), fittedGains[rowIndex].end(), gains);
+		return;
+	}
+
+	if (values == nullptr)
+	{
+		float gain = normalization == RAW_WEIGHTS ? 1.0f : 1.0f / float(numRefs);
+		for (int k=0; k<numRefs; k++)
+		{
+			gains[k] = gain;
+		}
+		return;
+	}
+
+	const float* chan = &values[rowIndex * nChannels];
+
+	float sum = 0;
+	for (int k=0; k<numRefs; k++)
+	{
+		sum += chan[refs[k]];
+	}
+
+	for (int k=0; k<numRefs; k++)
+	{
+		if (normalization == RAW_WEIGHTS)
+			gains[k] = chan[refs[k]];
+		else
+			gains[k] = chan[refs[k]] / sum;
+	}
+}
+
+void ReferenceMatrix::setChannelGain(int rowIndex, float gain)
+{
+	if (rowIndex >= 0 && rowIndex < nChannels)
+		channelGains[rowIndex] = gain;
+}
+
+float ReferenceMatrix::getChannelGain(int rowIndex)
+{
+	return channelGains[rowIndex];
+}
+
+void ReferenceMatrix::setChannelGains(const std::vector<float>& gains)
+{
+	for (int i=0; i<nChannels; i++)
+	{
+		channelGains[i] = i < (int) gains.size() ? gains[i] : 1.0f;
+	}
+}
+
+void ReferenceMatrix::resetChannelGains()
+{
+	channelGains.assign(nChannels, 1.0f);
+}
+
+bool ReferenceMatrix::hasChannelGains()
+{
+	for (int i=0; i<nChannels; i++)
+	{
+		if (channelGains[i] != 1.0f)
+			return true;
+	}
+	return false;
+}
+
+std::string ReferenceMatrix::getChannelGainText()
+{
+	std::ostringstream text;
+	text << std::setprecision(9);
+
+	for (int i=0; i<nChannels; )
+	{
+		int count = 1;
+		while (i + count < nChannels && channelGains[i + count] == channelGains[i])
+			count++;
+
+		if (i > 0)
+			text << ',';
+		if (count > 1)
+			text << count << 'x';
+		text << channelGains[i];
+
+		i += count;
+	}
+
+	return text.str();
+}
+
+bool ReferenceMatrix::setChannelGainText(const std::string& gainText)
+{
+	resetChannelGains();
+
+	const char* text = gainText.c_str();
+	int i = 0;
+
+	while (*text != 0)
+	{
+		/* A run starts with its length and 'x' */
+		char* end;
+		long count = std::strtol(text, &end, 10);
+
+		if (end != text && *end == 'x')
+		{
+			if (count < 1)
+				return false;
+			text = end + 1;
+		}
+		else
+		{
+			count = 1;
+		}
+
+		double gain = std::strtod(text, &end);
+		if (end == text)
+			return false;
+		text = end;
+
+		if (*text == ',')
+			text++;
+		else if (*text != 0)
+			return false;
+
+		for (long k=0; k<count && i<nChannels; k++)
+		{
+			channelGains[i++] = (float) gain;
+		}
+	}
+
+	return true;
+}
+
+void ReferenceMatrix::setFittedGains(FittedGains& gains)
+{
+	fittedGains.swap(gains);
+	fittedGains.resize(nChannels);
+	modificationCount++;
+}
+
+void ReferenceMatrix::clearFit()
+{
+	fittedGains.clear();
+}
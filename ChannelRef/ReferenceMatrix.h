@@ -0,0 +1,270 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEMATRIX_H__
+#define __REFERENCEMATRIX_H__
+
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Fraction of the smallest and of the largest values a trimmed mean drops */
+#define DEFAULT_TRIM_FRACTION 0.1f
+
+/* Changed ranges kept until the whole matrix is reported as changed */
+#define MAX_LOGGED_CHANGES 256
+
+/* First bytes of a binary reference matrix (see writeBinary()) */
+#define REFERENCE_BINARY_MAGIC "CHANREF1"
+
+/* Largest channel count accepted from a binary matrix (the weights of
+   such a matrix take 256 MB) */
+#define REFERENCE_BINARY_MAX_CHANNELS 8192
+
+
+/**
+
+  Reference matrix
+
+  Each row indicates the selected reference channels for each channel.
+
+  The selection is stored as one bit per entry (a row of 1024 channels is
+  16 words), so counting and listing the references of a row, setAll()
+  and clear() work on whole words. A dense float matrix is only kept
+  while at least one entry is a weight other than 0 or 1.
+
+  Changed cells are logged as ranges of a row, so that views can redraw
+  only what changed (see takeChanges()). Consecutive changes of the same
+  row are merged; bulk changes (setAll(), presets, a new channel count)
+  mark the whole matrix as changed.
+
+  For saving, a row can be written as a list of channel ranges, the whole
+  matrix as a binary blob, and a matrix that still equals the preset it was
+  set up with by the name of the preset alone.
+
+  > 0: selected, with the given weight (1 for the usual average)
+    0: not selected
+
+  How the weights of a row are turned into gains is set by the
+  normalization mode:
+
+  SUM_TO_ONE:    weights are divided by their sum (weighted average)
+  RAW_WEIGHTS:   weights are used as gains directly
+  LEAST_SQUARES: gains are fitted to recorded data (see
+                 ReferenceLeastSquaresFit) and set by setFittedGains();
+                 rows without a fit fall back to SUM_TO_ONE
+
+  The reference type selects the statistic of the reference channels that
+  is subtracted: the (weighted) average, or the per-sample median or
+  trimmed mean, which are not pulled around by single-channel artifacts.
+  Weights and normalization only apply to the average.
+
+  On top of that, each channel (row) has a gain of its reference, 1 by
+  default: channels with a higher or lower impedance pick up more or less
+  of a common signal, and subtract more or less of the same reference.
+  The gain applies to all reference types.
+
+  @see ChannelRefNode
+
+*/
+
+class ReferenceMatrix
+{
+public:
+
+    ReferenceMatrix(int nChan);
+    ~ReferenceMatrix();
+
+	void setNumberOfChannels(int n);
+	int getNumberOfChannels();
+
+	void update();
+
+	void setValue(int rowIndex, int colIndex, float value);
+	float getValue(int rowIndex, int colIndex);
+
+	/** Set all entries of a row to the same value. */
+	void setRow(int rowIndex, float value);
+
+	/** Number of selected references of a row. */
+	int getNumReferences(int rowIndex);
+
+	/** Indices of the selected references of a row, in ascending order. */
+	void getReferences(int rowIndex, std::vector<int>& refs);
+
+	bool allChannelReferencesActive(int index);
+
+	/** True if every entry is 0 or 1 (no dense weights are stored). */
+	bool isBinary();
+
+	void setAll(float value);
+	void setAll(float value, int maxChan);
+	void clear();
+
+	void print();
+
+	/** Set up one of the standard configurations for the first numChannels
+	    channels (see getPresetName()); false if the name is unknown. */
+	bool applyPreset(const std::string& name, int numChannels);
+
+	static int getNumPresets();
+	static const char* getPresetName(int index);
+
+	/** Preset the matrix was last set up with and its number of channels;
+	    empty once the matrix has been changed otherwise. */
+	const std::string& getAppliedPreset();
+	int getAppliedPresetChannels();
+
+	/** Compact text form of a row: comma-separated 1-based channels and
+	    channel ranges, each optionally followed by a weight other than 1,
+	    e.g. "1-4,9,12-16*0.5". */
+	std::string getRowRanges(int rowIndex);
+
+	/** Replace a row by its text form (see getRowRanges()). Returns false if
+	    the text is malformed or lists channels beyond the channel count,
+	    which are skipped. */
+	bool setRowRanges(int rowIndex, const std::string& ranges);
+
+	/** Write the matrix as REFERENCE_BINARY_MAGIC, the channel count and a
+	    flag for weights (32-bit integers), the bitset (64-bit words, rows
+	    padded to whole words) and, with weights, the dense matrix. Numbers
+	    are stored in the byte order of the machine. */
+	bool writeBinary(const std::string& path);
+
+	/** Read a matrix written by writeBinary(). A matrix of another channel
+	    count is copied as far as the channels overlap. Returns false, and
+	    leaves the matrix as it is, if the header is invalid or the size of
+	    the file does not match it. */
+	bool readBinary(const std::string& path);
+
+	enum Normalization
+	{
+		SUM_TO_ONE = 0,
+		RAW_WEIGHTS,
+		LEAST_SQUARES,
+		NUM_NORMALIZATIONS
+	};
+
+	/** Values out of range are ignored. */
+	void setNormalization(Normalization mode);
+	Normalization getNormalization();
+
+	enum ReferenceType
+	{
+		AVERAGE_REFERENCE = 0,
+		MEDIAN_REFERENCE,
+		TRIMMED_MEAN_REFERENCE,
+		NUM_REFERENCE_TYPES
+	};
+
+	/** Values out of range are ignored. */
+	void setReferenceType(ReferenceType type);
+	ReferenceType getReferenceType();
+
+	void setTrimFraction(float fraction);
+	float getTrimFraction();
+
+	/** Gain applied to each of the given references (see getReferences())
+	    of a row before the global gain, according to the normalization mode. */
+	void getRowGains(int rowIndex, const std::vector<int>& refs, float* gains);
+
+	/** Gain of the reference of each channel (see above). Channel gains
+	    are kept for the channels that remain when the channel count
+	    changes. */
+	void setChannelGain(int rowIndex, float gain);
+	float getChannelGain(int rowIndex);
+	void setChannelGains(const std::vector<float>& gains);
+	void resetChannelGains();
+
+	/** True if any channel gain is not 1. */
+	bool hasChannelGains();
+
+	/** Compact text form of the channel gains: comma-separated gains of all
+	    channels, where a run of equal gains can be written as count and
+	    gain, e.g. "3x1,0.95,1.1". */
+	std::string getChannelGainText();
+
+	/** Set the channel gains from their text form (see
+	    getChannelGainText()); missing channels get a gain of 1. Returns false
+	    if the text is malformed. */
+	bool setChannelGainText(const std::string& text);
+
+	/** Least-squares gains of each row, one per reference of the row (see
+	    getReferences()) and in the same order; rows without a fit are
+	    empty. */
+	typedef std::vector<std::vector<float> > FittedGains;
+
+	/** Use gains fitted to the matrix as it is now (the gains are moved
+	    out of the given list). Rows that are changed afterwards lose their
+	    fit. */
+	void setFittedGains(FittedGains& gains);
+	void clearFit();
+
+	/** Incremented on every change of the matrix. */
+	int getModificationCount();
+
+	/** Cells [firstCol, lastCol] of a row that have changed. */
+	struct Change
+	{
+		int row;
+		int firstCol;
+		int lastCol;
+	};
+
+	/** Move the changes since the last call into the given list. Returns
+	    false if the whole matrix has to be considered changed. */
+	bool takeChanges(std::vector<Change>& changes);
+
+private:
+
+	void allocateValues();
+	void releaseValues();
+	void setBits(int rowIndex, int first, int last, bool state);
+	void logChange(int rowIndex, int firstCol, int lastCol);
+	void logAllChanged();
+
+	int nChannels;
+	int nChannelsBefore;
+	int wordsPerRow;
+	uint64_t* bits;
+	float* values;
+	int numWeighted;
+	int modificationCount;
+
+	std::vector<Change> changeLog;
+	bool allChanged;
+
+	std::string appliedPreset;
+	int appliedPresetChannels;
+
+	Normalization normalization;
+	ReferenceType referenceType;
+	float trimFraction;
+	FittedGains fittedGains;
+	std::vector<float> channelGains;
+
+};
+
+
+#endif  //__REFERENCEMATRIX_H__
@@ -0,0 +1,386 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+
+#include "ReferenceMontage.h"
+#include "ReferenceMatrix.h"
+
+
+ReferenceMontage::ReferenceMontage() : nChannels(0), zeroSource(0)
+{
+}
+
+ReferenceMontage::~ReferenceMontage()
+{
+}
+
+bool ReferenceMontage::compile(int numChannels, const std::vector<Derivation>& derivations, float globalGain,
+							   const float* channelGains)
+{
+	nChannels = numChannels;
+	error.clear();
+
+	targets.clear();
+	sources.clear();
+	gains.clear();
+	snapshotChannels.clear();
+
+	int numDerivations = (int) derivations.size();
+	std::vector<int> derivationOf(nChannels, -1);
+
+	for (int d=0; d<numDerivations; d++)
+	{
+		int c = derivations[d].channel;
+		int r = derivations[d].reference;
+
+		if (c < 0 || c >= nChannels || r < 0 || r >= nChannels)
+		{
+			error = "Derivation " + std::to_string(c + 1) + ":" + std::to_string(r + 1)
+				+ " is beyond the channel count";
+		}
+		else if (derivationOf[c] >= 0)
+		{
+			error = "Channel " + std::to_string(c + 1) + " has more than one derivation";
+		}
+		else
+		{
+			derivationOf[c] = d;
+			continue;
+		}
+
+		nChannels = 0;
+		return false;
+	}
+
+	/* A derived channel can only be modified once the derivations that
+	   read it have run. A channel that references itself reads the same
+	   sample it writes, so that is no constraint. */
+	std::vector<int> numReaders(nChannels, 0);
+	for (int d=0; d<numDerivations; d++)
+	{
+		int r = derivations[d].reference;
+		if (r != derivations[d].channel && derivationOf[r] >= 0)
+			numReaders[r]++;
+	}
+
+	std::vector<int> order;
+	std::vector<int> snapshotOf(numDerivations, -1);
+	std::vector<char> done(numDerivations, 0);
+
+	for (int d=0; d<numDerivations; d++)
+	{
+		if (numReaders[derivations[d].channel] == 0)
+			order.push_back(d);
+	}
+
+	int next = 0;
+	int firstCycle = 0;
+
+	while (true)
+	{
+		/* Derivations in the order in which they become ready (a chain in
+		   the order of the chain) */
+		for (; next<(int) order.size(); next++)
+		{
+			const Derivation& derivation = derivations[order[next]];
+			done[order[next]] = 1;
+
+			int r = derivation.reference;
+			if (r != derivation.channel && derivationOf[r] >= 0 && --numReaders[r] == 0)
+				order.push_back(derivationOf[r]);
+		}
+
+		if ((int) order.size() == numDerivations)
+			break;
+
+		/* Everything left lies on cycles, as every channel has only one
+		   reference. Copy one channel of a cycle first and let the
+		   derivation before it in the cycle read the copy. */
+		while (done[firstCycle])
+			firstCycle++;
+
+		int x = derivations[firstCycle].channel;
+		int reader = firstCycle;
+		while (derivations[reader].reference != x)
+			reader = derivationOf[derivations[reader].reference];
+
+		snapshotOf[reader] = (int) snapshotChannels.size();
+		snapshotChannels.push_back(x);
+
+		numReaders[x]--;
+		order.push_back(firstCycle);
+	}
+
+	int numSnapshots = (int) snapshotChannels.size();
+	zeroSource = nChannels + numSnapshots;
+
+	for (int k=0; k<numDerivations; k++)
+	{
+		const Derivation& derivation = derivations[order[k]];
+		int s = snapshotOf[order[k]];
+
+		targets.push_back(derivation.channel);
+		sources.push_back(s >= 0 ? nChannels + s : derivation.reference);
+		float referenceGain = channelGains ? globalGain * channelGains[derivation.channel] : globalGain;
+		gains.push_back(-1.0f * (referenceGain * derivation.gain));
+	}
+
+	/* The last buffer stays zero; masked channels are read from it */
+	scratch.assign((size_t) (numSnapshots + 1) * MONTAGE_BLOCK_SIZE, 0.0f);
+	sourceTable.assign(nChannels + numSnapshots + 1, nullptr);
+
+	/* Derivations referencing each channel (also through a copy) */
+	baseSources = sources;
+	maskStart.assign(nChannels + 1, 0);
+	maskPositions.resize(numDerivations);
+
+	for (int k=0; k<numDerivations; k++)
+		maskStart[derivations[order[k]].reference + 1]++;
+	for (int c=0; c<nChannels; c++)
+		maskStart[c + 1] += maskStart[c];
+
+	std::vector<int> fill(maskStart.begin(), maskStart.end() - 1);
+	for (int k=0; k<numDerivations; k++)
+		maskPositions[fill[derivations[order[k]].reference]++] = k;
+
+	channelMasked.assign(nChannels, 0);
+
+	return true;
+}
+
+const std::string& ReferenceMontage::getError()
+{
+	return error;
+}
+
+int ReferenceMontage::getNumChannels()
+{
+	return nChannels;
+}
+
+int ReferenceMontage::getNumDerivations()
+{
+	return (int) targets.size();
+}
+
+int ReferenceMontage::getNumSnapshots()
+{
+	return (int) snapshotChannels.size();
+}
+
+int ReferenceMontage::getChannel(int index)
+{
+	return targets[index];
+}
+
+int ReferenceMontage::getReference(int index)
+{
+	int s = baseSources[index];
+	return s < nChannels ? s : snapshotChannels[s - nChannels];
+}
+
+void ReferenceMontage::setChannelMasked(int channel, bool masked)
+{
+	if (channel < 0 || channel >= nChannels || (channelMasked[channel] != 0) == masked)
+		return;
+
+	channelMasked[channel] = masked ? 1 : 0;
+
+	for (int m=maskStart[channel]; m<maskStart[channel + 1]; m++)
+	{
+		int k = maskPositions[m];
+		sources[k] = masked ? zeroSource : baseSources[k];
+	}
+}
+
+bool ReferenceMontage::isChannelMasked(int channel)
+{
+	return channel >= 0 && channel < nChannels && channelMasked[channel] != 0;
+}
+
+struct MontageTask
+{
+	ReferenceMontage* montage;
+	DerivationKernel kernel;
+	int numSamples;
+};
+
+void ReferenceMontage::processRange(void* context, int taskIndex, int numTasks)
+{
+	MontageTask* task = (MontageTask*) context;
+	ReferenceMontage* montage = task->montage;
+
+	/* Whole cache lines per task; samples are independent */
+	int numLines = (task->numSamples + 15) / 16;
+	int first = std::min(task->numSamples, 16 * (numLines * taskIndex / numTasks));
+	int last = std::min(task->numSamples, 16 * (numLines * (taskIndex + 1) / numTasks));
+
+	if (first == last)
+		return;
+
+	float* const* table = montage->sourceTable.data();
+
+	/* Channels on reference cycles, before any of them is referenced */
+	for (int k=0; k<(int) montage->snapshotChannels.size(); k++)
+	{
+		const float* src = table[montage->snapshotChannels[k]];
+		std::copy(src + first, src + last, table[montage->nChannels + k] + first);
+	}
+
+	task->kernel(table, montage->targets.data(), montage->sources.data(), montage->gains.data(),
+				 (int) montage->targets.size(), first, last - first);
+}
+
+void ReferenceMontage::process(float* const* channels, int numSamples,
+							   ReferenceKernels::Type type, ReferenceThreadPool* threadPool)
+{
+	if (targets.empty())
+		return;
+
+	MontageTask task;
+	task.montage = this;
+	task.kernel = ReferenceKernels::getDerivation(type);
+
+	int numBuffers = (int) snapshotChannels.size() + 1;
+	for (int k=0; k<numBuffers; k++)
+	{
+		sourceTable[nChannels + k] = scratch.data() + (size_t) k * MONTAGE_BLOCK_SIZE;
+	}
+
+	int maxTasks = 1;
+	if (threadPool != nullptr && threadPool->getNumThreads() > 0)
+		maxTasks = threadPool->getNumThreads() + 1;
+
+	/* The block is processed in pieces that fit the preallocated scratch */
+	for (int offset=0; offset<numSamples; offset+=MONTAGE_BLOCK_SIZE)
+	{
+		int n = std::min(MONTAGE_BLOCK_SIZE, numSamples - offset);
+		task.numSamples = n;
+
+		for (int i=0; i<nChannels; i++)
+		{
+			sourceTable[i] = channels[i] + offset;
+		}
+
+		int numTasks = std::min(maxTasks, std::max(1, n / MONTAGE_TASK_SAMPLES));
+
+		if (numTasks > 1)
+			threadPool->run(&ReferenceMontage::processRange, &task, numTasks);
+		else
+			processRange(&task, 0, 1);
+	}
+}
+
+bool ReferenceMontage::fromMatrix(ReferenceMatrix* refMat, std::vector<Derivation>& derivations)
+{
+	derivations.clear();
+
+	if (refMat->getReferenceType() != ReferenceMatrix::AVERAGE_REFERENCE)
+		return false;
+
+	std::vector<int> refs;
+
+	for (int i=0; i<refMat->getNumberOfChannels(); i++)
+	{
+		refMat->getReferences(i, refs);
+
+		if (refs.size() > 1)
+		{
+			derivations.clear();
+			return false;
+		}
+		else if (refs.size() == 1)
+		{
+			Derivation derivation;
+			derivation.channel = i;
+			derivation.reference = refs[0];
+			refMat->getRowGains(i, refs, &derivation.gain);
+			derivations.push_back(derivation);
+		}
+	}
+
+	return true;
+}
+
+std::string ReferenceMontage::toText(const std::vector<Derivation>& derivations)
+{
+	std::ostringstream text;
+	text << std::setprecision(9);
+
+	for (int d=0; d<(int) derivations.size(); d++)
+	{
+		if (d > 0)
+			text << ',';
+
+		text << derivations[d].channel + 1 << ':' << derivations[d].reference + 1;
+		if (derivations[d].gain != 1.0f)
+			text << '*' << derivations[d].gain;
+	}
+
+	return text.str();
+}
+
+bool ReferenceMontage::fromText(const std::string& derivationText, std::vector<Derivation>& derivations)
+{
+	derivations.clear();
+
+	const char* text = derivationText.c_str();
+
+	while (*text != 0)
+	{
+		char* end;
+		Derivation derivation;
+		derivation.gain = 1.0f;
+
+		derivation.channel = (int) std::strtol(text, &end, 10) - 1;
+		if (end == text || *end != ':')
+			return false;
+		text = end + 1;
+
+		derivation.reference = (int) std::strtol(text, &end, 10) - 1;
+		if (end == text)
+			return false;
+		text = end;
+
+		if (*text == '*')
+		{
+			derivation.gain = (float) std::strtod(text + 1, &end);
+			if (end == text + 1)
+				return false;
+			text = end;
+		}
+
+		if (*text == ',')
+			text++;
+		else if (*text != 0)
+			return false;
+
+		derivations.push_back(derivation);
+	}
+
+	return true;
+}
@@ -0,0 +1,165 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEMONTAGE_H__
+#define __REFERENCEMONTAGE_H__
+
+#include <string>
+#include <vector>
+
+#include "ReferenceKernels.h"
+#include "ReferenceThreadPool.h"
+
+class ReferenceMatrix;
+
+/* Samples per piece of a block; sizes the snapshot buffers of a montage */
+#define MONTAGE_BLOCK_SIZE 1024
+
+/* Fewest samples per thread when a block is split across the pool */
+#define MONTAGE_TASK_SAMPLES 64
+
+
+/**
+
+  Reference montage
+
+  A list of derivations, each of which references one channel to a single
+  other channel:
+
+    out[channel] = in[channel] - globalGain * channelGain * gain * in[reference]
+
+  where channelGain is the reference gain of the channel in the matrix
+  (see ReferenceMatrix::getChannelGain()), if one is given.
+
+  This covers bipolar derivations, chains of neighbouring sites along a
+  shank, and any other user-defined pairs (what the single-selection mode
+  of the reference table produces). Channels without a derivation pass
+  unchanged.
+
+  Each derivation is a single fused pass of the derivation kernel over its
+  channel (see ReferenceKernels), with no sums and no scratch copies. The
+  derivations are compiled into an order in which every channel is read
+  by the derivations that reference it before its own derivation modifies
+  it (for a chain 1-2, 2-3, 3-4 that is the order of the chain), so the
+  referencing can be done in place. Only where the references form a
+  cycle (1-2, 2-1) is one channel of the cycle copied before referencing.
+  Samples are independent, so a block is split across the thread pool by
+  sample ranges.
+
+  Derivations are written as text as comma-separated pairs of 1-based
+  channel and reference, each optionally followed by a gain other than 1,
+  e.g. "1:2,2:3,5:9*0.5" (see toText()).
+
+  Input channels can be masked out of all derivations like in a
+  ReferencePlan: derivations that reference a masked channel read zeros
+  instead, without recompiling.
+
+  @see ReferencePlan, ChannelRefNode
+
+*/
+
+class ReferenceMontage
+{
+public:
+
+	struct Derivation
+	{
+		int channel;
+		int reference;
+		float gain;
+	};
+
+	ReferenceMontage();
+	~ReferenceMontage();
+
+	/** Compile the derivations for the given number of channels. Returns
+	    false (see getError()) if a channel is out of range or has more
+	    than one derivation; the montage is empty then. If channelGains is
+	    given, it holds a reference gain for each of the channels. */
+	bool compile(int numChannels, const std::vector<Derivation>& derivations, float globalGain,
+				 const float* channelGains = nullptr);
+
+	/** Problem found by the last compile(), empty if there was none. */
+	const std::string& getError();
+
+	int getNumChannels();
+	int getNumDerivations();
+
+	/** Number of channels that are copied to break reference cycles. */
+	int getNumSnapshots();
+
+	/** Channel and reference of the n-th derivation in processing order. */
+	int getChannel(int index);
+	int getReference(int index);
+
+	/** Make derivations that reference a channel read zeros (or the
+	    channel again). Must not be called while process() is running. */
+	void setChannelMasked(int channel, bool masked);
+	bool isChannelMasked(int channel);
+
+	/** Reference the given channel buffers in place. If a thread pool with
+	    workers is given, the samples are split across it. */
+	void process(float* const* channels, int numSamples,
+				 ReferenceKernels::Type type, ReferenceThreadPool* threadPool);
+
+	/** Derivations of a matrix in which no row has more than one reference,
+	    with the gains of its normalization. Returns false if a row has more
+	    references or the reference type is not an average. */
+	static bool fromMatrix(ReferenceMatrix* refMat, std::vector<Derivation>& derivations);
+
+	/** Text form of a list of derivations, e.g. "1:2,2:3,5:9*0.5". */
+	static std::string toText(const std::vector<Derivation>& derivations);
+
+	/** Parse the text form (see toText()). Returns false if it is
+	    malformed; the derivations read up to that point are kept. */
+	static bool fromText(const std::string& text, std::vector<Derivation>& derivations);
+
+private:
+
+	static void processRange(void* context, int taskIndex, int numTasks);
+
+	int nChannels;
+	std::string error;
+
+	/* Derivations in processing order; sources index the table, which
+	   holds the channels, then the snapshots and a buffer of zeros */
+	std::vector<int> targets;
+	std::vector<int> sources;
+	std::vector<float> gains;
+
+	std::vector<int> snapshotChannels;
+	std::vector<float> scratch;
+	std::vector<float*> sourceTable;
+
+	/* Masks: per channel, the derivations that reference it (positions in
+	   sources), which read zeroSource while it is masked */
+	int zeroSource;
+	std::vector<int> baseSources;
+	std::vector<int> maskStart;
+	std::vector<int> maskPositions;
+	std::vector<char> channelMasked;
+
+};
+
+
+#endif  //__REFERENCEMONTAGE_H__
@@ -0,0 +1,1634 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <algorithm>
+#include <iterator>
+#include <set>
+
+#include "ReferencePlan.h"
+#include "ReferenceFilter.h"
+#include "ReferenceMatrix.h"
+
+
+ReferencePlan::ReferencePlan() : nChannels(0), blockSize(0), groupKernelSize(0), groupKernelEnabled(true),
+	numDistinctReferences(0), rowMontageCompiled(false), montageEnabled(true), tileStride(0), zeroSource(0), renormalize(false), numMasked(0)
+{
+	reset();
+}
+
+ReferencePlan::~ReferencePlan()
+{
+}
+
+void ReferencePlan::reset()
+{
+	selfGains.assign(nChannels, 1.0f);
+	rowStart.assign(1, 0);
+	sourceIndex.clear();
+	gains.clear();
+	sumStart.assign(1, 0);
+	sumMembers.clear();
+	sumGains.clear();
+	sumLookup.clear();
+	schedule.clear();
+	snapshotChannels.clear();
+	groupStart.assign(1, 0);
+	groupMembers.clear();
+	groupNetwork.clear();
+	groupLeaveOutStart.assign(1, 0);
+	groupLeaveOut.clear();
+	numNetworkReferences = 0;
+	networkKeys.clear();
+	networkPairStart.assign(1, 0);
+	networkPairs.clear();
+	networkOutputStart.assign(1, 0);
+	networkOutputs.clear();
+	unitStart.assign(1, 0);
+	phaseStart.assign(1, 0);
+	blockSize = 0;
+	groupKernelSize = 0;
+	rowMontageCompiled = false;
+	numDistinctReferences = 0;
+}
+
+static bool isUniform(const std::vector<float>& weights)
+{
+	for (int k=1; k<(int) weights.size(); k++)
+	{
+		if (weights[k] != weights[0])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void ReferencePlan::compile(ReferenceMatrix* refMat, float globalGain, bool useChannelGains,
+							const std::vector<char>* excluded)
+{
+	nChannels = refMat->getNumberOfChannels();
+
+	/* Selected references of each row and their final gains. The reference
+	   gain of a row only scales the gains of that row, so rows keep sharing
+	   sums and the kernels do the same work as without it. */
+	std::vector<std::vector<int> > supports(nChannels);
+	std::vector<std::vector<float> > rowGains(nChannels);
+	std::vector<std::vector<float> > weights(nChannels);
+	std::vector<float> referenceGains(nChannels, globalGain);
+	bool allUniform = true;
+
+	for (int i=0; i<nChannels; i++)
+	{
+		refMat->getReferences(i, supports[i]);
+		rowGains[i].resize(supports[i].size());
+		refMat->getRowGains(i, supports[i], rowGains[i].data());
+
+		if (useChannelGains)
+		{
+			referenceGains[i] = globalGain * refMat->getChannelGain(i);
+		}
+
+		for (int k=0; k<(int) supports[i].size(); k++)
+		{
+			weights[i].push_back(referenceGains[i] * rowGains[i][k]);
+		}
+
+		allUniform = allUniform && isUniform(weights[i]);
+	}
+
+	/* Rows with the same reference set share one reference signal,
+	   whatever their reference gain */
+	std::set<std::pair<std::vector<int>, std::vector<float> > > distinct;
+	for (int i=0; i<nChannels; i++)
+	{
+		if (!supports[i].empty())
+		{
+			distinct.insert(std::make_pair(supports[i], rowGains[i]));
+		}
+	}
+
+	ReferenceMatrix::ReferenceType type = refMat->getReferenceType();
+
+	if (type != ReferenceMatrix::AVERAGE_REFERENCE)
+	{
+		/* Networks have a fixed size, so excluded channels are left out of
+		   them here rather than masked while processing */
+		std::vector<std::vector<int> > networkSupports(supports);
+		if (excluded != nullptr && (int) excluded->size() == nChannels)
+		{
+			for (int i=0; i<nChannels; i++)
+			{
+				std::vector<int>& support = networkSupports[i];
+				int kept = 0;
+				for (int k=0; k<(int) support.size(); k++)
+				{
+					if (!(*excluded)[support[k]])
+						support[kept++] = support[k];
+				}
+				support.resize(kept);
+			}
+		}
+
+		compileNetworks(networkSupports, type == ReferenceMatrix::MEDIAN_REFERENCE,
+						refMat->getTrimFraction(), referenceGains);
+		distinct.clear();
+	}
+	else
+	{
+		compileSharedSums(supports, weights);
+
+		/* Tetrode/shank presets are block structured; use the group engine
+		   if it needs fewer passes over memory than the generic plan */
+		int size = allUniform ? findBlockSize(supports) : 0;
+		if (size > 1)
+		{
+			ReferencePlan blockPlan;
+			blockPlan.nChannels = nChannels;
+			blockPlan.compileBlocks(supports, size, weights);
+
+			if (blockPlan.getCost() <= getCost())
+			{
+				*this = blockPlan;
+			}
+		}
+	}
+
+	numDistinctReferences = (int) distinct.size() + numNetworkReferences;
+
+	allocateScratch();
+
+	/* Only averages with normalized weights keep their total when masked */
+	compileMasks(supports, rowGains, type == ReferenceMatrix::AVERAGE_REFERENCE
+				 && refMat->getNormalization() == ReferenceMatrix::SUM_TO_ONE);
+
+	compileGroupKernel();
+
+	if (type == ReferenceMatrix::AVERAGE_REFERENCE)
+		compileRowMontage(supports, weights);
+
+	/* For the montages added later */
+	channelGains.clear();
+	if (useChannelGains)
+	{
+		for (int i=0; i<nChannels; i++)
+			channelGains.push_back(refMat->getChannelGain(i));
+	}
+}
+
+void ReferencePlan::compileRowMontage(const std::vector<std::vector<int> >& supports,
+									  const std::vector<std::vector<float> >& weights)
+{
+	rowMontageCompiled = false;
+
+	/* The weights already include the global gain */
+	std::vector<ReferenceMontage::Derivation> derivations;
+
+	for (int i=0; i<nChannels; i++)
+	{
+		if (supports[i].size() > 1)
+			return;
+
+		if (supports[i].size() == 1)
+		{
+			ReferenceMontage::Derivation derivation;
+			derivation.channel = i;
+			derivation.reference = supports[i][0];
+			derivation.gain = weights[i][0];
+			derivations.push_back(derivation);
+		}
+	}
+
+	rowMontageCompiled = !derivations.empty() && rowMontage.compile(nChannels, derivations, 1.0f);
+}
+
+void ReferencePlan::compileGroupKernel()
+{
+	groupKernelSize = 0;
+
+	int numSums = getNumSums();
+	if (numSums == 0 || getNumNetworkGroups() > 0 || !snapshotChannels.empty())
+		return;
+
+	int size = nChannels / numSums;
+	if (size * numSums != nChannels || !ReferenceKernels::hasGroupKernel(size))
+		return;
+
+	/* Sum g adds up channels g*size..(g+1)*size-1, in this order */
+	for (int g=0; g<numSums; g++)
+	{
+		if (sumStart[g + 1] - sumStart[g] != size)
+			return;
+
+		for (int k=0; k<size; k++)
+		{
+			if (sumMembers[sumStart[g] + k] != g * size + k || sumGains[sumStart[g] + k] != 1.0f)
+				return;
+		}
+	}
+
+	/* Every row subtracts the sum of its own group and nothing else, so
+	   gains[i] and selfGains[i] are the gains of row i. Rows with a self
+	   gain of 0 do not read the channel in the generic kernel. */
+	for (int i=0; i<nChannels; i++)
+	{
+		if (rowStart[i] != i || rowStart[i + 1] != i + 1
+			|| sourceIndex[i] != nChannels + i / size || selfGains[i] == 0.0f)
+			return;
+	}
+
+	groupKernelSize = size;
+}
+
+void ReferencePlan::compileSharedSums(const std::vector<std::vector<int> >& supports,
+									  const std::vector<std::vector<float> >& weights)
+{
+	reset();
+
+	/* Only rows that weight all their references equally can refer to
+	   (unweighted) shared sums; weighted rows are expanded */
+	std::vector<bool> uniform(nChannels);
+	for (int i=0; i<nChannels; i++)
+	{
+		uniform[i] = isUniform(weights[i]);
+	}
+
+	/* Count how many rows share the same reference set once the target
+	   itself is added ("all" and "all except self" rows map to the same
+	   set), and collect the union of all large reference sets */
+	std::map<std::vector<int>, int> closedCount;
+	std::map<std::vector<int>, int> rowCount;
+	std::vector<std::vector<int> > closedSupports(nChannels);
+	std::vector<bool> inUnion(nChannels, false);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		if (!uniform[i])
+		{
+			continue;
+		}
+
+		rowCount[supports[i]]++;
+
+		if (supports[i].size() >= MIN_SHARED_SUM_SIZE)
+		{
+			std::vector<int>& closed = closedSupports[i];
+			closed = supports[i];
+			std::vector<int>::iterator it = std::lower_bound(closed.begin(), closed.end(), i);
+			if (it == closed.end() || *it != i)
+			{
+				closed.insert(it, i);
+			}
+			closedCount[closed]++;
+
+			for (int k=0; k<(int) supports[i].size(); k++)
+			{
+				inUnion[supports[i][k]] = true;
+			}
+		}
+	}
+
+	std::vector<int> allChannels;
+	for (int j=0; j<nChannels; j++)
+	{
+		if (inUnion[j])
+		{
+			allChannels.push_back(j);
+		}
+	}
+
+	for (int i=0; i<nChannels; i++)
+	{
+		const std::vector<int>& support = supports[i];
+		int numRefs = (int) support.size();
+
+		if (numRefs == 0)
+		{
+			rowStart.push_back((int) sourceIndex.size());
+			continue;
+		}
+
+		float refGain = weights[i][0];
+		bool selfIncluded = std::binary_search(support.begin(), support.end(), i);
+		bool isShared = uniform[i] && numRefs >= MIN_SHARED_SUM_SIZE;
+
+		std::vector<int> complement;
+		if (isShared)
+		{
+			std::set_difference(allChannels.begin(), allChannels.end(),
+								support.begin(), support.end(),
+								std::back_inserter(complement));
+		}
+
+		if (isShared && closedCount[closedSupports[i]] > 1)
+		{
+			/* Shared (group) average, optionally excluding the target:
+			   x - g/n * (S - x) = (1 + g/n) * x - g/n * S */
+			int sum = findOrAddSum(closedSupports[i]);
+			sourceIndex.push_back(nChannels + sum);
+			gains.push_back(-1.0f * refGain);
+
+			if (!selfIncluded)
+			{
+				selfGains[i] += refGain;
+			}
+		}
+		else if (isShared && 2 * complement.size() < support.size())
+		{
+			/* Everything except a small set (e.g. all except own tetrode):
+			   subtract the small set from the shared sum of all channels */
+			int sum = findOrAddSum(allChannels);
+			sourceIndex.push_back(nChannels + sum);
+			gains.push_back(-1.0f * refGain);
+
+			if (complement.size() == 1 && complement[0] == i)
+			{
+				selfGains[i] += refGain;
+			}
+			else if (complement.size() == 1)
+			{
+				sourceIndex.push_back(complement[0]);
+				gains.push_back(refGain);
+			}
+			else if (complement.size() > 1)
+			{
+				sourceIndex.push_back(nChannels + findOrAddSum(complement));
+				gains.push_back(refGain);
+			}
+		}
+		else if (uniform[i] && (rowCount[support] - 1) * (numRefs - 1) > 1)
+		{
+			/* Small reference set used by several rows (e.g. a whole shank
+			   referenced to the same quiet channels): computing it once
+			   costs numRefs + count passes instead of numRefs * count */
+			sourceIndex.push_back(nChannels + findOrAddSum(support));
+			gains.push_back(-1.0f * refGain);
+		}
+		else
+		{
+			for (int k=0; k<numRefs; k++)
+			{
+				sourceIndex.push_back(support[k]);
+				gains.push_back(-1.0f * weights[i][k]);
+			}
+		}
+
+		rowStart.push_back((int) sourceIndex.size());
+	}
+
+	buildSchedule(std::vector<int>(), 0);
+
+	sumLookup.clear();
+}
+
+void ReferencePlan::compileNetworks(const std::vector<std::vector<int> >& supports,
+									bool median, float trimFraction,
+									const std::vector<float>& referenceGains)
+{
+	reset();
+
+	/* Rows that reference all channels of a large group except themselves
+	   share the sorted group, so that it is sorted once; each of them then
+	   takes its own statistic from it (see processNetworks()) */
+	std::map<std::vector<int>, int> closedCount;
+	std::vector<std::vector<int> > closedSupports(nChannels);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		const std::vector<int>& support = supports[i];
+		if (support.size() >= MIN_SHARED_SUM_SIZE
+			&& !std::binary_search(support.begin(), support.end(), i))
+		{
+			std::vector<int>& closed = closedSupports[i];
+			closed = support;
+			closed.insert(std::lower_bound(closed.begin(), closed.end(), i), i);
+			closedCount[closed]++;
+		}
+	}
+
+	/* Groups are keyed by their channels and whether rows leave one out */
+	std::map<std::pair<std::vector<int>, bool>, int> groupLookup;
+	std::vector<std::vector<int> > leaveOuts;
+	std::vector<int> rowGroup(nChannels, -1);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		bool leaveOut = !closedSupports[i].empty() && closedCount[closedSupports[i]] > 1;
+		const std::vector<int>& members = leaveOut ? closedSupports[i] : supports[i];
+
+		if (members.empty())
+		{
+			continue;
+		}
+
+		std::pair<std::vector<int>, bool> key(members, leaveOut);
+		std::map<std::pair<std::vector<int>, bool>, int>::iterator it = groupLookup.find(key);
+		int group;
+
+		if (it != groupLookup.end())
+		{
+			group = it->second;
+		}
+		else
+		{
+			/* Order statistics of the references of a row; with a channel
+			   left out, the network sorts one rank further */
+			int n = (int) members.size() - (leaveOut ? 1 : 0);
+			int first, last;
+
+			if (median)
+			{
+				first = (n - 1) / 2;
+				last = n / 2;
+			}
+			else
+			{
+				first = std::min((int) (trimFraction * n), (n - 1) / 2);
+				last = n - 1 - first;
+			}
+
+			group = getNumNetworkGroups();
+			groupLookup[key] = group;
+			groupMembers.insert(groupMembers.end(), members.begin(), members.end());
+			groupStart.push_back((int) groupMembers.size());
+			groupNetwork.push_back(addNetwork((int) members.size(), first, leaveOut ? last + 1 : last));
+			leaveOuts.push_back(std::vector<int>());
+			numNetworkReferences += leaveOut ? 0 : 1;
+		}
+
+		rowGroup[i] = group;
+		if (leaveOut)
+		{
+			leaveOuts[group].push_back(i);
+		}
+	}
+
+	/* Buffers of the rows that leave themselves out follow the groups */
+	std::vector<int> leaveOutBuffer(nChannels, -1);
+	int firstLeaveOut = nChannels + getNumNetworkGroups();
+
+	for (int g=0; g<getNumNetworkGroups(); g++)
+	{
+		for (int k=0; k<(int) leaveOuts[g].size(); k++)
+		{
+			leaveOutBuffer[leaveOuts[g][k]] = firstLeaveOut + (int) groupLeaveOut.size();
+			groupLeaveOut.push_back(leaveOuts[g][k]);
+		}
+		groupLeaveOutStart.push_back((int) groupLeaveOut.size());
+	}
+
+	numNetworkReferences += (int) groupLeaveOut.size();
+
+	for (int i=0; i<nChannels; i++)
+	{
+		if (rowGroup[i] >= 0)
+		{
+			sourceIndex.push_back(leaveOutBuffer[i] >= 0 ? leaveOutBuffer[i] : nChannels + rowGroup[i]);
+			gains.push_back(-1.0f * referenceGains[i]);
+		}
+
+		rowStart.push_back((int) sourceIndex.size());
+	}
+
+	buildSchedule(std::vector<int>(), 0);
+}
+
+int ReferencePlan::addNetwork(int size, int firstOutput, int lastOutput)
+{
+	for (int net=0; net<(int) networkKeys.size() / 3; net++)
+	{
+		if (networkKeys[3*net] == size && networkKeys[3*net + 1] == firstOutput
+			&& networkKeys[3*net + 2] == lastOutput)
+		{
+			return net;
+		}
+	}
+
+	/* Batcher's odd-even merge sort over the next power of two. Padding
+	   wires hold +inf and never need to be compared: a comparator whose
+	   upper wire is padding does nothing, and one whose lower wire is
+	   padding only moves a value, which is done by relabeling the slots. */
+	int numWires = 1;
+	while (numWires < size)
+	{
+		numWires *= 2;
+	}
+
+	std::vector<int> slotAt(numWires);
+	for (int w=0; w<numWires; w++)
+	{
+		slotAt[w] = w;
+	}
+
+	std::vector<int> pairs;
+
+	for (int p=1; p<numWires; p*=2)
+	{
+		for (int k=p; k>0; k/=2)
+		{
+			for (int j=k%p; j+k<numWires; j+=2*k)
+			{
+				for (int i=0; i<k && i+j+k<numWires; i++)
+				{
+					if ((i + j) / (2*p) != (i + j + k) / (2*p))
+					{
+						continue;
+					}
+
+					int a = slotAt[i + j];
+					int b = slotAt[i + j + k];
+
+					if (b >= size)
+					{
+						continue;
+					}
+					else if (a >= size)
+					{
+						std::swap(slotAt[i + j], slotAt[i + j + k]);
+					}
+					else
+					{
+						pairs.push_back(a);
+						pairs.push_back(b);
+					}
+				}
+			}
+		}
+	}
+
+	/* Selection network: keep only comparators that the output wires
+	   depend on */
+	std::vector<bool> isNeeded(size, false);
+	for (int w=firstOutput; w<=lastOutput; w++)
+	{
+		isNeeded[slotAt[w]] = true;
+		networkOutputs.push_back(slotAt[w]);
+	}
+
+	std::vector<int> selected;
+	for (int c=(int) pairs.size() / 2 - 1; c>=0; c--)
+	{
+		int a = pairs[2*c];
+		int b = pairs[2*c + 1];
+
+		if (isNeeded[a] || isNeeded[b])
+		{
+			isNeeded[a] = isNeeded[b] = true;
+			selected.push_back(b);
+			selected.push_back(a);
+		}
+	}
+
+	networkPairs.insert(networkPairs.end(), selected.rbegin(), selected.rend());
+	networkPairStart.push_back((int) networkPairs.size() / 2);
+	networkOutputStart.push_back((int) networkOutputs.size());
+
+	networkKeys.push_back(size);
+	networkKeys.push_back(firstOutput);
+	networkKeys.push_back(lastOutput);
+
+	return (int) networkKeys.size() / 3 - 1;
+}
+
+static int gcd(int a, int b)
+{
+	while (b != 0)
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* gcd of g and the boundaries of the contiguous runs of a sorted reference
+   set; 0 if there are no interior boundaries */
+static int gcdOfRunBoundaries(const std::vector<int>& support, int nChannels, int g)
+{
+	for (int k=0; k<(int) support.size(); k++)
+	{
+		int c = support[k];
+		if (c > 0 && (k == 0 || support[k-1] != c - 1))
+		{
+			g = gcd(g, c);
+		}
+		if (c + 1 < nChannels && (k + 1 == (int) support.size() || support[k+1] != c + 1))
+		{
+			g = gcd(g, c + 1);
+		}
+	}
+	return g;
+}
+
+int ReferencePlan::findBlockSize(const std::vector<std::vector<int> >& supports)
+{
+	/* A block size fits if every reference set, either as it is or with
+	   the target itself added, only has run boundaries at multiples of it.
+	   Returns the largest such size, or 0 if the matrix is not block
+	   structured. */
+	std::vector<int> gSupport(nChannels, 0);
+	std::vector<int> gClosed(nChannels, -1);
+	bool hasBoundaries = false;
+
+	for (int i=0; i<nChannels; i++)
+	{
+		const std::vector<int>& support = supports[i];
+		if (support.size() == 0)
+		{
+			continue;
+		}
+
+		gSupport[i] = gcdOfRunBoundaries(support, nChannels, 0);
+		if (!std::binary_search(support.begin(), support.end(), i))
+		{
+			std::vector<int> closed(support);
+			closed.insert(std::lower_bound(closed.begin(), closed.end(), i), i);
+			gClosed[i] = gcdOfRunBoundaries(closed, nChannels, 0);
+		}
+
+		if (gSupport[i] != 0 && gClosed[i] != 0)
+		{
+			hasBoundaries = true;
+		}
+	}
+
+	/* No interior boundaries at all (e.g. plain CAR) is not a block
+	   structure; the shared sum plan handles it */
+	if (!hasBoundaries)
+	{
+		return 0;
+	}
+
+	for (int size=nChannels/2; size>1; size--)
+	{
+		bool fits = true;
+		for (int i=0; i<nChannels && fits; i++)
+		{
+			fits = gSupport[i] % size == 0 || (gClosed[i] >= 0 && gClosed[i] % size == 0);
+		}
+
+		if (fits)
+		{
+			return size;
+		}
+	}
+
+	return 0;
+}
+
+void ReferencePlan::compileBlocks(const std::vector<std::vector<int> >& supports, int size,
+								  const std::vector<std::vector<float> >& weights)
+{
+	reset();
+	blockSize = size;
+
+	int numBlocks = (nChannels + size - 1) / size;
+
+	/* Blocks referenced by each row; rows excluding themselves from their
+	   own block fold the self term into the self gain */
+	std::vector<std::vector<int> > rowBlocks(nChannels);
+	std::vector<bool> selfExcluded(nChannels, false);
+	std::vector<int> blockSum(numBlocks, -1);
+	std::vector<bool> inUnion(numBlocks, false);
+
+	for (int i=0; i<nChannels; i++)
+	{
+		const std::vector<int>& support = supports[i];
+		if (support.size() == 0)
+		{
+			continue;
+		}
+
+		std::vector<int> closed(support);
+		if (!std::binary_search(support.begin(), support.end(), i)
+			&& gcdOfRunBoundaries(support, nChannels, size) != size)
+		{
+			closed.insert(std::lower_bound(closed.begin(), closed.end(), i), i);
+			selfExcluded[i] = true;
+		}
+
+		for (int k=0; k<(int) closed.size(); k++)
+		{
+			int b = closed[k] / size;
+			if (rowBlocks[i].size() == 0 || rowBlocks[i].back() != b)
+			{
+				rowBlocks[i].push_back(b);
+				inUnion[b] = true;
+			}
+		}
+	}
+
+	/* One sum per referenced block, computed once per block of samples */
+	std::vector<int> unionBlocks;
+	for (int b=0; b<numBlocks; b++)
+	{
+		if (inUnion[b])
+		{
+			std::vector<int> members;
+			for (int c=b*size; c<std::min((b+1)*size, nChannels); c++)
+			{
+				members.push_back(c);
+			}
+			blockSum[b] = findOrAddSum(members);
+			unionBlocks.push_back(b);
+		}
+	}
+
+	/* Sum over all referenced blocks, built from the block sums */
+	int unionSum = -1;
+
+	for (int i=0; i<nChannels; i++)
+	{
+		const std::vector<int>& blocks = rowBlocks[i];
+		int numRefs = (int) supports[i].size();
+
+		if (numRefs > 0)
+		{
+			float refGain = weights[i][0];
+
+			std::vector<int> complement;
+			std::set_difference(unionBlocks.begin(), unionBlocks.end(),
+								blocks.begin(), blocks.end(),
+								std::back_inserter(complement));
+
+			if (blocks.size() > 2 && complement.size() < blocks.size())
+			{
+				/* All blocks except a few (e.g. avg of other tetrodes) */
+				if (unionSum < 0)
+				{
+					std::vector<int> members;
+					for (int k=0; k<(int) unionBlocks.size(); k++)
+					{
+						members.push_back(nChannels + blockSum[unionBlocks[k]]);
+					}
+					unionSum = findOrAddSum(members);
+				}
+
+				sourceIndex.push_back(nChannels + unionSum);
+				gains.push_back(-1.0f * refGain);
+				for (int k=0; k<(int) complement.size(); k++)
+				{
+					sourceIndex.push_back(nChannels + blockSum[complement[k]]);
+					gains.push_back(refGain);
+				}
+			}
+			else
+			{
+				for (int k=0; k<(int) blocks.size(); k++)
+				{
+					sourceIndex.push_back(nChannels + blockSum[blocks[k]]);
+					gains.push_back(-1.0f * refGain);
+				}
+			}
+
+			if (selfExcluded[i])
+			{
+				selfGains[i] += refGain;
+			}
+		}
+
+		rowStart.push_back((int) sourceIndex.size());
+	}
+
+	/* If every row only refers to its own block (e.g. tetrode presets),
+	   process group by group so that each group's channels are still in
+	   cache when its members are referenced. Otherwise all sums first. */
+	bool selfContained = unionSum < 0;
+	for (int i=0; i<nChannels && selfContained; i++)
+	{
+		const std::vector<int>& blocks = rowBlocks[i];
+		selfContained = blocks.size() == 0 || (blocks.size() == 1 && blocks[0] == i / size);
+	}
+
+	buildSchedule(blockSum, selfContained ? size : 0);
+
+	sumLookup.clear();
+}
+
+void ReferencePlan::buildSchedule(const std::vector<int>& groupSums, int groupSize)
+{
+	schedule.clear();
+	unitStart.clear();
+	phaseStart.clear();
+
+	if (groupSize > 0)
+	{
+		/* Each group (its sum followed by its members) is one unit; groups
+		   are independent of each other, so there is a single phase */
+		phaseStart.push_back(0);
+		for (int b=0; b<(int) groupSums.size(); b++)
+		{
+			unitStart.push_back((int) schedule.size());
+			if (groupSums[b] >= 0)
+			{
+				schedule.push_back(-groupSums[b] - 1);
+			}
+			for (int c=b*groupSize; c<std::min((b+1)*groupSize, nChannels); c++)
+			{
+				schedule.push_back(c);
+			}
+		}
+	}
+	else
+	{
+		/* All sums first, ordered by their depth (sums of sums come after
+		   their members), then all rows. Steps of the same depth are
+		   independent and form one phase. */
+		int numSums = getNumSums();
+		std::vector<int> level(numSums, 0);
+		int maxLevel = -1;
+
+		for (int s=0; s<numSums; s++)
+		{
+			for (int k=sumStart[s]; k<sumStart[s + 1]; k++)
+			{
+				if (sumMembers[k] >= nChannels)
+				{
+					level[s] = std::max(level[s], level[sumMembers[k] - nChannels] + 1);
+				}
+			}
+			maxLevel = std::max(maxLevel, level[s]);
+		}
+
+		for (int l=0; l<=maxLevel; l++)
+		{
+			phaseStart.push_back((int) unitStart.size());
+			for (int s=0; s<numSums; s++)
+			{
+				if (level[s] == l)
+				{
+					unitStart.push_back((int) schedule.size());
+					schedule.push_back(-s - 1);
+				}
+			}
+		}
+
+		phaseStart.push_back((int) unitStart.size());
+		for (int i=0; i<nChannels; i++)
+		{
+			unitStart.push_back((int) schedule.size());
+			schedule.push_back(i);
+		}
+	}
+
+	unitStart.push_back((int) schedule.size());
+	phaseStart.push_back((int) unitStart.size() - 1);
+}
+
+int ReferencePlan::getCost()
+{
+	/* Number of channel passes per block */
+	return (int) sumMembers.size() + (int) sourceIndex.size();
+}
+
+int ReferencePlan::findOrAddSum(const std::vector<int>& members)
+{
+	std::map<std::vector<int>, int>::iterator it = sumLookup.find(members);
+	if (it != sumLookup.end())
+	{
+		return it->second;
+	}
+
+	int index = getNumSums();
+	sumMembers.insert(sumMembers.end(), members.begin(), members.end());
+	sumGains.insert(sumGains.end(), members.size(), 1.0f);
+	sumStart.push_back((int) sumMembers.size());
+	sumLookup[members] = index;
+
+	return index;
+}
+
+int ReferencePlan::getNumChannels()
+{
+	return nChannels;
+}
+
+int ReferencePlan::getNumEntries()
+{
+	return (int) sourceIndex.size();
+}
+
+int ReferencePlan::getRowStart(int rowIndex)
+{
+	return rowStart[rowIndex];
+}
+
+int ReferencePlan::getRowEnd(int rowIndex)
+{
+	return rowStart[rowIndex + 1];
+}
+
+int ReferencePlan::getBlockSize()
+{
+	return blockSize;
+}
+
+float ReferencePlan::getSelfGain(int rowIndex)
+{
+	return selfGains[rowIndex];
+}
+
+const int* ReferencePlan::getSourceIndices()
+{
+	return sourceIndex.data();
+}
+
+const float* ReferencePlan::getGains()
+{
+	return gains.data();
+}
+
+int ReferencePlan::getNumSums()
+{
+	return (int) sumStart.size() - 1;
+}
+
+int ReferencePlan::getSumStart(int sumIndex)
+{
+	return sumStart[sumIndex];
+}
+
+int ReferencePlan::getSumEnd(int sumIndex)
+{
+	return sumStart[sumIndex + 1];
+}
+
+const int* ReferencePlan::getSumMembers()
+{
+	return sumMembers.data();
+}
+
+void ReferencePlan::allocateScratch()
+{
+	/* Sums read the channels before they are referenced (see schedule), but
+	   a row may run after (or concurrently with) the row of a channel it
+	   references directly. Those channels are copied first and the rows
+	   read the copy instead. */
+	std::vector<int> snapshotSlot(nChannels, -1);
+	int numSums = getNumSums();
+	int firstSnapshot = nChannels + numSums + getNumNetworkBuffers();
+
+	snapshotChannels.clear();
+
+	for (int k=0; k<(int) sourceIndex.size(); k++)
+	{
+		int j = sourceIndex[k];
+		bool isModified = j < nChannels && (rowStart[j + 1] > rowStart[j] || selfGains[j] != 1.0f);
+
+		if (isModified)
+		{
+			if (snapshotSlot[j] < 0)
+			{
+				snapshotSlot[j] = (int) snapshotChannels.size();
+				snapshotChannels.push_back(j);
+			}
+			sourceIndex[k] = firstSnapshot + snapshotSlot[j];
+		}
+	}
+
+	/* The last buffer stays zero; masked channels are read from it */
+	int numBuffers = numSums + getNumNetworkBuffers() + (int) snapshotChannels.size() + 1;
+	scratch.assign((size_t) numBuffers * REFERENCE_BLOCK_SIZE, 0.0f);
+	zeroSource = nChannels + numBuffers - 1;
+
+	int maxGroupSize = 0;
+	for (int g=0; g<getNumNetworkGroups(); g++)
+	{
+		maxGroupSize = std::max(maxGroupSize, groupStart[g + 1] - groupStart[g]);
+	}
+
+	tileStride = maxGroupSize * NETWORK_TILE_WIDTH;
+	networkTiles.assign((size_t) MAX_NETWORK_TASKS * tileStride, 0.0f);
+
+	sourceTable.assign(nChannels + numBuffers, nullptr);
+	for (int k=0; k<numBuffers; k++)
+	{
+		sourceTable[nChannels + k] = scratch.data() + (size_t) k * REFERENCE_BLOCK_SIZE;
+	}
+
+	filterTile.assign(nChannels, nullptr);
+}
+
+void ReferencePlan::compileMasks(const std::vector<std::vector<int> >& supports,
+								 const std::vector<std::vector<float> >& rowGains, bool renormalize_)
+{
+	int firstSnapshot = nChannels + getNumSums() + getNumNetworkBuffers();
+
+	renormalize = renormalize_;
+	channelMasked.assign(nChannels, 0);
+	numMasked = 0;
+	baseSourceIndex = sourceIndex;
+	baseGains = gains;
+	baseSelfGains = selfGains;
+
+	/* Places where each channel is read, as a source of a row (directly or
+	   through its snapshot) or as a member of a sum */
+	std::vector<int> sourceChannel(sourceIndex.size(), -1);
+	maskStart.assign(nChannels + 1, 0);
+
+	for (int k=0; k<(int) sourceIndex.size(); k++)
+	{
+		int j = sourceIndex[k];
+		if (j < nChannels)
+			sourceChannel[k] = j;
+		else if (j >= firstSnapshot && j < zeroSource)
+			sourceChannel[k] = snapshotChannels[j - firstSnapshot];
+
+		if (sourceChannel[k] >= 0)
+			maskStart[sourceChannel[k] + 1]++;
+	}
+
+	for (int k=0; k<(int) sumMembers.size(); k++)
+	{
+		if (sumMembers[k] < nChannels)
+			maskStart[sumMembers[k] + 1]++;
+	}
+
+	for (int c=0; c<nChannels; c++)
+		maskStart[c + 1] += maskStart[c];
+
+	std::vector<int> fill(maskStart.begin(), maskStart.end() - 1);
+	maskPositions.resize(maskStart[nChannels]);
+
+	for (int k=0; k<(int) sourceIndex.size(); k++)
+	{
+		if (sourceChannel[k] >= 0)
+			maskPositions[fill[sourceChannel[k]]++] = k;
+	}
+
+	for (int k=0; k<(int) sumMembers.size(); k++)
+	{
+		if (sumMembers[k] < nChannels)
+			maskPositions[fill[sumMembers[k]]++] = -k - 1;
+	}
+
+	/* Rows referencing each channel, with the weight they give it */
+	refRowStart.assign(nChannels + 1, 0);
+	refRows.clear();
+	refRowGains.clear();
+	rowWeight.assign(nChannels, 0.0f);
+	maskedWeight.assign(nChannels, 0.0f);
+	maskedCount.assign(nChannels, 0);
+
+	if (renormalize)
+	{
+		for (int i=0; i<nChannels; i++)
+		{
+			for (int k=0; k<(int) supports[i].size(); k++)
+			{
+				refRowStart[supports[i][k] + 1]++;
+				rowWeight[i] += rowGains[i][k];
+			}
+		}
+
+		for (int c=0; c<nChannels; c++)
+			refRowStart[c + 1] += refRowStart[c];
+
+		refRows.resize(refRowStart[nChannels]);
+		refRowGains.resize(refRowStart[nChannels]);
+		fill.assign(refRowStart.begin(), refRowStart.end() - 1);
+
+		for (int i=0; i<nChannels; i++)
+		{
+			for (int k=0; k<(int) supports[i].size(); k++)
+			{
+				int slot = fill[supports[i][k]]++;
+				refRows[slot] = i;
+				refRowGains[slot] = rowGains[i][k];
+			}
+		}
+	}
+}
+
+void ReferencePlan::setChannelMasked(int channel, bool masked)
+{
+	if (channel < 0 || channel >= nChannels || (channelMasked[channel] != 0) == masked)
+		return;
+
+	channelMasked[channel] = masked ? 1 : 0;
+	numMasked += masked ? 1 : -1;
+
+	rowMontage.setChannelMasked(channel, masked);
+	for (int m=0; m<(int) montages.size(); m++)
+		montages[m].setChannelMasked(channel, masked);
+
+	for (int m=maskStart[channel]; m<maskStart[channel + 1]; m++)
+	{
+		int k = maskPositions[m];
+		if (k >= 0)
+			sourceIndex[k] = masked ? zeroSource : baseSourceIndex[k];
+		else
+			sumMembers[-k - 1] = masked ? zeroSource : channel;
+	}
+
+	for (int m=refRowStart[channel]; m<refRowStart[channel + 1]; m++)
+	{
+		int i = refRows[m];
+		maskedWeight[i] += masked ? refRowGains[m] : -refRowGains[m];
+		maskedCount[i] += masked ? 1 : -1;
+
+		/* Avoid drift once all references of a row are back */
+		if (maskedCount[i] == 0)
+			maskedWeight[i] = 0.0f;
+
+		updateRowGains(i);
+	}
+
+	/* A row that excludes itself from a shared sum adds itself back through
+	   the self gain, which no longer applies once the channel reads as zero */
+	if (baseSelfGains[channel] != 1.0f)
+		updateRowGains(channel);
+}
+
+bool ReferencePlan::isChannelMasked(int channel)
+{
+	return channel >= 0 && channel < nChannels && channelMasked[channel] != 0;
+}
+
+void ReferencePlan::updateRowGains(int rowIndex)
+{
+	float scale = 1.0f;
+
+	if (renormalize && maskedCount[rowIndex] > 0)
+	{
+		float remaining = rowWeight[rowIndex] - maskedWeight[rowIndex];
+		scale = remaining > 1e-6f * rowWeight[rowIndex] ? rowWeight[rowIndex] / remaining : 0.0f;
+	}
+
+	for (int k=rowStart[rowIndex]; k<rowStart[rowIndex + 1]; k++)
+	{
+		gains[k] = baseGains[k] * scale;
+	}
+
+	float fold = channelMasked[rowIndex] ? 0.0f : baseSelfGains[rowIndex] - 1.0f;
+	selfGains[rowIndex] = 1.0f + fold * scale;
+}
+
+int ReferencePlan::getNumDistinctReferences()
+{
+	return numDistinctReferences;
+}
+
+int ReferencePlan::getNumNetworkGroups()
+{
+	return (int) groupStart.size() - 1;
+}
+
+int ReferencePlan::getNumNetworkBuffers()
+{
+	return getNumNetworkGroups() + (int) groupLeaveOut.size();
+}
+
+int ReferencePlan::getGroupKernelSize()
+{
+	return groupKernelSize;
+}
+
+void ReferencePlan::setGroupKernelEnabled(bool enabled)
+{
+	groupKernelEnabled = enabled;
+}
+
+bool ReferencePlan::isMontage()
+{
+	return rowMontageCompiled;
+}
+
+void ReferencePlan::setMontageEnabled(bool enabled)
+{
+	montageEnabled = enabled;
+}
+
+bool ReferencePlan::addMontage(const std::vector<ReferenceMontage::Derivation>& derivations, float globalGain)
+{
+	/* A montage that does not fit is added empty, so that the indices of
+	   the montages stay the same */
+	ReferenceMontage montage;
+	bool compiled = montage.compile(nChannels, derivations, globalGain,
+									channelGains.empty() ? nullptr : channelGains.data());
+
+	for (int c=0; c<nChannels; c++)
+	{
+		if (channelMasked[c])
+			montage.setChannelMasked(c, true);
+	}
+
+	montages.push_back(montage);
+	return compiled;
+}
+
+int ReferencePlan::getNumMontages()
+{
+	return (int) montages.size();
+}
+
+void ReferencePlan::setActiveMontage(int montageIndex)
+{
+	activeMontage.index = montageIndex >= 0 && montageIndex < getNumMontages() ? montageIndex : -1;
+}
+
+int ReferencePlan::getActiveMontage()
+{
+	return activeMontage.index;
+}
+
+void ReferencePlan::processMontage(int montageIndex, float* const* channels, int numSamples,
+								   ReferenceKernels::Type type, ReferenceThreadPool* threadPool,
+								   ReferenceFilter* filter)
+{
+	processFiltered(montageIndex, channels, numSamples, type, threadPool, filter);
+}
+
+int ReferencePlan::getNumSnapshots()
+{
+	return (int) snapshotChannels.size();
+}
+
+int ReferencePlan::getScheduleLength()
+{
+	return (int) schedule.size();
+}
+
+const int* ReferencePlan::getSchedule()
+{
+	return schedule.data();
+}
+
+void ReferencePlan::processSteps(int firstStep, int lastStep, int numSamples, AccumulateKernel kernel)
+{
+	float* const* sources = sourceTable.data();
+
+	for (int step=firstStep; step<lastStep; step++)
+	{
+		if (schedule[step] < 0)
+		{
+			int s = -schedule[step] - 1;
+			kernel(sources[nChannels + s], 0.0f, sources,
+				   sumMembers.data() + sumStart[s], sumGains.data() + sumStart[s],
+				   sumStart[s + 1] - sumStart[s], numSamples);
+		}
+		else
+		{
+			int i = schedule[step];
+			int numTerms = rowStart[i + 1] - rowStart[i];
+
+			if (numTerms > 0 || selfGains[i] != 1.0f)
+			{
+				kernel(sources[i], selfGains[i], sources,
+					   sourceIndex.data() + rowStart[i], gains.data() + rowStart[i],
+					   numTerms, numSamples);
+			}
+		}
+	}
+}
+
+struct ParallelTask
+{
+	ReferencePlan* plan;
+	int numSamples;
+	int firstUnit;
+	int numUnits;
+	AccumulateKernel kernel;
+};
+
+void ReferencePlan::processUnits(void* context, int taskIndex, int numTasks)
+{
+	ParallelTask* task = (ParallelTask*) context;
+	ReferencePlan* plan = task->plan;
+
+	int firstUnit = task->firstUnit + task->numUnits * taskIndex / numTasks;
+	int lastUnit = task->firstUnit + task->numUnits * (taskIndex + 1) / numTasks;
+
+	plan->processSteps(plan->unitStart[firstUnit], plan->unitStart[lastUnit],
+					   task->numSamples, task->kernel);
+}
+
+void ReferencePlan::processNetworks(int firstTile, int lastTile, int numSamples,
+									CompareExchangeKernel kernel, float* tile)
+{
+	float acc[NETWORK_TILE_WIDTH];
+	int firstLeaveOut = nChannels + getNumSums() + getNumNetworkGroups();
+
+	for (int g=0; g<getNumNetworkGroups(); g++)
+	{
+		const int* members = groupMembers.data() + groupStart[g];
+		int numMembers = groupStart[g + 1] - groupStart[g];
+
+		int net = groupNetwork[g];
+		const int* pairs = networkPairs.data() + 2 * networkPairStart[net];
+		int numPairs = networkPairStart[net + 1] - networkPairStart[net];
+		const int* outputs = networkOutputs.data() + networkOutputStart[net];
+		int numOutputs = networkOutputStart[net + 1] - networkOutputStart[net];
+
+		/* Groups whose rows leave themselves out have one output more
+		   than their statistic has values */
+		int firstRow = groupLeaveOutStart[g];
+		int lastRow = groupLeaveOutStart[g + 1];
+		int numValues = firstRow < lastRow ? numOutputs - 1 : numOutputs;
+		float scale = 1.0f / float(numValues);
+
+		float* dest = sourceTable[nChannels + getNumSums() + g];
+
+		for (int t=firstTile; t<lastTile; t++)
+		{
+			int offset = t * NETWORK_TILE_WIDTH;
+			int n = std::min(NETWORK_TILE_WIDTH, numSamples - offset);
+
+			/* One slot per channel of the group */
+			for (int k=0; k<numMembers; k++)
+			{
+				const float* src = sourceTable[members[k]] + offset;
+				std::copy(src, src + n, tile + k * NETWORK_TILE_WIDTH);
+			}
+
+			kernel(tile, pairs, numPairs);
+
+			std::fill(acc, acc + NETWORK_TILE_WIDTH, 0.0f);
+			for (int o=0; o<numValues; o++)
+			{
+				const float* slot = tile + outputs[o] * NETWORK_TILE_WIDTH;
+				for (int l=0; l<NETWORK_TILE_WIDTH; l++)
+				{
+					acc[l] += slot[l];
+				}
+			}
+
+			if (firstRow == lastRow)
+			{
+				for (int l=0; l<n; l++)
+				{
+					dest[offset + l] = acc[l] * scale;
+				}
+				continue;
+			}
+
+			/* Without the row's own value x, value k of the statistic is
+			   rank k of the group if that is below x, else rank k + 1 */
+			const float* lowest = tile + outputs[0] * NETWORK_TILE_WIDTH;
+			const float* highest = tile + outputs[numValues - 1] * NETWORK_TILE_WIDTH;
+			const float* next = tile + outputs[numValues] * NETWORK_TILE_WIDTH;
+
+			for (int r=firstRow; r<lastRow; r++)
+			{
+				const float* x = sourceTable[groupLeaveOut[r]] + offset;
+				float* out = sourceTable[firstLeaveOut + r] + offset;
+
+				/* Medians pick their values, so that they stay exact */
+				if (numValues <= 2)
+				{
+					for (int l=0; l<n; l++)
+					{
+						float sum = 0.0f;
+						for (int o=0; o<numValues; o++)
+						{
+							float v = tile[outputs[o] * NETWORK_TILE_WIDTH + l];
+							sum += v < x[l] ? v : tile[outputs[o + 1] * NETWORK_TILE_WIDTH + l];
+						}
+						out[l] = sum * scale;
+					}
+					continue;
+				}
+
+				/* Trimmed means correct the sum of the ranks: x is above
+				   all of them, below all of them, or one of them */
+				for (int l=0; l<n; l++)
+				{
+					float sum;
+					if (highest[l] < x[l])
+						sum = acc[l];
+					else if (lowest[l] >= x[l])
+						sum = acc[l] - lowest[l] + next[l];
+					else
+						sum = acc[l] - x[l] + next[l];
+					out[l] = sum * scale;
+				}
+			}
+		}
+	}
+}
+
+struct NetworkTask
+{
+	ReferencePlan* plan;
+	int numSamples;
+	int numTiles;
+	CompareExchangeKernel kernel;
+};
+
+void ReferencePlan::processNetworkTiles(void* context, int taskIndex, int numTasks)
+{
+	NetworkTask* task = (NetworkTask*) context;
+	ReferencePlan* plan = task->plan;
+
+	int firstTile = task->numTiles * taskIndex / numTasks;
+	int lastTile = task->numTiles * (taskIndex + 1) / numTasks;
+
+	plan->processNetworks(firstTile, lastTile, task->numSamples, task->kernel,
+						  plan->networkTiles.data() + (size_t) taskIndex * plan->tileStride);
+}
+
+struct GroupTask
+{
+	float* const* channels;
+	int numSamples;
+	int groupSize;
+	int numGroups;
+	const float* selfGains;
+	const float* gains;
+	GroupKernel kernel;
+};
+
+void ReferencePlan::processGroups(void* context, int taskIndex, int numTasks)
+{
+	GroupTask* task = (GroupTask*) context;
+
+	/* Split the groups if there are enough, otherwise the samples (in whole
+	   cache lines; samples are independent) */
+	int firstGroup = 0;
+	int lastGroup = task->numGroups;
+	int first = 0;
+	int last = task->numSamples;
+
+	if (task->numGroups >= numTasks)
+	{
+		firstGroup = task->numGroups * taskIndex / numTasks;
+		lastGroup = task->numGroups * (taskIndex + 1) / numTasks;
+	}
+	else
+	{
+		int numLines = (task->numSamples + 15) / 16;
+		first = std::min(task->numSamples, 16 * (numLines * taskIndex / numTasks));
+		last = std::min(task->numSamples, 16 * (numLines * (taskIndex + 1) / numTasks));
+	}
+
+	for (int g=firstGroup; g<lastGroup; g++)
+	{
+		int c = g * task->groupSize;
+		task->kernel(task->channels + c, task->selfGains + c, task->gains + c, first, last - first);
+	}
+}
+
+void ReferencePlan::process(float* const* channels, int numSamples,
+							ReferenceKernels::Type type, ReferenceThreadPool* threadPool,
+							ReferenceFilter* filter)
+{
+	processFiltered(-1, channels, numSamples, type, threadPool, filter);
+}
+
+void ReferencePlan::processFiltered(int montageIndex, float* const* channels, int numSamples,
+									ReferenceKernels::Type type, ReferenceThreadPool* threadPool,
+									ReferenceFilter* filter)
+{
+	bool filtered = filter != nullptr && filter->isActive() && filter->getNumChannels() == nChannels;
+
+	/* Without a filter the whole block is one tile */
+	int tileSize = filtered ? FILTER_TILE_SIZE : std::max(numSamples, 1);
+
+	for (int offset=0; offset<numSamples; offset+=tileSize)
+	{
+		int n = std::min(tileSize, numSamples - offset);
+		float* const* tile = channels;
+
+		if (filtered)
+		{
+			for (int i=0; i<nChannels; i++)
+			{
+				filterTile[i] = channels[i] + offset;
+			}
+			tile = filterTile.data();
+		}
+
+		if (montageIndex >= 0)
+			montages[montageIndex].process(tile, n, type, threadPool);
+		else
+			processMatrix(tile, n, type, threadPool);
+
+		if (filtered)
+			filter->process(tile, n, type, threadPool);
+	}
+}
+
+void ReferencePlan::processMatrix(float* const* channels, int numSamples,
+								  ReferenceKernels::Type type, ReferenceThreadPool* threadPool)
+{
+	if (rowMontageCompiled && montageEnabled)
+	{
+		rowMontage.process(channels, numSamples, type, threadPool);
+		return;
+	}
+
+	if (groupKernelSize > 0 && groupKernelEnabled && numMasked == 0)
+	{
+		/* One row per channel, so gains[i] is the gain of row i; no
+		   scratch memory is needed */
+		GroupTask groupTask;
+		groupTask.channels = channels;
+		groupTask.numSamples = numSamples;
+		groupTask.groupSize = groupKernelSize;
+		groupTask.numGroups = nChannels / groupKernelSize;
+		groupTask.selfGains = selfGains.data();
+		groupTask.gains = gains.data();
+		groupTask.kernel = ReferenceKernels::getGroupKernel(type, groupKernelSize);
+
+		int numTasks = 1;
+		if (threadPool != nullptr && threadPool->getNumThreads() > 0)
+			numTasks = std::min(threadPool->getNumThreads() + 1, std::max(groupTask.numGroups, numSamples / 64));
+
+		if (numTasks > 1)
+			threadPool->run(&ReferencePlan::processGroups, &groupTask, numTasks);
+		else
+			processGroups(&groupTask, 0, 1);
+
+		return;
+	}
+
+	int numSnapshots = (int) snapshotChannels.size();
+	int firstSnapshot = nChannels + getNumSums() + getNumNetworkBuffers();
+	bool parallel = threadPool != nullptr && threadPool->getNumThreads() > 0;
+
+	ParallelTask task;
+	task.plan = this;
+	task.kernel = ReferenceKernels::getAccumulate(type);
+
+	NetworkTask networkTask;
+	networkTask.plan = this;
+	networkTask.kernel = ReferenceKernels::getCompareExchange(type);
+
+	/* The block is processed in pieces that fit the preallocated scratch */
+	for (int offset=0; offset<numSamples; offset+=REFERENCE_BLOCK_SIZE)
+	{
+		int n = std::min(REFERENCE_BLOCK_SIZE, numSamples - offset);
+		task.numSamples = n;
+
+		for (int i=0; i<nChannels; i++)
+		{
+			sourceTable[i] = channels[i] + offset;
+		}
+
+		/* Inputs that are read by other rows after being referenced */
+		for (int k=0; k<numSnapshots; k++)
+		{
+			const float* src = sourceTable[snapshotChannels[k]];
+			std::copy(src, src + n, sourceTable[firstSnapshot + k]);
+		}
+
+		/* Medians and trimmed means of the unreferenced input; tiles of
+		   samples are independent and can be split across the pool */
+		if (getNumNetworkGroups() > 0)
+		{
+			networkTask.numSamples = n;
+			networkTask.numTiles = (n + NETWORK_TILE_WIDTH - 1) / NETWORK_TILE_WIDTH;
+
+			int numTasks = parallel ? std::min(threadPool->getNumThreads() + 1, MAX_NETWORK_TASKS) : 1;
+			numTasks = std::min(numTasks, networkTask.numTiles);
+
+			if (numTasks > 1)
+			{
+				threadPool->run(&ReferencePlan::processNetworkTiles, &networkTask, numTasks);
+			}
+			else
+			{
+				processNetworkTiles(&networkTask, 0, 1);
+			}
+		}
+
+		if (!parallel)
+		{
+			processSteps(0, (int) schedule.size(), n, task.kernel);
+			continue;
+		}
+
+		/* Phases run one after the other; the units of one phase are split
+		   into contiguous ranges across the pool */
+		for (int p=0; p+1<(int) phaseStart.size(); p++)
+		{
+			task.firstUnit = phaseStart[p];
+			task.numUnits = phaseStart[p + 1] - phaseStart[p];
+
+			if (task.numUnits > 0)
+			{
+				int numTasks = std::min(threadPool->getNumThreads() + 1, task.numUnits);
+				threadPool->run(&ReferencePlan::processUnits, &task, numTasks);
+			}
+		}
+	}
+}
@@ -0,0 +1,381 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCEPLAN_H__
+#define __REFERENCEPLAN_H__
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "ReferenceKernels.h"
+#include "ReferenceMontage.h"
+#include "ReferenceThreadPool.h"
+
+class ReferenceFilter;
+class ReferenceMatrix;
+
+/* Rows with at least this many references are candidates for shared sums */
+#define MIN_SHARED_SUM_SIZE 8
+
+/* Samples per piece of a block; sizes the scratch buffers of a plan */
+#define REFERENCE_BLOCK_SIZE 1024
+
+/* Maximum number of threads that compute medians/trimmed means together */
+#define MAX_NETWORK_TASKS 16
+
+
+/**
+
+  Reference plan
+
+  Sparse (compressed row) form of a ReferenceMatrix. Each row lists the
+  column indices of the selected reference channels together with the final
+  gain that is applied to them, so that referencing costs O(number of
+  selected references) instead of O(nChannels^2) per block.
+
+  Reference sets that are used by several rows (common average reference,
+  per-group CAR, a shank referenced to the same channels) are not expanded
+  per row. Instead, the plan
+  lists them as shared sums that are computed once per block, and each row
+  refers to them as an additional source:
+
+    out[i] = selfGain[i] * in[i] + sum_k gain[k] * source[k]
+
+  where a source index below nChannels is an input channel, the next
+  getNumSums() indices are the shared sums, then the robust references
+  (see below), followed by copies of input channels that are referenced by
+  other rows after they were modified themselves (see getNumSnapshots()). "All except self" rows
+  fold the self term into selfGain, and "all except group" rows are the
+  difference of two shared sums.
+
+  Block-structured matrices (tetrode and shank presets) are detected and
+  compiled into one sum per group. Sums over many groups are built from
+  the group sums, so sum members use the same source indexing as rows.
+  The schedule lists the order in which sums (encoded as -index - 1) and
+  rows (>= 0) are computed; for self-contained groups each group sum is
+  directly followed by its members so the group stays in cache.
+
+  Each row and each sum is computed by a single call of the vectorized
+  weighted-accumulate kernel (see ReferenceKernels).
+
+  Plans that consist of equal groups only, where every row subtracts the
+  sum of its own group (tetrode presets, or a common average reference as
+  one group of all channels), are processed by a group kernel that is
+  specialized for the group size if there is one (4, 16, 32, 64, 128, 384;
+  see ReferenceKernels::getGroupKernel()). The kernel is picked when the
+  plan is compiled and gives the same result as the generic kernels.
+
+  Plans in which no row has more than one reference (bipolar derivations,
+  chains and other pairs, as set up in the single-selection mode of the
+  reference table) are processed as a ReferenceMontage instead: one fused
+  pass per row in an order that needs no copies of the input, except one
+  per reference cycle. The result is again the same.
+
+  Further montages can be compiled into a plan with addMontage() and
+  processed with processMontage() instead of the matrix, so the node can
+  switch between them from one block to the next without compiling
+  anything. The montage in use is kept by the plan (setActiveMontage()),
+  so that an index always refers to the montages of the same plan.
+
+  For median and trimmed-mean references, each distinct group of reference
+  channels is reduced per sample by a comparator network: the group is
+  copied into a tile of NETWORK_TILE_WIDTH samples per channel, sorted
+  across channels by a pruned Batcher network (only the comparators the
+  middle order statistics depend on) with vectorized min/max over the
+  samples, and the middle values are averaged. Rows subtract the result.
+  Rows that reference all channels of a group except themselves share the
+  sorted group, which is sorted one rank further: without the row's own
+  value x, order statistic k of the rest is rank k of the group if that
+  is below x and rank k + 1 otherwise, so each row gets the statistic of
+  exactly its references (trimmed means by correcting the sum of the
+  group's ranks).
+
+  For parallel processing, the schedule is divided into phases that run one
+  after the other. A phase consists of independent units (a single sum or
+  row, or a whole self-contained group) that can be split across threads.
+
+  All scratch memory (sum and snapshot buffers, source pointer table) is
+  allocated when the plan is compiled; process() never allocates.
+
+  If the referenced channels are to be filtered as well, process() takes
+  the filter and runs both on tiles of FILTER_TILE_SIZE samples of all
+  channels: each tile is referenced (by whichever path the plan uses) and
+  filtered while it is still in cache, so the filter does not need another
+  pass over the whole block in memory.
+
+  Input channels can be masked out of all references (e.g. broken
+  channels) without recompiling: every place where the channel is read as
+  a source is redirected to a buffer of zeros, and for normalized averages
+  the remaining gains of each affected row are rescaled so they still sum
+  to the same total. An index from each channel to these places and rows
+  makes this O(rows that reference the channel). Medians and trimmed means
+  are sorted by networks of a fixed size, so masks do not reach them;
+  instead, the channels excluded when the plan is compiled are left out of
+  their reference sets, and ChannelRefNode recompiles the plan when the
+  excluded channels change.
+
+  The reference gain of each channel (see ReferenceMatrix::getChannelGain())
+  is folded into the gains of its row like the global gain. Rows with
+  different reference gains still refer to the same sums, so a plan with
+  reference gains costs as much as one without.
+
+  The plan is compiled on the message thread whenever the matrix or the
+  global gain changes and is read-only afterwards, so it can be handed to
+  the audio thread as a whole.
+
+  @see ReferenceMatrix, ChannelRefNode
+
+*/
+
+class ReferencePlan
+{
+public:
+
+	ReferencePlan();
+	~ReferencePlan();
+
+	/** Rebuild the plan from the current matrix. Gains already include the
+	    sign, the weights and normalization of the matrix, the reference gain
+	    of each channel (unless useChannelGains is false) and the global gain,
+	    so processing is a pure multiply-add. Channels flagged in excluded
+	    (one entry per channel) are left out of medians and trimmed means. */
+	void compile(ReferenceMatrix* refMat, float globalGain, bool useChannelGains = true,
+				 const std::vector<char>* excluded = nullptr);
+
+	int getNumChannels();
+	int getNumEntries();
+
+	/** Channel passes per block; used to choose between engines. */
+	int getCost();
+
+	/** Group size of the block engine, 0 if the plan is not block structured. */
+	int getBlockSize();
+
+	int getRowStart(int rowIndex);
+	int getRowEnd(int rowIndex);
+	float getSelfGain(int rowIndex);
+
+	const int* getSourceIndices();
+	const float* getGains();
+
+	int getNumSums();
+	int getSumStart(int sumIndex);
+	int getSumEnd(int sumIndex);
+	const int* getSumMembers();
+
+	int getScheduleLength();
+	const int* getSchedule();
+
+	/** Number of different (non-empty) reference sets in the matrix. */
+	int getNumDistinctReferences();
+
+	/** Number of channel groups reduced by a median/trimmed-mean network. */
+	int getNumNetworkGroups();
+
+	/** Number of input channels that are copied before referencing. */
+	int getNumSnapshots();
+
+	/** Group size of the specialized group kernel, 0 if the plan is
+	    processed by the generic kernels. While channels are masked, the
+	    generic kernels are used. */
+	int getGroupKernelSize();
+
+	/** Use the group kernel if there is one (the default); for comparing
+	    it with the generic kernels. */
+	void setGroupKernelEnabled(bool enabled);
+
+	/** True if every row has at most one reference, so that the plan is
+	    processed as a montage (see ReferenceMontage). */
+	bool isMontage();
+
+	/** Process montage plans as a montage (the default); for comparing it
+	    with the generic kernels. */
+	void setMontageEnabled(bool enabled);
+
+	/** Compile a montage into the plan (see processMontage()). Returns
+	    false if the derivations do not fit the channels of the plan, in
+	    which case the montage is added without derivations. The reference
+	    gains of the channels apply like they do to the matrix. */
+	bool addMontage(const std::vector<ReferenceMontage::Derivation>& derivations, float globalGain);
+	int getNumMontages();
+
+	/** Montage the caller processes instead of the matrix, -1 for the
+	    matrix (the default). Can be set from any thread while the plan is
+	    processed; indices out of range select the matrix. */
+	void setActiveMontage(int montageIndex);
+	int getActiveMontage();
+
+	/** Exclude an input channel from (or include it again in) all average
+	    references, including those of the montages. The channel itself is
+	    still referenced. Must not be called while process() is running. */
+	void setChannelMasked(int channel, bool masked);
+	bool isChannelMasked(int channel);
+
+	/** Reference the given channel buffers in place. Blocks of any length
+	    are processed in pieces of REFERENCE_BLOCK_SIZE samples. If a
+	    thread pool with workers is given, each phase is split across it.
+	    If an active filter for the channels of the plan is given, the
+	    block is referenced and filtered tile by tile instead (see
+	    ReferenceFilter). */
+	void process(float* const* channels, int numSamples,
+				 ReferenceKernels::Type type, ReferenceThreadPool* threadPool,
+				 ReferenceFilter* filter = nullptr);
+
+	/** Reference the channels by one of the added montages instead of the
+	    matrix. */
+	void processMontage(int montageIndex, float* const* channels, int numSamples,
+						ReferenceKernels::Type type, ReferenceThreadPool* threadPool,
+						ReferenceFilter* filter = nullptr);
+
+private:
+
+	int nChannels;
+
+	void reset();
+	void compileSharedSums(const std::vector<std::vector<int> >& supports,
+						   const std::vector<std::vector<float> >& weights);
+	void compileBlocks(const std::vector<std::vector<int> >& supports, int size,
+					   const std::vector<std::vector<float> >& weights);
+	int findBlockSize(const std::vector<std::vector<int> >& supports);
+	int findOrAddSum(const std::vector<int>& members);
+	void buildSchedule(const std::vector<int>& groupSums, int groupSize);
+	void compileNetworks(const std::vector<std::vector<int> >& supports,
+						 bool median, float trimFraction,
+						 const std::vector<float>& referenceGains);
+	int addNetwork(int size, int firstOutput, int lastOutput);
+	int getNumNetworkBuffers();
+
+	void allocateScratch();
+	void compileMasks(const std::vector<std::vector<int> >& supports,
+					  const std::vector<std::vector<float> >& rowGains, bool renormalize);
+	void updateRowGains(int rowIndex);
+	void processSteps(int firstStep, int lastStep, int numSamples, AccumulateKernel kernel);
+
+	void processNetworks(int firstTile, int lastTile, int numSamples,
+						 CompareExchangeKernel kernel, float* tile);
+
+	static void processUnits(void* context, int taskIndex, int numTasks);
+	static void processNetworkTiles(void* context, int taskIndex, int numTasks);
+
+	void compileGroupKernel();
+	static void processGroups(void* context, int taskIndex, int numTasks);
+
+	void compileRowMontage(const std::vector<std::vector<int> >& supports,
+						   const std::vector<std::vector<float> >& weights);
+
+	void processFiltered(int montageIndex, float* const* channels, int numSamples,
+						 ReferenceKernels::Type type, ReferenceThreadPool* threadPool,
+						 ReferenceFilter* filter);
+	void processMatrix(float* const* channels, int numSamples,
+					   ReferenceKernels::Type type, ReferenceThreadPool* threadPool);
+
+	int blockSize;
+	int groupKernelSize;
+	bool groupKernelEnabled;
+	int numDistinctReferences;
+
+	/* The rows as a montage, if they have one reference at most */
+	ReferenceMontage rowMontage;
+	bool rowMontageCompiled;
+	bool montageEnabled;
+	std::vector<ReferenceMontage> montages;
+
+	/* Copyable, as compile() takes over the block plan by assignment */
+	struct MontageSelection
+	{
+		MontageSelection() : index(-1) {}
+		MontageSelection(const MontageSelection& other) : index(other.index.load()) {}
+		MontageSelection& operator=(const MontageSelection& other) { index = other.index.load(); return *this; }
+		std::atomic<int> index;
+	};
+	MontageSelection activeMontage;
+
+	/* Reference gain of each channel, empty if they are not used */
+	std::vector<float> channelGains;
+
+	std::vector<float> selfGains;
+	std::vector<int> rowStart;
+	std::vector<int> sourceIndex;
+	std::vector<float> gains;
+
+	std::vector<int> sumStart;
+	std::vector<int> sumMembers;
+	std::vector<float> sumGains;
+	std::map<std::vector<int>, int> sumLookup;
+
+	std::vector<int> schedule;
+	std::vector<int> unitStart;
+	std::vector<int> phaseStart;
+
+	std::vector<int> groupStart;
+	std::vector<int> groupMembers;
+	std::vector<int> groupNetwork;
+
+	/* Channels whose rows take the statistic of a group without
+	   themselves; each has a buffer after those of the groups */
+	std::vector<int> groupLeaveOutStart;
+	std::vector<int> groupLeaveOut;
+	int numNetworkReferences;
+
+	std::vector<int> networkKeys;
+	std::vector<int> networkPairStart;
+	std::vector<int> networkPairs;
+	std::vector<int> networkOutputStart;
+	std::vector<int> networkOutputs;
+
+	std::vector<int> snapshotChannels;
+	std::vector<float> scratch;
+	std::vector<float*> sourceTable;
+
+	std::vector<float> networkTiles;
+	int tileStride;
+
+	/* Channel pointers of the current tile when filtering */
+	std::vector<float*> filterTile;
+
+	/* Channel masks: sources redirected to zeroSource, gains rescaled from
+	   their compiled values. maskPositions lists, per channel, positions in
+	   sourceIndex (>= 0) and in sumMembers (-position - 1); refRows lists
+	   the rows referencing the channel with the channel's share of the row
+	   weight. */
+	int zeroSource;
+	bool renormalize;
+	std::vector<char> channelMasked;
+	int numMasked;
+	std::vector<int> baseSourceIndex;
+	std::vector<float> baseGains;
+	std::vector<float> baseSelfGains;
+	std::vector<int> maskStart;
+	std::vector<int> maskPositions;
+	std::vector<int> refRowStart;
+	std::vector<int> refRows;
+	std::vector<float> refRowGains;
+	std::vector<float> rowWeight;
+	std::vector<float> maskedWeight;
+	std::vector<int> maskedCount;
+
+};
+
+
+#endif  //__REFERENCEPLAN_H__
@@ -0,0 +1,434 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+
+#include "ReferenceSettings.h"
+#include "ReferenceMatrix.h"
+
+
+/* Characters of a settings file, read in blocks */
+class SettingsStream
+{
+public:
+
+	SettingsStream(const std::string& path) :
+		file(path.c_str(), std::ios::in | std::ios::binary), buffer(SETTINGS_READ_BUFFER_SIZE),
+		position(0), length(0)
+	{
+	}
+
+	bool isOpen()
+	{
+		return file.is_open();
+	}
+
+	/* Next character, -1 at the end of the file */
+	int next()
+	{
+		if (position == length)
+		{
+			file.read(buffer.data(), buffer.size());
+			length = (int) file.gcount();
+			position = 0;
+
+			if (length == 0)
+				return -1;
+		}
+
+		return (unsigned char) buffer[position++];
+	}
+
+	/* Skip up to and including the given (ASCII) terminator */
+	bool skipPast(const char* terminator)
+	{
+		int matched = 0;
+
+		while (terminator[matched] != 0)
+		{
+			int c = next();
+			if (c < 0)
+				return false;
+
+			if (c == terminator[matched])
+				matched++;
+			else
+				matched = (c == terminator[0]) ? 1 : 0;
+		}
+
+		return true;
+	}
+
+private:
+
+	std::ifstream file;
+	std::vector<char> buffer;
+	int position;
+	int length;
+
+};
+
+
+static bool isSpace(int c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isNameChar(int c)
+{
+	return c > 0 && !isSpace(c) && c != '=' && c != '>' && c != '/' && c != '"' && c != '\'';
+}
+
+/* Replace the predefined XML entities and character references */
+static std::string unescape(const std::string& text)
+{
+	if (text.find('&') == std::string::npos)
+		return text;
+
+	std::string result;
+
+	for (size_t i=0; i<text.size(); i++)
+	{
+		size_t end = text.find(';', i);
+
+		if (text[i] != '&' || end == std::string::npos)
+		{
+			result += text[i];
+			continue;
+		}
+
+		std::string entity = text.substr(i + 1, end - i - 1);
+
+		if (entity == "amp")
+			result += '&';
+		else if (entity == "lt")
+			result += '<';
+		else if (entity == "gt")
+			result += '>';
+		else if (entity == "quot")
+			result += '"';
+		else if (entity == "apos")
+			result += '\'';
+		else if (entity.size() > 1 && entity[0] == '#')
+		{
+			long code = entity[1] == 'x' ? std::strtol(entity.c_str() + 2, nullptr, 16)
+										 : std::strtol(entity.c_str() + 1, nullptr, 10);
+			if (code < 0x80)
+				result += (char) code;
+		}
+		else
+		{
+			result += text.substr(i, end - i + 1);
+		}
+
+		i = end;
+	}
+
+	return result;
+}
+
+static int toInt(const ReferenceSettingsReader::Attributes& attributes, const char* name, int defaultValue)
+{
+	ReferenceSettingsReader::Attributes::const_iterator it = attributes.find(name);
+	return it != attributes.end() ? std::atoi(it->second.c_str()) : defaultValue;
+}
+
+
+ReferenceSettingsReader::ReferenceSettingsReader(ReferenceMatrix* refMat_, const std::string& baseDirectory_) :
+	refMat(refMat_), baseDirectory(baseDirectory_), foundReferences(false), inReferences(false), channelIndex(-1),
+	activeMontage(-1)
+{
+}
+
+ReferenceSettingsReader::~ReferenceSettingsReader()
+{
+}
+
+bool ReferenceSettingsReader::read(const std::string& path)
+{
+	SettingsStream stream(path);
+
+	if (!stream.isOpen())
+	{
+		setError("Couldn't open " + path);
+		return false;
+	}
+
+	std::string tag;
+	std::string name;
+	std::string value;
+	Attributes attributes;
+
+	for (int c = stream.next(); c >= 0; c = stream.next())
+	{
+		if (c != '<')
+			continue;
+
+		c = stream.next();
+
+		/* Declarations, processing instructions and comments */
+		if (c == '?')
+		{
+			stream.skipPast("?>");
+			continue;
+		}
+		else if (c == '!')
+		{
+			int d = stream.next();
+			stream.skipPast(d == '-' ? "-->" : ">");
+			continue;
+		}
+
+		bool closing = (c == '/');
+		if (closing)
+			c = stream.next();
+
+		tag.clear();
+		for (; isNameChar(c); c = stream.next())
+			tag += (char) c;
+
+		if (tag.empty())
+		{
+			setError("Malformed tag in " + path);
+			return false;
+		}
+
+		/* Attributes up to the end of the tag */
+		attributes.clear();
+		bool empty = false;
+
+		while (true)
+		{
+			while (isSpace(c))
+				c = stream.next();
+
+			if (c < 0)
+			{
+				setError("Unexpected end of " + path);
+				return false;
+			}
+			else if (c == '>')
+			{
+				break;
+			}
+			else if (c == '/')
+			{
+				empty = true;
+				c = stream.next();
+				continue;
+			}
+
+			name.clear();
+			for (; isNameChar(c); c = stream.next())
+				name += (char) c;
+
+			while (isSpace(c))
+				c = stream.next();
+
+			int quote = (c == '=') ? stream.next() : -1;
+			while (isSpace(quote))
+				quote = stream.next();
+
+			if (name.empty() || (quote != '"' && quote != '\''))
+			{
+				setError("Malformed attribute in <" + tag + "> in " + path);
+				return false;
+			}
+
+			value.clear();
+			for (c = stream.next(); c >= 0 && c != quote; c = stream.next())
+				value += (char) c;
+
+			attributes[name] = unescape(value);
+			c = stream.next();
+		}
+
+		if (closing)
+		{
+			endElement(tag);
+		}
+		else
+		{
+			startElement(tag, attributes);
+			if (empty)
+				endElement(tag);
+		}
+	}
+
+	return error.empty();
+}
+
+void ReferenceSettingsReader::startElement(const std::string& tag, const Attributes& attributes)
+{
+	if (tag == "PARAMETERS")
+	{
+		parameters = attributes;
+	}
+	else if (tag == "REFERENCES")
+	{
+		foundReferences = true;
+		inReferences = true;
+		refMat->clear();
+
+		Attributes::const_iterator preset = attributes.find("Preset");
+		Attributes::const_iterator sidecar = attributes.find("Sidecar");
+
+		if (preset != attributes.end())
+		{
+			int numChannels = toInt(attributes, "PresetChannels", refMat->getNumberOfChannels());
+			if (!refMat->applyPreset(preset->second, numChannels))
+				setError("Unknown preset " + preset->second);
+		}
+		else if (sidecar != attributes.end())
+		{
+			std::string path = sidecar->second;
+			bool absolute = (!path.empty() && (path[0] == '/' || path[0] == '\\')) || (path.size() > 1 && path[1] == ':');
+			if (!absolute && !baseDirectory.empty())
+				path = baseDirectory + "/" + path;
+
+			if (!refMat->readBinary(path))
+				setError("Couldn't read " + path);
+		}
+	}
+	else if (inReferences && tag == "CHANNEL")
+	{
+		channelIndex = toInt(attributes, "Index", 0) - 1;
+
+		Attributes::const_iterator ranges = attributes.find("Ranges");
+		if (ranges != attributes.end() && !refMat->setRowRanges(channelIndex, ranges->second))
+			setError("Invalid references of channel " + std::to_string(channelIndex + 1));
+	}
+	else if (tag == "MONTAGES")
+	{
+		montageNames.clear();
+		montageDerivations.clear();
+		activeMontage = toInt(attributes, "Active", -1);
+	}
+	else if (tag == "MONTAGE")
+	{
+		Attributes::const_iterator name = attributes.find("Name");
+		Attributes::const_iterator derivations = attributes.find("Derivations");
+
+		montageNames.push_back(name != attributes.end() ? name->second : "");
+		montageDerivations.push_back(std::vector<ReferenceMontage::Derivation>());
+
+		if (derivations != attributes.end()
+			&& !ReferenceMontage::fromText(derivations->second, montageDerivations.back()))
+			setError("Invalid derivations of montage " + montageNames.back());
+	}
+	else if (inReferences && tag == "REFERENCE" && channelIndex >= 0)
+	{
+		Attributes::const_iterator value = attributes.find("Value");
+		refMat->setValue(channelIndex, toInt(attributes, "Index", 0) - 1,
+						 value != attributes.end() ? (float) std::atof(value->second.c_str()) : 0.0f);
+	}
+}
+
+void ReferenceSettingsReader::endElement(const std::string& tag)
+{
+	if (tag == "REFERENCES")
+		inReferences = false;
+	else if (tag == "CHANNEL")
+		channelIndex = -1;
+}
+
+const ReferenceSettingsReader::Attributes& ReferenceSettingsReader::getParameters()
+{
+	return parameters;
+}
+
+double ReferenceSettingsReader::getParameter(const std::string& name, double defaultValue)
+{
+	Attributes::const_iterator it = parameters.find(name);
+	return it != parameters.end() ? std::atof(it->second.c_str()) : defaultValue;
+}
+
+void ReferenceSettingsReader::applyMatrixParameters()
+{
+	if (parameters.empty())
+		return;
+
+	/* Values out of range fall back to the defaults, like the other
+	   modes of the editor */
+	double mode = getParameter("Normalization", ReferenceMatrix::SUM_TO_ONE);
+	if (!(mode >= 0 && mode < ReferenceMatrix::NUM_NORMALIZATIONS))
+	{
+		setError("Invalid normalization " + parameters["Normalization"]);
+		mode = ReferenceMatrix::SUM_TO_ONE;
+	}
+	refMat->setNormalization((ReferenceMatrix::Normalization) (int) mode);
+
+	double type = getParameter("ReferenceType", ReferenceMatrix::AVERAGE_REFERENCE);
+	if (!(type >= 0 && type < ReferenceMatrix::NUM_REFERENCE_TYPES))
+	{
+		setError("Invalid reference type " + parameters["ReferenceType"]);
+		type = ReferenceMatrix::AVERAGE_REFERENCE;
+	}
+	refMat->setReferenceType((ReferenceMatrix::ReferenceType) (int) type);
+	refMat->setTrimFraction((float) getParameter("TrimFraction", DEFAULT_TRIM_FRACTION));
+
+	/* Only written if a channel has a gain other than 1 */
+	Attributes::const_iterator gains = parameters.find("ChannelGains");
+	if (gains == parameters.end())
+		refMat->resetChannelGains();
+	else if (!refMat->setChannelGainText(gains->second))
+		setError("Malformed channel gains: " + gains->second);
+}
+
+bool ReferenceSettingsReader::hasReferences()
+{
+	return foundReferences;
+}
+
+int ReferenceSettingsReader::getNumMontages()
+{
+	return (int) montageDerivations.size();
+}
+
+const std::string& ReferenceSettingsReader::getMontageName(int index)
+{
+	return montageNames[index];
+}
+
+const std::vector<ReferenceMontage::Derivation>& ReferenceSettingsReader::getMontageDerivations(int index)
+{
+	return montageDerivations[index];
+}
+
+int ReferenceSettingsReader::getActiveMontage()
+{
+	return activeMontage >= 0 && activeMontage < getNumMontages() ? activeMontage : -1;
+}
+
+const std::string& ReferenceSettingsReader::getError()
+{
+	return error;
+}
+
+void ReferenceSettingsReader::setError(const std::string& message)
+{
+	if (error.empty())
+		error = message;
+}
@@ -0,0 +1,138 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCESETTINGS_H__
+#define __REFERENCESETTINGS_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ReferenceMontage.h"
+
+class ReferenceMatrix;
+
+/* Bytes read from a settings file at a time */
+#define SETTINGS_READ_BUFFER_SIZE 65536
+
+
+/**
+
+  Reference settings reader
+
+  Reads the settings written by ChannelRefEditor without building a
+  document tree: the file is scanned tag by tag and the references are
+  applied to the matrix while reading, so a configuration with millions of
+  entries takes no more memory than the matrix itself.
+
+  All formats of the REFERENCES element are understood:
+
+    <REFERENCES Preset="Common average reference" PresetChannels="384"/>
+    <REFERENCES Sidecar="settings.refmat"/>     (see ReferenceMatrix::writeBinary())
+    <REFERENCES>
+      <CHANNEL Index="1" Ranges="2-4"/>         (see ReferenceMatrix::getRowRanges())
+      <CHANNEL Index="2">                       (one element per entry, older files)
+        <REFERENCE Index="1" Value="1"/>
+      </CHANNEL>
+    </REFERENCES>
+
+  Montages (see ReferenceMontage) are collected from the MONTAGES element
+  for the caller, along with the index of the one in use (-1 for the
+  matrix):
+
+    <MONTAGES Active="0">
+      <MONTAGE Name="Bipolar" Derivations="1:2,2:3,3:4"/>
+    </MONTAGES>
+
+  The matrix is cleared when REFERENCES starts. The attributes of the
+  PARAMETERS element are collected for the caller. Settings that are already
+  parsed can be fed in with startElement() and endElement().
+
+  @see ReferenceMatrix, ChannelRefEditor
+
+*/
+
+class ReferenceSettingsReader
+{
+public:
+
+	typedef std::map<std::string, std::string> Attributes;
+
+	/** Sidecar files are looked up relative to baseDirectory. */
+	ReferenceSettingsReader(ReferenceMatrix* refMat, const std::string& baseDirectory);
+	~ReferenceSettingsReader();
+
+	/** Read a settings file. Returns false if it cannot be read or is not
+	    well formed (see getError()); references read up to that point are
+	    kept. */
+	bool read(const std::string& path);
+
+	void startElement(const std::string& tag, const Attributes& attributes);
+	void endElement(const std::string& tag);
+
+	/** Attributes of the PARAMETERS element, empty if there was none. */
+	const Attributes& getParameters();
+
+	/** Numeric value of a PARAMETERS attribute, defaultValue if missing. */
+	double getParameter(const std::string& name, double defaultValue);
+
+	/** Set the normalization, reference type, trim fraction and channel
+	    gains of the matrix from the parameters (if there were any). A
+	    normalization or reference type out of range is reported (see
+	    getError()) and the default is used instead. */
+	void applyMatrixParameters();
+
+	bool hasReferences();
+
+	/** Montages in the order of the file, and the one in use (-1 for the
+	    matrix or if there were none). */
+	int getNumMontages();
+	const std::string& getMontageName(int index);
+	const std::vector<ReferenceMontage::Derivation>& getMontageDerivations(int index);
+	int getActiveMontage();
+
+	/** First problem found, empty if there was none. */
+	const std::string& getError();
+
+private:
+
+	void setError(const std::string& message);
+
+	ReferenceMatrix* refMat;
+	std::string baseDirectory;
+
+	Attributes parameters;
+	bool foundReferences;
+	bool inReferences;
+	int channelIndex;
+
+	std::vector<std::string> montageNames;
+	std::vector<std::vector<ReferenceMontage::Derivation> > montageDerivations;
+	int activeMontage;
+
+	std::string error;
+
+};
+
+
+#endif  //__REFERENCESETTINGS_H__
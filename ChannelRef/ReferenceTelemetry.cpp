@@ -0,0 +1,190 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceTelemetry.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+ReferenceTelemetry::ReferenceTelemetry() : nChannels(0), intervalSamples(0), enabled(false),
+	firstChannel(0), numChannels(0), nextChannel(0), channelCredit(0),
+	windowStart(0), windowLength(0), numElapsed(0), measuring(false),
+	writeCount(0), readCount(0)
+{
+}
+
+ReferenceTelemetry::~ReferenceTelemetry()
+{
+}
+
+void ReferenceTelemetry::prepare(int n, float sampleRate)
+{
+	nChannels = std::max(0, n);
+	intervalSamples = std::max(1, (int) (TELEMETRY_INTERVAL * (sampleRate > 0 ? sampleRate : 30000.0f)));
+
+	firstChannel = 0;
+	numChannels = 0;
+	nextChannel = 0;
+	channelCredit = 0;
+	windowStart = 0;
+	windowLength = 0;
+	numElapsed = 0;
+	measuring = false;
+	inputMeanSquares.assign(nChannels, 0.0f);
+	outputMeanSquares.assign(nChannels, 0.0f);
+	primed.assign(nChannels, 0);
+
+	frames.assign((size_t) TELEMETRY_RING_SIZE * 2 * nChannels, 0.0f);
+	writeCount.store(0);
+	readCount.store(0);
+}
+
+int ReferenceTelemetry::getNumChannels()
+{
+	return nChannels;
+}
+
+void ReferenceTelemetry::setEnabled(bool state)
+{
+	enabled.store(state);
+}
+
+bool ReferenceTelemetry::isEnabled()
+{
+	return enabled.load();
+}
+
+/* Independent partial sums, so the loop is not bound by the add latency */
+float ReferenceTelemetry::meanSquare(const float* x, int numSamples)
+{
+	float s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	int n = 0;
+
+	for (; n + 8 <= numSamples; n += 8)
+	{
+		for (int k=0; k<8; k++)
+			s[k] += x[n + k] * x[n + k];
+	}
+
+	for (; n < numSamples; n++)
+		s[0] += x[n] * x[n];
+
+	return (((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]))) / numSamples;
+}
+
+void ReferenceTelemetry::measureInput(const float* const* channels, int numSamples)
+{
+	measuring = enabled.load() && nChannels > 0 && numSamples > 0;
+	numChannels = 0;
+
+	if (!measuring)
+	{
+		/* Start over with fresh averages when enabled again */
+		if (numElapsed > 0)
+		{
+			std::fill(primed.begin(), primed.end(), 0);
+			channelCredit = 0;
+			numElapsed = 0;
+		}
+		return;
+	}
+
+	/* Each channel is due once every TELEMETRY_STRIDE samples */
+	channelCredit += numSamples * nChannels;
+	numChannels = std::min(nChannels, channelCredit / TELEMETRY_STRIDE);
+	channelCredit -= numChannels * TELEMETRY_STRIDE;
+
+	firstChannel = nextChannel;
+	nextChannel = (nextChannel + numChannels) % nChannels;
+
+	/* A step that is prime to common block sizes moves the window around */
+	windowLength = std::min(numSamples, TELEMETRY_WINDOW);
+	windowStart = (windowStart + 61) % (numSamples - windowLength + 1);
+
+	for (int k=0; k<numChannels; k++)
+	{
+		int c = (firstChannel + k) % nChannels;
+		float x = meanSquare(channels[c] + windowStart, windowLength);
+
+		inputMeanSquares[c] = primed[c] ? inputMeanSquares[c] + TELEMETRY_SMOOTHING * (x - inputMeanSquares[c]) : x;
+	}
+
+	numElapsed += numSamples;
+}
+
+void ReferenceTelemetry::measureOutput(const float* const* channels, int numSamples)
+{
+	/* The window was placed in the input block; a shorter output block
+	   cannot be the same block, so nothing is measured */
+	if (!measuring || windowStart + windowLength > numSamples)
+		return;
+
+	for (int k=0; k<numChannels; k++)
+	{
+		int c = (firstChannel + k) % nChannels;
+		float x = meanSquare(channels[c] + windowStart, windowLength);
+
+		outputMeanSquares[c] = primed[c] ? outputMeanSquares[c] + TELEMETRY_SMOOTHING * (x - outputMeanSquares[c]) : x;
+		primed[c] = 1;
+	}
+
+	if (numElapsed < intervalSamples)
+		return;
+
+	numElapsed = 0;
+
+	/* Publish the frame unless the reader has fallen behind by a whole ring */
+	unsigned int w = writeCount.load(std::memory_order_relaxed);
+
+	if (w - readCount.load(std::memory_order_acquire) < TELEMETRY_RING_SIZE)
+	{
+		float* frame = &frames[(size_t) (w % TELEMETRY_RING_SIZE) * 2 * nChannels];
+
+		for (int c=0; c<nChannels; c++)
+		{
+			frame[c] = std::sqrt(inputMeanSquares[c]);
+			frame[nChannels + c] = std::sqrt(outputMeanSquares[c]);
+		}
+
+		writeCount.store(w + 1, std::memory_order_release);
+	}
+}
+
+bool ReferenceTelemetry::readLatest(std::vector<float>& inputRms, std::vector<float>& outputRms)
+{
+	unsigned int w = writeCount.load(std::memory_order_acquire);
+	unsigned int r = readCount.load(std::memory_order_relaxed);
+
+	if (w == r)
+		return false;
+
+	const float* frame = &frames[(size_t) ((w - 1) % TELEMETRY_RING_SIZE) * 2 * nChannels];
+
+	inputRms.assign(frame, frame + nChannels);
+	outputRms.assign(frame + nChannels, frame + 2 * nChannels);
+
+	readCount.store(w, std::memory_order_release);
+
+	return true;
+}
@@ -0,0 +1,128 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCETELEMETRY_H__
+#define __REFERENCETELEMETRY_H__
+
+#include <atomic>
+#include <vector>
+
+/* Samples per measured window */
+#define TELEMETRY_WINDOW 64
+
+/* Input samples per window of each channel (decimation of the measurement) */
+#define TELEMETRY_STRIDE 16384
+
+/* Weight of a new window in the running mean square of its channel */
+#define TELEMETRY_SMOOTHING 0.5f
+
+/* Interval between published RMS frames in seconds */
+#define TELEMETRY_INTERVAL 0.1f
+
+/* Frames the ring holds; the writer drops frames when it is full */
+#define TELEMETRY_RING_SIZE 8
+
+
+/**
+
+  Reference telemetry
+
+  Measures the RMS of each channel before and after referencing while
+  acquisition is running, so the effect of a reference setup on common-mode
+  noise can be seen live.
+
+  To keep the cost on the audio thread small, the measurement is
+  decimated: each block measures a window of TELEMETRY_WINDOW samples of
+  the next few channels in turn, so that each channel is measured once
+  every TELEMETRY_STRIDE samples and the cost per block is independent of
+  the block size. The same samples are measured in the input
+  (measureInput(), before referencing) and the output (measureOutput(),
+  after referencing). The window moves through the block from one block
+  to the next so that periodic signals are not sampled at a fixed phase.
+  At 384 channels this adds less than 1 % to referencing.
+
+  Every TELEMETRY_INTERVAL seconds the running mean squares are written
+  as one frame into a single-producer single-consumer ring, which the GUI
+  reads with readLatest() without locks or waiting on either side.
+
+  @see ChannelRefNode
+
+*/
+
+class ReferenceTelemetry
+{
+public:
+
+	ReferenceTelemetry();
+	~ReferenceTelemetry();
+
+	/** Allocate the ring for the given number of channels. Must not be
+	    called while measuring. */
+	void prepare(int numChannels, float sampleRate);
+
+	int getNumChannels();
+
+	/** Measuring only takes place while enabled. */
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	/** Audio thread: measure a block before and after referencing. Both
+	    calls must be given the same block. */
+	void measureInput(const float* const* channels, int numSamples);
+	void measureOutput(const float* const* channels, int numSamples);
+
+	/** Reader thread: copy the most recent frame (RMS per channel) and
+	    discard older ones. Returns false if no new frame is available. */
+	bool readLatest(std::vector<float>& inputRms, std::vector<float>& outputRms);
+
+private:
+
+	static float meanSquare(const float* x, int numSamples);
+
+	int nChannels;
+	int intervalSamples;
+	std::atomic<bool> enabled;
+
+	/* Writer state: the channels [firstChannel, firstChannel + numChannels)
+	   (wrapping around) are measured in the current block */
+	int firstChannel;
+	int numChannels;
+	int nextChannel;
+	int channelCredit;
+	int windowStart;
+	int windowLength;
+	int numElapsed;
+	bool measuring;
+	std::vector<float> inputMeanSquares;
+	std::vector<float> outputMeanSquares;
+	std::vector<char> primed;
+
+	/* Frames of 2 * nChannels values (input RMS, then output RMS) */
+	std::vector<float> frames;
+	std::atomic<unsigned int> writeCount;
+	std::atomic<unsigned int> readCount;
+
+};
+
+
+#endif  //__REFERENCETELEMETRY_H__
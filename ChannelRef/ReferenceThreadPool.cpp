@@ -0,0 +1,202 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ReferenceThreadPool.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(WIN32)
+#include <Windows.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() std::this_thread::yield()
+#endif
+
+
+ReferenceThreadPool::ReferenceThreadPool()
+	: generation(0), pendingTasks(0), numParked(0), shouldExit(false),
+	  currentJob(nullptr), currentContext(nullptr), currentNumTasks(0),
+	  pinToCores(true), spinIterations(DEFAULT_SPIN_ITERATIONS)
+{
+}
+
+ReferenceThreadPool::~ReferenceThreadPool()
+{
+	stopWorkers();
+}
+
+void ReferenceThreadPool::setNumThreads(int n)
+{
+	if (n < 0)
+		n = 0;
+
+	if (n == (int) workers.size())
+		return;
+
+	stopWorkers();
+
+	shouldExit = false;
+	for (int i=0; i<n; i++)
+	{
+		workers.push_back(std::thread(&ReferenceThreadPool::workerLoop, this, i, (unsigned int) generation));
+	}
+}
+
+int ReferenceThreadPool::getNumThreads()
+{
+	return (int) workers.size();
+}
+
+void ReferenceThreadPool::setPinToCores(bool pin)
+{
+	pinToCores = pin;
+}
+
+void ReferenceThreadPool::setSpinIterations(int n)
+{
+	spinIterations = n;
+}
+
+void ReferenceThreadPool::stopWorkers()
+{
+	if (workers.size() == 0)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(parkMutex);
+		shouldExit = true;
+		generation++;
+	}
+	parkCondition.notify_all();
+
+	for (int i=0; i<(int) workers.size(); i++)
+	{
+		workers[i].join();
+	}
+	workers.clear();
+}
+
+void ReferenceThreadPool::run(ThreadPoolJob job, void* context, int numTasks)
+{
+	if (numTasks > (int) workers.size() + 1)
+		numTasks = (int) workers.size() + 1;
+
+	if (numTasks <= 1)
+	{
+		job(context, 0, 1);
+		return;
+	}
+
+	/* Every worker acknowledges each generation (even without a task), so
+	   the job parameters are not rewritten while a worker still reads them */
+	currentJob = job;
+	currentContext = context;
+	currentNumTasks = numTasks;
+	pendingTasks = (int) workers.size();
+
+	generation++;
+
+	/* Only touch the mutex if some worker went to sleep */
+	if (numParked > 0)
+	{
+		std::lock_guard<std::mutex> lock(parkMutex);
+		parkCondition.notify_all();
+	}
+
+	job(context, 0, numTasks);
+
+	/* Workers should finish about the same time; yield if the machine is
+	   oversubscribed so that they can get a core */
+	int spins = 0;
+	while (pendingTasks > 0)
+	{
+		if (spins < spinIterations)
+		{
+			CPU_RELAX();
+			spins++;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ReferenceThreadPool::workerLoop(int workerIndex, unsigned int seen)
+{
+	if (pinToCores)
+	{
+		int numCores = (int) std::thread::hardware_concurrency();
+		if (numCores > 1)
+		{
+			int core = numCores - 1 - (workerIndex % (numCores - 1));
+#if defined(__linux__)
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(core, &cpus);
+			pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+#elif defined(WIN32)
+			SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core);
+#endif
+		}
+	}
+
+	while (true)
+	{
+		/* Spin first, then park until the next generation */
+		int spins = 0;
+		while (generation == seen && spins < spinIterations)
+		{
+			CPU_RELAX();
+			spins++;
+		}
+
+		if (generation == seen)
+		{
+			std::unique_lock<std::mutex> lock(parkMutex);
+			numParked++;
+			while (generation == seen)
+			{
+				parkCondition.wait(lock);
+			}
+			numParked--;
+		}
+
+		seen = generation;
+
+		if (shouldExit)
+			break;
+
+		int taskIndex = workerIndex + 1;
+		if (taskIndex < currentNumTasks)
+		{
+			currentJob(currentContext, taskIndex, currentNumTasks);
+		}
+		pendingTasks--;
+	}
+}
@@ -0,0 +1,102 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __REFERENCETHREADPOOL_H__
+#define __REFERENCETHREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Iterations a worker spins for new work before it parks */
+#define DEFAULT_SPIN_ITERATIONS 20000
+
+typedef void (*ThreadPoolJob)(void* context, int taskIndex, int numTasks);
+
+
+/**
+
+  Reference thread pool
+
+  Persistent fork-join worker pool for the audio thread. run() hands one
+  task to each worker, executes task 0 on the calling thread and returns
+  when all tasks are done. Idle workers spin for a short while (so that
+  consecutive phases of one block do not pay for a wake-up) and then park
+  on a condition variable until the next block.
+
+  Workers are pinned to dedicated cores, counted down from the last core
+  so that the low cores stay free for the GUI and the acquisition thread.
+
+  setNumThreads() must not be called while run() is in progress.
+
+  @see ReferencePlan
+
+*/
+
+class ReferenceThreadPool
+{
+public:
+
+	ReferenceThreadPool();
+	~ReferenceThreadPool();
+
+	/** Number of worker threads in addition to the calling thread. */
+	void setNumThreads(int n);
+	int getNumThreads();
+
+	/** Takes effect for threads started afterwards. */
+	void setPinToCores(bool pin);
+	void setSpinIterations(int n);
+
+	/** Run job(context, t, numTasks) for t = 0..numTasks-1 in parallel.
+	    numTasks should not exceed getNumThreads() + 1. */
+	void run(ThreadPoolJob job, void* context, int numTasks);
+
+private:
+
+	void stopWorkers();
+	void workerLoop(int workerIndex, unsigned int seen);
+
+	std::vector<std::thread> workers;
+
+	std::atomic<unsigned int> generation;
+	std::atomic<int> pendingTasks;
+	std::atomic<int> numParked;
+	std::atomic<bool> shouldExit;
+
+	ThreadPoolJob currentJob;
+	void* currentContext;
+	int currentNumTasks;
+
+	std::mutex parkMutex;
+	std::condition_variable parkCondition;
+
+	std::atomic<bool> pinToCores;
+	std::atomic<int> spinIterations;
+
+};
+
+
+#endif  //__REFERENCETHREADPOOL_H__
@@ -0,0 +1,728 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpatialFilter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "CovarianceEngine.h"
+#include "ReferencePlan.h"
+
+/* Rows of the scratch buffers are a cache line longer than a piece, so that
+   the same vector of all rows does not map to the same L1 cache set */
+#define SCRATCH_STRIDE (REFERENCE_BLOCK_SIZE + 16)
+
+struct SpatialFilter::Projection
+{
+	Mode mode;
+	int numChannels;
+
+	/* Channels and components, padded to whole kernel row blocks */
+	int numRows;
+	int numComponents;
+
+	/* WHITEN: numRows x numChannels; REMOVE_COMPONENTS: U^T
+	   (numComponents x numChannels) and -U (numRows x numComponents) */
+	std::vector<float> weights;
+	std::vector<float> back;
+
+	/* Copy of the input, and the projections on the components */
+	std::vector<float> scratch;
+	std::vector<float*> inputRows;
+	std::vector<float*> componentRows;
+
+	/* Channel pointers of the current piece; padding rows are discarded */
+	std::vector<float*> channelRows;
+	std::vector<float> discard;
+};
+
+/* One matrix multiply over a piece, split by row blocks */
+struct MultiplyJob
+{
+	MatrixMultiplyKernel kernel;
+	float* const* dest;
+	const float* weights;
+	int weightStride;
+	float* const* sources;
+	int numSources;
+	int numRows;
+	int numSamples;
+};
+
+
+SpatialFilter::SpatialFilter() : nChannels(0), mode(OFF), numComponents(SPATIAL_COMPONENTS), numFits(0),
+	active(nullptr), pending(nullptr), retired(nullptr), engine(nullptr), wake(false), shouldExit(false),
+	basisComponents(0), random(1)
+{
+}
+
+SpatialFilter::~SpatialFilter()
+{
+	stop();
+	deleteProjections();
+}
+
+const char* SpatialFilter::getModeName(Mode mode)
+{
+	switch (mode)
+	{
+	case REMOVE_COMPONENTS:
+		return "Remove PCs";
+	case WHITEN:
+		return "Whiten";
+	default:
+		return "Off";
+	}
+}
+
+void SpatialFilter::prepare(int numChannels)
+{
+	stop();
+	deleteProjections();
+
+	nChannels = std::max(0, numChannels);
+	basis.clear();
+	basisComponents = 0;
+}
+
+int SpatialFilter::getNumChannels()
+{
+	return nChannels;
+}
+
+void SpatialFilter::setMode(Mode m)
+{
+	mode.store(m);
+
+	std::lock_guard<std::mutex> lock(wakeLock);
+	wake = true;
+	wakeCondition.notify_one();
+}
+
+SpatialFilter::Mode SpatialFilter::getMode()
+{
+	return (Mode) mode.load();
+}
+
+void SpatialFilter::setNumComponents(int n)
+{
+	numComponents.store(std::max(1, n));
+
+	std::lock_guard<std::mutex> lock(wakeLock);
+	wake = true;
+	wakeCondition.notify_one();
+}
+
+int SpatialFilter::getNumComponents()
+{
+	return numComponents.load();
+}
+
+int SpatialFilter::getNumFits()
+{
+	return numFits.load();
+}
+
+void SpatialFilter::start(CovarianceEngine* covarianceEngine)
+{
+	if (worker.joinable() || nChannels == 0)
+		return;
+
+	engine = covarianceEngine;
+	shouldExit = false;
+	wake = false;
+	worker = std::thread(&SpatialFilter::run, this);
+}
+
+void SpatialFilter::stop()
+{
+	if (worker.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(wakeLock);
+			shouldExit = true;
+			wakeCondition.notify_one();
+		}
+		worker.join();
+	}
+
+	delete retired.exchange(nullptr);
+}
+
+void SpatialFilter::deleteProjections()
+{
+	delete active;
+	delete pending.exchange(nullptr);
+	delete retired.exchange(nullptr);
+	active = nullptr;
+}
+
+void SpatialFilter::run()
+{
+	std::vector<double> covariance;
+	std::unique_lock<std::mutex> lock(wakeLock);
+
+	while (!shouldExit)
+	{
+		lock.unlock();
+		bool fitted = mode.load() != OFF && engine->getCovariance(covariance) && fit(covariance);
+		lock.lock();
+
+		/* Until there is enough data, try again every second */
+		float interval = fitted ? SPATIAL_REFIT_INTERVAL : 1.0f;
+		wakeCondition.wait_for(lock, std::chrono::milliseconds((int) (interval * 1000)),
+							   [this] { return wake || shouldExit; });
+		wake = false;
+	}
+}
+
+bool SpatialFilter::fit(const std::vector<double>& covariance)
+{
+	Mode m = (Mode) mode.load();
+	int k = std::min(numComponents.load(), nChannels);
+
+	if (m == OFF || nChannels == 0 || covariance.size() < (size_t) nChannels * nChannels)
+		return false;
+
+	Projection* projection = createProjection(m, k);
+
+	bool fitted = m == WHITEN ? fitWhitening(covariance, projection)
+							  : fitComponents(covariance, k, projection);
+
+	if (!fitted)
+	{
+		delete projection;
+		return false;
+	}
+
+	publish(projection);
+	return true;
+}
+
+void SpatialFilter::publish(Projection* projection)
+{
+	/* The audio thread is done with the retired projection; a pending one
+	   that it has not picked up yet is replaced */
+	delete retired.exchange(nullptr);
+	delete pending.exchange(projection);
+
+	numFits.fetch_add(1);
+}
+
+SpatialFilter::Projection* SpatialFilter::createProjection(Mode m, int k)
+{
+	Projection* p = new Projection();
+
+	p->mode = m;
+	p->numChannels = nChannels;
+	p->numRows = (nChannels + MATRIX_MULTIPLY_ROWS - 1) / MATRIX_MULTIPLY_ROWS * MATRIX_MULTIPLY_ROWS;
+
+	if (m == WHITEN)
+	{
+		p->numComponents = 0;
+		p->weights.assign((size_t) p->numRows * nChannels, 0.0f);
+	}
+	else
+	{
+		p->numComponents = (k + MATRIX_MULTIPLY_ROWS - 1) / MATRIX_MULTIPLY_ROWS * MATRIX_MULTIPLY_ROWS;
+		p->weights.assign((size_t) p->numComponents * nChannels, 0.0f);
+		p->back.assign((size_t) p->numRows * p->numComponents, 0.0f);
+	}
+
+	p->scratch.assign((size_t) (nChannels + p->numComponents) * SCRATCH_STRIDE, 0.0f);
+	p->inputRows.resize(nChannels);
+	p->componentRows.resize(p->numComponents);
+	for (int i=0; i<nChannels; i++)
+		p->inputRows[i] = &p->scratch[(size_t) i * SCRATCH_STRIDE];
+	for (int c=0; c<p->numComponents; c++)
+		p->componentRows[c] = &p->scratch[(size_t) (nChannels + c) * SCRATCH_STRIDE];
+
+	p->discard.assign(REFERENCE_BLOCK_SIZE, 0.0f);
+	p->channelRows.assign(p->numRows, p->discard.data());
+
+	return p;
+}
+
+/* C Q for a symmetric n x n matrix C and the l columns of Q */
+static void multiplyColumns(const std::vector<double>& c, int n,
+							const std::vector<double>& q, int l, std::vector<double>& result)
+{
+	result.assign((size_t) l * n, 0.0);
+
+	for (int a=0; a<l; a++)
+	{
+		const double* x = &q[(size_t) a * n];
+		double* y = &result[(size_t) a * n];
+
+		for (int i=0; i<n; i++)
+		{
+			const double* row = &c[(size_t) i * n];
+			double sum = 0;
+			for (int j=0; j<n; j++)
+				sum += row[j] * x[j];
+			y[i] = sum;
+		}
+	}
+}
+
+/* Modified Gram-Schmidt, twice for accuracy; columns without a component
+   of their own are set to zero */
+static void orthonormalize(std::vector<double>& q, int n, int l)
+{
+	for (int pass=0; pass<2; pass++)
+	{
+		for (int a=0; a<l; a++)
+		{
+			double* x = &q[(size_t) a * n];
+
+			for (int b=0; b<a; b++)
+			{
+				const double* y = &q[(size_t) b * n];
+				double dot = 0;
+				for (int i=0; i<n; i++)
+					dot += x[i] * y[i];
+				for (int i=0; i<n; i++)
+					x[i] -= dot * y[i];
+			}
+
+			double norm = 0;
+			for (int i=0; i<n; i++)
+				norm += x[i] * x[i];
+			norm = std::sqrt(norm);
+
+			double scale = norm > 1e-150 ? 1.0 / norm : 0.0;
+			for (int i=0; i<n; i++)
+				x[i] *= scale;
+		}
+	}
+}
+
+bool SpatialFilter::fitComponents(const std::vector<double>& covariance, int k, Projection* p)
+{
+	int n = nChannels;
+	int l = std::min(n, k + SPATIAL_OVERSAMPLING);
+
+	/* Random subspace, or the previous components and random columns */
+	bool warm = basisComponents == k && basis.size() == (size_t) k * n;
+	std::normal_distribution<double> normal;
+	std::vector<double> q((size_t) l * n);
+
+	for (int a=0; a<l; a++)
+	{
+		for (int i=0; i<n; i++)
+			q[(size_t) a * n + i] = warm && a < k ? basis[(size_t) a * n + i] : normal(random);
+	}
+	orthonormalize(q, n, l);
+
+	std::vector<double> z;
+	int iterations = warm ? SPATIAL_WARM_ITERATIONS : SPATIAL_POWER_ITERATIONS;
+
+	for (int it=0; it<iterations; it++)
+	{
+		multiplyColumns(covariance, n, q, l, z);
+		q.swap(z);
+		orthonormalize(q, n, l);
+	}
+
+	/* Rayleigh-Ritz: eigenvectors of Q^T C Q within the subspace */
+	multiplyColumns(covariance, n, q, l, z);
+
+	std::vector<double> t((size_t) l * l);
+	for (int a=0; a<l; a++)
+	{
+		for (int b=0; b<l; b++)
+		{
+			double dot = 0;
+			for (int i=0; i<n; i++)
+				dot += q[(size_t) a * n + i] * z[(size_t) b * n + i];
+			t[(size_t) a * l + b] = dot;
+		}
+	}
+
+	std::vector<double> values, vectors;
+	eigenSymmetric(t, l, values, vectors);
+
+	basis.assign((size_t) k * n, 0.0);
+	for (int c=0; c<k; c++)
+	{
+		double* u = &basis[(size_t) c * n];
+
+		for (int a=0; a<l; a++)
+		{
+			double v = vectors[(size_t) a * l + c];
+			for (int i=0; i<n; i++)
+				u[i] += v * q[(size_t) a * n + i];
+		}
+	}
+	basisComponents = k;
+
+	for (int c=0; c<k; c++)
+	{
+		for (int i=0; i<n; i++)
+		{
+			p->weights[(size_t) c * n + i] = (float) basis[(size_t) c * n + i];
+			p->back[(size_t) i * p->numComponents + c] = (float) -basis[(size_t) c * n + i];
+		}
+	}
+
+	return true;
+}
+
+bool SpatialFilter::fitWhitening(const std::vector<double>& covariance, Projection* p)
+{
+	int n = nChannels;
+
+	std::vector<double> a(covariance.begin(), covariance.begin() + (size_t) n * n);
+	std::vector<double> values, vectors;
+	eigenSymmetric(a, n, values, vectors);
+
+	/* Scaled so that a direction of median variance (background noise
+	   rather than common mode) keeps its variance, and regularized
+	   relative to it */
+	double median = std::max(0.0, values[n / 2]);
+
+	if (!(median > 0))
+		return false;
+
+	double epsilon = SPATIAL_WHITENING_EPSILON * median;
+	std::vector<double> scale(n);
+	for (int c=0; c<n; c++)
+		scale[c] = std::sqrt(median / (std::max(0.0, values[c]) + epsilon));
+
+	/* W = V diag(scale) V^T */
+	std::vector<double> scaled((size_t) n * n);
+	for (int i=0; i<n; i++)
+	{
+		for (int c=0; c<n; c++)
+			scaled[(size_t) i * n + c] = vectors[(size_t) i * n + c] * scale[c];
+	}
+
+	for (int i=0; i<n; i++)
+	{
+		const double* x = &scaled[(size_t) i * n];
+
+		for (int j=i; j<n; j++)
+		{
+			const double* v = &vectors[(size_t) j * n];
+			double sum = 0;
+			for (int c=0; c<n; c++)
+				sum += x[c] * v[c];
+
+			p->weights[(size_t) i * n + j] = (float) sum;
+			p->weights[(size_t) j * n + i] = (float) sum;
+		}
+	}
+
+	return true;
+}
+
+void SpatialFilter::eigenSymmetric(std::vector<double>& a, int n,
+								   std::vector<double>& values, std::vector<double>& vectors)
+{
+	/* Householder reduction to tridiagonal form, a = Q T Q^T, followed by
+	   implicit QR steps with Wilkinson shifts on T. Q is kept transposed
+	   (one row per column of Q), so every update runs along rows. */
+	std::vector<double> qt((size_t) n * n, 0.0);
+	for (int i=0; i<n; i++)
+		qt[(size_t) i * n + i] = 1.0;
+
+	std::vector<double> d(n), e(n, 0.0);
+	std::vector<double> v(n), p(n), u(n);
+
+	for (int k=0; k<n-2; k++)
+	{
+		int m = n - k - 1;
+		double* x = &v[k + 1];
+
+		double norm = 0;
+		for (int i=0; i<m; i++)
+		{
+			x[i] = a[(size_t) (k + 1 + i) * n + k];
+			norm += x[i] * x[i];
+		}
+		norm = std::sqrt(norm);
+
+		double alpha = x[0] > 0 ? -norm : norm;
+		e[k] = alpha;
+
+		x[0] -= alpha;
+		double length = 0;
+		for (int i=0; i<m; i++)
+			length += x[i] * x[i];
+
+		if (length == 0)
+			continue;
+
+		length = 1 / std::sqrt(length);
+		for (int i=0; i<m; i++)
+			x[i] *= length;
+
+		/* Trailing block S -= 2 v w^T + 2 w v^T, with p = S v and
+		   w = p - (v^T p) v */
+		double vp = 0;
+		for (int i=0; i<m; i++)
+		{
+			const double* row = &a[(size_t) (k + 1 + i) * n + k + 1];
+			double sum = 0;
+			for (int j=0; j<m; j++)
+				sum += row[j] * x[j];
+			p[i] = sum;
+			vp += x[i] * sum;
+		}
+
+		for (int i=0; i<m; i++)
+			p[i] -= vp * x[i];
+
+		for (int i=0; i<m; i++)
+		{
+			double* row = &a[(size_t) (k + 1 + i) * n + k + 1];
+			for (int j=0; j<m; j++)
+				row[j] -= 2 * (x[i] * p[j] + p[i] * x[j]);
+		}
+
+		/* Q = Q H, as rows of Q^T */
+		std::fill(u.begin(), u.end(), 0.0);
+		for (int i=0; i<m; i++)
+		{
+			const double* row = &qt[(size_t) (k + 1 + i) * n];
+			for (int j=0; j<n; j++)
+				u[j] += x[i] * row[j];
+		}
+
+		for (int i=0; i<m; i++)
+		{
+			double* row = &qt[(size_t) (k + 1 + i) * n];
+			for (int j=0; j<n; j++)
+				row[j] -= 2 * x[i] * u[j];
+		}
+	}
+
+	for (int i=0; i<n; i++)
+		d[i] = a[(size_t) i * n + i];
+	if (n > 1)
+		e[n - 2] = a[(size_t) (n - 1) * n + n - 2];
+
+	/* Implicit QR on the last unreduced block until everything is split */
+	int end = n - 1;
+	int iterations = 0;
+
+	while (end > 0 && iterations < 30 * n)
+	{
+		for (int i=0; i<end; i++)
+		{
+			if (std::fabs(e[i]) <= 1e-15 * (std::fabs(d[i]) + std::fabs(d[i + 1])))
+				e[i] = 0;
+		}
+
+		if (e[end - 1] == 0)
+		{
+			end--;
+			continue;
+		}
+
+		int start = end - 1;
+		while (start > 0 && e[start - 1] != 0)
+			start--;
+
+		double half = (d[end - 1] - d[end]) / 2;
+		double b = e[end - 1];
+		double shift = d[end] - b * b / (half + (half >= 0 ? 1 : -1) * std::sqrt(half * half + b * b));
+
+		double x = d[start] - shift;
+		double z = e[start];
+
+		for (int k=start; k<end; k++)
+		{
+			double r = std::sqrt(x * x + z * z);
+			double c = r > 0 ? x / r : 1.0;
+			double s = r > 0 ? z / r : 0.0;
+
+			if (k > start)
+				e[k - 1] = r;
+
+			double dk = d[k];
+			double ek = e[k];
+			double dk1 = d[k + 1];
+
+			d[k] = c * c * dk + 2 * c * s * ek + s * s * dk1;
+			d[k + 1] = s * s * dk - 2 * c * s * ek + c * c * dk1;
+			e[k] = c * s * (dk1 - dk) + (c * c - s * s) * ek;
+
+			if (k < end - 1)
+			{
+				z = s * e[k + 1];
+				e[k + 1] *= c;
+			}
+			x = e[k];
+
+			double* qk = &qt[(size_t) k * n];
+			double* qk1 = &qt[(size_t) (k + 1) * n];
+			for (int i=0; i<n; i++)
+			{
+				double q0 = qk[i];
+				double q1 = qk1[i];
+				qk[i] = c * q0 + s * q1;
+				qk1[i] = c * q1 - s * q0;
+			}
+		}
+
+		iterations++;
+	}
+
+	std::vector<int> order(n);
+	for (int i=0; i<n; i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&d] (int x, int y) { return d[x] > d[y]; });
+
+	values.resize(n);
+	vectors.resize((size_t) n * n);
+	for (int c=0; c<n; c++)
+	{
+		values[c] = d[order[c]];
+		for (int i=0; i<n; i++)
+			vectors[(size_t) i * n + c] = qt[(size_t) order[c] * n + i];
+	}
+}
+
+static void multiply(const MultiplyJob* job, int firstRow, int lastRow)
+{
+	for (int t=0; t<job->numSamples; t+=SPATIAL_TILE_SAMPLES)
+	{
+		int numSamples = std::min(SPATIAL_TILE_SAMPLES, job->numSamples - t);
+
+		for (int j=0; j<job->numSources; j+=SPATIAL_K_BLOCK)
+		{
+			int numSources = std::min(SPATIAL_K_BLOCK, job->numSources - j);
+
+			for (int row=firstRow; row<lastRow; row+=MATRIX_MULTIPLY_ROWS)
+			{
+				job->kernel(job->dest + row, job->weights + (size_t) row * job->weightStride + j,
+							job->weightStride, job->sources + j, numSources, t, numSamples);
+			}
+		}
+	}
+}
+
+void SpatialFilter::multiplyRows(void* context, int taskIndex, int numTasks)
+{
+	const MultiplyJob* job = (const MultiplyJob*) context;
+
+	int numBlocks = job->numRows / MATRIX_MULTIPLY_ROWS;
+	int firstBlock = numBlocks * taskIndex / numTasks;
+	int lastBlock = numBlocks * (taskIndex + 1) / numTasks;
+
+	multiply(job, firstBlock * MATRIX_MULTIPLY_ROWS, lastBlock * MATRIX_MULTIPLY_ROWS);
+}
+
+bool SpatialFilter::process(float* const* channels, int numSamples,
+							ReferenceKernels::Type type, ReferenceThreadPool* threadPool)
+{
+	/* A new projection can only be taken once the refit thread has
+	   collected the previous one */
+	if (retired.load(std::memory_order_acquire) == nullptr)
+	{
+		Projection* projection = pending.exchange(nullptr, std::memory_order_acq_rel);
+		if (projection != nullptr)
+		{
+			retired.store(active, std::memory_order_release);
+			active = projection;
+		}
+	}
+
+	Projection* p = active;
+
+	if (p == nullptr || p->mode != mode.load(std::memory_order_relaxed))
+		return false;
+
+	MultiplyJob job;
+	job.kernel = ReferenceKernels::getMatrixMultiply(type);
+
+	int numTasks = 1;
+	if (threadPool != nullptr)
+		numTasks = std::max(1, std::min(threadPool->getNumThreads() + 1, p->numRows / MATRIX_MULTIPLY_ROWS));
+
+	for (int offset=0; offset<numSamples; offset+=REFERENCE_BLOCK_SIZE)
+	{
+		int n = std::min(REFERENCE_BLOCK_SIZE, numSamples - offset);
+
+		for (int i=0; i<p->numChannels; i++)
+			p->channelRows[i] = channels[i] + offset;
+
+		if (p->mode == WHITEN)
+		{
+			/* out = W in, from a copy of the input */
+			for (int i=0; i<p->numChannels; i++)
+			{
+				std::memcpy(p->inputRows[i], p->channelRows[i], n * sizeof(float));
+				std::memset(p->channelRows[i], 0, n * sizeof(float));
+			}
+
+			job.dest = p->channelRows.data();
+			job.weights = p->weights.data();
+			job.weightStride = p->numChannels;
+			job.sources = p->inputRows.data();
+			job.numSources = p->numChannels;
+			job.numRows = p->numRows;
+			job.numSamples = n;
+
+			if (numTasks > 1)
+				threadPool->run(&SpatialFilter::multiplyRows, &job, numTasks);
+			else
+				multiplyRows(&job, 0, 1);
+		}
+		else
+		{
+			/* Tile by tile, so the input is still cached when it is updated:
+			   the projections on the components, then out = in - U proj */
+			for (int t=0; t<n; t+=SPATIAL_TILE_SAMPLES)
+			{
+				int tile = std::min(SPATIAL_TILE_SAMPLES, n - t);
+
+				for (int i=0; i<p->numChannels; i++)
+					std::memcpy(p->inputRows[i] + t, p->channelRows[i] + t, tile * sizeof(float));
+				for (int c=0; c<p->numComponents; c++)
+					std::memset(p->componentRows[c] + t, 0, tile * sizeof(float));
+
+				for (int j=0; j<p->numChannels; j+=SPATIAL_K_BLOCK)
+				{
+					for (int c=0; c<p->numComponents; c+=MATRIX_MULTIPLY_ROWS)
+					{
+						job.kernel(&p->componentRows[c], &p->weights[(size_t) c * p->numChannels + j], p->numChannels,
+								   &p->inputRows[j], std::min(SPATIAL_K_BLOCK, p->numChannels - j), t, tile);
+					}
+				}
+
+				for (int row=0; row<p->numRows; row+=MATRIX_MULTIPLY_ROWS)
+				{
+					job.kernel(&p->channelRows[row], &p->back[(size_t) row * p->numComponents], p->numComponents,
+							   p->componentRows.data(), p->numComponents, t, tile);
+				}
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,193 @@
+/*
+    ------------------------------------------------------------------
+
+    This file is part of the Open Ephys GUI
+    Copyright (C) 2014 Open Ephys
+
+    ------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __SPATIALFILTER_H__
+#define __SPATIALFILTER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "ReferenceKernels.h"
+#include "ReferenceThreadPool.h"
+
+class CovarianceEngine;
+
+/* Principal components removed by default */
+#define SPATIAL_COMPONENTS 4
+
+/* Seconds between refits of the projection */
+#define SPATIAL_REFIT_INTERVAL 10.0f
+
+/* Whitening regularization, relative to the median eigenvalue */
+#define SPATIAL_WHITENING_EPSILON 0.01f
+
+/* Subspace iterations of the randomized fit; a fit that starts from the
+   previous components needs fewer */
+#define SPATIAL_POWER_ITERATIONS 6
+#define SPATIAL_WARM_ITERATIONS 2
+
+/* Extra columns of the random subspace */
+#define SPATIAL_OVERSAMPLING 8
+
+/* Sources per k-block of the matrix multiply, samples per tile */
+#define SPATIAL_K_BLOCK 128
+#define SPATIAL_TILE_SAMPLES 256
+
+
+/**
+
+  Spatial filter
+
+  Referencing by a projection that is fitted to the channel covariance
+  instead of a fixed matrix:
+
+    REMOVE_COMPONENTS  out = (I - U U^T) in, where U holds the top principal
+                       components (common-mode signals shared by many
+                       channels)
+    WHITEN             out = W in, with the ZCA whitening matrix
+                       W = V diag(s) V^T of the eigenvectors V, scaled so
+                       that directions of median variance keep it
+
+  A refit thread periodically takes the covariance estimate of a
+  CovarianceEngine and fits a new projection: the components by randomized
+  subspace iteration, started from the previous components once there
+  are any, and the whitening matrix by a full eigendecomposition
+  (Householder tridiagonalization and implicit QR).
+  The new projection is handed to the audio thread through an atomic
+  pointer, like the reference plans of the node, and the previous one is
+  deleted by the refit thread.
+
+  On the audio thread, process() only multiplies: a dense N x N matrix for
+  whitening, or U^T and then -U (N x k) for component removal, with the
+  matrix multiply kernel (see ReferenceKernels) over tiles of
+  SPATIAL_TILE_SAMPLES samples and SPATIAL_K_BLOCK sources, so that the
+  tile stays in cache while all rows are computed. Dense projections are
+  split across the thread pool by rows; component removal is cheap enough
+  to run on the audio thread alone, tile by tile. Until there is a
+  projection of the current mode, process() leaves the channels as they
+  are and returns false, so that the caller can reference them otherwise.
+
+  @see CovarianceEngine, ChannelRefNode
+
+*/
+
+class SpatialFilter
+{
+public:
+
+	enum Mode
+	{
+		OFF = 0,
+		REMOVE_COMPONENTS,
+		WHITEN,
+		NUM_MODES
+	};
+
+	SpatialFilter();
+	~SpatialFilter();
+
+	static const char* getModeName(Mode mode);
+
+	/** Stop refitting and drop the current projection. Must not be called
+	    while process() is running. */
+	void prepare(int numChannels);
+
+	int getNumChannels();
+
+	/** Changes are picked up by the next fit, which is started at once. */
+	void setMode(Mode mode);
+	Mode getMode();
+
+	void setNumComponents(int n);
+	int getNumComponents();
+
+	/** Refit periodically from the covariance of the engine, which must
+	    stay alive (and running) until stop(). */
+	void start(CovarianceEngine* engine);
+	void stop();
+
+	/** Fit a projection for the current mode to a covariance matrix
+	    (numChannels x numChannels, row-major) and publish it. This is what
+	    the refit thread does; it must not be called while the thread runs. */
+	bool fit(const std::vector<double>& covariance);
+
+	/** Number of projections published so far. */
+	int getNumFits();
+
+	/** Audio thread: apply the current projection in place. Returns false
+	    without touching the channels if no projection of the current mode
+	    has been fitted yet. */
+	bool process(float* const* channels, int numSamples,
+				 ReferenceKernels::Type type, ReferenceThreadPool* threadPool);
+
+	/** Eigendecomposition of a symmetric matrix (row-major, destroyed):
+	    eigenvalues in decreasing order, eigenvectors in the columns of
+	    vectors. */
+	static void eigenSymmetric(std::vector<double>& a, int n,
+							   std::vector<double>& values, std::vector<double>& vectors);
+
+private:
+
+	struct Projection;
+
+	void run();
+	Projection* createProjection(Mode mode, int numComponents);
+	bool fitComponents(const std::vector<double>& covariance, int numComponents, Projection* projection);
+	bool fitWhitening(const std::vector<double>& covariance, Projection* projection);
+	void publish(Projection* projection);
+	void deleteProjections();
+
+	static void multiplyRows(void* context, int taskIndex, int numTasks);
+
+	int nChannels;
+	std::atomic<int> mode;
+	std::atomic<int> numComponents;
+	std::atomic<int> numFits;
+
+	/* Handover: the refit thread publishes into pending, the audio thread
+	   swaps it into active and hands the previous one back in retired */
+	Projection* active;
+	std::atomic<Projection*> pending;
+	std::atomic<Projection*> retired;
+
+	/* Refit thread */
+	std::thread worker;
+	CovarianceEngine* engine;
+	std::mutex wakeLock;
+	std::condition_variable wakeCondition;
+	bool wake;
+	bool shouldExit;
+
+	/* Components of the last fit, the start of the next one */
+	std::vector<double> basis;
+	int basisComponents;
+	std::mt19937 random;
+
+};
+
+
+#endif  //__SPATIALFILTER_H__
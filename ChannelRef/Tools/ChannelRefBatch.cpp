@@ -0,0 +1,1165 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+
+/*
+
+  Offline re-referencing of recorded data.
+
+  Applies the references saved by ChannelRefEditor (the same XML file, see
+  ReferenceSettingsReader) to a recording on disk, with the same plan and
+  kernels as ChannelRefNode::process. Every sample of a row is computed by
+  the same sequence of operations, independent of how the data are split
+  into blocks, tiles or threads, so for a given kernel type the float
+  output is bit-identical to the online node as long as the settings use
+  nothing that depends on the data seen while acquiring (see below).
+
+  Input files are memory-mapped and processed in tiles of all channels
+  that fit into the cache, so that a tile is converted to floats,
+  referenced and converted back without going to memory in between. The
+  tiles are spread over worker threads, one plan per thread, and written
+  out in order as soon as they are done, so memory use does not depend on
+  the length of the recording.
+
+  Two formats are understood:
+
+    flat        interleaved samples (sample 0 of all channels, sample 1 of
+                all channels, ...), int16 or float32, e.g. continuous.dat
+                of the binary format. Needs --channels. int16 values are
+                scaled by --bit-volts.
+    .continuous one file per channel in the legacy Open Ephys format. The
+                files are given in channel order; headers, timestamps and
+                record markers are copied to files of the same name in the
+                output directory, samples are quantized as by the record
+                node.
+
+  If a montage was in use when the settings were saved, the montage is
+  applied instead of the matrix, as by the node.
+
+  The high-pass or band-pass filter of the settings (see ReferenceFilter)
+  is applied to the referenced channels, as the node does within its
+  referencing stage. The state of each channel's filter runs through the
+  whole recording, so tiles are filtered one after the other, in order;
+  reading, referencing and encoding still run in parallel. The filter
+  starts from rest at the beginning of the recording: if the node had
+  been filtering for a while before recording started, the output differs
+  during the settling time of the filter. The sample rate of flat data is
+  taken from --sample-rate.
+
+  Least-squares fits, automatic exclusion of bad channels and spatial
+  filters depend on the data seen while acquiring and are not applied;
+  the output differs from the node's wherever they were in effect. Rows
+  with a least-squares fit use averages and excluded channels are kept,
+  with a warning. The spatial filter replaces the references, so settings
+  that use it are refused unless --ignore-spatial-filter is given, in
+  which case the references are applied instead.
+
+  Usage: channelref-batch [options] SETTINGS INPUT...
+
+    -o, --output PATH        output file (flat) or directory (.continuous)
+    --channels N             channels of a flat file
+    --input-format TYPE      int16 | float32 (flat only, default int16)
+    --output-format TYPE     int16 | float32 (flat only, default: as input)
+    --bit-volts V            uV per bit of int16 flat data (default 0.195)
+    --threads N              worker threads (default: all cores)
+    --tile N                 samples per tile (default: 2 MB of samples, at
+                             least 1024; .continuous tiles are whole records
+                             of 1024 samples)
+    --kernel TYPE            scalar | sse | avx2 | avx512 (default: best)
+    --ignore-spatial-filter  apply the references of settings that use the
+                             spatial filter
+    --sample-rate HZ         of flat data, for the filter and the realtime
+                             factor (default 30000)
+    --quiet                  no progress on stderr
+
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../ReferenceMatrix.h"
+#include "../ReferencePlan.h"
+#include "../ReferenceKernels.h"
+#include "../ReferenceSettings.h"
+#include "../ReferenceFilter.h"
+
+
+/* Bytes of float samples per tile unless --tile is given; a tile is read,
+   referenced and encoded while it is still in the (L2) cache */
+#define DEFAULT_TILE_BYTES (1 << 21)
+
+/* Samples per tile at least */
+#define MIN_TILE_SIZE 1024
+
+/* Tiles in flight per worker thread (being processed or waiting to be written) */
+#define TILES_PER_THREAD 2
+
+/* Padding between the channels of a tile, so that (de)interleaving does
+   not hit the same cache sets for every channel */
+#define TILE_PADDING 16
+
+/* Flat files are transposed in blocks of this many samples and channels,
+   so that only a few output streams are written at a time */
+#define TRANSPOSE_SAMPLES 64
+#define TRANSPOSE_CHANNELS 16
+
+/* Layout of the legacy .continuous format */
+#define CONTINUOUS_HEADER_SIZE 1024
+#define CONTINUOUS_RECORD_SAMPLES 1024
+#define CONTINUOUS_RECORD_PREFIX 12
+#define CONTINUOUS_RECORD_MARKER 10
+#define CONTINUOUS_RECORD_SIZE (CONTINUOUS_RECORD_PREFIX + 2 * CONTINUOUS_RECORD_SAMPLES + CONTINUOUS_RECORD_MARKER)
+
+
+struct BatchSettings
+{
+	std::string settingsPath;
+	std::vector<std::string> inputs;
+	std::string output;
+	int numChannels;
+	bool floatInput;
+	int floatOutput;
+	float bitVolts;
+	int numThreads;
+	int tileSize;
+	ReferenceKernels::Type kernelType;
+	double sampleRate;
+	bool ignoreSpatialFilter;
+	bool quiet;
+};
+
+
+/**
+
+  Read-only memory map of a whole file.
+
+*/
+
+class MappedFile
+{
+public:
+
+	MappedFile() : data(nullptr), size(0)
+#if defined(WIN32)
+		, file(INVALID_HANDLE_VALUE), mapping(NULL)
+#endif
+	{
+	}
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open(const std::string& path)
+	{
+		close();
+
+#if defined(WIN32)
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+						   FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		LARGE_INTEGER length;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &length))
+			return false;
+
+		size = (size_t) length.QuadPart;
+		if (size == 0)
+			return true;
+
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL)
+			return false;
+
+		data = (const char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		return data != nullptr;
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat info;
+		if (fstat(fd, &info) != 0)
+		{
+			::close(fd);
+			return false;
+		}
+
+		size = (size_t) info.st_size;
+		if (size > 0)
+		{
+			void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (address != MAP_FAILED)
+			{
+				/* Tiles are read front to back; let the kernel read ahead */
+				madvise(address, size, MADV_SEQUENTIAL);
+				data = (const char*) address;
+			}
+		}
+
+		::close(fd);
+		return size == 0 || data != nullptr;
+#endif
+	}
+
+	void close()
+	{
+#if defined(WIN32)
+		if (data != nullptr)
+			UnmapViewOfFile(data);
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr)
+			munmap((void*) data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const char* getData()
+	{
+		return data;
+	}
+
+	size_t getSize()
+	{
+		return size;
+	}
+
+private:
+
+	const char* data;
+	size_t size;
+
+#if defined(WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+};
+
+
+/**
+
+  A recording on disk: reads tiles into float channel buffers (in uV, as
+  the online node sees them) and encodes referenced tiles into the bytes
+  that are written out. read() and encode() are called from the worker
+  threads for different tiles at the same time; write() is called from the
+  main thread in tile order.
+
+*/
+
+class Recording
+{
+public:
+
+	virtual ~Recording() {}
+
+	/** Opens the inputs and the outputs; prints the reason if that fails. */
+	virtual bool open(const BatchSettings& settings) = 0;
+
+	virtual int getNumChannels() = 0;
+	virtual int64_t getNumSamples() = 0;
+	virtual double getSampleRate() = 0;
+
+	/** Tile size actually used (the format may round it). */
+	virtual int getTileSize(int requested)
+	{
+		return requested;
+	}
+
+	virtual void read(int64_t first, int numSamples, float* const* channels) = 0;
+
+	/** Bytes of output for a tile of the given size. */
+	virtual size_t getEncodedSize(int numSamples) = 0;
+
+	virtual void encode(int64_t first, int numSamples, float* const* channels, char* output) = 0;
+
+	virtual bool write(int numSamples, const char* output) = 0;
+
+	virtual bool close() = 0;
+
+};
+
+
+/* Like the record node (AudioDataConverters::convertFloatToInt16BE):
+   scaled to full range, clipped, and rounded to nearest even by adding
+   1.5 * 2^52, as roundToInt() does */
+static inline int16_t quantize(float value, float scaleFactor)
+{
+	double x = 32767.0 * (value * scaleFactor);
+	x = std::min(std::max(x, -32767.0), 32767.0) + 6755399441055744.0;
+
+	int64_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	return (int16_t) bits;
+}
+
+static bool closeOutput(FILE* file)
+{
+	return file != nullptr && std::fclose(file) == 0;
+}
+
+
+class FlatRecording : public Recording
+{
+public:
+
+	FlatRecording() : numChannels(0), numSamples(0), output(nullptr) {}
+
+	~FlatRecording()
+	{
+		if (output != nullptr)
+			std::fclose(output);
+	}
+
+	bool open(const BatchSettings& settings)
+	{
+		const std::string& path = settings.inputs[0];
+
+		if (settings.numChannels <= 0)
+		{
+			std::fprintf(stderr, "The number of channels of %s is needed (--channels)\n", path.c_str());
+			return false;
+		}
+
+		if (!input.open(path))
+		{
+			std::fprintf(stderr, "Cannot read %s\n", path.c_str());
+			return false;
+		}
+
+		numChannels = settings.numChannels;
+		floatInput = settings.floatInput;
+		floatOutput = settings.floatOutput < 0 ? floatInput : settings.floatOutput != 0;
+		bitVolts = settings.bitVolts;
+		sampleRate = settings.sampleRate;
+
+		size_t frame = (size_t) numChannels * (floatInput ? sizeof(float) : sizeof(int16_t));
+		numSamples = (int64_t) (input.getSize() / frame);
+
+		if (input.getSize() % frame != 0)
+		{
+			std::fprintf(stderr, "Warning: %s does not end on a whole sample; the rest is ignored\n",
+						 path.c_str());
+		}
+
+		output = std::fopen(settings.output.c_str(), "wb");
+		if (output == nullptr)
+		{
+			std::fprintf(stderr, "Cannot write %s\n", settings.output.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	int getNumChannels()
+	{
+		return numChannels;
+	}
+
+	int64_t getNumSamples()
+	{
+		return numSamples;
+	}
+
+	double getSampleRate()
+	{
+		return sampleRate;
+	}
+
+	void read(int64_t first, int n, float* const* channels)
+	{
+		for (int t0=0; t0<n; t0+=TRANSPOSE_SAMPLES)
+		{
+			int t1 = std::min(t0 + TRANSPOSE_SAMPLES, n);
+
+			for (int c0=0; c0<numChannels; c0+=TRANSPOSE_CHANNELS)
+			{
+				int c1 = std::min(c0 + TRANSPOSE_CHANNELS, numChannels);
+
+				if (floatInput)
+				{
+					const float* in = (const float*) input.getData() + first * numChannels;
+					for (int i=c0; i<c1; i++)
+					{
+						for (int t=t0; t<t1; t++)
+							channels[i][t] = in[(size_t) t * numChannels + i];
+					}
+				}
+				else
+				{
+					const int16_t* in = (const int16_t*) input.getData() + first * numChannels;
+					for (int i=c0; i<c1; i++)
+					{
+						for (int t=t0; t<t1; t++)
+							channels[i][t] = (float) in[(size_t) t * numChannels + i] * bitVolts;
+					}
+				}
+			}
+		}
+	}
+
+	size_t getEncodedSize(int n)
+	{
+		return (size_t) n * numChannels * (floatOutput ? sizeof(float) : sizeof(int16_t));
+	}
+
+	/* Interleaved samples need no position, unlike .continuous records */
+	void encode(int64_t, int n, float* const* channels, char* output)
+	{
+		float scaleFactor = 1.0f / (32767.0f * bitVolts);
+
+		for (int t0=0; t0<n; t0+=TRANSPOSE_SAMPLES)
+		{
+			int t1 = std::min(t0 + TRANSPOSE_SAMPLES, n);
+
+			for (int c0=0; c0<numChannels; c0+=TRANSPOSE_CHANNELS)
+			{
+				int c1 = std::min(c0 + TRANSPOSE_CHANNELS, numChannels);
+
+				if (floatOutput)
+				{
+					float* out = (float*) output;
+					for (int t=t0; t<t1; t++)
+					{
+						for (int i=c0; i<c1; i++)
+							out[(size_t) t * numChannels + i] = channels[i][t];
+					}
+				}
+				else
+				{
+					int16_t* out = (int16_t*) output;
+					for (int t=t0; t<t1; t++)
+					{
+						for (int i=c0; i<c1; i++)
+							out[(size_t) t * numChannels + i] = quantize(channels[i][t], scaleFactor);
+					}
+				}
+			}
+		}
+	}
+
+	bool write(int n, const char* data)
+	{
+		size_t size = getEncodedSize(n);
+		return std::fwrite(data, 1, size, output) == size;
+	}
+
+	bool close()
+	{
+		bool ok = closeOutput(output);
+		output = nullptr;
+		return ok;
+	}
+
+private:
+
+	MappedFile input;
+	int numChannels;
+	int64_t numSamples;
+	bool floatInput;
+	bool floatOutput;
+	float bitVolts;
+	double sampleRate;
+	FILE* output;
+
+};
+
+
+class ContinuousRecording : public Recording
+{
+public:
+
+	ContinuousRecording() : numRecords(0), bitVolts(0.195f), sampleRate(30000.0) {}
+
+	~ContinuousRecording()
+	{
+		for (int i=0; i<(int) outputs.size(); i++)
+		{
+			if (outputs[i] != nullptr)
+				std::fclose(outputs[i]);
+		}
+	}
+
+	bool open(const BatchSettings& settings)
+	{
+		int n = (int) settings.inputs.size();
+		inputs.resize(n);
+		outputs.assign(n, nullptr);
+		bitVolts.assign(n, settings.bitVolts);
+
+		for (int i=0; i<n; i++)
+		{
+			const std::string& path = settings.inputs[i];
+
+			if (!inputs[i].open(path) || inputs[i].getSize() < CONTINUOUS_HEADER_SIZE)
+			{
+				std::fprintf(stderr, "Cannot read %s\n", path.c_str());
+				return false;
+			}
+
+			int64_t records = (int64_t) ((inputs[i].getSize() - CONTINUOUS_HEADER_SIZE) / CONTINUOUS_RECORD_SIZE);
+			if (i == 0 || records < numRecords)
+			{
+				if (i > 0)
+					std::fprintf(stderr, "Warning: %s is shorter than the other channels\n", path.c_str());
+				numRecords = records;
+			}
+
+			std::string header(inputs[i].getData(), CONTINUOUS_HEADER_SIZE);
+			readHeaderValue(header, "header.bitVolts", bitVolts[i]);
+			if (i == 0)
+				readHeaderValue(header, "header.sampleRate", sampleRate);
+
+			std::string name = path.substr(path.find_last_of("/\\") + 1);
+			std::string outputPath = settings.output + "/" + name;
+
+			outputs[i] = std::fopen(outputPath.c_str(), "wb");
+			if (outputs[i] == nullptr)
+			{
+				std::fprintf(stderr, "Cannot write %s\n", outputPath.c_str());
+				return false;
+			}
+
+			if (std::fwrite(header.data(), 1, CONTINUOUS_HEADER_SIZE, outputs[i]) != CONTINUOUS_HEADER_SIZE)
+				return false;
+		}
+
+		return true;
+	}
+
+	int getNumChannels()
+	{
+		return (int) inputs.size();
+	}
+
+	int64_t getNumSamples()
+	{
+		return numRecords * CONTINUOUS_RECORD_SAMPLES;
+	}
+
+	double getSampleRate()
+	{
+		return sampleRate;
+	}
+
+	int getTileSize(int requested)
+	{
+		int records = std::max(1, (requested + CONTINUOUS_RECORD_SAMPLES / 2) / CONTINUOUS_RECORD_SAMPLES);
+		return records * CONTINUOUS_RECORD_SAMPLES;
+	}
+
+	void read(int64_t first, int n, float* const* channels)
+	{
+		for (int i=0; i<(int) inputs.size(); i++)
+		{
+			float* dest = channels[i];
+
+			for (int t=0; t<n; t+=CONTINUOUS_RECORD_SAMPLES)
+			{
+				const unsigned char* in = (const unsigned char*) getRecord(i, first + t) + CONTINUOUS_RECORD_PREFIX;
+
+				/* Samples are stored big-endian */
+				for (int k=0; k<CONTINUOUS_RECORD_SAMPLES; k++)
+				{
+					int16_t value = (int16_t) ((in[2 * k] << 8) | in[2 * k + 1]);
+					dest[t + k] = (float) value * bitVolts[i];
+				}
+			}
+		}
+	}
+
+	size_t getEncodedSize(int n)
+	{
+		return (size_t) (n / CONTINUOUS_RECORD_SAMPLES) * CONTINUOUS_RECORD_SIZE * inputs.size();
+	}
+
+	void encode(int64_t first, int n, float* const* channels, char* output)
+	{
+		for (int i=0; i<(int) inputs.size(); i++)
+		{
+			float scaleFactor = 1.0f / (32767.0f * bitVolts[i]);
+
+			for (int t=0; t<n; t+=CONTINUOUS_RECORD_SAMPLES)
+			{
+				const char* record = getRecord(i, first + t);
+				unsigned char* samples = (unsigned char*) output + CONTINUOUS_RECORD_PREFIX;
+
+				std::memcpy(output, record, CONTINUOUS_RECORD_PREFIX);
+
+				for (int k=0; k<CONTINUOUS_RECORD_SAMPLES; k++)
+				{
+					uint16_t value = (uint16_t) quantize(channels[i][t + k], scaleFactor);
+					samples[2 * k] = (unsigned char) (value >> 8);
+					samples[2 * k + 1] = (unsigned char) value;
+				}
+
+				std::memcpy(output + CONTINUOUS_RECORD_SIZE - CONTINUOUS_RECORD_MARKER,
+							record + CONTINUOUS_RECORD_SIZE - CONTINUOUS_RECORD_MARKER,
+							CONTINUOUS_RECORD_MARKER);
+
+				output += CONTINUOUS_RECORD_SIZE;
+			}
+		}
+	}
+
+	bool write(int n, const char* data)
+	{
+		size_t size = (size_t) (n / CONTINUOUS_RECORD_SAMPLES) * CONTINUOUS_RECORD_SIZE;
+
+		for (int i=0; i<(int) outputs.size(); i++, data += size)
+		{
+			if (std::fwrite(data, 1, size, outputs[i]) != size)
+				return false;
+		}
+
+		return true;
+	}
+
+	bool close()
+	{
+		bool ok = true;
+		for (int i=0; i<(int) outputs.size(); i++)
+		{
+			ok = closeOutput(outputs[i]) && ok;
+			outputs[i] = nullptr;
+		}
+		return ok;
+	}
+
+private:
+
+	const char* getRecord(int channel, int64_t sample)
+	{
+		return inputs[channel].getData() + CONTINUOUS_HEADER_SIZE
+			+ (sample / CONTINUOUS_RECORD_SAMPLES) * CONTINUOUS_RECORD_SIZE;
+	}
+
+	/* Header lines look like: header.bitVolts = 0.195000; */
+	template <typename T>
+	static void readHeaderValue(const std::string& header, const char* key, T& value)
+	{
+		size_t position = header.find(key);
+		if (position == std::string::npos)
+			return;
+
+		position = header.find('=', position);
+		if (position != std::string::npos)
+			value = (T) std::atof(header.c_str() + position + 1);
+	}
+
+	std::vector<MappedFile> inputs;
+	std::vector<FILE*> outputs;
+	int64_t numRecords;
+	std::vector<float> bitVolts;
+	double sampleRate;
+
+};
+
+
+/**
+
+  Tiles in flight. Workers take the next tile, wait for a free slot (the
+  slot of a tile is free once the tile TILES_PER_THREAD * threads before it
+  has been written), read, reference and encode it; the main thread writes
+  the slots in tile order. If there is a filter, a referenced tile waits
+  until the tile before it has been filtered.
+
+*/
+
+struct Pipeline
+{
+	Recording* recording;
+	ReferenceKernels::Type kernelType;
+	int tileSize;
+	int tileStride;
+	int64_t numTiles;
+	int numSlots;
+	bool montage;
+
+	std::vector<ReferencePlan*> plans;
+	ReferenceFilter* filter;
+	std::vector<std::vector<float> > buffers;
+	std::vector<std::vector<char> > outputs;
+	std::vector<int64_t> slotTile;
+
+	std::atomic<int64_t> nextTile;
+	int64_t numFiltered;
+	int64_t numWritten;
+	bool cancelled;
+	std::mutex lock;
+	std::condition_variable changed;
+};
+
+static void runWorker(Pipeline* p, int workerIndex)
+{
+	int nChannels = p->recording->getNumChannels();
+	std::vector<float*> channels(nChannels);
+
+	while (true)
+	{
+		int64_t tile = p->nextTile++;
+		if (tile >= p->numTiles)
+			break;
+
+		int slot = (int) (tile % p->numSlots);
+		{
+			std::unique_lock<std::mutex> guard(p->lock);
+			while (!p->cancelled && tile >= p->numWritten + p->numSlots)
+				p->changed.wait(guard);
+			if (p->cancelled)
+				break;
+		}
+
+		int64_t first = tile * p->tileSize;
+		int n = (int) std::min((int64_t) p->tileSize, p->recording->getNumSamples() - first);
+
+		for (int i=0; i<nChannels; i++)
+		{
+			channels[i] = p->buffers[slot].data() + (size_t) i * p->tileStride;
+		}
+
+		p->recording->read(first, n, channels.data());
+
+		if (p->montage)
+			p->plans[workerIndex]->processMontage(0, channels.data(), n, p->kernelType, nullptr);
+		else
+			p->plans[workerIndex]->process(channels.data(), n, p->kernelType, nullptr);
+
+		if (p->filter != nullptr)
+		{
+			{
+				std::unique_lock<std::mutex> guard(p->lock);
+				while (!p->cancelled && p->numFiltered != tile)
+					p->changed.wait(guard);
+				if (p->cancelled)
+					break;
+			}
+
+			p->filter->process(channels.data(), n, p->kernelType, nullptr);
+
+			{
+				std::lock_guard<std::mutex> guard(p->lock);
+				p->numFiltered = tile + 1;
+			}
+			p->changed.notify_all();
+		}
+
+		p->recording->encode(first, n, channels.data(), p->outputs[slot].data());
+
+		{
+			std::lock_guard<std::mutex> guard(p->lock);
+			p->slotTile[slot] = tile;
+		}
+		p->changed.notify_all();
+	}
+}
+
+static bool writeTiles(Pipeline& p, bool quiet)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point lastReport = start;
+	int64_t numSamples = p.recording->getNumSamples();
+	bool ok = true;
+
+	for (int64_t tile=0; tile<p.numTiles && ok; tile++)
+	{
+		int slot = (int) (tile % p.numSlots);
+		{
+			std::unique_lock<std::mutex> guard(p.lock);
+			while (p.slotTile[slot] != tile)
+				p.changed.wait(guard);
+		}
+
+		int64_t first = tile * p.tileSize;
+		int n = (int) std::min((int64_t) p.tileSize, numSamples - first);
+
+		ok = p.recording->write(n, p.outputs[slot].data());
+
+		{
+			std::lock_guard<std::mutex> guard(p.lock);
+			p.numWritten = tile + 1;
+			p.cancelled = !ok;
+		}
+		p.changed.notify_all();
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (!quiet && now - lastReport > std::chrono::seconds(1))
+		{
+			double seconds = std::chrono::duration<double>(now - start).count();
+			double done = (double) (first + n);
+			std::fprintf(stderr, "\r%5.1f%%  %.1fx realtime", 100.0 * done / numSamples,
+						 done / p.recording->getSampleRate() / seconds);
+			lastReport = now;
+		}
+	}
+
+	return ok;
+}
+
+static bool parseFormat(const char* value, bool& isFloat)
+{
+	if (std::strcmp(value, "int16") == 0)
+		isFloat = false;
+	else if (std::strcmp(value, "float32") == 0)
+		isFloat = true;
+	else
+		return false;
+
+	return true;
+}
+
+static bool parseArguments(int argc, char** argv, BatchSettings& settings)
+{
+	settings.numChannels = 0;
+	settings.floatInput = false;
+	settings.floatOutput = -1;
+	settings.bitVolts = 0.195f;
+	settings.numThreads = std::max(1, (int) std::thread::hardware_concurrency());
+	settings.tileSize = 0;
+	settings.kernelType = ReferenceKernels::getBestType();
+	settings.sampleRate = 30000.0;
+	settings.ignoreSpatialFilter = false;
+	settings.quiet = false;
+
+	std::vector<std::string> positional;
+
+	for (int i=1; i<argc; i++)
+	{
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (arg.empty() || arg[0] != '-')
+		{
+			positional.push_back(arg);
+			continue;
+		}
+
+		if (arg == "--quiet")
+		{
+			settings.quiet = true;
+			continue;
+		}
+
+		if (arg == "--ignore-spatial-filter")
+		{
+			settings.ignoreSpatialFilter = true;
+			continue;
+		}
+
+		if (value == nullptr)
+		{
+			std::fprintf(stderr, "Missing value for %s\n", arg.c_str());
+			return false;
+		}
+		i++;
+
+		if (arg == "-o" || arg == "--output")
+			settings.output = value;
+		else if (arg == "--channels")
+			settings.numChannels = std::atoi(value);
+		else if (arg == "--bit-volts")
+			settings.bitVolts = (float) std::atof(value);
+		else if (arg == "--threads")
+			settings.numThreads = std::max(1, std::atoi(value));
+		else if (arg == "--tile")
+			settings.tileSize = std::max(1, std::atoi(value));
+		else if (arg == "--sample-rate")
+			settings.sampleRate = std::atof(value);
+		else if (arg == "--input-format" || arg == "--output-format")
+		{
+			bool isFloat;
+			if (!parseFormat(value, isFloat))
+			{
+				std::fprintf(stderr, "Unknown format %s\n", value);
+				return false;
+			}
+			if (arg == "--input-format")
+				settings.floatInput = isFloat;
+			else
+				settings.floatOutput = isFloat ? 1 : 0;
+		}
+		else if (arg == "--kernel")
+		{
+			bool found = false;
+			for (int t=0; t<ReferenceKernels::NUM_TYPES; t++)
+			{
+				if (ReferenceKernels::getName((ReferenceKernels::Type) t) == std::string(value))
+				{
+					settings.kernelType = (ReferenceKernels::Type) t;
+					found = true;
+				}
+			}
+			if (!found || !ReferenceKernels::isSupported(settings.kernelType))
+			{
+				std::fprintf(stderr, "Kernel %s is not supported on this machine\n", value);
+				return false;
+			}
+		}
+		else
+		{
+			std::fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return false;
+		}
+	}
+
+	if (positional.size() < 2 || settings.output.empty())
+		return false;
+
+	settings.settingsPath = positional[0];
+	settings.inputs.assign(positional.begin() + 1, positional.end());
+
+	return settings.bitVolts > 0 && settings.sampleRate > 0;
+}
+
+static bool isContinuous(const std::string& path)
+{
+	const std::string extension = ".continuous";
+	return path.size() > extension.size()
+		&& path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+static std::string getDirectory(const std::string& path)
+{
+	size_t separator = path.find_last_of("/\\");
+	return separator == std::string::npos ? std::string(".") : path.substr(0, separator);
+}
+
+/* Sets up the matrix, gain and filter like ChannelRefEditor::applySettings,
+   and returns the derivations of the montage in use (if any). Settings that
+   use the spatial filter are refused unless ignoreSpatialFilter is set. */
+static bool loadSettings(const std::string& path, bool ignoreSpatialFilter, ReferenceMatrix& refMat,
+						 float& globalGain, ReferenceFilter& filter,
+						 std::vector<ReferenceMontage::Derivation>& montage, bool& useMontage)
+{
+	ReferenceSettingsReader reader(&refMat, getDirectory(path));
+
+	if (!reader.read(path))
+	{
+		std::fprintf(stderr, "Cannot load %s: %s\n", path.c_str(), reader.getError().c_str());
+		return false;
+	}
+
+	globalGain = 1.0f;
+
+	if (!reader.getParameters().empty())
+	{
+		globalGain = (float) reader.getParameter("GlobalGain", 0);
+		reader.applyMatrixParameters();
+
+		if (!reader.getError().empty())
+		{
+			std::fprintf(stderr, "Cannot load %s: %s\n", path.c_str(), reader.getError().c_str());
+			return false;
+		}
+
+		if (refMat.getNormalization() == ReferenceMatrix::LEAST_SQUARES)
+			std::fprintf(stderr, "Warning: least-squares fits are not saved; those rows use averages\n");
+		if (reader.getParameter("AutoExclude", 0) != 0)
+			std::fprintf(stderr, "Warning: bad channels are not excluded offline\n");
+		if (reader.getParameter("SpatialMode", 0) != 0)
+		{
+			if (!ignoreSpatialFilter)
+			{
+				std::fprintf(stderr, "%s uses the spatial filter, which cannot be applied offline; "
+							 "use --ignore-spatial-filter to apply the references instead\n", path.c_str());
+				return false;
+			}
+			std::fprintf(stderr, "Warning: the spatial filter is not applied offline; applying the references\n");
+		}
+
+		int filterMode = (int) reader.getParameter("FilterMode", ReferenceFilter::OFF);
+		if (filterMode < 0 || filterMode >= ReferenceFilter::NUM_MODES)
+			filterMode = ReferenceFilter::OFF;
+		filter.setMode((ReferenceFilter::Mode) filterMode);
+		if (!filter.setCutoffs((float) reader.getParameter("FilterLowCut", DEFAULT_FILTER_LOW_CUT),
+							   (float) reader.getParameter("FilterHighCut", DEFAULT_FILTER_HIGH_CUT)))
+			std::fprintf(stderr, "Warning: invalid filter cutoffs; using %g-%g Hz\n",
+						 filter.getLowCut(), filter.getHighCut());
+		filter.setOrder((int) reader.getParameter("FilterOrder", REFERENCE_FILTER_ORDER));
+	}
+
+	if (!reader.hasReferences())
+		std::fprintf(stderr, "Warning: %s has no references\n", path.c_str());
+
+	useMontage = reader.getActiveMontage() >= 0;
+	if (useMontage)
+		montage = reader.getMontageDerivations(reader.getActiveMontage());
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	BatchSettings settings;
+
+	if (!parseArguments(argc, argv, settings))
+	{
+		std::fprintf(stderr, "Usage: %s [-o OUTPUT] [--channels N] [--input-format int16|float32] "
+					 "[--output-format int16|float32] [--bit-volts V] [--threads N] [--tile N] "
+					 "[--kernel scalar|sse|avx2|avx512] [--sample-rate HZ] [--ignore-spatial-filter] [--quiet] "
+					 "SETTINGS INPUT...\n", argv[0]);
+		return 1;
+	}
+
+	bool continuous = isContinuous(settings.inputs[0]);
+	if (!continuous && settings.inputs.size() > 1)
+	{
+		std::fprintf(stderr, "Flat recordings are a single file\n");
+		return 1;
+	}
+
+	Recording* recording = continuous ? (Recording*) new ContinuousRecording() : new FlatRecording();
+	if (!recording->open(settings))
+	{
+		delete recording;
+		return 1;
+	}
+
+	int nChannels = recording->getNumChannels();
+
+	ReferenceMatrix refMat(nChannels);
+	float globalGain;
+	ReferenceFilter filter;
+	std::vector<ReferenceMontage::Derivation> montage;
+	bool useMontage = false;
+	if (!loadSettings(settings.settingsPath, settings.ignoreSpatialFilter, refMat, globalGain, filter,
+					  montage, useMontage))
+	{
+		delete recording;
+		return 1;
+	}
+
+	Pipeline p;
+	p.recording = recording;
+	p.kernelType = settings.kernelType;
+	int tileSize = settings.tileSize;
+	if (tileSize == 0)
+		tileSize = std::max(MIN_TILE_SIZE, (int) (DEFAULT_TILE_BYTES / (sizeof(float) * nChannels)));
+
+	p.tileSize = recording->getTileSize(tileSize);
+	p.tileStride = p.tileSize + TILE_PADDING;
+	p.numTiles = (recording->getNumSamples() + p.tileSize - 1) / p.tileSize;
+	p.numSlots = TILES_PER_THREAD * settings.numThreads;
+	p.nextTile = 0;
+	p.numFiltered = 0;
+	p.numWritten = 0;
+	p.cancelled = false;
+	p.montage = useMontage;
+
+	filter.prepare(nChannels, (float) recording->getSampleRate());
+	p.filter = filter.getMode() != ReferenceFilter::OFF ? &filter : nullptr;
+
+	/* Plans are read-only while processing, but own their scratch memory */
+	for (int w=0; w<settings.numThreads; w++)
+	{
+		p.plans.push_back(new ReferencePlan());
+		p.plans.back()->compile(&refMat, globalGain);
+
+		if (useMontage && !p.plans.back()->addMontage(montage, globalGain))
+		{
+			std::fprintf(stderr, "The montage in use does not fit %d channels\n", nChannels);
+			p.montage = false;
+		}
+	}
+
+	p.buffers.resize(p.numSlots);
+	p.outputs.resize(p.numSlots);
+	p.slotTile.assign(p.numSlots, -1);
+
+	for (int s=0; s<p.numSlots; s++)
+	{
+		p.buffers[s].resize((size_t) nChannels * p.tileStride);
+		p.outputs[s].resize(recording->getEncodedSize(p.tileSize));
+	}
+
+	if (!settings.quiet)
+	{
+		std::fprintf(stderr, "%d channels, %.1f s, %d distinct references, %s, %s kernel, %d threads\n",
+					 nChannels, recording->getNumSamples() / recording->getSampleRate(),
+					 p.plans[0]->getNumDistinctReferences(), ReferenceFilter::getModeName(filter.getMode()),
+					 ReferenceKernels::getName(p.kernelType), settings.numThreads);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int w=0; w<settings.numThreads; w++)
+	{
+		workers.push_back(std::thread(runWorker, &p, w));
+	}
+
+	bool ok = writeTiles(p, settings.quiet);
+
+	for (int w=0; w<(int) workers.size(); w++)
+	{
+		workers[w].join();
+	}
+
+	ok = recording->close() && ok;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (!ok)
+		std::fprintf(stderr, "\nCannot write %s\n", settings.output.c_str());
+	else if (!settings.quiet)
+	{
+		double duration = recording->getNumSamples() / recording->getSampleRate();
+		std::fprintf(stderr, "\r%.1f s of data in %.2f s (%.1fx realtime)\n", duration, seconds,
+					 seconds > 0 ? duration / seconds : 0.0);
+	}
+
+	for (int w=0; w<(int) p.plans.size(); w++)
+	{
+		delete p.plans[w];
+	}
+	delete recording;
+
+	return ok ? 0 : 1;
+}
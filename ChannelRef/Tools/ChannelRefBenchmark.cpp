@@ -0,0 +1,529 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+  Headless benchmark for the Channel Ref processor.
+
+  Runs the referencing engine of ChannelRefNode (ReferenceMatrix ->
+  ReferencePlan -> kernels and thread pool, with the same serial/parallel
+  decision as ChannelRefNode::process) on synthetic data, for every
+  combination of channel count, block size and preset, and prints one
+  record per combination as JSON lines (default) or CSV:
+
+    channels, block_size, preset, reference, kernel, group_kernel, montage,
+    threads, telemetry, filter, filter_stage, blocks, ns_per_sample_channel,
+    channel_samples_per_second, realtime_factor, mean_us, p50_us, p99_us,
+    p999_us, max_us
+
+  group_kernel is the group size of the specialized kernel that processed
+  the plan (see ReferencePlan::getGroupKernelSize()), 0 for the generic
+  kernels. montage is 1 if the plan was processed as a montage of
+  single-reference rows (see ReferencePlan::isMontage()), as for the
+  bipolar chain preset. With --group-kernel both, plans that have a group
+  kernel or are montages are measured with and without that, to show the
+  gain of the specialization.
+
+  filter is the high-pass or band-pass filter of the referencing stage
+  (see ReferenceFilter), off by default. filter_stage is "fused" if the
+  plan filtered each tile right after referencing it, "separate" if the
+  whole block was referenced and then filtered as a second pass (as an
+  external filter would), and "none" without a filter. With
+  --filter-stage both, every combination is measured both ways.
+
+  Block latency percentiles are measured per process() call. The
+  realtime factor is block duration at the given sample rate divided by
+  the mean block latency.
+
+  Usage: channelref-benchmark [options]
+
+    --channels 16,64,384     channel counts (default 16..1024)
+    --block-sizes 256,1024   samples per block (default 64,256,1024,4096)
+    --preset NAME            only this preset (repeatable; default: all)
+    --reference TYPE         average | median | trimmed (default average)
+    --threads N              total threads incl. the caller (default 1)
+    --parallel-min-channels N  (default 128, as in ChannelRefNode)
+    --kernel TYPE            scalar | sse | avx2 | avx512 (default: best)
+    --group-kernel MODE      on | off | both (default on); also montages
+    --blocks N               measured blocks per combination (default 1000)
+    --sample-rate HZ         for the realtime factor (default 30000)
+    --telemetry              include the RMS telemetry of the canvas
+    --filter MODE            off | highpass | bandpass (default off)
+    --filter-stage MODE      fused | separate | both (default fused)
+    --csv                    CSV instead of JSON lines
+
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../ReferenceFilter.h"
+#include "../ReferenceMatrix.h"
+#include "../ReferencePlan.h"
+#include "../ReferenceKernels.h"
+#include "../ReferenceTelemetry.h"
+#include "../ReferenceThreadPool.h"
+
+
+/* Blocks processed before measuring (caches, page faults, thread wake-up) */
+#define WARMUP_BLOCKS 20
+
+
+struct BenchmarkSettings
+{
+	std::vector<int> channelCounts;
+	std::vector<int> blockSizes;
+	std::vector<std::string> presets;
+	ReferenceMatrix::ReferenceType referenceType;
+	int numThreads;
+	int parallelMinChannels;
+	ReferenceKernels::Type kernelType;
+	bool groupKernel;
+	bool genericKernel;
+	int numBlocks;
+	double sampleRate;
+	bool telemetry;
+	ReferenceFilter::Mode filterMode;
+	bool filterFused;
+	bool filterSeparate;
+	bool csv;
+};
+
+struct BenchmarkResult
+{
+	int groupKernelSize;
+	bool montage;
+	const char* filterStage;
+	double nsPerSampleChannel;
+	double channelSamplesPerSecond;
+	double realtimeFactor;
+	double meanUs;
+	double p50Us;
+	double p99Us;
+	double p999Us;
+	double maxUs;
+};
+
+
+static std::vector<int> parseList(const char* text)
+{
+	std::vector<int> values;
+	const char* p = text;
+
+	while (*p != 0)
+	{
+		char* end;
+		long v = std::strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (v > 0)
+			values.push_back((int) v);
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	return values;
+}
+
+static const char* getReferenceName(ReferenceMatrix::ReferenceType type)
+{
+	switch (type)
+	{
+	case ReferenceMatrix::MEDIAN_REFERENCE:
+		return "median";
+	case ReferenceMatrix::TRIMMED_MEAN_REFERENCE:
+		return "trimmed";
+	default:
+		return "average";
+	}
+}
+
+static const char* getFilterName(ReferenceFilter::Mode mode)
+{
+	switch (mode)
+	{
+	case ReferenceFilter::HIGH_PASS:
+		return "highpass";
+	case ReferenceFilter::BAND_PASS:
+		return "bandpass";
+	default:
+		return "off";
+	}
+}
+
+static bool parseArguments(int argc, char** argv, BenchmarkSettings& settings)
+{
+	int channels[] = {16, 32, 64, 128, 256, 384, 512, 1024};
+	int blockSizes[] = {64, 256, 1024, 4096};
+
+	settings.channelCounts.assign(channels, channels + sizeof(channels) / sizeof(int));
+	settings.blockSizes.assign(blockSizes, blockSizes + sizeof(blockSizes) / sizeof(int));
+	settings.referenceType = ReferenceMatrix::AVERAGE_REFERENCE;
+	settings.numThreads = 1;
+	settings.parallelMinChannels = 128;
+	settings.kernelType = ReferenceKernels::getBestType();
+	settings.groupKernel = true;
+	settings.genericKernel = false;
+	settings.numBlocks = 1000;
+	settings.sampleRate = 30000.0;
+	settings.telemetry = false;
+	settings.filterMode = ReferenceFilter::OFF;
+	settings.filterFused = true;
+	settings.filterSeparate = false;
+	settings.csv = false;
+
+	for (int i=1; i<argc; i++)
+	{
+		std::string arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (arg == "--csv")
+		{
+			settings.csv = true;
+			continue;
+		}
+
+		if (arg == "--telemetry")
+		{
+			settings.telemetry = true;
+			continue;
+		}
+
+		if (value == nullptr)
+		{
+			std::fprintf(stderr, "Missing value for %s\n", arg.c_str());
+			return false;
+		}
+		i++;
+
+		if (arg == "--channels")
+			settings.channelCounts = parseList(value);
+		else if (arg == "--block-sizes")
+			settings.blockSizes = parseList(value);
+		else if (arg == "--preset")
+			settings.presets.push_back(value);
+		else if (arg == "--threads")
+			settings.numThreads = std::max(1, std::atoi(value));
+		else if (arg == "--parallel-min-channels")
+			settings.parallelMinChannels = std::atoi(value);
+		else if (arg == "--blocks")
+			settings.numBlocks = std::max(1, std::atoi(value));
+		else if (arg == "--sample-rate")
+			settings.sampleRate = std::atof(value);
+		else if (arg == "--reference")
+		{
+			bool found = false;
+			for (int t=ReferenceMatrix::AVERAGE_REFERENCE; t<=ReferenceMatrix::TRIMMED_MEAN_REFERENCE; t++)
+			{
+				if (getReferenceName((ReferenceMatrix::ReferenceType) t) == std::string(value))
+				{
+					settings.referenceType = (ReferenceMatrix::ReferenceType) t;
+					found = true;
+				}
+			}
+			if (!found)
+			{
+				std::fprintf(stderr, "Unknown reference type %s\n", value);
+				return false;
+			}
+		}
+		else if (arg == "--group-kernel")
+		{
+			std::string mode = value;
+			if (mode != "on" && mode != "off" && mode != "both")
+			{
+				std::fprintf(stderr, "Unknown group kernel mode %s\n", value);
+				return false;
+			}
+			settings.groupKernel = mode != "off";
+			settings.genericKernel = mode != "on";
+		}
+		else if (arg == "--filter")
+		{
+			bool found = false;
+			for (int m=0; m<ReferenceFilter::NUM_MODES; m++)
+			{
+				if (getFilterName((ReferenceFilter::Mode) m) == std::string(value))
+				{
+					settings.filterMode = (ReferenceFilter::Mode) m;
+					found = true;
+				}
+			}
+			if (!found)
+			{
+				std::fprintf(stderr, "Unknown filter %s\n", value);
+				return false;
+			}
+		}
+		else if (arg == "--filter-stage")
+		{
+			std::string mode = value;
+			if (mode != "fused" && mode != "separate" && mode != "both")
+			{
+				std::fprintf(stderr, "Unknown filter stage %s\n", value);
+				return false;
+			}
+			settings.filterFused = mode != "separate";
+			settings.filterSeparate = mode != "fused";
+		}
+		else if (arg == "--kernel")
+		{
+			bool found = false;
+			for (int t=0; t<ReferenceKernels::NUM_TYPES; t++)
+			{
+				if (ReferenceKernels::getName((ReferenceKernels::Type) t) == std::string(value))
+				{
+					settings.kernelType = (ReferenceKernels::Type) t;
+					found = true;
+				}
+			}
+			if (!found || !ReferenceKernels::isSupported(settings.kernelType))
+			{
+				std::fprintf(stderr, "Kernel %s is not supported on this machine\n", value);
+				return false;
+			}
+		}
+		else
+		{
+			std::fprintf(stderr, "Unknown option %s\n", arg.c_str());
+			return false;
+		}
+	}
+
+	if (settings.presets.empty())
+	{
+		for (int p=0; p<ReferenceMatrix::getNumPresets(); p++)
+		{
+			settings.presets.push_back(ReferenceMatrix::getPresetName(p));
+		}
+	}
+
+	return !settings.channelCounts.empty() && !settings.blockSizes.empty();
+}
+
+/* Nearest-rank percentile of sorted values */
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	int index = (int) std::ceil(p * sorted.size()) - 1;
+	return sorted[std::min(std::max(index, 0), (int) sorted.size() - 1)];
+}
+
+static BenchmarkResult runBenchmark(const BenchmarkSettings& settings, ReferenceThreadPool& threadPool,
+									int nChannels, int blockSize, const std::string& preset,
+									bool groupKernel, bool fusedFilter)
+{
+	ReferenceMatrix refMat(nChannels);
+	refMat.applyPreset(preset, nChannels);
+	refMat.setReferenceType(settings.referenceType);
+
+	ReferencePlan plan;
+	plan.compile(&refMat, 1.0f);
+	plan.setGroupKernelEnabled(groupKernel);
+	plan.setMontageEnabled(groupKernel);
+
+	ReferenceTelemetry telemetry;
+	telemetry.prepare(nChannels, (float) settings.sampleRate);
+	telemetry.setEnabled(settings.telemetry);
+
+	/* Prepared either way; the plan only gets it when it is on */
+	ReferenceFilter filter;
+	filter.prepare(nChannels, (float) settings.sampleRate);
+	filter.setMode(settings.filterMode);
+	bool filtered = settings.filterMode != ReferenceFilter::OFF;
+
+	/* Noise plus a common-mode component, regenerated into the processing
+	   buffer before every block (outside of the measurement) */
+	std::vector<float> input((size_t) nChannels * blockSize);
+	std::vector<float> buffer(input.size());
+	std::vector<float*> channels(nChannels);
+
+	unsigned int seed = 1;
+	for (int t=0; t<blockSize; t++)
+	{
+		float common = std::sin(0.01f * t);
+		for (int i=0; i<nChannels; i++)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			input[(size_t) i * blockSize + t] = common + (seed >> 8) * (1.0f / 16777216.0f) - 0.5f;
+		}
+	}
+
+	for (int i=0; i<nChannels; i++)
+	{
+		channels[i] = buffer.data() + (size_t) i * blockSize;
+	}
+
+	bool parallel = threadPool.getNumThreads() > 0 && nChannels >= settings.parallelMinChannels;
+	ReferenceThreadPool* pool = parallel ? &threadPool : nullptr;
+
+	std::vector<double> latencies;
+	latencies.reserve(settings.numBlocks);
+
+	for (int b=0; b<WARMUP_BLOCKS + settings.numBlocks; b++)
+	{
+		std::copy(input.begin(), input.end(), buffer.begin());
+
+		/* As in ChannelRefNode::process */
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (settings.telemetry)
+			telemetry.measureInput(channels.data(), blockSize);
+		if (filtered && fusedFilter)
+		{
+			plan.process(channels.data(), blockSize, settings.kernelType, pool, &filter);
+		}
+		else
+		{
+			plan.process(channels.data(), blockSize, settings.kernelType, pool);
+			if (filtered)
+				filter.process(channels.data(), blockSize, settings.kernelType, pool);
+		}
+		if (settings.telemetry)
+			telemetry.measureOutput(channels.data(), blockSize);
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+		if (b >= WARMUP_BLOCKS)
+		{
+			latencies.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+		}
+	}
+
+	double total = 0;
+	for (int b=0; b<(int) latencies.size(); b++)
+	{
+		total += latencies[b];
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	BenchmarkResult result;
+	result.groupKernelSize = groupKernel ? plan.getGroupKernelSize() : 0;
+	result.montage = groupKernel && plan.isMontage();
+	result.filterStage = !filtered ? "none" : fusedFilter ? "fused" : "separate";
+	result.meanUs = total / latencies.size();
+	result.nsPerSampleChannel = 1000.0 * result.meanUs / ((double) blockSize * nChannels);
+	result.channelSamplesPerSecond = result.nsPerSampleChannel > 0 ? 1e9 / result.nsPerSampleChannel : 0;
+	result.realtimeFactor = result.meanUs > 0 ? (1e6 * blockSize / settings.sampleRate) / result.meanUs : 0;
+	result.p50Us = percentile(latencies, 0.5);
+	result.p99Us = percentile(latencies, 0.99);
+	result.p999Us = percentile(latencies, 0.999);
+	result.maxUs = latencies.back();
+
+	return result;
+}
+
+static void printResult(const BenchmarkSettings& settings, int nChannels, int blockSize,
+						const std::string& preset, const BenchmarkResult& r)
+{
+	const char* kernel = ReferenceKernels::getName(settings.kernelType);
+	const char* reference = getReferenceName(settings.referenceType);
+	const char* filter = getFilterName(settings.filterMode);
+
+	if (settings.csv)
+	{
+		std::printf("%d,%d,\"%s\",%s,%s,%d,%d,%d,%d,%s,%s,%d,%.4f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+					nChannels, blockSize, preset.c_str(), reference, kernel, r.groupKernelSize, r.montage ? 1 : 0,
+					settings.numThreads,
+					settings.telemetry ? 1 : 0, filter, r.filterStage, settings.numBlocks, r.nsPerSampleChannel,
+					r.channelSamplesPerSecond, r.realtimeFactor, r.meanUs, r.p50Us, r.p99Us, r.p999Us, r.maxUs);
+	}
+	else
+	{
+		std::printf("{\"channels\": %d, \"block_size\": %d, \"preset\": \"%s\", \"reference\": \"%s\", "
+					"\"kernel\": \"%s\", \"group_kernel\": %d, \"montage\": %s, \"threads\": %d, \"telemetry\": %s, "
+					"\"filter\": \"%s\", \"filter_stage\": \"%s\", \"blocks\": %d, \"ns_per_sample_channel\": %.4f, "
+					"\"channel_samples_per_second\": %.0f, \"realtime_factor\": %.2f, \"mean_us\": %.2f, "
+					"\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, \"max_us\": %.2f}\n",
+					nChannels, blockSize, preset.c_str(), reference, kernel, r.groupKernelSize,
+					r.montage ? "true" : "false", settings.numThreads, settings.telemetry ? "true" : "false", filter, r.filterStage, settings.numBlocks, r.nsPerSampleChannel,
+					r.channelSamplesPerSecond, r.realtimeFactor, r.meanUs, r.p50Us, r.p99Us, r.p999Us, r.maxUs);
+	}
+
+	std::fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	BenchmarkSettings settings;
+
+	if (!parseArguments(argc, argv, settings))
+	{
+		std::fprintf(stderr, "Usage: %s [--channels LIST] [--block-sizes LIST] [--preset NAME] "
+					 "[--reference average|median|trimmed] [--threads N] [--parallel-min-channels N] "
+					 "[--kernel scalar|sse|avx2|avx512] [--group-kernel on|off|both] [--blocks N] [--sample-rate HZ] [--telemetry] "
+					 "[--filter off|highpass|bandpass] [--filter-stage fused|separate|both] [--csv]\n", argv[0]);
+		return 1;
+	}
+
+	ReferenceThreadPool threadPool;
+	threadPool.setNumThreads(settings.numThreads - 1);
+
+	if (settings.csv)
+	{
+		std::printf("channels,block_size,preset,reference,kernel,group_kernel,montage,threads,telemetry,filter,filter_stage,blocks,ns_per_sample_channel,"
+					"channel_samples_per_second,realtime_factor,mean_us,p50_us,p99_us,p999_us,max_us\n");
+	}
+
+	for (int c=0; c<(int) settings.channelCounts.size(); c++)
+	{
+		for (int b=0; b<(int) settings.blockSizes.size(); b++)
+		{
+			for (int p=0; p<(int) settings.presets.size(); p++)
+			{
+				int nChannels = settings.channelCounts[c];
+				int blockSize = settings.blockSizes[b];
+
+				/* Without a filter, the stages make no difference */
+				for (int s=0; s<2; s++)
+				{
+					bool fused = s == 0;
+					bool measured = settings.filterMode == ReferenceFilter::OFF ? fused
+						: fused ? settings.filterFused : settings.filterSeparate;
+					if (!measured)
+						continue;
+
+					BenchmarkResult result = runBenchmark(settings, threadPool, nChannels, blockSize,
+														  settings.presets[p], settings.groupKernel, fused);
+					printResult(settings, nChannels, blockSize, settings.presets[p], result);
+
+					/* The generic kernels for comparison, if they are not
+					   what was just measured anyway */
+					if (settings.groupKernel && settings.genericKernel && (result.groupKernelSize > 0 || result.montage))
+					{
+						result = runBenchmark(settings, threadPool, nChannels, blockSize,
+											  settings.presets[p], false, fused);
+						printResult(settings, nChannels, blockSize, settings.presets[p], result);
+					}
+				}
+			}
+		}
+	}
+
+	threadPool.setNumThreads(0);
+
+	return 0;
+}
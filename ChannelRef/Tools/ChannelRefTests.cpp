@@ -0,0 +1,721 @@
+/*
+------------------------------------------------------------------
+
+This file is part of the Open Ephys GUI
+Copyright (C) 2014 Open Ephys
+
+------------------------------------------------------------------
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+
+  Tests for the referencing engine of the Channel Ref processor.
+
+  Each test compares the engine with a direct computation on synthetic
+  data and prints one line per failed case; the exit status is the
+  number of failed tests.
+
+  Usage: channelref-tests
+
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "../ReferenceMatrix.h"
+#include "../ReferencePlan.h"
+#include "../ReferenceKernels.h"
+#include "../ReferenceThreadPool.h"
+#include "../ReferenceSettings.h"
+#include "../ReferenceFilter.h"
+#include "../ProbeGeometry.h"
+
+
+/* Relative tolerance of results that are summed in another order */
+#define SUM_TOLERANCE 1e-5
+
+/* Scratch file of the binary matrix tests, in the working directory */
+#define TEST_MATRIX_PATH "channelref-tests.bin"
+
+/* Scratch file of the probe geometry tests */
+#define TEST_GEOMETRY_PATH "channelref-tests.txt"
+
+/* Batch tool and the scratch files of its test, in the working directory */
+#define TEST_BATCH_TOOL "./channelref-batch"
+#define TEST_SETTINGS_PATH "channelref-tests.xml"
+#define TEST_INPUT_PATH "channelref-tests-in.dat"
+#define TEST_OUTPUT_PATH "channelref-tests-out.dat"
+
+/* Where the messages of the batch tool go */
+#if defined(WIN32)
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+
+/* Uniform values in [-range, range), rounded to integers if coarse, so
+   that groups have ties */
+static void fillRandom(std::vector<float>& data, unsigned int seed, float range, bool coarse)
+{
+	for (int k=0; k<(int) data.size(); k++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		float v = ((seed >> 8) * (1.0f / 16777216.0f) * 2.0f - 1.0f) * range;
+		data[k] = coarse ? std::floor(v) : v;
+	}
+}
+
+/* Median or trimmed mean of the values, as ReferenceMatrix defines them */
+static float statistic(std::vector<float> values, bool median, float trimFraction)
+{
+	int n = (int) values.size();
+	std::sort(values.begin(), values.end());
+
+	if (median)
+		return (values[(n - 1) / 2] + values[n / 2]) / 2.0f;
+
+	int first = std::min((int) (trimFraction * n), (n - 1) / 2);
+	int last = n - 1 - first;
+
+	double sum = 0.0;
+	for (int k=first; k<=last; k++)
+		sum += values[k];
+
+	return (float) (sum / (last - first + 1));
+}
+
+/* Rows that reference all channels except themselves, in median and
+   trimmed-mean mode, against the statistic of exactly those channels */
+static bool testLeaveSelfOut()
+{
+	int channelCounts[] = {9, 16, 20, 64};
+	int blockSize = 300;
+	int failures = 0;
+
+	ReferenceThreadPool threadPool;
+	threadPool.setNumThreads(2);
+
+	for (int c=0; c<4; c++)
+	{
+		int n = channelCounts[c];
+
+		for (int mode=0; mode<2; mode++)
+		{
+			bool median = mode == 0;
+
+			ReferenceMatrix refMat(n);
+			refMat.setReferenceType(median ? ReferenceMatrix::MEDIAN_REFERENCE
+								   : ReferenceMatrix::TRIMMED_MEAN_REFERENCE);
+
+			for (int i=0; i<n; i++)
+			{
+				refMat.setRow(i, 1.0f);
+				refMat.setValue(i, i, 0.0f);
+			}
+
+			/* Rows of other shapes alongside: one that includes itself and
+			   one with a few references */
+			refMat.setValue(0, 0, 1.0f);
+			refMat.setRow(1, 0.0f);
+			refMat.setValue(1, 2, 1.0f);
+			refMat.setValue(1, 3, 1.0f);
+			refMat.setValue(1, 5, 1.0f);
+
+			ReferencePlan plan;
+			plan.compile(&refMat, 1.0f);
+
+			for (int coarse=0; coarse<2; coarse++)
+			{
+				for (int type=0; type<ReferenceKernels::NUM_TYPES; type++)
+				{
+					if (!ReferenceKernels::isSupported((ReferenceKernels::Type) type))
+						continue;
+
+					/* Threads only for the widest kernel, to keep it short */
+					bool parallel = type == ReferenceKernels::getBestType();
+
+					std::vector<float> input((size_t) n * blockSize);
+					fillRandom(input, n * 7 + coarse, 100.0f, coarse != 0);
+
+					std::vector<float> output(input);
+					std::vector<float*> channels(n);
+					for (int i=0; i<n; i++)
+						channels[i] = output.data() + (size_t) i * blockSize;
+
+					plan.process(channels.data(), blockSize, (ReferenceKernels::Type) type,
+								 parallel ? &threadPool : nullptr);
+
+					int differences = 0;
+					double maxError = 0.0;
+					std::vector<int> refs;
+					std::vector<float> values;
+
+					for (int i=0; i<n; i++)
+					{
+						refMat.getReferences(i, refs);
+
+						for (int t=0; t<blockSize; t++)
+						{
+							values.clear();
+							for (int k=0; k<(int) refs.size(); k++)
+								values.push_back(input[(size_t) refs[k] * blockSize + t]);
+
+							float x = input[(size_t) i * blockSize + t];
+							float reference = statistic(values, median, refMat.getTrimFraction());
+							float expected = x - reference;
+							float actual = output[(size_t) i * blockSize + t];
+
+							double error = std::fabs((double) actual - expected);
+							double tolerance = median ? 0.0 : SUM_TOLERANCE * (std::fabs(x) + std::fabs(reference) + 1.0);
+
+							if (error > tolerance)
+							{
+								differences++;
+								maxError = std::max(maxError, error);
+							}
+						}
+					}
+
+					if (differences > 0)
+					{
+						std::printf("FAIL leave-self-out: %d channels, %s, %s values, %s kernel%s: "
+									"%d samples differ by up to %g\n",
+									n, median ? "median" : "trimmed mean", coarse ? "coarse" : "fine",
+									ReferenceKernels::getName((ReferenceKernels::Type) type),
+									parallel ? " (parallel)" : "", differences, maxError);
+						failures++;
+					}
+				}
+			}
+		}
+	}
+
+	threadPool.setNumThreads(0);
+
+	return failures == 0;
+}
+
+/* Channels excluded when a median or trimmed-mean plan is compiled drop
+   out of every reference set, including those shared by leaving one out */
+static bool testExcludedChannels()
+{
+	int n = 20;
+	int blockSize = 300;
+	int failures = 0;
+
+	std::vector<char> excluded(n, 0);
+	excluded[3] = 1;
+	excluded[7] = 1;
+	excluded[12] = 1;
+
+	for (int mode=0; mode<2; mode++)
+	{
+		bool median = mode == 0;
+
+		ReferenceMatrix refMat(n);
+		refMat.setReferenceType(median ? ReferenceMatrix::MEDIAN_REFERENCE
+							   : ReferenceMatrix::TRIMMED_MEAN_REFERENCE);
+
+		for (int i=0; i<n; i++)
+		{
+			refMat.setRow(i, 1.0f);
+			refMat.setValue(i, i, 0.0f);
+		}
+
+		/* A short row that references an excluded channel */
+		refMat.setRow(1, 0.0f);
+		refMat.setValue(1, 2, 1.0f);
+		refMat.setValue(1, 3, 1.0f);
+		refMat.setValue(1, 5, 1.0f);
+		refMat.setValue(1, 6, 1.0f);
+
+		ReferencePlan plan;
+		plan.compile(&refMat, 1.0f, true, &excluded);
+
+		std::vector<float> input((size_t) n * blockSize);
+		fillRandom(input, n * 11 + mode, 100.0f, false);
+
+		std::vector<float> output(input);
+		std::vector<float*> channels(n);
+		for (int i=0; i<n; i++)
+			channels[i] = output.data() + (size_t) i * blockSize;
+
+		plan.process(channels.data(), blockSize, ReferenceKernels::getBestType(), nullptr);
+
+		int differences = 0;
+		double maxError = 0.0;
+		std::vector<int> refs;
+		std::vector<float> values;
+
+		for (int i=0; i<n; i++)
+		{
+			refMat.getReferences(i, refs);
+
+			for (int t=0; t<blockSize; t++)
+			{
+				values.clear();
+				for (int k=0; k<(int) refs.size(); k++)
+				{
+					if (!excluded[refs[k]])
+						values.push_back(input[(size_t) refs[k] * blockSize + t]);
+				}
+
+				float x = input[(size_t) i * blockSize + t];
+				float reference = statistic(values, median, refMat.getTrimFraction());
+				float expected = x - reference;
+				float actual = output[(size_t) i * blockSize + t];
+
+				double error = std::fabs((double) actual - expected);
+				double tolerance = median ? 0.0 : SUM_TOLERANCE * (std::fabs(x) + std::fabs(reference) + 1.0);
+
+				if (error > tolerance)
+				{
+					differences++;
+					maxError = std::max(maxError, error);
+				}
+			}
+		}
+
+		if (differences > 0)
+		{
+			std::printf("FAIL excluded channels: %s: %d samples differ by up to %g\n",
+						median ? "median" : "trimmed mean", differences, maxError);
+			failures++;
+		}
+	}
+
+	return failures == 0;
+}
+
+/* Binary matrix file with the given header and contents */
+static void writeMatrixFile(int32_t numChannels, int32_t flags, const std::vector<uint64_t>& bits,
+							const std::vector<float>& values)
+{
+	std::ofstream file(TEST_MATRIX_PATH, std::ios::out | std::ios::binary | std::ios::trunc);
+	int32_t header[2] = { numChannels, flags };
+
+	file.write(REFERENCE_BINARY_MAGIC, 8);
+	file.write((const char*) header, sizeof(header));
+	file.write((const char*) bits.data(), sizeof(uint64_t) * bits.size());
+	file.write((const char*) values.data(), sizeof(float) * values.size());
+}
+
+/* Corrupt binary matrices are rejected or cleaned up, never read into
+   references past the last channel */
+static bool testBinaryMatrix()
+{
+	int n = 20;
+	int failures = 0;
+
+	std::vector<uint64_t> bits(n, 0);
+	std::vector<float> values((size_t) n * n, 0.0f);
+	for (int i=0; i<n; i++)
+	{
+		bits[i] = ((uint64_t) 1 << ((i + 1) % n));
+		values[(size_t) i * n + (i + 1) % n] = 0.5f;
+	}
+
+	/* All bits of the padding set */
+	std::vector<uint64_t> padded(bits);
+	for (int i=0; i<n; i++)
+		padded[i] |= ~(((uint64_t) 1 << n) - 1);
+
+	writeMatrixFile(n, 0, padded, std::vector<float>());
+
+	ReferenceMatrix refMat(n);
+	std::vector<int> refs;
+
+	if (!refMat.readBinary(TEST_MATRIX_PATH))
+	{
+		std::printf("FAIL binary matrix: valid file with padding bits rejected\n");
+		failures++;
+	}
+
+	for (int i=0; i<n; i++)
+	{
+		refMat.getReferences(i, refs);
+		if (refs.size() != 1 || refs[0] != (i + 1) % n)
+		{
+			std::printf("FAIL binary matrix: row %d has %d references after reading padding bits\n",
+						i, (int) refs.size());
+			failures++;
+			break;
+		}
+	}
+
+	/* Bad headers and sizes; the matrix must stay as it is */
+	struct BadFile
+	{
+		const char* name;
+		int32_t numChannels;
+		int32_t flags;
+		int numWords;
+		int numValues;
+	};
+
+	BadFile badFiles[] =
+	{
+		{ "no channels", 0, 0, 0, 0 },
+		{ "negative channel count", -5, 0, n, 0 },
+		{ "huge channel count", 1 << 30, 1, n, n * n },
+		{ "unknown flags", n, 7, n, n * n },
+		{ "truncated bits", n, 0, n - 1, 0 },
+		{ "truncated weights", n, 1, n, n * n - 1 },
+		{ "trailing data", n, 0, n, 1 },
+	};
+
+	for (int f=0; f<(int) (sizeof(badFiles) / sizeof(badFiles[0])); f++)
+	{
+		const BadFile& bad = badFiles[f];
+		writeMatrixFile(bad.numChannels, bad.flags,
+						std::vector<uint64_t>(bits.begin(), bits.begin() + bad.numWords),
+						std::vector<float>(values.begin(), values.begin() + bad.numValues));
+
+		int before = refMat.getModificationCount();
+		if (refMat.readBinary(TEST_MATRIX_PATH) || refMat.getModificationCount() != before)
+		{
+			std::printf("FAIL binary matrix: file with %s accepted\n", bad.name);
+			failures++;
+		}
+	}
+
+	std::remove(TEST_MATRIX_PATH);
+
+	return failures == 0;
+}
+
+/* Normalizations and reference types out of range are reported and not
+   loaded into the matrix */
+static bool testSettingsParameters()
+{
+	const char* settings[] =
+	{
+		"<SETTINGS><PARAMETERS Normalization=\"3\"/></SETTINGS>",
+		"<SETTINGS><PARAMETERS Normalization=\"-1\"/></SETTINGS>",
+		"<SETTINGS><PARAMETERS ReferenceType=\"7\"/></SETTINGS>",
+		"<SETTINGS><PARAMETERS ReferenceType=\"1e300\"/></SETTINGS>",
+	};
+	int failures = 0;
+
+	for (int k=0; k<(int) (sizeof(settings) / sizeof(settings[0])); k++)
+	{
+		{
+			std::ofstream file(TEST_SETTINGS_PATH, std::ios::out | std::ios::trunc);
+			file << settings[k];
+		}
+
+		ReferenceMatrix refMat(4);
+		refMat.setNormalization(ReferenceMatrix::RAW_WEIGHTS);
+		refMat.setReferenceType(ReferenceMatrix::MEDIAN_REFERENCE);
+
+		ReferenceSettingsReader reader(&refMat, ".");
+		bool read = reader.read(TEST_SETTINGS_PATH);
+		reader.applyMatrixParameters();
+
+		int normalization = (int) refMat.getNormalization();
+		int type = (int) refMat.getReferenceType();
+
+		if (!read || reader.getError().empty()
+			|| normalization < 0 || normalization >= ReferenceMatrix::NUM_NORMALIZATIONS
+			|| type < 0 || type >= ReferenceMatrix::NUM_REFERENCE_TYPES)
+		{
+			std::printf("FAIL settings parameters: %s loaded as normalization %d, reference type %d%s\n",
+						settings[k], normalization, type, reader.getError().empty() ? " without an error" : "");
+			failures++;
+		}
+	}
+
+	std::remove(TEST_SETTINGS_PATH);
+
+	return failures == 0;
+}
+
+/* Cutoffs that do not make a filter are rejected and the previous ones kept */
+static bool testFilterCutoffs()
+{
+	float cutoffs[][2] =
+	{
+		{ 6000.0f, 300.0f },
+		{ 300.0f, 300.0f },
+		{ 0.0f, 6000.0f },
+		{ -10.0f, 6000.0f },
+		{ 300.0f, INFINITY },
+		{ NAN, 6000.0f },
+	};
+	int failures = 0;
+
+	ReferenceFilter filter;
+	filter.setMode(ReferenceFilter::BAND_PASS);
+
+	if (!filter.setCutoffs(500.0f, 5000.0f))
+	{
+		std::printf("FAIL filter cutoffs: 500-5000 Hz rejected\n");
+		failures++;
+	}
+
+	for (int k=0; k<(int) (sizeof(cutoffs) / sizeof(cutoffs[0])); k++)
+	{
+		if (filter.setCutoffs(cutoffs[k][0], cutoffs[k][1])
+			|| filter.getLowCut() != 500.0f || filter.getHighCut() != 5000.0f)
+		{
+			std::printf("FAIL filter cutoffs: %g-%g Hz accepted\n", cutoffs[k][0], cutoffs[k][1]);
+			failures++;
+		}
+	}
+
+	return failures == 0;
+}
+
+/* Geometry files with sites out of range are rejected without touching the
+   geometry that was loaded before */
+static bool testProbeGeometry()
+{
+	const char* badFiles[] =
+	{
+		"1 0 0\n100000000 0 0\n",
+		"1 0 0\n1e300 0 0\n",
+		"1 0 0\n2 nan 0\n",
+		"1 0 0\n2 0 1e40\n",
+		"1 0 0\n2 0 0 1e12\n",
+		"# no sites\n",
+	};
+	int failures = 0;
+
+	{
+		std::ofstream file(TEST_GEOMETRY_PATH, std::ios::out | std::ios::trunc);
+		file << "channel x y\n1 0 0\n2 0 20\n3 0 40\n";
+	}
+
+	ProbeGeometry geometry;
+	if (!geometry.load(TEST_GEOMETRY_PATH) || geometry.getNumSites() != 3)
+	{
+		std::printf("FAIL probe geometry: valid file not loaded: %s\n", geometry.getError().c_str());
+		failures++;
+	}
+
+	for (int k=0; k<(int) (sizeof(badFiles) / sizeof(badFiles[0])); k++)
+	{
+		{
+			std::ofstream file(TEST_GEOMETRY_PATH, std::ios::out | std::ios::trunc);
+			file << badFiles[k];
+		}
+
+		if (geometry.load(TEST_GEOMETRY_PATH) || geometry.getNumSites() != 3 || !geometry.hasPosition(2))
+		{
+			std::printf("FAIL probe geometry: bad file %d accepted or geometry changed (%d sites)\n",
+						k, geometry.getNumSites());
+			failures++;
+		}
+	}
+
+	std::remove(TEST_GEOMETRY_PATH);
+
+	return failures == 0;
+}
+
+/* Runs the batch tool on the float32 flat test input; returns its exit status */
+static int runBatch(int numChannels, const char* options)
+{
+	char command[512];
+	std::snprintf(command, sizeof(command), "%s --quiet --channels %d --input-format float32 %s %s %s -o %s 2>%s",
+				  TEST_BATCH_TOOL, numChannels, options, TEST_SETTINGS_PATH, TEST_INPUT_PATH, TEST_OUTPUT_PATH,
+				  NULL_DEVICE);
+
+	return std::system(command);
+}
+
+/* The batch tool against the node's path: plan and filter set up from the
+   same settings, processed in blocks with the filter fused into
+   referencing, as by ChannelRefNode::process. Tiles, blocks and threads
+   split the data differently, and the output must match bit for bit. */
+static bool testBatchFilter()
+{
+	int n = 12;
+	int numSamples = 20000;
+	int blockSize = 512;
+	float sampleRate = 30000.0f;
+	ReferenceKernels::Type type = ReferenceKernels::getBestType();
+	int failures = 0;
+
+	struct BatchCase
+	{
+		const char* name;
+		const char* settings;
+	};
+
+	BatchCase cases[] =
+	{
+		{ "band-pass, common average",
+		  "<SETTINGS><PARAMETERS GlobalGain=\"2\" FilterMode=\"2\" FilterLowCut=\"300\" FilterHighCut=\"6000\" "
+		  "FilterOrder=\"4\"/><REFERENCES Preset=\"Common average reference\" PresetChannels=\"12\"/></SETTINGS>" },
+		{ "high-pass, median of others",
+		  "<SETTINGS><PARAMETERS GlobalGain=\"1\" ReferenceType=\"1\" FilterMode=\"1\" FilterLowCut=\"1\" "
+		  "FilterOrder=\"6\"/><REFERENCES><CHANNEL Index=\"1\" Ranges=\"2-12\"/><CHANNEL Index=\"2\" Ranges=\"1,3-12\"/>"
+		  "<CHANNEL Index=\"3\" Ranges=\"1-2,4-12\"/><CHANNEL Index=\"7\" Ranges=\"5-6,8\"/></REFERENCES></SETTINGS>" },
+		{ "band-pass, montage",
+		  "<SETTINGS><PARAMETERS GlobalGain=\"1\" FilterMode=\"2\" FilterLowCut=\"500\" FilterHighCut=\"3000\" "
+		  "FilterOrder=\"2\"/><REFERENCES Preset=\"Common average reference\" PresetChannels=\"12\"/>"
+		  "<MONTAGES Active=\"0\"><MONTAGE Name=\"Bipolar\" Derivations=\"1:2,2:3,3:4*0.5\"/></MONTAGES></SETTINGS>" },
+	};
+
+	std::vector<float> input((size_t) n * numSamples);
+	fillRandom(input, 11, 100.0f, false);
+	{
+		std::ofstream file(TEST_INPUT_PATH, std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write((const char*) input.data(), sizeof(float) * input.size());
+	}
+
+	ReferenceThreadPool threadPool;
+	threadPool.setNumThreads(2);
+
+	for (int c=0; c<(int) (sizeof(cases) / sizeof(cases[0])); c++)
+	{
+		{
+			std::ofstream file(TEST_SETTINGS_PATH, std::ios::out | std::ios::trunc);
+			file << cases[c].settings;
+		}
+
+		ReferenceMatrix refMat(n);
+		ReferenceSettingsReader reader(&refMat, ".");
+		if (!reader.read(TEST_SETTINGS_PATH))
+		{
+			std::printf("FAIL batch filter: %s: %s\n", cases[c].name, reader.getError().c_str());
+			failures++;
+			continue;
+		}
+
+		float globalGain = (float) reader.getParameter("GlobalGain", 0);
+		reader.applyMatrixParameters();
+
+		ReferencePlan plan;
+		plan.compile(&refMat, globalGain);
+		int montage = reader.getActiveMontage();
+		if (montage >= 0)
+			plan.addMontage(reader.getMontageDerivations(montage), globalGain);
+
+		ReferenceFilter filter;
+		filter.setMode((ReferenceFilter::Mode) (int) reader.getParameter("FilterMode", 0));
+		filter.setCutoffs((float) reader.getParameter("FilterLowCut", DEFAULT_FILTER_LOW_CUT),
+						  (float) reader.getParameter("FilterHighCut", DEFAULT_FILTER_HIGH_CUT));
+		filter.setOrder((int) reader.getParameter("FilterOrder", REFERENCE_FILTER_ORDER));
+		filter.prepare(n, sampleRate);
+
+		/* The node sees one channel buffer per block */
+		std::vector<float> expected((size_t) n * numSamples);
+		std::vector<float> block((size_t) n * blockSize);
+		std::vector<float*> channels(n);
+
+		for (int t0=0; t0<numSamples; t0+=blockSize)
+		{
+			int length = std::min(blockSize, numSamples - t0);
+
+			for (int i=0; i<n; i++)
+			{
+				channels[i] = block.data() + (size_t) i * blockSize;
+				for (int t=0; t<length; t++)
+					channels[i][t] = input[(size_t) (t0 + t) * n + i];
+			}
+
+			if (montage >= 0)
+				plan.processMontage(0, channels.data(), length, type, &threadPool, &filter);
+			else
+				plan.process(channels.data(), length, type, &threadPool, &filter);
+
+			for (int i=0; i<n; i++)
+			{
+				for (int t=0; t<length; t++)
+					expected[(size_t) (t0 + t) * n + i] = channels[i][t];
+			}
+		}
+
+		char options[128];
+		std::snprintf(options, sizeof(options), "--output-format float32 --sample-rate %g --threads 3 --tile 1500 --kernel %s",
+					  sampleRate, ReferenceKernels::getName(type));
+
+		std::vector<float> output(expected.size(), 0.0f);
+		int status = runBatch(n, options);
+		{
+			std::ifstream file(TEST_OUTPUT_PATH, std::ios::in | std::ios::binary);
+			file.read((char*) output.data(), sizeof(float) * output.size());
+		}
+
+		int differences = 0;
+		for (size_t k=0; k<output.size(); k++)
+		{
+			if (output[k] != expected[k])
+				differences++;
+		}
+
+		if (status != 0 || differences > 0)
+		{
+			std::printf("FAIL batch filter: %s: exit status %d, %d samples differ from the node\n",
+						cases[c].name, status, differences);
+			failures++;
+		}
+	}
+
+	threadPool.setNumThreads(0);
+
+	/* The spatial filter cannot be applied offline: refused unless ignored */
+	{
+		std::ofstream file(TEST_SETTINGS_PATH, std::ios::out | std::ios::trunc);
+		file << "<SETTINGS><PARAMETERS GlobalGain=\"1\" SpatialMode=\"1\"/>"
+				"<REFERENCES Preset=\"Common average reference\" PresetChannels=\"12\"/></SETTINGS>";
+	}
+
+	if (runBatch(n, "") == 0)
+	{
+		std::printf("FAIL batch filter: settings with the spatial filter accepted\n");
+		failures++;
+	}
+
+	if (runBatch(n, "--ignore-spatial-filter") != 0)
+	{
+		std::printf("FAIL batch filter: settings with the spatial filter refused with --ignore-spatial-filter\n");
+		failures++;
+	}
+
+	std::remove(TEST_SETTINGS_PATH);
+	std::remove(TEST_INPUT_PATH);
+	std::remove(TEST_OUTPUT_PATH);
+
+	return failures == 0;
+}
+
+int main()
+{
+	int failed = 0;
+
+	failed += testLeaveSelfOut() ? 0 : 1;
+	failed += testExcludedChannels() ? 0 : 1;
+	failed += testBinaryMatrix() ? 0 : 1;
+	failed += testSettingsParameters() ? 0 : 1;
+	failed += testFilterCutoffs() ? 0 : 1;
+	failed += testProbeGeometry() ? 0 : 1;
+	failed += testBatchFilter() ? 0 : 1;
+
+	std::printf("%s\n", failed == 0 ? "All tests passed" : "Some tests failed");
+
+	return failed;
+}